@@ -0,0 +1,114 @@
+# frozen_string_literal: true
+
+# Concurrency scaling and memory-pressure harness. Run with
+# `bundle exec rake bench:load`.
+#
+# For JQ.filter, Program#call and the batch APIs this measures ops/sec and
+# p50/p99 latency at each thread and Ractor count, then RSS growth and
+# allocated objects per call over BENCH_ITERATIONS operations. Results are
+# compared with a baseline from a previous run on the same machine, and
+# the run exits with status 1 when any of them regressed.
+#
+# Baselines depend on the machine, so none is committed: record one with
+# BENCH_UPDATE_BASELINE=1 before comparing. Without one, only the RSS
+# growth limit is checked, and the run says so.
+#
+# Environment:
+#   BENCH_WORKERS          Thread and Ractor counts (default: 1,2,4,8,16)
+#   BENCH_CALLS            Operations timed per thread or Ractor (default: 2000)
+#   BENCH_ITERATIONS       Operations run to measure memory (default: 1000000)
+#   BENCH_FILTER           Regexp matched against "section/workload[/workers]"
+#   BENCH_BASELINE         Baseline file (default: bench/baselines/load.json)
+#   BENCH_UPDATE_BASELINE  Set to 1 to write the results as the new baseline
+#   BENCH_TOLERANCE        Allowed throughput and latency change (default: 0.3)
+#   BENCH_MAX_RSS_GROWTH   RSS growth limit in MB, baseline or not (default: 64)
+#   BENCH_OUTPUT           Path of the JSON results file (default: none)
+
+require "jq"
+require "json"
+require_relative "load_runner"
+
+module JQBench
+  ##
+  # The workloads measured by bench/load.rb. Documents are frozen so
+  # Ractors can share them.
+  #
+  module LoadWorkloads
+    FILTER = ".users | map(.score) | add"
+    DOCUMENT = JSON.generate(
+      "users" => (1..20).map { |i| { "id" => i, "name" => "user#{i}", "score" => i * 1.5, "tags" => ["t#{i % 3}"] } }
+    ).freeze
+    BATCH = Array.new(100, DOCUMENT).freeze
+
+    NAMES = ["JQ.filter", "Program#call", "Program#call_many", "JQ.filter_many"].freeze
+
+    def self.names
+      NAMES
+    end
+
+    def self.build(name)
+      case name
+      when "JQ.filter"
+        LoadRunner::Workload.new(ops: 1, call: -> { JQ.filter(DOCUMENT, FILTER) })
+      when "Program#call"
+        program = JQ.compile(FILTER)
+        LoadRunner::Workload.new(ops: 1, call: -> { program.call(DOCUMENT) })
+      when "Program#call_many"
+        program = JQ.compile(FILTER)
+        LoadRunner::Workload.new(ops: BATCH.size, call: -> { program.call_many(BATCH) })
+      when "JQ.filter_many"
+        LoadRunner::Workload.new(ops: BATCH.size, call: -> { JQ.filter_many(BATCH, FILTER) })
+      else
+        raise ArgumentError, "unknown workload: #{name}"
+      end
+    end
+  end
+end
+
+runner = JQBench::LoadRunner.new(
+  workloads: JQBench::LoadWorkloads,
+  workers: ENV.fetch("BENCH_WORKERS", "1,2,4,8,16").split(",").map { |n| Integer(n) },
+  calls: Integer(ENV.fetch("BENCH_CALLS", "2000")),
+  iterations: Integer(ENV.fetch("BENCH_ITERATIONS", "1000000")),
+  filter: ENV["BENCH_FILTER"] && Regexp.new(ENV["BENCH_FILTER"])
+)
+runner.run
+
+if (path = ENV["BENCH_OUTPUT"])
+  runner.write_json(path)
+  puts "\nResults written to #{path}"
+end
+
+baseline_path = ENV.fetch("BENCH_BASELINE", File.expand_path("baselines/load.json", __dir__))
+if ENV["BENCH_UPDATE_BASELINE"] == "1"
+  runner.write_json(baseline_path)
+  puts "\nBaseline written to #{baseline_path}"
+  exit
+end
+
+baseline = File.exist?(baseline_path) ? JSON.parse(File.read(baseline_path)) : nil
+if baseline.nil?
+  puts "\nNo baseline at #{baseline_path} (record one with BENCH_UPDATE_BASELINE=1)"
+elsif baseline.dig("environment", "cpus") != JQBench.environment["cpus"]
+  puts "\nWarning: the baseline was recorded on a machine with #{baseline.dig('environment', 'cpus')} CPUs"
+end
+
+failures = runner.compare(
+  baseline,
+  tolerance: Float(ENV.fetch("BENCH_TOLERANCE", "0.3")),
+  max_rss_growth_kb: Integer(ENV.fetch("BENCH_MAX_RSS_GROWTH", "64")) * 1024
+)
+# Results the baseline does not have were only checked against the RSS limit
+recorded = (baseline ? baseline["results"] : []).map { |result| result["key"] }
+unchecked = runner.results.map { |result| result["key"] } - recorded
+
+if failures.empty? && unchecked.empty?
+  puts "\nNo regressions"
+elsif failures.empty?
+  puts "\nPartial check: #{unchecked.size} of #{runner.results.size} results have no baseline, " \
+       "so only their RSS growth was checked; it is within the limit"
+else
+  puts "\nRegressions:"
+  failures.each { |failure| puts "  #{failure}" }
+  exit 1
+end
@@ -0,0 +1,280 @@
+# frozen_string_literal: true
+
+require "fileutils"
+require "json"
+require "time"
+require_relative "runner"
+
+module JQBench
+  ##
+  # A load harness measuring how workloads scale across threads and
+  # Ractors, and what they cost in memory, with baselines to catch
+  # regressions.
+  #
+  # A workload set is a module answering +names+ and +build(name)+, where
+  # +build+ returns a Workload. Workloads are built inside each Ractor, so
+  # the module and anything its workloads reference must be shareable.
+  #
+  #   runner = JQBench::LoadRunner.new(workloads: Workloads, workers: [1, 4])
+  #   runner.run
+  #   failures = runner.compare(JSON.parse(File.read("baseline.json")))
+  #
+  # Results are keyed "section/name", e.g. "threads/Program#call/4" or
+  # "memory/JQ.filter", and a baseline is a previous run's #to_h.
+  #
+  class LoadRunner
+    # One unit of work: +call+ performs +ops+ operations (a batch call
+    # performs one per document)
+    Workload = Struct.new(:ops, :call, keyword_init: true)
+
+    # Allocated objects per call a workload may gain over its baseline
+    ALLOCATION_SLACK = 0.5
+
+    # Timed calls made by each thread or Ractor, whatever the batch size
+    MIN_CALLS = 20
+
+    # RSS growth in KB allowed over a baseline on top of the tolerance, as
+    # RSS moves with the allocator's heap layout as well as with leaks
+    RSS_SLACK_KB = 16 * 1024
+
+    # Baseline metrics, and whether a larger value is the regression
+    METRICS = {
+      "ops_per_sec" => :lower,
+      "p50_us" => :higher,
+      "p99_us" => :higher,
+      "allocated_per_call" => :higher,
+      "rss_growth_kb" => :higher
+    }.freeze
+
+    attr_reader :results
+
+    ##
+    # @param workloads [Module] The workload set
+    # @param workers [Array<Integer>] Thread and Ractor counts to measure
+    # @param calls [Integer] Operations timed by each thread or Ractor; batch
+    #   workloads make fewer calls, but at least MIN_CALLS
+    # @param iterations [Integer] Operations run to measure memory
+    # @param filter [Regexp, nil] Only run results whose key matches
+    # @param io [IO] Where progress is printed
+    #
+    def initialize(workloads:, workers: [1, 2, 4, 8, 16], calls: 2_000,
+                   iterations: 1_000_000, filter: nil, io: $stdout)
+      @workloads = workloads
+      @workers = workers
+      @calls = calls
+      @iterations = iterations
+      @filter = filter
+      @io = io
+      @results = []
+    end
+
+    ##
+    # Measure every workload: thread scaling, Ractor scaling (when the
+    # extension can run in Ractors), then RSS growth and allocations.
+    #
+    def run
+      ractors = ractor_support
+
+      @workloads.names.each do |name|
+        keys = %w[threads ractors].product(@workers).map { |mode, n| "#{mode}/#{name}/#{n}" }
+        next unless (keys << "memory/#{name}").any? { |key| selected?(key) }
+
+        @io.puts "\n#{name}"
+        @workers.each { |n| scale("threads", name, n) }
+        if ractors == true
+          @workers.each { |n| scale("ractors", name, n) }
+        else
+          @io.puts "  ractors: skipped (#{ractors})"
+        end
+        memory(name)
+      end
+      @results
+    end
+
+    ##
+    # Check the results against a baseline.
+    #
+    # Throughput and latency may move by +tolerance+ (a fraction), and
+    # allocations by ALLOCATION_SLACK objects per call. RSS growth may move
+    # by +tolerance+ plus RSS_SLACK_KB, and never exceed +max_rss_growth_kb+,
+    # with or without a baseline. Results missing from the baseline are
+    # only checked against that limit.
+    #
+    # @param baseline [Hash, nil] A previous run's #to_h
+    # @return [Array<String>] One message per regression
+    #
+    def compare(baseline, tolerance: 0.3, max_rss_growth_kb: 64 * 1024)
+      previous = (baseline ? baseline["results"] : []).to_h { |r| [r["key"], r] }
+
+      @results.flat_map do |result|
+        failures = []
+        if (growth = result["rss_growth_kb"]) && growth > max_rss_growth_kb
+          failures << "#{result['key']}: RSS grew #{growth} KB, limit is #{max_rss_growth_kb} KB"
+        end
+
+        if (base = previous[result["key"]])
+          METRICS.each do |metric, worse|
+            next unless result[metric] && base[metric]
+
+            limit = limit(metric, worse, base[metric], tolerance)
+            regressed = worse == :lower ? result[metric] < limit : result[metric] > limit
+            failures << "#{result['key']}: #{metric} #{result[metric]}, baseline #{base[metric]}" if regressed
+          end
+        end
+        failures
+      end
+    end
+
+    ##
+    # Results and environment as a JSON-serializable Hash.
+    #
+    def to_h
+      {
+        "created_at" => Time.now.utc.iso8601,
+        "environment" => JQBench.environment,
+        "results" => @results
+      }
+    end
+
+    def write_json(path)
+      FileUtils.mkdir_p(File.dirname(path))
+      File.write(path, JSON.pretty_generate(to_h) + "\n")
+    end
+
+    ##
+    # Time calls of a workload, after a tenth as many untimed calls.
+    #
+    # A class method so Ractors can run it.
+    #
+    # @return [Array<Float>] Seconds taken by each call
+    #
+    def self.time_calls(workload, calls)
+      (calls / 10).times { workload.call.call }
+
+      Array.new(calls) do
+        started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        workload.call.call
+        Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+      end
+    end
+
+    ##
+    # Resident set size of this process in KB.
+    #
+    def self.rss_kb
+      File.foreach("/proc/self/status") do |line|
+        return line.split[1].to_i if line.start_with?("VmRSS:")
+      end
+    rescue Errno::ENOENT
+      Integer(`ps -o rss= -p #{Process.pid}`.strip)
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def selected?(key)
+      @filter.nil? || key.match?(@filter)
+    end
+
+    # Run n threads or Ractors, each timing @calls operations; ops/sec
+    # counts every operation against the wall time of the whole run.
+    def scale(mode, name, n)
+      key = "#{mode}/#{name}/#{n}"
+      return unless selected?(key)
+
+      workload = @workloads.build(name)
+      ops = workload.ops
+      calls = [(@calls.to_f / ops).ceil, MIN_CALLS].max
+      started = now
+      latencies =
+        if mode == "threads"
+          Array.new(n) { Thread.new { self.class.time_calls(workload, calls) } }.flat_map(&:value)
+        else
+          Array.new(n) do
+            Ractor.new(@workloads, name, calls) do |workloads, workload, count|
+              JQBench::LoadRunner.time_calls(workloads.build(workload), count)
+            end
+          end.flat_map { |r| ractor_value(r) }
+        end
+      elapsed = now - started
+      latencies.sort!
+
+      record(
+        "key" => key,
+        "ops_per_sec" => (latencies.size * ops / elapsed).round(1),
+        "p50_us" => (percentile(latencies, 50) * 1e6).round(1),
+        "p99_us" => (percentile(latencies, 99) * 1e6).round(1)
+      )
+      @io.puts format("  %-8s %3d %14.1f ops/s  p50 %9.1f us  p99 %9.1f us",
+                      mode, n, *@results.last.values_at("ops_per_sec", "p50_us", "p99_us"))
+    end
+
+    # Run @iterations operations on the main thread, recording RSS growth
+    # and Ruby objects allocated per call.
+    def memory(name)
+      key = "memory/#{name}"
+      return unless selected?(key)
+
+      workload = @workloads.build(name)
+      calls = (@iterations.to_f / workload.ops).ceil
+      self.class.time_calls(workload, 100)
+
+      GC.start
+      rss = self.class.rss_kb
+      allocated = GC.stat(:total_allocated_objects)
+      gc_count = GC.count
+      calls.times { workload.call.call }
+      allocated = GC.stat(:total_allocated_objects) - allocated
+      gc_count = GC.count - gc_count
+      GC.start
+
+      record(
+        "key" => key,
+        "calls" => calls,
+        "rss_growth_kb" => self.class.rss_kb - rss,
+        "allocated_per_call" => (allocated.to_f / calls).round(2),
+        "gc_runs" => gc_count
+      )
+      @io.puts format("  memory   %d calls: RSS %+d KB, %.2f objects/call, %d GC runs",
+                      calls, *@results.last.values_at("rss_growth_kb", "allocated_per_call", "gc_runs"))
+    end
+
+    def record(result)
+      @results << result
+    end
+
+    def limit(metric, worse, base, tolerance)
+      case metric
+      when "allocated_per_call" then base + ALLOCATION_SLACK
+      when "rss_growth_kb" then (base.clamp(0, nil) * (1 + tolerance)) + RSS_SLACK_KB
+      else worse == :lower ? base * (1 - tolerance) : base * (1 + tolerance)
+      end
+    end
+
+    def percentile(sorted, pct)
+      return 0.0 if sorted.empty?
+
+      sorted[((pct / 100.0) * (sorted.size - 1)).round]
+    end
+
+    # Ractor#value replaced Ractor#take for a finished Ractor's result
+    def ractor_value(ractor)
+      ractor.respond_to?(:value) ? ractor.value : ractor.take
+    end
+
+    # true, or why Ractor reports are skipped
+    def ractor_support
+      return "Ractor is not available" unless defined?(Ractor)
+
+      Warning[:experimental] = false
+      name = @workloads.names.first
+      ractor_value(Ractor.new(@workloads, name) { |workloads, workload| workloads.build(workload).call.call })
+      true
+    rescue Ractor::Error => e
+      (e.cause || e).message
+    end
+  end
+end
@@ -0,0 +1,144 @@
+# frozen_string_literal: true
+
+# Benchmark suite for the jq extension. Run with `bundle exec rake bench`.
+#
+# Environment:
+#   BENCH_TIME    Seconds measured per report (default: 2)
+#   BENCH_WARMUP  Seconds of warmup per report (default: 1)
+#   BENCH_FILTER  Regexp matched against "suite/report" to run a subset
+#   BENCH_OUTPUT  Path of the JSON results file (default: none)
+
+require "jq"
+require "json"
+require_relative "runner"
+
+runner = JQBench::Runner.new(
+  time: Float(ENV.fetch("BENCH_TIME", "2")),
+  warmup: Float(ENV.fetch("BENCH_WARMUP", "1")),
+  filter: ENV["BENCH_FILTER"] && Regexp.new(ENV["BENCH_FILTER"])
+)
+
+def user(i)
+  {
+    "id" => i,
+    "name" => "user#{i}",
+    "email" => "user#{i}@example.com",
+    "active" => i.even?,
+    "score" => i * 1.5,
+    "tags" => ["tag#{i % 7}", "tag#{i % 11}"],
+    "address" => { "city" => "City #{i % 50}", "zip" => format("%05d", i) }
+  }
+end
+
+TINY = '{"a":1}'
+MEDIUM = { "users" => (1..50).map { |i| user(i) } }.to_json         # ~10 KB
+HUGE = { "users" => (1..25_000).map { |i| user(i) } }.to_json       # ~5 MB
+MEDIUM_LARGE = { "users" => (1..350).map { |i| user(i) } }.to_json  # ~50 KB
+LARGE = { "users" => (1..3_200).map { |i| user(i) } }.to_json       # ~500 KB
+MEDIUM_OBJECT = JSON.parse(MEDIUM)
+FANOUT = (1..1_000).to_a.to_json
+
+# Heavy to compile, cheap to run on a tiny document
+COMPILE_HEAVY = <<~JQ
+  def clean: with_entries(select(.value != null));
+  def summarize: {id, name, city: .address.city, tags: (.tags | unique | join(","))};
+  [.users[]? | select(.active) | summarize | clean] | group_by(.city) | map({city: .[0].city, count: length})
+JQ
+
+# Cheap to compile, heavy to run
+EXECUTE_HEAVY = "[range(20000) | . * 2] | add"
+
+runner.suite("documents") do |s|
+  tiny = JQ.compile(".a")
+  identity = JQ.compile(".")
+  count = JQ.compile(".users | length")
+
+  s.report("tiny .a") { tiny.call(TINY) }
+  s.report("medium identity") { identity.call(MEDIUM) }
+  s.report("medium .users | length") { count.call(MEDIUM) }
+  s.report("huge .users | length") { count.call(HUGE) }
+  s.report("huge identity") { identity.call(HUGE) }
+end
+
+runner.suite("compile_vs_execute") do |s|
+  compiled = JQ.compile(COMPILE_HEAVY)
+  execute_heavy = JQ.compile(EXECUTE_HEAVY)
+
+  s.report("compile-heavy JQ.filter") { JQ.filter(TINY, COMPILE_HEAVY) }
+  s.report("compile-heavy Program#call") { compiled.call(TINY) }
+  s.report("JQ.compile only") { JQ.compile(COMPILE_HEAVY) }
+  s.report("execute-heavy JQ.filter") { JQ.filter("null", EXECUTE_HEAVY) }
+  s.report("execute-heavy Program#call") { execute_heavy.call("null") }
+end
+
+runner.suite("fanout") do |s|
+  program = JQ.compile(".[]")
+
+  s.report("multiple_outputs 1000", ops: 1_000) { program.call(FANOUT, multiple_outputs: true) }
+  s.report("each 1000", ops: 1_000) { program.each(FANOUT) { } }
+  s.report("call_into 1000", ops: 1_000) { program.call_into(FANOUT, String.new(capacity: 8_192)) }
+  s.report("first output only") { program.call(FANOUT) }
+end
+
+runner.suite("output") do |s|
+  program = JQ.compile(".users")
+
+  s.report("compact") { program.call(MEDIUM) }
+  s.report("pretty") { program.call(MEDIUM, compact_output: false) }
+  s.report("sorted") { program.call(MEDIUM, sort_keys: true) }
+  s.report("raw string") { program.call('{"users":"abc"}', raw_output: true) }
+end
+
+# Documents whose parse, rebuild and teardown make one jv allocation per
+# value, so allocator costs show up here first
+runner.suite("allocation") do |s|
+  identity = JQ.compile(".")
+  count = JQ.compile(".users | length")
+  rebuild = JQ.compile(".users | map(. + {seen: true})")
+
+  { "50 KB" => MEDIUM_LARGE, "500 KB" => LARGE }.each do |size, json|
+    s.report("#{size} parse + length") { count.call(json) }
+    s.report("#{size} identity") { identity.call(json) }
+    s.report("#{size} rebuild") { rebuild.call(json) }
+  end
+end
+
+runner.suite("batch") do |s|
+  docs = (1..1_000).map { |i| user(i).to_json }
+  program = JQ.compile(".address.city")
+
+  s.report("Program#call x1000", ops: 1_000) { docs.each { |d| program.call(d) } }
+  s.report("Program#call_many 1000", ops: 1_000) { program.call_many(docs) }
+
+  # Cached so both sides measure conversion, not compilation
+  JQ.cache_capacity = 16
+  s.report("JQ.filter_object medium") { JQ.filter_object(MEDIUM_OBJECT, ".users[0]") }
+  s.report("to_json + filter + JSON.parse medium") do
+    JSON.parse(JQ.filter(MEDIUM_OBJECT.to_json, ".users[0]"))
+  end
+ensure
+  JQ.cache_capacity = 0
+end
+
+runner.suite("threads") do |s|
+  program = JQ.compile(".users | map(.score) | add")
+  calls = 64
+
+  [1, 2, 4, 8].each do |n|
+    s.report("#{n} threads", ops: calls) do
+      Array.new(n) do
+        Thread.new { (calls / n).times { program.call(MEDIUM) } }
+      end.each(&:join)
+    end
+  end
+
+  docs = Array.new(calls, MEDIUM)
+  [1, 2, 4, 8].each do |n|
+    s.report("call_many parallel: #{n}", ops: calls) { program.call_many(docs, parallel: n) }
+  end
+end
+
+if (path = ENV["BENCH_OUTPUT"])
+  runner.write_json(path)
+  puts "\nResults written to #{path}"
+end
@@ -0,0 +1,193 @@
+# frozen_string_literal: true
+
+require "json"
+require "rbconfig"
+require "time"
+
+module JQBench
+  ##
+  # A small iterations-per-second benchmark runner in the style of
+  # benchmark-ips, with no dependencies outside the standard library.
+  #
+  # Each report is warmed up, then run in fixed-length samples. The mean rate
+  # and its standard deviation across samples are recorded, so results can be
+  # printed as a table and written as JSON for tracking across releases.
+  #
+  #   runner = JQBench::Runner.new(time: 2, warmup: 1)
+  #   runner.suite("documents") do |s|
+  #     s.report("tiny") { JQ.filter('{"a":1}', '.a') }
+  #   end
+  #   runner.write_json("bench.json")
+  #
+  class Runner
+    Result = Struct.new(:suite, :name, :ips, :stddev, :iterations, :seconds,
+                        :ops_per_iteration, keyword_init: true) do
+      def to_h
+        super.merge(stddev_pct: ips.zero? ? 0.0 : (stddev / ips * 100).round(2))
+      end
+    end
+
+    # Length of one measurement sample in seconds
+    SAMPLE_TIME = 0.1
+
+    attr_reader :results
+
+    ##
+    # @param time [Numeric] Seconds spent measuring each report
+    # @param warmup [Numeric] Seconds spent warming up each report
+    # @param filter [Regexp, nil] Only run reports whose "suite/name" matches
+    # @param io [IO] Where the human-readable table is printed
+    #
+    def initialize(time: 2, warmup: 1, filter: nil, io: $stdout)
+      @time = time
+      @warmup = warmup
+      @filter = filter
+      @io = io
+      @results = []
+      @suite = nil
+    end
+
+    ##
+    # Group reports under a suite name.
+    #
+    def suite(name)
+      @suite = name
+      @io.puts "\n#{name}"
+      yield self
+    ensure
+      @suite = nil
+    end
+
+    ##
+    # Measure a block.
+    #
+    # @param name [String] Report name, unique within the suite
+    # @param ops [Integer] Operations performed by one call of the block, so
+    #   batch and multi-threaded reports are comparable with single calls
+    #
+    def report(name, ops: 1, &block)
+      return if @filter && "#{@suite}/#{name}" !~ @filter
+
+      per_sample = calibrate(block)
+      rates = []
+      iterations = 0
+      started = now
+
+      while now - started < @time
+        elapsed = time_iterations(per_sample, block)
+        rates << per_sample * ops / elapsed
+        iterations += per_sample
+      end
+
+      result = Result.new(
+        suite: @suite,
+        name: name,
+        ips: mean(rates),
+        stddev: stddev(rates),
+        iterations: iterations,
+        seconds: now - started,
+        ops_per_iteration: ops
+      )
+      @results << result
+      print_result(result)
+      result
+    end
+
+    ##
+    # Results and environment as a JSON-serializable Hash.
+    #
+    def to_h
+      {
+        "created_at" => Time.now.utc.iso8601,
+        "environment" => environment,
+        "results" => @results.map { |r| r.to_h.transform_keys(&:to_s) }
+      }
+    end
+
+    def write_json(path)
+      File.write(path, JSON.pretty_generate(to_h) + "\n")
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # Warm up and find how many iterations fill one sample.
+    def calibrate(block)
+      iterations = 0
+      started = now
+      loop do
+        block.call
+        iterations += 1
+        break if now - started >= @warmup
+      end
+
+      per_second = iterations / (now - started)
+      [(per_second * SAMPLE_TIME).ceil, 1].max
+    end
+
+    def time_iterations(count, block)
+      started = now
+      i = 0
+      while i < count
+        block.call
+        i += 1
+      end
+      now - started
+    end
+
+    def mean(values)
+      values.sum / values.size
+    end
+
+    def stddev(values)
+      return 0.0 if values.size < 2
+
+      m = mean(values)
+      Math.sqrt(values.sum { |v| (v - m)**2 } / (values.size - 1))
+    end
+
+    def print_result(result)
+      pct = result.to_h[:stddev_pct]
+      @io.puts format("  %-40s %14s i/s (±%5.1f%%)", result.name, humanize(result.ips), pct)
+    end
+
+    def humanize(ips)
+      if ips >= 1_000_000
+        format("%.2fM", ips / 1_000_000)
+      elsif ips >= 1_000
+        format("%.2fk", ips / 1_000)
+      else
+        format("%.2f", ips)
+      end
+    end
+
+    def environment
+      JQBench.environment
+    end
+  end
+
+  ##
+  # Gem, Ruby and machine details recorded next to benchmark results.
+  #
+  def self.environment
+    require "etc"
+
+    {
+      "jq_gem" => JQ::VERSION,
+      "ruby" => RUBY_DESCRIPTION,
+      "platform" => RUBY_PLATFORM,
+      "cpus" => Etc.nprocessors,
+      "git_commit" => git_commit
+    }
+  end
+
+  def self.git_commit
+    commit = `git rev-parse --short HEAD 2>/dev/null`.strip
+    commit.empty? ? nil : commit
+  rescue SystemCallError
+    nil
+  end
+end
@@ -67,6 +67,26 @@ checking_for "ability to link against libjq" do
   try_link(src) or abort "Failed to link against libjq"
 end
 
+# Native worker threads for JQ.filter_many(parallel: N); without pthreads the
+# shards run one after another on the calling thread
+have_header('pthread.h') && have_library('pthread', 'pthread_create')
+
+# Dump streams for JQ.filter_into, so jv_dumpf() can serialize straight into a
+# native buffer; without either, results go through jv_dump_string()
+have_func('fopencookie', 'stdio.h') || have_func('funopen', 'stdio.h')
+
+# Read-only mappings for JQ.filter_file; without mmap() the file is read into
+# one buffer instead
+have_func('mmap', 'sys/mman.h')
+
+# JSON parser for JQ.parser = :fast (the default); --disable-fast-parser
+# builds with jq's parser only
+$defs << '-DJQ_FAST_PARSER' if enable_config('fast-parser', true)
+
+# jq release recorded in JQ::Program#dump, so JQ::Program.load refuses
+# bytecode compiled by another version
+$defs << %(-DJQ_LIBJQ_VERSION=\\"#{JQRecipe::JQ_VERSION}\\")
+
 # Add compiler flags
 $CFLAGS << " -Wall -Wextra -Wno-unused-parameter -fPIC"
 
@@ -0,0 +1,294 @@
+/* frozen_string_literal: true */
+
+#include "jq_ext.h"
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+#include <ruby/encoding.h>
+
+// Same nesting limit jq applies when parsing JSON text
+#define JQ_CONVERT_MAX_DEPTH 10000
+
+// Integers beyond this magnitude lose precision as doubles
+#define JQ_CONVERT_MAX_SAFE_INTEGER 9007199254740992LL
+
+static void rb_value_check(VALUE obj, int depth);
+static jv rb_value_build(VALUE obj);
+
+/**
+ * Hash iterator for rb_value_check: keys must be strings or symbols
+ */
+static int rb_value_check_pair(VALUE key, VALUE value, VALUE depth) {
+    if (!RB_TYPE_P(key, T_STRING) && !RB_TYPE_P(key, T_SYMBOL)) {
+        rb_raise(rb_eTypeError, "jq object keys must be String or Symbol (got %"PRIsVALUE")",
+                 rb_obj_class(key));
+    }
+    rb_value_check(value, NUM2INT(depth));
+    return ST_CONTINUE;
+}
+
+/**
+ * Check that a Ruby object can be converted to a jv, raising if not
+ *
+ * Runs before any jv is allocated so a failed conversion leaks nothing.
+ *
+ * @param obj Ruby object to check
+ * @param depth Current nesting depth
+ */
+static void rb_value_check(VALUE obj, int depth) {
+    switch (TYPE(obj)) {
+    case T_NIL:
+    case T_TRUE:
+    case T_FALSE:
+    case T_FIXNUM:
+    case T_BIGNUM:
+    case T_FLOAT:
+    case T_STRING:
+    case T_SYMBOL:
+        return;
+    case T_ARRAY:
+    case T_HASH:
+        break;
+    default:
+        rb_raise(rb_eTypeError, "can't convert %"PRIsVALUE" into a jq value",
+                 rb_obj_class(obj));
+    }
+
+    if (depth >= JQ_CONVERT_MAX_DEPTH) {
+        rb_raise(rb_eArgError, "nesting of %d is too deep", depth + 1);
+    }
+
+    if (RB_TYPE_P(obj, T_ARRAY)) {
+        for (long i = 0; i < RARRAY_LEN(obj); i++) {
+            rb_value_check(RARRAY_AREF(obj, i), depth + 1);
+        }
+    } else {
+        rb_hash_foreach(obj, rb_value_check_pair, INT2NUM(depth + 1));
+    }
+}
+
+/**
+ * Convert a Ruby string to a jv string
+ *
+ * Strings in other encodings are transcoded to UTF-8 when possible; bytes
+ * that are still invalid UTF-8 are replaced by jq with U+FFFD.
+ */
+static jv rb_string_build(VALUE str) {
+    rb_encoding *enc = rb_enc_get(str);
+
+    if (enc != rb_utf8_encoding() && enc != rb_usascii_encoding() &&
+        enc != rb_ascii8bit_encoding() && !rb_enc_str_asciionly_p(str)) {
+        str = rb_str_conv_enc(str, enc, rb_utf8_encoding());
+    }
+
+    jv value = jv_string_sized(RSTRING_PTR(str), (int)RSTRING_LEN(str));
+    RB_GC_GUARD(str);
+    return value;
+}
+
+/**
+ * Convert a Ruby Integer to a jv number
+ *
+ * Integers a double cannot represent exactly keep their decimal literal, so
+ * jq passes them through unchanged unless arithmetic is applied.
+ */
+static jv rb_integer_build(VALUE num) {
+    if (FIXNUM_P(num)) {
+        long n = FIX2LONG(num);
+        if (n > -JQ_CONVERT_MAX_SAFE_INTEGER && n < JQ_CONVERT_MAX_SAFE_INTEGER) {
+            return jv_number((double)n);
+        }
+    }
+
+    VALUE literal = rb_big2str(rb_to_int(num), 10);
+    jv value = jv_number_with_literal(StringValueCStr(literal));
+    RB_GC_GUARD(literal);
+    return value;
+}
+
+/**
+ * Convert a Ruby Float to a jv number
+ *
+ * Integral floats keep their literal (e.g. "1.0") so they come back as
+ * Floats when jq passes them through unchanged.
+ */
+static jv rb_float_build(VALUE num) {
+    double d = RFLOAT_VALUE(num);
+    if (!isfinite(d) || d != floor(d)) return jv_number(d);
+
+    char literal[32];
+    if (fabs(d) < 1e16) {
+        snprintf(literal, sizeof(literal), "%.0f.0", d);
+    } else {
+        snprintf(literal, sizeof(literal), "%.17g", d);
+    }
+    return jv_number_with_literal(literal);
+}
+
+/**
+ * Hash iterator for rb_value_build
+ */
+static int rb_value_build_pair(VALUE key, VALUE value, VALUE arg) {
+    jv *object = (jv *)arg;
+    VALUE key_str = RB_TYPE_P(key, T_SYMBOL) ? rb_sym2str(key) : key;
+
+    *object = jv_object_set(*object, rb_string_build(key_str),
+                            rb_value_build(value));
+    return ST_CONTINUE;
+}
+
+/**
+ * Build a jv from a Ruby object already accepted by rb_value_check
+ */
+static jv rb_value_build(VALUE obj) {
+    switch (TYPE(obj)) {
+    case T_NIL:
+        return jv_null();
+    case T_TRUE:
+        return jv_true();
+    case T_FALSE:
+        return jv_false();
+    case T_FIXNUM:
+    case T_BIGNUM:
+        return rb_integer_build(obj);
+    case T_FLOAT:
+        return rb_float_build(obj);
+    case T_STRING:
+        return rb_string_build(obj);
+    case T_SYMBOL:
+        return rb_string_build(rb_sym2str(obj));
+    case T_ARRAY: {
+        long len = RARRAY_LEN(obj);
+        jv array = jv_array_sized((int)len);
+        for (long i = 0; i < len; i++) {
+            array = jv_array_append(array, rb_value_build(RARRAY_AREF(obj, i)));
+        }
+        return array;
+    }
+    default: {
+        jv object = jv_object();
+        rb_hash_foreach(obj, rb_value_build_pair, (VALUE)&object);
+        return object;
+    }
+    }
+}
+
+/**
+ * Convert a Ruby object to a jv value
+ *
+ * Supports Hash (String or Symbol keys), Array, String, Symbol, Integer,
+ * Float, true, false and nil.
+ *
+ * @param obj Ruby object to convert
+ * @return New jv value (caller owns it)
+ * @raise TypeError if obj contains an unsupported object
+ * @raise ArgumentError if obj is nested too deeply (or recursive)
+ */
+jv jq_rb_to_jv(VALUE obj) {
+    rb_value_check(obj, 0);
+    return rb_value_build(obj);
+}
+
+/**
+ * Convert a jv number to a Ruby Integer or Float
+ *
+ * Mirrors what parsing jq's JSON output would return: numbers printed
+ * without a fraction or exponent become Integers, others Floats. NaN
+ * becomes nil and infinities are clamped, as in jq's output.
+ */
+static VALUE jv_number_to_rb(jv value) {
+    if (jv_number_has_literal(value)) {
+        const char *literal = jv_number_get_literal(value);
+        if (literal && !strpbrk(literal, ".eE")) {
+            VALUE num = rb_cstr2inum(literal, 10);
+            jv_free(value);
+            return num;
+        }
+        if (literal) {
+            double d = jv_number_value(value);
+            jv_free(value);
+            return DBL2NUM(d);
+        }
+    }
+
+    double d = jv_number_value(value);
+    jv_free(value);
+
+    if (isnan(d)) return Qnil;
+    if (isinf(d)) return DBL2NUM(d > 0 ? DBL_MAX : -DBL_MAX);
+    if (d == floor(d) && fabs(d) < 9.2e18) return LL2NUM((long long)d);
+    return DBL2NUM(d);
+}
+
+/**
+ * Convert a jv string to a Ruby string (frozen and deduplicated if asked)
+ */
+static VALUE jv_string_to_rb_str(jv value, int freeze) {
+    const char *ptr = jv_string_value(value);
+    long len = jv_string_length_bytes(jv_copy(value));
+
+    VALUE str = freeze ?
+        rb_enc_interned_str(ptr, len, rb_utf8_encoding()) :
+        rb_utf8_str_new(ptr, len);
+    jv_free(value);
+    return str;
+}
+
+/**
+ * Convert a jv value to a Ruby object
+ *
+ * Objects become Hashes (String keys, or Symbols with symbolize_names),
+ * arrays become Arrays, strings become UTF-8 Strings, numbers become
+ * Integers or Floats.
+ *
+ * @param value The jv value to convert (CONSUMED by this function)
+ * @param opts Conversion options
+ * @return Ruby object
+ */
+VALUE jq_jv_to_rb(jv value, const jq_object_options *opts) {
+    switch (jv_get_kind(value)) {
+    case JV_KIND_NULL:
+        jv_free(value);
+        return Qnil;
+    case JV_KIND_TRUE:
+        jv_free(value);
+        return Qtrue;
+    case JV_KIND_FALSE:
+        jv_free(value);
+        return Qfalse;
+    case JV_KIND_NUMBER:
+        return jv_number_to_rb(value);
+    case JV_KIND_STRING:
+        return jv_string_to_rb_str(value, opts->freeze);
+    case JV_KIND_ARRAY: {
+        int len = jv_array_length(jv_copy(value));
+        VALUE ary = rb_ary_new_capa(len);
+        for (int i = 0; i < len; i++) {
+            rb_ary_push(ary, jq_jv_to_rb(jv_array_get(jv_copy(value), i), opts));
+        }
+        jv_free(value);
+        if (opts->freeze) rb_ary_freeze(ary);
+        return ary;
+    }
+    case JV_KIND_OBJECT: {
+        VALUE hash = rb_hash_new();
+        int iter = jv_object_iter(value);
+        while (jv_object_iter_valid(value, iter)) {
+            // Keys are always interned: Hash#[]= would copy them otherwise
+            VALUE key = jv_string_to_rb_str(jv_object_iter_key(value, iter), 1);
+            if (opts->symbolize_names) key = rb_str_intern(key);
+
+            rb_hash_aset(hash, key,
+                         jq_jv_to_rb(jv_object_iter_value(value, iter), opts));
+            iter = jv_object_iter_next(value, iter);
+        }
+        jv_free(value);
+        if (opts->freeze) rb_hash_freeze(hash);
+        return hash;
+    }
+    default:
+        jv_free(value);
+        return Qnil;
+    }
+}
@@ -0,0 +1,320 @@
+/* frozen_string_literal: true */
+
+#include "jq_ext.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Compact JSON output without jv_dump_string (see jq_dump)
+ *
+ * jv_dump_string() appends to a jv string one character at a time, and
+ * with JV_PRINT_SORTED builds and sorts a jv array of keys for every
+ * object. jq_dump writes compact output straight into a jq_output_buffer
+ * instead: string bodies are copied in runs found 16 bytes at a time,
+ * object keys are sorted as C strings, and numbers are written from their
+ * literal text. The bytes are the same as jq's; whatever it cannot
+ * reproduce exactly (pretty printing, numbers without a literal that are
+ * not small integers, very deep values) is still written by jq.
+ */
+
+// Object entries sorted on the stack; larger objects use malloc
+#define JQ_DUMP_STACK_KEYS 16
+
+// An object entry being sorted by key
+typedef struct {
+    const char *key;            // Owned by the object, which outlives the dump
+    int len;
+    int iter;                   // jv_object_iter position of the entry
+} jq_dump_entry;
+
+/**
+ * Find the first byte of a string body that jq writes escaped: '"', '\\',
+ * a control character or DEL
+ *
+ * @return Pointer to that byte, or end if there is none
+ */
+static const char *jq_dump_scan(const char *p, const char *end) {
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                         _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control),
+                         _mm_cmpeq_epi8(chunk, del)));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t control = vdupq_n_u8(0x1f);
+    const uint8x16_t del = vdupq_n_u8(0x7f);
+
+    while (end - p >= 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint8x16_t hits = vorrq_u8(
+            vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)),
+            vorrq_u8(vcleq_u8(chunk, control), vceqq_u8(chunk, del)));
+        if (vmaxvq_u8(hits)) break;  // Found in this chunk: finish bytewise
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' &&
+           (unsigned char)*p >= 0x20 && *p != 0x7f) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Write a quoted string the way jv_dump_string() does: '"' and '\\'
+ * backslashed, \b \f \n \r \t by name, other control characters and DEL
+ * as \u00XX, and everything else (UTF-8 included) as is
+ */
+static int jq_dump_string(jq_output_buffer *out, const char *str, int len) {
+    static const char hex[] = "0123456789abcdef";
+    const char *p = str;
+    const char *end = str + len;
+
+    // The whole string plus its quotes, unless it has escapes
+    if (!jq_output_reserve(out, (size_t)len + 2)) return 0;
+    out->ptr[out->len++] = '"';
+
+    for (;;) {
+        const char *stop = jq_dump_scan(p, end);
+        if (!jq_output_append(out, p, stop - p)) return 0;
+        if (stop == end) break;
+
+        char escape[6] = { '\\', 0, '0', '0', 0, 0 };
+        size_t n = 2;
+        switch (*stop) {
+        case '"': escape[1] = '"'; break;
+        case '\\': escape[1] = '\\'; break;
+        case '\b': escape[1] = 'b'; break;
+        case '\f': escape[1] = 'f'; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\r': escape[1] = 'r'; break;
+        case '\t': escape[1] = 't'; break;
+        default:
+            escape[1] = 'u';
+            escape[4] = hex[(unsigned char)*stop >> 4];
+            escape[5] = hex[*stop & 0xf];
+            n = 6;
+        }
+        if (!jq_output_append(out, escape, n)) return 0;
+        p = stop + 1;
+    }
+
+    return jq_output_append(out, "\"", 1);
+}
+
+/**
+ * Write a number the way jv_dump_string() does
+ *
+ * Numbers parsed from JSON text keep their literal, which jq prints as is,
+ * and integers below 1e16 print as plain digits. Any other double goes
+ * through jq, whose shortest round-trip formatting is not reproduced here.
+ */
+static int jq_dump_number(jq_output_buffer *out, jv x) {
+    if (jv_number_has_literal(x)) {
+        const char *literal = jv_number_get_literal(x);
+        // NaN and infinite literals are printed specially
+        if (literal && (*literal == '-' || (*literal >= '0' && *literal <= '9'))) {
+            return jq_output_append(out, literal, strlen(literal));
+        }
+    } else {
+        double d = jv_number_value(x);
+        if (d > -1e16 && d < 1e16 && d == (double)(long long)d) {
+            char digits[24];
+            char *p = digits + sizeof(digits);
+            unsigned long long n = d < 0 ? (unsigned long long)-d :
+                (unsigned long long)d;
+            do {
+                *--p = (char)('0' + n % 10);
+                n /= 10;
+            } while (n);
+            if (signbit(d)) *--p = '-';  // -0 too, as jq prints it
+            return jq_output_append(out, p, digits + sizeof(digits) - p);
+        }
+    }
+
+    jv text = jv_dump_string(jv_copy(x), 0);
+    int ok = jv_is_valid(text) &&
+        jq_output_append(out, jv_string_value(text),
+                         jv_string_length_bytes(jv_copy(text)));
+    jv_free(text);
+    return ok;
+}
+
+// Byte order of jq's string comparison (jv_sort), shorter strings first
+static int jq_dump_entry_cmp(const void *a, const void *b) {
+    const jq_dump_entry *x = a;
+    const jq_dump_entry *y = b;
+    int r = memcmp(x->key, y->key, x->len < y->len ? x->len : y->len);
+    return r ? r : x->len - y->len;
+}
+
+static int jq_dump_value(jq_output_buffer *out, jv x, int flags, int depth);
+
+/**
+ * Write the entries of an object sorted by key (JV_PRINT_SORTED)
+ */
+static int jq_dump_sorted_object(jq_output_buffer *out, jv x, int flags,
+                                 int depth) {
+    jq_dump_entry stack[JQ_DUMP_STACK_KEYS];
+    jq_dump_entry *entries = stack;
+    int count = jv_object_length(jv_copy(x));
+
+    if (count > JQ_DUMP_STACK_KEYS) {
+        entries = malloc(sizeof(jq_dump_entry) * count);
+        if (!entries) {
+            out->failed = 1;
+            return 0;
+        }
+    }
+
+    int n = 0;
+    for (int i = jv_object_iter(x); jv_object_iter_valid(x, i);
+         i = jv_object_iter_next(x, i)) {
+        jv key = jv_object_iter_key(x, i);
+        entries[n].key = jv_string_value(key);
+        entries[n].len = jv_string_length_bytes(jv_copy(key));
+        entries[n].iter = i;
+        n++;
+        jv_free(key);  // Still referenced by the object
+    }
+    qsort(entries, n, sizeof(jq_dump_entry), jq_dump_entry_cmp);
+
+    int ok = jq_output_append(out, "{", 1);
+    for (int i = 0; ok && i < n; i++) {
+        ok = (i == 0 || jq_output_append(out, ",", 1)) &&
+            jq_dump_string(out, entries[i].key, entries[i].len) &&
+            jq_output_append(out, ":", 1) &&
+            jq_dump_value(out, jv_object_iter_value(x, entries[i].iter),
+                          flags, depth);
+    }
+
+    if (entries != stack) free(entries);
+    return ok && jq_output_append(out, "}", 1);
+}
+
+/**
+ * Write one value without whitespace
+ *
+ * @param x The value (CONSUMED by this function)
+ * @return 1, or 0 if out of memory or the value is too deep to be written
+ *   like jq (which stops printing at its own depth limit)
+ */
+static int jq_dump_value(jq_output_buffer *out, jv x, int flags, int depth) {
+    int ok = 1;
+
+    switch (jv_get_kind(x)) {
+    case JV_KIND_NULL:
+        ok = jq_output_append(out, "null", 4);
+        break;
+    case JV_KIND_TRUE:
+        ok = jq_output_append(out, "true", 4);
+        break;
+    case JV_KIND_FALSE:
+        ok = jq_output_append(out, "false", 5);
+        break;
+    case JV_KIND_NUMBER:
+        ok = jq_dump_number(out, x);
+        break;
+    case JV_KIND_STRING:
+        ok = jq_dump_string(out, jv_string_value(x),
+                            jv_string_length_bytes(jv_copy(x)));
+        break;
+    case JV_KIND_ARRAY: {
+        if (++depth > JQ_DUMP_MAX_DEPTH) {
+            ok = 0;
+            break;
+        }
+        int len = jv_array_length(jv_copy(x));
+        ok = jq_output_append(out, "[", 1);
+        for (int i = 0; ok && i < len; i++) {
+            ok = (i == 0 || jq_output_append(out, ",", 1)) &&
+                jq_dump_value(out, jv_array_get(jv_copy(x), i), flags, depth);
+        }
+        ok = ok && jq_output_append(out, "]", 1);
+        break;
+    }
+    case JV_KIND_OBJECT:
+        if (++depth > JQ_DUMP_MAX_DEPTH) {
+            ok = 0;
+            break;
+        }
+        if (flags & JV_PRINT_SORTED) {
+            ok = jq_dump_sorted_object(out, x, flags, depth);
+            break;
+        }
+        ok = jq_output_append(out, "{", 1);
+        int first = 1;
+        for (int i = jv_object_iter(x); ok && jv_object_iter_valid(x, i);
+             i = jv_object_iter_next(x, i)) {
+            jv key = jv_object_iter_key(x, i);
+            ok = (first || jq_output_append(out, ",", 1)) &&
+                jq_dump_string(out, jv_string_value(key),
+                               jv_string_length_bytes(jv_copy(key))) &&
+                jq_output_append(out, ":", 1) &&
+                jq_dump_value(out, jv_object_iter_value(x, i), flags, depth);
+            jv_free(key);
+            first = 0;
+        }
+        ok = ok && jq_output_append(out, "}", 1);
+        break;
+    default:
+        ok = 0;
+    }
+
+    jv_free(x);
+    return ok;
+}
+
+/**
+ * Append a value serialized as jv_dump_string(value, flags) would
+ *
+ * Compact output, sorted or not, is written directly; other flags, and
+ * values jq_dump_value gives up on, are dumped by jq.
+ *
+ * Pure C (no Ruby API), so it is safe to call without the GVL.
+ *
+ * @param out Output buffer
+ * @param value The value (CONSUMED by this function)
+ * @param flags jv_dump flags
+ * @return 1, or 0 if out of memory (out->failed set) or jq failed to dump
+ */
+int jq_dump(jq_output_buffer *out, jv value, int flags) {
+    size_t start = out->len;
+
+    if (!(flags & ~JV_PRINT_SORTED) &&
+        jq_dump_value(out, jv_copy(value), flags, 0)) {
+        jv_free(value);
+        return 1;
+    }
+    if (out->failed) {
+        jv_free(value);
+        return 0;
+    }
+
+    out->len = start;
+    jv text = jv_dump_string(value, flags);  // CONSUMES value
+    int ok = jv_is_valid(text) &&
+        jq_output_append(out, jv_string_value(text),
+                         jv_string_length_bytes(jv_copy(text)));
+    jv_free(text);
+    return ok;
+}
@@ -1,7 +1,16 @@
 /* frozen_string_literal: true */
 
 #include "jq_ext.h"
+#include <limits.h>
+#include <math.h>
 #include <string.h>
+#include <time.h>
+#include <ruby/thread.h>
+#include <ruby/fiber/scheduler.h>
+#include <ruby/ractor.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 // Global variables for Ruby module and exception classes
 VALUE rb_mJQ;
@@ -9,112 +18,471 @@ VALUE rb_eJQError;
 VALUE rb_eJQCompileError;
 VALUE rb_eJQRuntimeError;
 VALUE rb_eJQParseError;
+VALUE rb_eJQPoolTimeoutError;
+VALUE rb_eJQTimeoutError;
+VALUE rb_eJQResourceError;
+VALUE rb_cJQProgram;
+VALUE rb_cJQProgramSet;
+VALUE rb_cJQDocument;
+static VALUE rb_cJQStats;
+
+// Option keys, interned once in Init_jq_ext
+static VALUE sym_raw_output;
+static VALUE sym_compact_output;
+static VALUE sym_sort_keys;
+static VALUE sym_multiple_outputs;
+static VALUE sym_sandbox;
+static VALUE sym_errors;
+static VALUE sym_parallel;
+static VALUE sym_symbolize_names;
+static VALUE sym_freeze;
+static VALUE sym_pool_size;
+static VALUE sym_pool_timeout;
+static VALUE sym_timeout;
+static VALUE sym_args;
+static VALUE sym_max_steps;
+static VALUE sym_max_outputs;
+static VALUE sym_max_memory;
+static VALUE sym_fast;
+static VALUE sym_jq;
+static VALUE sym_async;
+static ID id_join;
+static VALUE sym_stats;
+static VALUE sym_stream;
+static VALUE sym_document;
+static VALUE sym_filter;
+static VALUE sym_exception;
+static VALUE sym_exception_object;
+static ID id_call;
+static ID id_instrument;
+static ID id_to_h;
+static ID id_last_stats;
+static ID id_pop;
+static ID id_push;
+static VALUE rb_cQueue;
+static ID id_read;
+static ID id_write;
+static VALUE sym_raise;
+static VALUE sym_nil;
+static VALUE sym_error;
+static VALUE rb_eRactorIsolationError;
+
+// Ractor-local key set (to true) in the main Ractor only
+static rb_ractor_local_key_t jq_main_ractor_key;
+
+// Compiled filter cache used by JQ.filter, one per Ractor (see
+// JQ.cache_capacity)
+static rb_ractor_local_key_t jq_cache_key;
+static long jq_cache_capacity = 0;
+
+// Initialized jq_states reused by jq_compile_filter, one pool per Ractor
+// (see JQ.state_pool_size)
+static rb_ractor_local_key_t jq_state_pool_key;
+static int jq_state_pool_size = JQ_STATE_POOL_SIZE;
+
+// Whether JSON text is parsed with jq_parse_fast (see JQ.parser)
+#ifdef JQ_FAST_PARSER
+static int jq_fast_parse = 1;
+#else
+static int jq_fast_parse = 0;
+#endif
+
+// Whether runs under a fiber scheduler are offloaded by default (see JQ.async)
+static int jq_async = 0;
+
+// Receiver of a "filter.jq" event per JQ.filter / Program#call (see
+// JQ.instrumenter=), or nil
+static VALUE jq_instrumenter = Qnil;
 
 // Forward declarations for static helper functions
-static VALUE jv_to_json_string(jv value, int raw, int compact, int sort);
-static void raise_jq_error(jv error_value, VALUE exception_class);
-static VALUE rb_jq_filter_impl(const char *json_str, const char *filter_str,
-                                int raw_output, int compact_output,
-                                int sort_keys, int multiple_outputs,
-                                int sandbox);
+static jv jv_serialize(jv value, const jq_output_options *opts);
+static VALUE jv_string_to_rb(jv value);
+static VALUE jq_error_new(jv error_value, VALUE exception_class);
+static jq_state *jq_compile_filter(const char *filter_str, int sandbox);
+static void parse_output_options(VALUE opts, jq_output_options *out);
+static void parse_stream_option(VALUE opts, jq_output_options *out);
+static void parse_document_option(VALUE opts, jq_output_options *out);
+static int parse_sandbox_option(VALUE opts);
+static jq_error_mode parse_error_mode_option(VALUE opts);
+static int parse_parallel_option(VALUE opts);
+static void parse_object_options(VALUE opts, jq_object_options *out);
+static int parse_pool_size_option(VALUE opts);
+static double parse_pool_timeout_option(VALUE opts);
+static void *jq_run_nogvl(void *ptr);
+static void jq_interrupt_ubf(void *ptr);
+static VALUE jq_run_execute(jq_run *run);
+static VALUE jq_pin_input(VALUE json_str);
+static VALUE jq_execute(jq_state *jq, VALUE json_str,
+                        const jq_output_options *opts, const jq_kernel *kernel);
+static VALUE jq_execute_many(jq_state **states, int nstates, VALUE filter,
+                             VALUE bytecode, int sandbox,
+                             const jq_kernel *kernel, VALUE jsons,
+                             const jq_output_options *opts,
+                             jq_error_mode error_mode);
+static VALUE rb_jq_filter_impl(VALUE json_str, const char *filter_str,
+                                const jq_output_options *opts, int sandbox,
+                                const jq_file *file, jq_input_kind kind);
+static VALUE jq_execute_file(jq_state *jq, const jq_file *file,
+                             const jq_output_options *opts,
+                             const jq_kernel *kernel);
+static VALUE jq_execute_document(jq_state *jq, VALUE doc,
+                                 const jq_output_options *opts,
+                                 const jq_kernel *kernel);
+static VALUE jq_execute_object(jq_state *jq, VALUE obj,
+                               const jq_output_options *opts,
+                               const jq_object_options *object_opts,
+                               const jq_kernel *kernel);
+static VALUE jq_execute_stream(jq_state *jq, VALUE input,
+                               const jq_output_options *opts,
+                               const jq_file *file);
+static VALUE jq_execute_into(jq_state *jq, VALUE json_str, VALUE dest,
+                             const jq_output_options *opts,
+                             const jq_kernel *kernel);
+static VALUE jq_execute_each(jq_state *jq, VALUE json_str,
+                             const jq_output_options *opts,
+                             const jq_kernel *kernel);
+static VALUE jq_program_run(VALUE self, VALUE json_str,
+                            const jq_output_options *opts);
+static VALUE jq_program_run_object(VALUE self, VALUE obj,
+                                   const jq_output_options *opts,
+                                   const jq_object_options *object_opts);
+static VALUE jq_program_run_input(VALUE self, VALUE input,
+                                  const jq_output_options *opts,
+                                  jq_input_kind kind,
+                                  const jq_object_options *object_opts);
+static VALUE jq_program_run_into(VALUE self, VALUE json_str, VALUE dest,
+                                 const jq_output_options *opts);
+static VALUE jq_program_run_file(VALUE self, const jq_file *file,
+                                 const jq_output_options *opts,
+                                 jq_input_kind kind);
+static VALUE jq_program_run_many(VALUE self, VALUE jsons,
+                                 const jq_output_options *opts,
+                                 jq_error_mode error_mode, int parallel);
+static VALUE jq_cache_fetch(VALUE filter_str, int sandbox);
+static jq_filter_cache *jq_cache_current(void);
+static double jq_monotonic_time(void);
+static int jq_is_document(VALUE obj);
+static jv jq_document_value(VALUE self);
+static VALUE jq_document_wrap(jv value, long long memsize);
 
 /**
- * Convert a jv value to a Ruby JSON string
- *
- * @param value The jv value to convert (CONSUMED by this function)
- * @param raw If true and value is string, return raw string (jq -r)
- * @param compact If true, use compact JSON output (jq -c)
- * @param sort If true, sort object keys (jq -S)
- * @return Ruby string containing JSON or raw value
+ * jv_dump flags for the given output options
  */
-static VALUE jv_to_json_string(jv value, int raw, int compact, int sort) {
+static int jq_dump_flags(const jq_output_options *opts) {
     int flags = 0;
     // Compact is the default; JV_PRINT_PRETTY makes it non-compact
-    if (!compact) flags |= JV_PRINT_PRETTY;
-    if (sort) flags |= JV_PRINT_SORTED;
+    if (!opts->compact_output) flags |= JV_PRINT_PRETTY;
+    if (opts->sort_keys) flags |= JV_PRINT_SORTED;
+    return flags;
+}
 
-    jv json;
-    VALUE result;
+/**
+ * Serialize a jq result to a jv string
+ *
+ * Pure C (no Ruby API), so it is safe to call without the GVL.
+ *
+ * @param value The jv value to convert (CONSUMED by this function)
+ * @param opts Output options (raw, compact, sort keys)
+ * @return jv string containing JSON or raw value, or jv_invalid() on failure
+ */
+static jv jv_serialize(jv value, const jq_output_options *opts) {
+    int flags = jq_dump_flags(opts);
 
     // Raw output - return string directly without JSON encoding
-    if (raw && jv_get_kind(value) == JV_KIND_STRING) {
-        const char *str = jv_string_value(value);
-        size_t len = jv_string_length_bytes(jv_copy(value));
-        result = rb_utf8_str_new(str, len);
-        jv_free(value);  // Free the string value
-        return result;
+    if (opts->raw_output && jv_get_kind(value) == JV_KIND_STRING) {
+        return value;
+    }
+
+    // Compact output is written by jq_dump, then copied once into a string
+    if (!(flags & JV_PRINT_PRETTY)) {
+        jq_output_buffer buf = { NULL, 0, 0, NULL, 0 };
+        buf.ptr = malloc(JQ_DUMP_INITIAL_SIZE);
+        if (!buf.ptr) {
+            jv_free(value);
+            return jv_invalid();
+        }
+        buf.capa = JQ_DUMP_INITIAL_SIZE;
+
+        jv json = jq_dump(&buf, value, flags) ?  // CONSUMES value
+            jv_string_sized(buf.ptr, (int)buf.len) : jv_invalid();
+        free(buf.ptr);
+        return json;
     }
 
     // Convert to JSON string
-    json = jv_dump_string(value, flags);  // CONSUMES value
+    jv json = jv_dump_string(value, flags);  // CONSUMES value
 
     if (!jv_is_valid(json)) {
         jv_free(json);
-        rb_raise(rb_eJQRuntimeError, "Failed to convert result to JSON");
+        return jv_invalid();
     }
 
-    const char *json_str = jv_string_value(json);
-    size_t json_len = jv_string_length_bytes(jv_copy(json));
-    result = rb_utf8_str_new(json_str, json_len);
-    jv_free(json);  // Free the JSON string
+    return json;
+}
 
+/**
+ * Convert a jv string to a Ruby UTF-8 string
+ *
+ * @param value The jv string to convert (CONSUMED by this function)
+ * @return Ruby string
+ */
+static VALUE jv_string_to_rb(jv value) {
+    const char *str = jv_string_value(value);
+    size_t len = jv_string_length_bytes(jv_copy(value));
+    VALUE result = rb_utf8_str_new(str, len);
+    jv_free(value);  // Free the string value
     return result;
 }
 
 /**
- * Raise a Ruby exception from a jv error value
+ * Build a Ruby exception from a jv error value
  *
  * @param error_value The jv error message (CONSUMED by this function)
- * @param exception_class The Ruby exception class to raise
+ * @param exception_class The Ruby exception class to instantiate
+ * @return Exception object (not raised)
  */
-static void raise_jq_error(jv error_value, VALUE exception_class) {
+static VALUE jq_error_new(jv error_value, VALUE exception_class) {
     if (!jv_is_valid(error_value) ||
         jv_get_kind(error_value) != JV_KIND_STRING) {
         jv_free(error_value);
-        rb_raise(exception_class, "Unknown jq error");
+        return rb_exc_new_cstr(exception_class, "Unknown jq error");
+    }
+
+    VALUE rb_msg = jv_string_to_rb(error_value);  // CONSUMES error_value
+    return rb_exc_new_str(exception_class, rb_msg);
+}
+
+/**
+ * Current monotonic clock reading in seconds
+ */
+static double jq_monotonic_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * Current monotonic clock reading in nanoseconds
+ */
+static unsigned long long jq_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL +
+        (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * Start timing a phase of a measured call
+ *
+ * @return Clock reading to pass to jq_stats_add, or 0 if not measured
+ */
+static unsigned long long jq_stats_start(const jq_output_options *opts) {
+    return opts->stats ? jq_monotonic_ns() : 0;
+}
+
+/**
+ * Add the time since +start+ to a phase counter of a measured call
+ */
+static void jq_stats_add(unsigned long long *phase_ns,
+                         unsigned long long start) {
+    *phase_ns += jq_monotonic_ns() - start;
+}
+
+/**
+ * Whether the caller runs in the main Ractor
+ */
+static int jq_main_ractor_p(void) {
+    return RTEST(rb_ractor_local_storage_value(jq_main_ractor_key));
+}
+
+/**
+ * Raise Ractor::IsolationError unless called from the main Ractor
+ *
+ * The JQ.* settings apply to every Ractor, so like the instance variables
+ * of a module they can only be changed by the main one.
+ */
+static void jq_check_main_ractor(const char *setting) {
+    if (!jq_main_ractor_p()) {
+        rb_raise(rb_eRactorIsolationError,
+                 "can not set JQ.%s from non-main Ractors", setting);
+    }
+}
+
+/**
+ * The instrumenter calls made here are reported to, or Qnil
+ *
+ * Only the main Ractor publishes events: an instrumenter such as
+ * ActiveSupport::Notifications keeps its subscribers in objects other
+ * Ractors cannot use.
+ */
+static VALUE jq_instrumenter_current(void) {
+    return jq_main_ractor_p() ? jq_instrumenter : Qnil;
+}
+
+static void jq_state_pool_free(void *ptr) {
+    jq_state_pool *pool = (jq_state_pool *)ptr;
+    for (int sandbox = 0; sandbox < 2; sandbox++) {
+        while (pool->count[sandbox] > 0) {
+            jq_teardown(&pool->states[sandbox][--pool->count[sandbox]]);
+        }
+    }
+    xfree(pool);
+}
+
+static const struct rb_ractor_local_storage_type jq_state_pool_storage = {
+    NULL,
+    jq_state_pool_free,
+};
+
+/**
+ * The state pool of the current Ractor, created on first use
+ *
+ * Each Ractor pools its own states: a released state still holds the
+ * constants of its last program, which results of that program (such as a
+ * JQ::Document) may share with non-atomic reference counts, so it must not
+ * be recompiled by another Ractor.
+ */
+static jq_state_pool *jq_state_pool_current(void) {
+    jq_state_pool *pool = rb_ractor_local_storage_ptr(jq_state_pool_key);
+    if (!pool) {
+        pool = ZALLOC(jq_state_pool);
+        rb_ractor_local_storage_ptr_set(jq_state_pool_key, pool);
+    }
+    return pool;
+}
+
+/**
+ * Take an initialized jq_state with the given sandbox flag
+ *
+ * States released by earlier calls are reused (jq_compile() resets them and
+ * replaces their bytecode), so a compile does not pay for jq_init() and the
+ * matching jq_teardown(). The sandbox flag cannot be cleared, so sandboxed
+ * and unsandboxed states are pooled separately. Called with the GVL held,
+ * which also serializes access to the current Ractor's pool.
+ *
+ * @return jq_state, or NULL if jq_init() failed
+ */
+static jq_state *jq_state_acquire(int sandbox) {
+    jq_state_pool *pool = jq_state_pool_current();
+    sandbox = sandbox ? 1 : 0;
+    if (pool->count[sandbox] > 0) {
+        return pool->states[sandbox][--pool->count[sandbox]];
+    }
+
+    jq_state *jq = jq_init();
+    if (jq && sandbox) {
+        jq_set_sandbox(jq);
     }
+    return jq;
+}
 
-    const char *msg = jv_string_value(error_value);
-    VALUE rb_msg = rb_str_new_cstr(msg);
-    jv_free(error_value);  // Free the error message
+/**
+ * Return a jq_state to the pool, or tear it down if the pool is full
+ *
+ * The state keeps its bytecode until the next jq_compile() replaces it;
+ * whatever its last run left on the stack (possibly a large input) is
+ * dropped now. Called with the GVL held.
+ *
+ * @param jq jq_state that compiled successfully (set to NULL)
+ */
+static void jq_state_release(jq_state **jq) {
+    jq_state_pool *pool = jq_state_pool_current();
+    int sandbox = jq_is_sandbox(*jq) ? 1 : 0;
+    if (pool->count[sandbox] < jq_state_pool_size) {
+        jq_start(*jq, jv_null(), 0);  // Resets the previous run
+        pool->states[sandbox][pool->count[sandbox]++] = *jq;
+        *jq = NULL;
+        return;
+    }
+    jq_teardown(jq);
+}
 
-    // Store C string before rb_raise (StringValueCStr can raise if encoding issues occur)
-    const char *msg_cstr = StringValueCStr(rb_msg);
-    rb_raise(exception_class, "%s", msg_cstr);
+/**
+ * Tear down pooled states until each pool of the current Ractor holds at
+ * most +limit+ (the pools of other Ractors shrink as their states are reused)
+ */
+static void jq_state_pool_trim(int limit) {
+    jq_state_pool *pool = jq_state_pool_current();
+    for (int sandbox = 0; sandbox < 2; sandbox++) {
+        while (pool->count[sandbox] > limit) {
+            jq_teardown(&pool->states[sandbox][--pool->count[sandbox]]);
+        }
+    }
 }
 
 /**
- * Implementation of JQ.filter
+ * Create a jq_state and compile a filter into it, without touching Ruby
+ *
+ * Safe to call without the GVL (used by batch worker threads for filters
+ * already known to compile).
  *
- * @param json_str JSON input string
  * @param filter_str jq filter expression
- * @param raw_output If true, output raw strings (jq -r)
- * @param compact_output If true, output compact JSON (jq -c)
- * @param sort_keys If true, sort object keys (jq -S)
- * @param multiple_outputs If true, return array of all results
  * @param sandbox If true, enable sandbox mode (blocks env/include/import)
- * @return Ruby string or array of strings
+ * @return Compiled jq_state, or NULL on failure
  */
-static VALUE rb_jq_filter_impl(const char *json_str, const char *filter_str,
-                                int raw_output, int compact_output,
-                                int sort_keys, int multiple_outputs,
-                                int sandbox) {
-    jq_state *jq = NULL;
-    jv input = jv_invalid();
-    VALUE results = Qnil;
-    jv result;
+static jq_state *jq_new_state(const char *filter_str, int sandbox) {
+    jq_state *jq = jq_init();
+    if (!jq) return NULL;
 
-    // Initialize jq
-    jq = jq_init();
-    if (!jq) {
-        rb_raise(rb_eJQError, "Failed to initialize jq");
+    if (sandbox) {
+        jq_set_sandbox(jq);
+    }
+
+    if (!jq_compile(jq, filter_str)) {
+        jq_teardown(&jq);
+        return NULL;
     }
 
+    return jq;
+}
+
+/**
+ * Create a jq_state and load bytecode saved by JQ::Program#dump into it,
+ * without touching Ruby
+ *
+ * Safe to call without the GVL (used by batch worker threads for
+ * JQ::Program.load programs, whose bytecode is known to load). Each state
+ * parses its own copy of the text, as with jq_load_bytecode.
+ *
+ * @param bytecode JSON text of the bytecode
+ * @param len Length of bytecode in bytes
+ * @param sandbox If true, enable sandbox mode (blocks env/include/import)
+ * @return Loaded jq_state, or NULL on failure
+ */
+static jq_state *jq_new_loaded_state(const char *bytecode, long len,
+                                     int sandbox) {
+    jq_state *jq = jq_init();
+    if (!jq) return NULL;
+
     if (sandbox) {
         jq_set_sandbox(jq);
     }
 
-    // Compile filter
+    if (!jq_set_bytecode(jq, jv_parse_sized(bytecode, (int)len))) {
+        jq_teardown(&jq);
+        return NULL;
+    }
+
+    return jq;
+}
+
+/**
+ * Compile a filter into a pooled (or new) jq_state
+ *
+ * A state that fails to compile is torn down rather than pooled, so no
+ * error state carries over to a later compile.
+ *
+ * @param filter_str jq filter expression
+ * @param sandbox If true, enable sandbox mode (blocks env/include/import)
+ * @return Compiled jq_state (caller owns it and must jq_state_release or
+ *   jq_teardown it)
+ */
+static jq_state *jq_compile_filter(const char *filter_str, int sandbox) {
+    jq_state *jq = jq_state_acquire(sandbox);
+    if (!jq) {
+        rb_raise(rb_eJQError, "Failed to initialize jq");
+    }
+
     if (!jq_compile(jq, filter_str)) {
         jv error = jq_get_error_message(jq);
 
@@ -133,176 +501,3144 @@ static VALUE rb_jq_filter_impl(const char *json_str, const char *filter_str,
         rb_raise(rb_eJQCompileError, "Syntax error in jq filter");
     }
 
-    // Parse JSON input
-    input = jv_parse(json_str);
-    if (!jv_is_valid(input)) {
-        if (jv_invalid_has_msg(jv_copy(input))) {
-            jv error_msg = jv_invalid_get_msg(input);  // CONSUMES input
-            jq_teardown(&jq);
-            raise_jq_error(error_msg, rb_eJQParseError);
-        }
-        jv_free(input);
+    return jq;
+}
+
+/**
+ * Load bytecode saved by JQ::Program#dump into a pooled (or new) jq_state
+ *
+ * Every state parses its own copy of the text, so states running on
+ * different threads share no jv values (whose reference counts are not
+ * atomic).
+ *
+ * @param bytecode JSON text of the bytecode
+ * @param sandbox If true, enable sandbox mode (blocks env/include/import)
+ * @return Loaded jq_state (owned by the caller, as with jq_compile_filter)
+ * @raise JQ::Error if the bytecode is malformed
+ */
+static jq_state *jq_load_bytecode(VALUE bytecode, int sandbox) {
+    jq_state *jq = jq_state_acquire(sandbox);
+    if (!jq) {
+        rb_raise(rb_eJQError, "Failed to initialize jq");
+    }
+
+    jv desc = jv_parse_sized(RSTRING_PTR(bytecode), (int)RSTRING_LEN(bytecode));
+    if (!jq_set_bytecode(jq, desc)) {
         jq_teardown(&jq);
-        rb_raise(rb_eJQParseError, "Invalid JSON input");
+        rb_raise(rb_eJQError, "Invalid JQ::Program dump: malformed bytecode");
     }
 
-    // Process with jq
-    jq_start(jq, input, 0);  // CONSUMES input
+    return jq;
+}
+
+/**
+ * Read the output options shared by JQ.filter and JQ::Program#call
+ *
+ * @param opts Ruby options hash (may be nil)
+ * @param out Options struct to fill in (defaults to compact output)
+ */
+static void parse_output_options(VALUE opts, jq_output_options *out) {
+    out->raw_output = 0;
+    out->compact_output = 1;
+    out->sort_keys = 0;
+    out->multiple_outputs = 0;
+    out->args = Qnil;
+    out->timeout = 0.0;
+    out->max_steps = 0;
+    out->max_outputs = 0;
+    out->max_memory = 0;
+    out->fast_parse = jq_fast_parse;
+    out->async = jq_async;
+    out->stream = 0;
+    out->stream_depth = -1;
+    out->document = 0;
+    out->stats = NULL;
+
+    if (NIL_P(opts)) return;
 
-    // Collect results
-    if (multiple_outputs) {
-        results = rb_ary_new();
+    Check_Type(opts, T_HASH);
+    VALUE opt;
 
-        while (jv_is_valid(result = jq_next(jq))) {
-            VALUE json = jv_to_json_string(result, raw_output,
-                                           compact_output, sort_keys);
-            rb_ary_push(results, json);
-        }
+    opt = rb_hash_aref(opts, sym_raw_output);
+    if (RTEST(opt)) out->raw_output = 1;
 
-        // Check if the final invalid result has an error message
-        if (jv_invalid_has_msg(jv_copy(result))) {
-            jv error_msg = jv_invalid_get_msg(result);  // CONSUMES result
-            jq_teardown(&jq);
-            raise_jq_error(error_msg, rb_eJQRuntimeError);
+    opt = rb_hash_aref(opts, sym_compact_output);
+    if (!NIL_P(opt)) out->compact_output = RTEST(opt) ? 1 : 0;
+
+    opt = rb_hash_aref(opts, sym_sort_keys);
+    if (RTEST(opt)) out->sort_keys = 1;
+
+    opt = rb_hash_aref(opts, sym_multiple_outputs);
+    if (RTEST(opt)) out->multiple_outputs = 1;
+
+    opt = rb_hash_aref(opts, sym_async);
+    if (!NIL_P(opt)) out->async = RTEST(opt) ? 1 : 0;
+
+    opt = rb_hash_aref(opts, sym_timeout);
+    if (!NIL_P(opt)) {
+        out->timeout = NUM2DBL(opt);
+        if (!(out->timeout > 0)) {
+            rb_raise(rb_eArgError, "timeout must be positive (got %+"PRIsVALUE")",
+                     opt);
         }
+    }
 
-        jv_free(result);  // Free the invalid/end marker
-    } else {
-        result = jq_next(jq);
+    opt = rb_hash_aref(opts, sym_max_steps);
+    if (!NIL_P(opt)) {
+        out->max_steps = NUM2LONG(opt);
+        if (out->max_steps < 1) {
+            rb_raise(rb_eArgError, "max_steps must be positive (got %ld)",
+                     out->max_steps);
+        }
+    }
 
-        if (jv_is_valid(result)) {
-            results = jv_to_json_string(result, raw_output,
-                                       compact_output, sort_keys);
-        } else if (jv_invalid_has_msg(jv_copy(result))) {
-            jv error_msg = jv_invalid_get_msg(result);  // CONSUMES result
-            jq_teardown(&jq);
-            raise_jq_error(error_msg, rb_eJQRuntimeError);
-        } else {
-            jv_free(result);
-            // No results - return null
-            results = rb_str_new_cstr("null");
+    opt = rb_hash_aref(opts, sym_max_outputs);
+    if (!NIL_P(opt)) {
+        out->max_outputs = NUM2LONG(opt);
+        if (out->max_outputs < 1) {
+            rb_raise(rb_eArgError, "max_outputs must be positive (got %ld)",
+                     out->max_outputs);
         }
     }
 
-    jq_teardown(&jq);
-    return results;
+    opt = rb_hash_aref(opts, sym_max_memory);
+    if (!NIL_P(opt)) {
+        out->max_memory = NUM2LL(opt);
+        if (out->max_memory < 1) {
+            rb_raise(rb_eArgError, "max_memory must be positive (got %lld)",
+                     out->max_memory);
+        }
+    }
 }
 
-/*
- * call-seq:
- *   JQ.filter(json, filter, **options) -> String or Array<String>
- *
- * Apply a jq filter to JSON input and return the result.
- *
- * This is the primary method for using jq from Ruby. It parses the JSON input,
- * compiles the filter expression, executes it, and returns the result as a
- * JSON string (or array of strings with +multiple_outputs: true+).
- *
- * === Parameters
- *
- * [json (String)] Valid JSON input string
- * [filter (String)] jq filter expression (e.g., ".name", ".[] | select(.age > 18)")
- *
- * === Options
- *
- * [:raw_output (Boolean)] Return raw strings without JSON encoding (equivalent to jq -r). Default: false
- * [:compact_output (Boolean)] Output compact JSON on a single line. Default: true (set to false for pretty output)
- * [:sort_keys (Boolean)] Sort object keys alphabetically (equivalent to jq -S). Default: false
- * [:multiple_outputs (Boolean)] Return array of all results instead of just the first. Default: false
- * [:sandbox (Boolean)] Enable sandbox mode to block access to environment variables and file imports. Default: true
- *
- * === Returns
- *
- * [String] JSON-encoded result (default), or raw string if +raw_output: true+
- * [Array<String>] Array of results if +multiple_outputs: true+
- *
- * === Raises
- *
- * [JQ::ParseError] If the JSON input is invalid
- * [JQ::CompileError] If the jq filter expression is invalid
- * [JQ::RuntimeError] If the filter execution fails
- * [TypeError] If arguments are not strings
- *
- * === Examples
- *
- *   # Basic filtering
- *   JQ.filter('{"name":"Alice","age":30}', '.name')
- *   # => "\"Alice\""
- *
- *   # Raw output (no JSON encoding)
- *   JQ.filter('{"name":"Alice"}', '.name', raw_output: true)
- *   # => "Alice"
- *
- *   # Pretty output
- *   JQ.filter('{"a":1,"b":2}', '.', compact_output: false)
- *   # => "{\n  \"a\": 1,\n  \"b\": 2\n}"
- *
- *   # Multiple outputs
- *   JQ.filter('[1,2,3]', '.[]', multiple_outputs: true)
- *   # => ["1", "2", "3"]
- *
- *   # Sort keys
- *   JQ.filter('{"z":1,"a":2}', '.', sort_keys: true)
- *   # => "{\"a\":2,\"z\":1}"
- *
- *   # Complex transformation
- *   json = '[{"name":"Alice","age":30},{"name":"Bob","age":25}]'
- *   JQ.filter(json, '[.[] | select(.age > 26) | .name]')
- *   # => "[\"Alice\"]"
- *
- * === Thread Safety
+/**
+ * Parse the :stream option of the stream methods into output options
  *
- * This method is thread-safe with jq 1.7+ (required by this gem). Each call
- * creates an isolated jq_state, so concurrent calls do not interfere with
- * each other.
+ * +true+ runs the filter on each [path, leaf] event of jq --stream; an
+ * Integer depth runs it on each value at that depth, rebuilt from the
+ * events as fromstream(depth | truncate_stream(inputs)) would.
  *
+ * @raise ArgumentError for a negative depth or anything else
  */
-VALUE rb_jq_filter(int argc, VALUE *argv, VALUE self) {
-    VALUE json_str, filter_str, opts;
-    rb_scan_args(argc, argv, "2:", &json_str, &filter_str, &opts);
+static void parse_stream_option(VALUE opts, jq_output_options *out) {
+    if (NIL_P(opts)) return;
 
-    Check_Type(json_str, T_STRING);
-    Check_Type(filter_str, T_STRING);
+    Check_Type(opts, T_HASH);
+    VALUE opt = rb_hash_aref(opts, sym_stream);
+    if (!RTEST(opt)) return;
 
-    const char *json_cstr = StringValueCStr(json_str);
-    const char *filter_cstr = StringValueCStr(filter_str);
+    out->stream = 1;
+    if (opt == Qtrue) return;
 
-    // Parse options (default to compact output, sandbox enabled)
-    int raw_output = 0, compact_output = 1;
-    int sort_keys = 0, multiple_outputs = 0;
-    int sandbox = 1;
+    if (!RB_INTEGER_TYPE_P(opt) || NUM2LONG(opt) < 0 ||
+        NUM2LONG(opt) > JQ_STREAM_MAX_DEPTH) {
+        rb_raise(rb_eArgError,
+                 "stream must be true or a depth from 0 to %d (got %+"PRIsVALUE")",
+                 JQ_STREAM_MAX_DEPTH, opt);
+    }
+    out->stream_depth = NUM2INT(opt);
+}
+
+/**
+ * Read the :document option (results as JQ::Document) of the methods
+ * that accept a JQ::Document input
+ */
+static void parse_document_option(VALUE opts, jq_output_options *out) {
+    if (NIL_P(opts)) return;
 
-    if (!NIL_P(opts)) {
-        Check_Type(opts, T_HASH);
-        VALUE opt;
+    Check_Type(opts, T_HASH);
+    out->document = RTEST(rb_hash_aref(opts, sym_document));
+}
 
-        opt = rb_hash_aref(opts, ID2SYM(rb_intern("raw_output")));
-        if (RTEST(opt)) raw_output = 1;
+/**
+ * Read the :sandbox option (sandbox is enabled unless explicitly disabled)
+ *
+ * @param opts Ruby options hash (may be nil)
+ * @return 1 if sandbox mode should be enabled, 0 otherwise
+ */
+static int parse_sandbox_option(VALUE opts) {
+    if (NIL_P(opts)) return 1;
 
-        opt = rb_hash_aref(opts, ID2SYM(rb_intern("compact_output")));
-        if (!NIL_P(opt)) compact_output = RTEST(opt) ? 1 : 0;
+    Check_Type(opts, T_HASH);
+    VALUE opt = rb_hash_aref(opts, sym_sandbox);
+    if (NIL_P(opt)) return 1;
 
-        opt = rb_hash_aref(opts, ID2SYM(rb_intern("sort_keys")));
-        if (RTEST(opt)) sort_keys = 1;
+    return RTEST(opt) ? 1 : 0;
+}
 
-        opt = rb_hash_aref(opts, ID2SYM(rb_intern("multiple_outputs")));
-        if (RTEST(opt)) multiple_outputs = 1;
+/**
+ * Read the :errors option used by the batch APIs
+ *
+ * @param opts Ruby options hash (may be nil)
+ * @return How per-document errors are reported (default: raise)
+ */
+static jq_error_mode parse_error_mode_option(VALUE opts) {
+    if (NIL_P(opts)) return JQ_ERRORS_RAISE;
 
-        opt = rb_hash_aref(opts, ID2SYM(rb_intern("sandbox")));
-        if (!NIL_P(opt)) sandbox = RTEST(opt) ? 1 : 0;
-    }
+    Check_Type(opts, T_HASH);
+    VALUE opt = rb_hash_aref(opts, sym_errors);
+    if (NIL_P(opt) || opt == sym_raise) return JQ_ERRORS_RAISE;
+    if (opt == sym_nil) return JQ_ERRORS_NIL;
+    if (opt == sym_error) return JQ_ERRORS_ERROR;
 
-    return rb_jq_filter_impl(json_cstr, filter_cstr,
-                             raw_output, compact_output,
-                             sort_keys, multiple_outputs,
-                             sandbox);
+    rb_raise(rb_eArgError, "errors must be :raise, :nil or :error (got %+"PRIsVALUE")",
+             opt);
 }
 
-/*
- * call-seq:
- *   JQ.validate_filter!(filter) -> true
- *
- * Validate a jq filter expression without executing it.
+/**
+ * Read the :parallel option used by the batch APIs
+ *
+ * @param opts Ruby options hash (may be nil)
+ * @return Number of native threads to shard the batch over (default: 1)
+ */
+static int parse_parallel_option(VALUE opts) {
+    if (NIL_P(opts)) return 1;
+
+    Check_Type(opts, T_HASH);
+    VALUE opt = rb_hash_aref(opts, sym_parallel);
+    if (NIL_P(opt)) return 1;
+
+    int parallel = NUM2INT(opt);
+    if (parallel < 1 || parallel > JQ_PARALLEL_MAX) {
+        rb_raise(rb_eArgError, "parallel must be between 1 and %d (got %d)",
+                 JQ_PARALLEL_MAX, parallel);
+    }
+    return parallel;
+}
+
+/**
+ * Read the :pool_size option of JQ::Program.new
+ */
+static int parse_pool_size_option(VALUE opts) {
+    if (NIL_P(opts)) return JQ_PROGRAM_MAX_IDLE;
+
+    Check_Type(opts, T_HASH);
+    VALUE opt = rb_hash_aref(opts, sym_pool_size);
+    if (NIL_P(opt)) return JQ_PROGRAM_MAX_IDLE;
+
+    int pool_size = NUM2INT(opt);
+    if (pool_size < 1 || pool_size > JQ_PROGRAM_POOL_MAX) {
+        rb_raise(rb_eArgError, "pool_size must be between 1 and %d (got %d)",
+                 JQ_PROGRAM_POOL_MAX, pool_size);
+    }
+    return pool_size;
+}
+
+/**
+ * Read the :pool_timeout option of JQ::Program.new
+ *
+ * @return Seconds to wait for a free state, or -1 for an unbounded pool
+ */
+static double parse_pool_timeout_option(VALUE opts) {
+    if (NIL_P(opts)) return -1;
+
+    Check_Type(opts, T_HASH);
+    VALUE opt = rb_hash_aref(opts, sym_pool_timeout);
+    if (NIL_P(opt)) return -1;
+
+    double timeout = NUM2DBL(opt);
+    if (!(timeout >= 0)) {
+        rb_raise(rb_eArgError, "pool_timeout must not be negative");
+    }
+    return timeout;
+}
+
+/**
+ * Read the Ruby object conversion options used by JQ.filter_object
+ *
+ * @param opts Ruby options hash (may be nil)
+ * @param out Options struct to fill in (defaults to string keys, unfrozen)
+ */
+static void parse_object_options(VALUE opts, jq_object_options *out) {
+    out->symbolize_names = 0;
+    out->freeze = 0;
+
+    if (NIL_P(opts)) return;
+
+    Check_Type(opts, T_HASH);
+    out->symbolize_names = RTEST(rb_hash_aref(opts, sym_symbolize_names));
+    out->freeze = RTEST(rb_hash_aref(opts, sym_freeze));
+}
+
+/**
+ * Make room for +extra+ more bytes in an output buffer
+ *
+ * Uses malloc rather than xmalloc: it runs without the GVL.
+ *
+ * @return 1, or 0 (and failed set) if out of memory
+ */
+int jq_output_reserve(jq_output_buffer *out, size_t extra) {
+    if (out->len + extra <= out->capa) return 1;
+
+    size_t capa = out->capa ? out->capa : JQ_OUTPUT_FLUSH_SIZE;
+    while (capa < out->len + extra) capa *= 2;
+
+    char *ptr = realloc(out->ptr, capa);
+    if (!ptr) {
+        out->failed = 1;
+        return 0;
+    }
+    out->ptr = ptr;
+    out->capa = capa;
+    return 1;
+}
+
+int jq_output_append(jq_output_buffer *out, const char *buf, size_t len) {
+    if (!jq_output_reserve(out, len)) return 0;
+    memcpy(out->ptr + out->len, buf, len);
+    out->len += len;
+    return 1;
+}
+
+// Write callback of the dump stream: append straight to the output buffer
+#if defined(HAVE_FOPENCOOKIE)
+static ssize_t jq_output_cookie_write(void *cookie, const char *buf,
+                                      size_t len) {
+    return jq_output_append(cookie, buf, len) ? (ssize_t)len : 0;
+}
+#elif defined(HAVE_FUNOPEN)
+static int jq_output_cookie_write(void *cookie, const char *buf, int len) {
+    return jq_output_append(cookie, buf, (size_t)len) ? len : -1;
+}
+#endif
+
+/**
+ * Open the dump stream of an output buffer
+ *
+ * jv_dumpf() then pretty prints results through stdio straight into the
+ * buffer, without building a jv string per result (compact results are
+ * written by jq_dump regardless). Where neither
+ * fopencookie() nor funopen() exists, file stays NULL and results are
+ * serialized with jv_dump_string() and copied in.
+ *
+ * @param out Output buffer; must not move while the stream is open
+ */
+static void jq_output_open(jq_output_buffer *out) {
+#if defined(HAVE_FOPENCOOKIE)
+    cookie_io_functions_t io = { NULL, jq_output_cookie_write, NULL, NULL };
+    out->file = fopencookie(out, "w", io);
+#elif defined(HAVE_FUNOPEN)
+    out->file = funopen(out, NULL, jq_output_cookie_write, NULL, NULL);
+#endif
+    if (out->file) setvbuf(out->file, NULL, _IOFBF, JQ_OUTPUT_FLUSH_SIZE);
+}
+
+static void jq_output_close(jq_output_buffer *out) {
+    if (out->file) fclose(out->file);
+    free(out->ptr);
+    out->file = NULL;
+    out->ptr = NULL;
+    out->len = out->capa = 0;
+}
+
+/**
+ * Serialize a jq result into an output buffer, followed by a newline
+ *
+ * Pure C (no Ruby API), so it is safe to call without the GVL.
+ *
+ * @param out Output buffer
+ * @param value The jv value to write (CONSUMED by this function)
+ * @param opts Output options (raw, compact, sort keys)
+ * @return 1 on success, 0 on failure
+ */
+static int jq_output_write(jq_output_buffer *out, jv value,
+                           const jq_output_options *opts) {
+    // Compact output goes straight into the buffer; the dump stream is only
+    // needed for jv_dumpf()'s pretty printing
+    if (opts->compact_output) {
+        if (out->file) fflush(out->file);  // Keep anything written before first
+
+        int ok;
+        if (opts->raw_output && jv_get_kind(value) == JV_KIND_STRING) {
+            ok = jq_output_append(out, jv_string_value(value),
+                                  jv_string_length_bytes(jv_copy(value)));
+            jv_free(value);
+        } else {
+            ok = jq_dump(out, value, jq_dump_flags(opts));  // CONSUMES value
+        }
+        return ok && jq_output_append(out, "\n", 1);
+    }
+
+    if (!out->file) {
+        jv text = jv_serialize(value, opts);  // CONSUMES value
+        if (!jv_is_valid(text)) return 0;
+
+        int ok = jq_output_append(out, jv_string_value(text),
+                                  jv_string_length_bytes(jv_copy(text))) &&
+            jq_output_append(out, "\n", 1);
+        jv_free(text);
+        return ok;
+    }
+
+    if (opts->raw_output && jv_get_kind(value) == JV_KIND_STRING) {
+        fwrite(jv_string_value(value), 1,
+               jv_string_length_bytes(jv_copy(value)), out->file);
+        jv_free(value);
+    } else {
+        jv_dumpf(value, out->file, jq_dump_flags(opts));  // CONSUMES value
+    }
+    putc('\n', out->file);
+
+    return !out->failed && !ferror(out->file);
+}
+
+/**
+ * Instructions a run may execute before its next budget check
+ */
+static unsigned long jq_run_step_interval(const jq_run *run) {
+    unsigned long steps = JQ_BUDGET_CHECK_STEPS;
+    if (run->opts->max_steps > 0 &&
+        (unsigned long)run->opts->max_steps - run->steps < steps) {
+        steps = (unsigned long)run->opts->max_steps - run->steps;
+    }
+    return steps;
+}
+
+/**
+ * Check whether a run holds more memory than its max_memory, setting its
+ * status if so
+ */
+static int jq_run_memory_exceeded(jq_run *run) {
+    if (run->opts->max_memory > 0 && run->memory > run->opts->max_memory) {
+        run->status = JQ_RUN_MEMORY_LIMIT;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Point this thread's jv allocation counters at a run, or detach them
+ */
+static void jq_run_count(jq_run *run, int attach) {
+    jq_run_stats *stats = run->opts->stats;
+
+    if (run->opts->max_memory > 0 || stats || run->count_memory) {
+        jv_mem_set_counter(attach ? &run->memory : NULL);
+    }
+    if (stats) jv_mem_set_alloc_counter(attach ? &stats->allocations : NULL);
+}
+
+static VALUE jq_check_ints_body(VALUE arg) {
+    rb_thread_check_ints();
+    return Qnil;
+}
+
+static void *jq_check_ints_gvl(void *ptr) {
+    rb_protect(jq_check_ints_body, Qnil, (int *)ptr);
+    return NULL;
+}
+
+/**
+ * Handle an interrupt requested while a run is inside jq_next
+ *
+ * On a Ruby thread the GVL is taken back to process it: the run goes on if
+ * nothing was raised (a signal handler ran, say), and halts with the
+ * exception's state saved in run->interrupt otherwise. The native threads
+ * of a parallel batch cannot call Ruby, so they halt at once; the run
+ * starts its document over if the calling thread resumes the batch.
+ *
+ * @return 1 to go on, 0 to halt the filter (with the run's status set to
+ *   JQ_RUN_INTERRUPTED)
+ */
+static int jq_run_check_interrupt(jq_run *run) {
+    jq_interrupt *interrupt = run->interrupt;
+
+    if (!interrupt->state && ruby_native_thread_p()) {
+        double paused_at = jq_monotonic_time();
+        int state = 0;
+
+        interrupt->requested = 0;
+        jq_run_count(run, 0);
+        rb_thread_call_with_gvl(jq_check_ints_gvl, &state);
+        jq_run_count(run, 1);
+        run->resumed_at += jq_monotonic_time() - paused_at;
+
+        if (!state) return 1;
+        // Left requested, so the other shards of a batch stop too
+        interrupt->state = state;
+        interrupt->requested = 1;
+    }
+
+    run->status = JQ_RUN_INTERRUPTED;
+    return 0;
+}
+
+/**
+ * Step callback of a run, called by the patched jq_next between
+ * instructions to handle interrupts and enforce the run's timeout,
+ * max_steps and max_memory
+ *
+ * @param ptr The jq_run being executed
+ * @return Instructions until the next check, or 0 to halt the filter (with
+ *   the run's status set to the limit it hit, or JQ_RUN_INTERRUPTED)
+ */
+static unsigned long jq_run_step_cb(void *ptr) {
+    jq_run *run = (jq_run *)ptr;
+    run->steps += run->step_interval;
+
+    if (run->interrupt->requested && !jq_run_check_interrupt(run)) return 0;
+
+    if (run->opts->max_steps > 0 &&
+        run->steps >= (unsigned long)run->opts->max_steps) {
+        run->status = JQ_RUN_STEP_LIMIT;
+        return 0;
+    }
+    if (run->opts->timeout > 0 &&
+        run->elapsed + (jq_monotonic_time() - run->resumed_at) >=
+            run->opts->timeout) {
+        run->status = JQ_RUN_TIMEOUT;
+        return 0;
+    }
+    if (jq_run_memory_exceeded(run)) return 0;
+
+    run->step_interval = jq_run_step_interval(run);
+    return run->step_interval;
+}
+
+/**
+ * Parse one JSON document for a run
+ *
+ * With the fast parser enabled, jq_parse_fast builds the value; text it
+ * does not accept (including all invalid JSON) is parsed again by
+ * jv_parse_sized(), so values and error messages are always jq's. A
+ * mapped file is neither NUL-terminated nor limited to INT_MAX bytes, so
+ * it goes through jq's incremental parser instead (jq_file_parse).
+ *
+ * Pure C (no Ruby API), so it is safe to call without the GVL.
+ */
+static jv jq_run_parse(const jq_run *run, const char *json, long len) {
+#ifdef JQ_FAST_PARSER
+    if (run->opts->fast_parse) {
+        jv value = jq_parse_fast(json, len);
+        if (jv_is_valid(value)) return value;
+        jv_free(value);
+    }
+#endif
+    if (run->json_mapped) return jq_file_parse(json, len);
+    return jv_parse_sized(json, (int)len);
+}
+
+/**
+ * Copy a jv value so that it shares no reference-counted part with another
+ *
+ * A result kept as a value may hold references to the constants of the
+ * jq_state's bytecode (a string or array literal, say). Once the state is
+ * checked in, another thread can run it without the GVL while this one uses
+ * the result, and the two would race on the counts, which are not atomic.
+ * Results kept past their run are copied before check-in, so they only
+ * hold values of their own.
+ *
+ * Pure C (no Ruby API), so it is safe to call without the GVL.
+ *
+ * @param value The value to copy (CONSUMED by this function)
+ * @return The copy
+ */
+static jv jq_jv_deep_copy(jv value) {
+    jv copy;
+
+    switch (jv_get_kind(value)) {
+    case JV_KIND_NUMBER: {
+        if (!jv_number_has_literal(value)) return value;
+        // Infinities have no literal, and NaN's literal ("null") is none
+        const char *literal = jv_number_get_literal(value);
+        double d = jv_number_value(value);
+        copy = literal && !isnan(d) ? jv_number_with_literal(literal) :
+            jv_number(d);
+        if (!jv_is_valid(copy)) copy = jv_number(d);
+        break;
+    }
+    case JV_KIND_STRING:
+        copy = jv_string_sized(jv_string_value(value),
+                               jv_string_length_bytes(jv_copy(value)));
+        break;
+    case JV_KIND_ARRAY: {
+        int len = jv_array_length(jv_copy(value));
+        copy = jv_array_sized(len);
+        for (int i = 0; i < len; i++) {
+            copy = jv_array_append(copy,
+                                   jq_jv_deep_copy(jv_array_get(jv_copy(value), i)));
+        }
+        break;
+    }
+    case JV_KIND_OBJECT: {
+        copy = jv_object();
+        int iter = jv_object_iter(value);
+        while (jv_object_iter_valid(value, iter)) {
+            copy = jv_object_set(copy,
+                                 jq_jv_deep_copy(jv_object_iter_key(value, iter)),
+                                 jq_jv_deep_copy(jv_object_iter_value(value, iter)));
+            iter = jv_object_iter_next(value, iter);
+        }
+        break;
+    }
+    default:
+        // null and booleans are not reference counted
+        return value;
+    }
+
+    jv_free(value);
+    return copy;
+}
+
+/**
+ * Hand one result of a run to its output buffer or results array
+ *
+ * @param run Run in progress
+ * @param result The result (CONSUMED by this function)
+ * @return 1, or 0 if the run failed (its status set and finished)
+ */
+static int jq_run_emit(jq_run *run, jv result) {
+    if (run->opts->max_outputs > 0 &&
+        ++run->outputs > run->opts->max_outputs) {
+        jv_free(result);
+        run->status = JQ_RUN_OUTPUT_LIMIT;
+        run->finished = 1;
+        return 0;
+    }
+
+    jq_run_stats *stats = run->opts->stats;
+    unsigned long long start = jq_stats_start(run->opts);
+
+    if (run->output) {
+        if (!jq_output_write(run->output, result, run->opts)) {  // CONSUMES result
+            run->status = JQ_RUN_DUMP_ERROR;
+            run->finished = 1;
+            return 0;
+        }
+    } else {
+        // Documents outlive the run, so they get values of their own
+        jv output = !run->keep_values ? jv_serialize(result, run->opts) :
+            run->opts->document ? jq_jv_deep_copy(result) : result;  // CONSUMES result
+        if (!jv_is_valid(output)) {
+            run->status = JQ_RUN_DUMP_ERROR;
+            run->finished = 1;
+            return 0;
+        }
+        if (stats && !run->keep_values) {
+            stats->output_bytes += jv_string_length_bytes(jv_copy(output));
+        }
+        run->results = jv_array_append(run->results, output);
+    }
+
+    if (stats) {
+        jq_stats_add(&stats->serialize_ns, start);
+        stats->outputs++;
+    }
+
+    if (jq_run_memory_exceeded(run)) {
+        run->finished = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Answer a run whose filter is a simple path without parsing the input
+ *
+ * jq_path_find locates the value in the JSON text and only that span is
+ * parsed. Runs it cannot answer (including invalid input and type errors)
+ * are left untouched for jq.
+ *
+ * @return 1 if the run is finished, 0 if jq must run the filter
+ */
+static int jq_run_path(jq_run *run) {
+    const char *start = NULL, *end = NULL;
+    unsigned long long began = jq_stats_start(run->opts);
+    jv result;
+
+    switch (jq_path_find(&run->kernel->path, run->json_str, run->json_len,
+                         &start, &end)) {
+    case JQ_PATH_FOUND:
+        result = jq_run_parse(run, start, end - start);
+        if (!jv_is_valid(result)) {
+            jv_free(result);
+            return 0;
+        }
+        break;
+    case JQ_PATH_NULL:
+        result = jv_null();
+        break;
+    default:
+        if (run->opts->stats) jq_stats_add(&run->opts->stats->parse_ns, began);
+        return 0;
+    }
+
+    if (run->opts->stats) {
+        jq_stats_add(&run->opts->stats->parse_ns, began);
+        run->opts->stats->path = 1;
+        run->opts->stats->kernel = JQ_KERNEL_PATH;
+    }
+    jq_run_emit(run, result);  // CONSUMES result
+    run->finished = 1;
+    return 1;
+}
+
+/**
+ * Answer a run with the native kernel of its filter, without running jq
+ *
+ * @param run Run with a kernel
+ * @param input Parsed input (borrowed: jq runs on it if the kernel cannot)
+ * @return 1 if the run is finished, 0 if jq must run the filter
+ */
+static int jq_run_kernel(jq_run *run, jv input) {
+    unsigned long long start = jq_stats_start(run->opts);
+    jv result;
+
+    jq_kernel_status status = jq_kernel_run(run->kernel, input, &result);
+    if (status == JQ_KERNEL_FALLBACK) return 0;
+
+    if (run->opts->stats) {
+        jq_stats_add(&run->opts->stats->execute_ns, start);
+        run->opts->stats->kernel = run->kernel->kind;
+    }
+    if (status == JQ_KERNEL_RESULT) jq_run_emit(run, result);  // CONSUMES result
+    run->finished = 1;
+    return 1;
+}
+
+/**
+ * Parse, execute and serialize a filter run (the body of jq_run_nogvl)
+ */
+static void jq_run_collect(jq_run *run) {
+    if (!run->started) {
+        run->results = jv_array();
+        run->outputs = 0;
+        run->steps = 0;
+        run->elapsed = 0.0;
+        run->memory = 0;
+
+        if (run->kernel && run->kernel->kind == JQ_KERNEL_PATH &&
+            run->json_str && jq_run_path(run)) {
+            return;
+        }
+
+        jv input;
+        if (run->json_str) {
+            // Parse JSON input; the length is known, so no strlen()
+            unsigned long long start = jq_stats_start(run->opts);
+            input = jq_run_parse(run, run->json_str, run->json_len);
+            if (run->opts->stats) jq_stats_add(&run->opts->stats->parse_ns, start);
+        } else {
+            input = run->input;
+            run->input = jv_invalid();
+        }
+        if (!jv_is_valid(input)) {
+            run->status = JQ_RUN_PARSE_ERROR;
+            if (jv_invalid_has_msg(jv_copy(input))) {
+                run->error = jv_invalid_get_msg(input);  // CONSUMES input
+            } else {
+                jv_free(input);
+            }
+            run->finished = 1;
+            return;
+        }
+
+        if (jq_run_memory_exceeded(run)) {  // The input alone is too big
+            jv_free(input);
+            run->finished = 1;
+            return;
+        }
+
+        if (run->kernel && jq_run_kernel(run, input)) {
+            jv_free(input);
+            return;
+        }
+
+        if (jv_is_valid(run->args)) {
+            // Programs compiled with args: destructure [input, bindings]
+            input = jv_array_append(jv_array_append(jv_array(), input),
+                                    jv_copy(run->args));
+        }
+
+        // Process with jq
+        unsigned long long start = jq_stats_start(run->opts);
+        jq_start(run->jq, input, 0);  // CONSUMES input
+        if (run->opts->stats) jq_stats_add(&run->opts->stats->execute_ns, start);
+        run->started = 1;
+
+        // Always (re)set: a pooled jq_state may still point at an old run,
+        // and interrupts are handled there even without a budget
+        run->step_interval = jq_run_step_interval(run);
+        jq_set_step_cb(run->jq, jq_run_step_cb, run, run->step_interval);
+    }
+
+    while (!run->interrupt->requested) {
+        unsigned long long start = jq_stats_start(run->opts);
+        jv result = jq_next(run->jq);
+        if (run->opts->stats) jq_stats_add(&run->opts->stats->execute_ns, start);
+
+        if (!jv_is_valid(result)) {
+            if (run->status == JQ_RUN_INTERRUPTED) {
+                // Halted by jq_run_check_interrupt: left unfinished, and
+                // started over from its JSON text if resumed
+                jv_free(result);
+                jv_free(run->results);
+                run->results = jv_invalid();
+                run->status = JQ_RUN_OK;
+                run->started = 0;
+                return;
+            }
+
+            // Check if the final invalid result has an error message (when
+            // halted by jq_run_step_cb, status already names the limit hit)
+            if (run->status == JQ_RUN_OK &&
+                jv_invalid_has_msg(jv_copy(result))) {
+                run->status = JQ_RUN_RUNTIME_ERROR;
+                run->error = jv_invalid_get_msg(result);  // CONSUMES result
+            } else {
+                jv_free(result);  // Free the invalid/end marker
+            }
+            run->finished = 1;
+            return;
+        }
+
+        if (!jq_run_emit(run, result)) return;  // CONSUMES result
+
+        if (!run->opts->multiple_outputs) {
+            run->finished = 1;
+            return;
+        }
+
+        if (run->max_results &&
+            jv_array_length(jv_copy(run->results)) >= run->max_results) {
+            return;  // Paused: the caller takes the results and resumes
+        }
+
+        if (run->output && run->output->len >= JQ_OUTPUT_FLUSH_SIZE) {
+            return;  // Paused: the caller drains the output and resumes
+        }
+    }
+}
+
+/**
+ * Parse, execute and serialize a filter run without holding the GVL
+ *
+ * Runs until all results are collected, an error occurs, or the unblocking
+ * function requests an interrupt. Between results the run simply stops, so
+ * calling this again resumes it where jq_next left off. Inside jq_next the
+ * step callback handles the request (see jq_run_check_interrupt): a Ruby
+ * thread goes on unless an exception was raised, which halts the filter
+ * for the caller to release the run and re-raise it. Time spent paused
+ * (with the GVL, e.g. in a block) does not count toward a timeout.
+ *
+ * @param ptr The jq_run being executed
+ * @return NULL
+ */
+static void *jq_run_nogvl(void *ptr) {
+    jq_run *run = (jq_run *)ptr;
+    int timed = run->opts->timeout > 0;
+
+    // Allocations are counted per thread, and only while the run executes
+    jq_run_count(run, 1);
+    run->resumed_at = timed ? jq_monotonic_time() : 0.0;
+
+    jq_run_collect(run);
+
+    if (timed) run->elapsed += jq_monotonic_time() - run->resumed_at;
+    jq_run_count(run, 0);
+    if (run->opts->stats) run->opts->stats->memory = run->memory;
+    return NULL;
+}
+
+/**
+ * Unblocking function: ask the run in progress to stop (or, inside jq_next,
+ * to check) so Ruby can process the pending interrupt
+ *
+ * @param ptr The jq_interrupt checked by jq_run_nogvl
+ */
+static void jq_interrupt_ubf(void *ptr) {
+    ((jq_interrupt *)ptr)->requested = 1;
+}
+
+/**
+ * Call +func+ without the GVL on the current thread until it reports
+ * completion (see jq_call_without_gvl)
+ *
+ * RB_NOGVL_INTR_FAIL keeps rb_nogvl from raising pending interrupts itself
+ * (it skips +func+ instead), so they are only raised under rb_protect.
+ */
+static int jq_call_here(void *(*func)(void *), void *data,
+                        jq_interrupt *interrupt, const int *finished) {
+    while (!*finished) {
+        rb_nogvl(func, data, jq_interrupt_ubf, interrupt, RB_NOGVL_INTR_FAIL);
+        if (interrupt->state) return interrupt->state;  // Raised mid-filter
+
+        if (!*finished) {
+            int state = 0;
+            interrupt->requested = 0;
+            rb_protect(jq_check_ints_body, Qnil, &state);
+            if (state) return state;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Body of the worker thread a fiber offloads its run to
+ *
+ * @param ptr The jq_offload to complete
+ * @return nil
+ */
+static VALUE jq_offload_thread(void *ptr) {
+    jq_offload *work = (jq_offload *)ptr;
+    int state = jq_call_here(work->func, work->data, work->interrupt,
+                             work->finished);
+    if (state) rb_jump_tag(state);  // Killed by the waiting fiber
+    return Qnil;
+}
+
+static VALUE jq_offload_join(VALUE thread) {
+    return rb_funcall(thread, id_join, 0);
+}
+
+/**
+ * Complete +func+ on a worker thread while the current fiber waits
+ *
+ * Thread#join hands the wait to the fiber scheduler, so other fibers run
+ * until the worker is done. If the waiting fiber is interrupted (an
+ * exception raised into it, such as a task being stopped), the worker is
+ * killed, which stops the run within JQ_BUDGET_CHECK_STEPS instructions
+ * (see jq_run_check_interrupt), and joined before the run's memory goes
+ * away.
+ *
+ * @return 0, or the rb_protect state of the exception that interrupted the
+ *   waiting fiber
+ */
+static int jq_call_offloaded(void *(*func)(void *), void *data,
+                             jq_interrupt *interrupt, const int *finished) {
+    jq_offload work = {
+        .func = func,
+        .data = data,
+        .interrupt = interrupt,
+        .finished = finished,
+    };
+    VALUE thread = rb_thread_create(jq_offload_thread, &work);
+
+    int state = 0;
+    rb_protect(jq_offload_join, thread, &state);
+    if (state) {
+        rb_thread_kill(thread);
+        for (;;) {
+            int again = 0;
+            rb_protect(jq_offload_join, thread, &again);
+            if (!again) break;
+        }
+    }
+
+    RB_GC_GUARD(thread);
+    return state;
+}
+
+/**
+ * Call +func+ without the GVL until it reports completion
+ *
+ * Whenever the unblocking function stops +func+ early, Ruby gets a chance to
+ * handle the interrupt (Thread#raise, signals...) and +func+ is resumed if
+ * nothing was raised. A run inside jq_next handles it from its step
+ * callback instead, within JQ_BUDGET_CHECK_STEPS instructions, and the
+ * state of anything raised there is returned the same way.
+ *
+ * With +async+ set and a fiber scheduler active, +func+ runs on a worker
+ * thread instead and the current fiber yields to the scheduler until it is
+ * done, so a long run does not block the other fibers of the thread.
+ *
+ * @param func Resumable function to run without the GVL
+ * @param data Argument for +func+
+ * @param interrupt Request set by the unblocking function
+ * @param finished Flag +func+ sets once it is done
+ * @param async Offload to a worker thread under a fiber scheduler
+ * @return 0, or the rb_protect state of an exception raised while handling
+ *   an interrupt (the caller must release its resources and rb_jump_tag it)
+ */
+static int jq_call_without_gvl(void *(*func)(void *), void *data,
+                               jq_interrupt *interrupt, const int *finished,
+                               int async) {
+    if (async && !*finished && !NIL_P(rb_fiber_scheduler_current())) {
+        return jq_call_offloaded(func, data, interrupt, finished);
+    }
+    return jq_call_here(func, data, interrupt, finished);
+}
+
+/**
+ * Release everything a jq_run still owns
+ */
+static void jq_run_free(jq_run *run) {
+    jv_free(run->input);
+    jv_free(run->args);
+    jv_free(run->results);
+    jv_free(run->error);
+    run->input = jv_invalid();
+    run->args = jv_invalid();
+    run->results = jv_invalid();
+    run->error = jv_invalid();
+}
+
+/**
+ * Convert the $name bindings of a call to the jv passed with each input
+ *
+ * @param opts Output options
+ * @return New jv object, or jv_invalid() if the program declares no args
+ * @raise TypeError if a bound value cannot be converted
+ */
+static jv jq_args_new(const jq_output_options *opts) {
+    return NIL_P(opts->args) ? jv_invalid() : jq_rb_to_jv(opts->args);
+}
+
+/**
+ * Build the exception for a failed run
+ *
+ * @param run Finished jq_run with status != JQ_RUN_OK (its jv values are
+ *   CONSUMED)
+ * @return Exception object (not raised)
+ */
+static VALUE jq_run_exception(jq_run *run) {
+    jv error = run->error;
+    run->error = jv_invalid();
+    jq_run_free(run);
+
+    switch (run->status) {
+    case JQ_RUN_PARSE_ERROR:
+        if (!jv_is_valid(error)) {
+            return rb_exc_new_cstr(rb_eJQParseError, "Invalid JSON input");
+        }
+        return jq_error_new(error, rb_eJQParseError);  // CONSUMES error
+    case JQ_RUN_DUMP_ERROR:
+        jv_free(error);
+        return rb_exc_new_cstr(rb_eJQRuntimeError,
+                               "Failed to convert result to JSON");
+    case JQ_RUN_TIMEOUT:
+        jv_free(error);
+        return rb_exc_new_str(rb_eJQTimeoutError,
+                              rb_sprintf("jq filter timed out after %g seconds",
+                                         run->opts->timeout));
+    case JQ_RUN_STEP_LIMIT:
+        jv_free(error);
+        return rb_exc_new_str(rb_eJQTimeoutError,
+                              rb_sprintf("jq filter exceeded max_steps (%ld)",
+                                         run->opts->max_steps));
+    case JQ_RUN_OUTPUT_LIMIT:
+        jv_free(error);
+        return rb_exc_new_str(rb_eJQTimeoutError,
+                              rb_sprintf("jq filter exceeded max_outputs (%ld)",
+                                         run->opts->max_outputs));
+    case JQ_RUN_MEMORY_LIMIT:
+        jv_free(error);
+        return rb_exc_new_str(rb_eJQResourceError,
+                              rb_sprintf("jq filter exceeded max_memory (%lld bytes)",
+                                         run->opts->max_memory));
+    default:
+        return jq_error_new(error, rb_eJQRuntimeError);  // CONSUMES error
+    }
+}
+
+/**
+ * Convert the results of a successful run to Ruby objects
+ *
+ * @param run Finished jq_run with status JQ_RUN_OK (its jv values are
+ *   CONSUMED)
+ * @return Ruby string or array of strings
+ */
+static VALUE jq_run_value(jq_run *run) {
+    jv results = run->results;
+    run->results = jv_invalid();
+    jq_run_free(run);
+
+    int count = jv_array_length(jv_copy(results));
+
+    if (!run->opts->multiple_outputs) {
+        if (count == 0) {
+            jv_free(results);
+            // No results - return null
+            return rb_str_new_cstr("null");
+        }
+        return jv_string_to_rb(jv_array_get(results, 0));  // CONSUMES results
+    }
+
+    VALUE ary = rb_ary_new_capa(count);
+    for (int i = 0; i < count; i++) {
+        rb_ary_push(ary, jv_string_to_rb(jv_array_get(jv_copy(results), i)));
+    }
+    jv_free(results);
+
+    return ary;
+}
+
+/**
+ * Wrap the results of a successful run in JQ::Document objects
+ *
+ * The bytes the run still holds are shared out evenly between the results
+ * for GC accounting: results may share structure, so there is no exact
+ * split, and only the total matters to the GC. jq_run_emit copied them, so
+ * they share nothing with the jq_state (see jq_jv_deep_copy).
+ *
+ * @param run Finished jq_run with status JQ_RUN_OK, kept as values (its jv
+ *   values are CONSUMED)
+ * @return JQ::Document, or array of documents with multiple_outputs
+ */
+static VALUE jq_run_documents(jq_run *run) {
+    jv results = run->results;
+    run->results = jv_invalid();
+    jq_run_free(run);
+
+    int count = jv_array_length(jv_copy(results));
+    long long memsize = count > 0 ? run->memory / count : 0;
+
+    if (!run->opts->multiple_outputs) {
+        if (count == 0) {
+            jv_free(results);
+            // No results - a null document, as JQ.filter returns "null"
+            return jq_document_wrap(jv_null(), 0);
+        }
+        return jq_document_wrap(jv_array_get(results, 0), memsize);  // CONSUMES results
+    }
+
+    VALUE ary = rb_ary_new_capa(count);
+    for (int i = 0; i < count; i++) {
+        rb_ary_push(ary, jq_document_wrap(jv_array_get(jv_copy(results), i),
+                                          memsize));
+    }
+    jv_free(results);
+
+    return ary;
+}
+
+/**
+ * Raise the error of a finished run, or convert its results to Ruby objects
+ *
+ * @param run Finished jq_run (its jv values are CONSUMED)
+ * @return Ruby string or array of strings, or documents with +document:+
+ */
+static VALUE jq_run_result(jq_run *run) {
+    if (run->status != JQ_RUN_OK) {
+        rb_exc_raise(jq_run_exception(run));
+    }
+
+    return run->opts->document ? jq_run_documents(run) : jq_run_value(run);
+}
+
+/**
+ * Drive a jq_run to completion and convert its results to Ruby objects
+ *
+ * The pure-C work happens without the GVL; only Ruby object creation and
+ * error raising happen with it held.
+ *
+ * @param run Initialized jq_run (its jv values are CONSUMED)
+ * @return Ruby string or array of strings, or documents with +document:+
+ */
+static VALUE jq_run_execute(jq_run *run) {
+    int state = jq_call_without_gvl(jq_run_nogvl, run, run->interrupt,
+                                    &run->finished, run->opts->async);
+    if (state) {
+        jq_run_free(run);
+        rb_jump_tag(state);
+    }
+
+    return jq_run_result(run);
+}
+
+/**
+ * Pin a JSON input string so it can be parsed without the GVL
+ *
+ * Returns a frozen string sharing the input's buffer: the input itself if it
+ * is already frozen, otherwise a shared copy, so other threads cannot modify
+ * the bytes mid-parse. The buffer is not scanned or copied; the only
+ * exception is a shared substring that is not NUL-terminated, which is
+ * copied because jq quotes the input as a C string in parse errors. Any
+ * encoding is accepted.
+ *
+ * @param json_str Ruby string containing JSON input
+ * @return Frozen string to read RSTRING_PTR/RSTRING_LEN from
+ * @raise ArgumentError if the input is 2 GiB or larger
+ */
+static VALUE jq_pin_input(VALUE json_str) {
+    long len = RSTRING_LEN(json_str);
+    if (len > INT_MAX) {
+        rb_raise(rb_eArgError, "JSON input too large (%ld bytes)", len);
+    }
+
+    if (RSTRING_PTR(json_str)[len] != '\0') {
+        return rb_str_freeze(rb_str_new(RSTRING_PTR(json_str), len));
+    }
+    return rb_str_new_frozen(json_str);
+}
+
+/**
+ * Parse the JSON text of a jq_run into run->input without the GVL (the
+ * body of jq_parse_input)
+ *
+ * @param ptr The jq_run
+ * @return NULL
+ */
+static void *jq_parse_nogvl(void *ptr) {
+    jq_run *run = (jq_run *)ptr;
+
+    if (run->count_memory) jv_mem_set_counter(&run->memory);
+    run->input = jq_run_parse(run, run->json_str, run->json_len);
+    if (run->count_memory) jv_mem_set_counter(NULL);
+    run->finished = 1;
+    return NULL;
+}
+
+/**
+ * Parse a JSON document outside a filter run, without the GVL
+ *
+ * For inputs parsed once and then shared (JQ::Document, JQ::ProgramSet),
+ * with the parser a run would use.
+ *
+ * @param json_str Ruby string containing JSON input
+ * @param opts Output options (only the parser and +:async+ apply)
+ * @param memory If not NULL, set to the bytes of jv values parsed
+ * @return Parsed value
+ * @raise JQ::ParseError if the input is invalid
+ */
+static jv jq_parse_input(VALUE json_str, const jq_output_options *opts,
+                         long long *memory) {
+    VALUE input = jq_pin_input(json_str);
+    jq_interrupt interrupt = {0};
+    jq_run parse = {
+        .json_str = RSTRING_PTR(input),
+        .json_len = RSTRING_LEN(input),
+        .input = jv_invalid(),
+        .args = jv_invalid(),
+        .opts = opts,
+        .count_memory = memory != NULL,
+        .interrupt = &interrupt,
+        .status = JQ_RUN_OK,
+        .results = jv_invalid(),
+        .error = jv_invalid(),
+    };
+    int state = jq_call_without_gvl(jq_parse_nogvl, &parse,
+                                    parse.interrupt, &parse.finished,
+                                    opts->async);
+    if (state) {
+        jq_run_free(&parse);
+        rb_jump_tag(state);
+    }
+    RB_GC_GUARD(input);
+
+    if (!jv_is_valid(parse.input)) {
+        parse.status = JQ_RUN_PARSE_ERROR;
+        if (jv_invalid_has_msg(jv_copy(parse.input))) {
+            parse.error = jv_invalid_get_msg(parse.input);  // CONSUMES input
+            parse.input = jv_invalid();
+        }
+        rb_exc_raise(jq_run_exception(&parse));
+    }
+
+    if (memory) *memory = parse.memory;
+    return parse.input;
+}
+
+/**
+ * Run a compiled filter against JSON input
+ *
+ * The jq_state is left intact so it can be reused; jq_start() resets any
+ * state left over from a previous (possibly aborted) run.
+ *
+ * @param jq Compiled jq_state
+ * @param json_str Ruby string containing JSON input
+ * @param opts Output options
+ * @param kernel The filter's native kernel, or NULL
+ * @return Ruby string or array of strings
+ */
+static VALUE jq_execute(jq_state *jq, VALUE json_str,
+                        const jq_output_options *opts, const jq_kernel *kernel) {
+    VALUE input = jq_pin_input(json_str);
+    jq_interrupt interrupt = {0};
+
+    jq_run run = {
+        .jq = jq,
+        .json_str = RSTRING_PTR(input),
+        .json_len = (int)RSTRING_LEN(input),
+        .input = jv_invalid(),
+        .args = jq_args_new(opts),
+        .opts = opts,
+        .kernel = kernel,
+        .keep_values = opts->document,
+        .count_memory = opts->document,
+        .interrupt = &interrupt,
+        .status = JQ_RUN_OK,
+        .results = jv_invalid(),
+        .error = jv_invalid(),
+    };
+    if (opts->stats) opts->stats->input_bytes = RSTRING_LEN(input);
+    VALUE results = jq_run_execute(&run);
+
+    RB_GC_GUARD(input);
+    return results;
+}
+
+/**
+ * Run a compiled filter against a file opened with jq_file_open
+ *
+ * Like jq_execute, but the JSON text is the file's mapping, parsed in place.
+ *
+ * @param jq Compiled jq_state
+ * @param file The file (kept open by the caller)
+ * @param opts Output options
+ * @param kernel The filter's native kernel, or NULL
+ * @return Ruby string or array of strings
+ */
+static VALUE jq_execute_file(jq_state *jq, const jq_file *file,
+                             const jq_output_options *opts,
+                             const jq_kernel *kernel) {
+    jq_interrupt interrupt = {0};
+
+    jq_run run = {
+        .jq = jq,
+        .json_str = file->ptr,
+        .json_len = file->len,
+        .json_mapped = 1,
+        .input = jv_invalid(),
+        .args = jq_args_new(opts),
+        .opts = opts,
+        .kernel = kernel,
+        .interrupt = &interrupt,
+        .status = JQ_RUN_OK,
+        .results = jv_invalid(),
+        .error = jv_invalid(),
+    };
+    if (opts->stats) opts->stats->input_bytes = file->len;
+    return jq_run_execute(&run);
+}
+
+/**
+ * Run a compiled filter against a JQ::Document
+ *
+ * The run starts from a reference to the document's value, so nothing is
+ * parsed. It keeps the GVL throughout: jv reference counts are not
+ * atomic, and the document (like any result sharing its values) may be in
+ * use by other threads. Thread#raise and signals therefore wait for the
+ * run to finish; +:timeout+ and the other budget options still apply. The
+ * reference the run leaves on the state's stack is dropped when the state
+ * is checked in (see jq_program_checkin), still with the GVL.
+ *
+ * @param jq Compiled jq_state
+ * @param doc JQ::Document
+ * @param opts Output options
+ * @param kernel The filter's native kernel, or NULL
+ * @return Ruby string or array of strings, or documents with +document:+
+ */
+static VALUE jq_execute_document(jq_state *jq, VALUE doc,
+                                 const jq_output_options *opts,
+                                 const jq_kernel *kernel) {
+    jq_interrupt interrupt = {0};
+
+    jq_run run = {
+        .jq = jq,
+        .json_str = NULL,
+        .input = jv_invalid(),
+        .args = jq_args_new(opts),  // Raises before the reference below
+        .opts = opts,
+        .kernel = kernel,
+        .keep_values = opts->document,
+        .count_memory = opts->document,
+        .interrupt = &interrupt,
+        .status = JQ_RUN_OK,
+        .results = jv_invalid(),
+        .error = jv_invalid(),
+    };
+    run.input = jq_document_value(doc);
+
+    jq_run_nogvl(&run);  // With the GVL held, see above
+    RB_GC_GUARD(doc);
+    return jq_run_result(&run);
+}
+
+/**
+ * Run a compiled filter against a Ruby object, without JSON text
+ *
+ * The input is converted to a jv with the GVL held, the filter runs without
+ * it, and the result jvs are converted straight to Ruby objects.
+ *
+ * @param jq Compiled jq_state
+ * @param obj Ruby object (Hash, Array, String, Integer, Float, true, false
+ *   or nil, nested)
+ * @param opts Output options (only multiple_outputs applies)
+ * @param object_opts Ruby object conversion options
+ * @param kernel The filter's native kernel, or NULL
+ * @return Ruby object, or array of Ruby objects with multiple_outputs
+ */
+static VALUE jq_execute_object(jq_state *jq, VALUE obj,
+                               const jq_output_options *opts,
+                               const jq_object_options *object_opts,
+                               const jq_kernel *kernel) {
+    jq_interrupt interrupt = {0};
+
+    // Bindings travel inside the input, so one conversion can raise on
+    // either before anything is allocated
+    if (!NIL_P(opts->args)) obj = rb_assoc_new(obj, opts->args);
+
+    jq_run run = {
+        .jq = jq,
+        .json_str = NULL,
+        .input = jq_rb_to_jv(obj),  // Raises before allocating on bad input
+        .args = jv_invalid(),
+        .opts = opts,
+        .kernel = kernel,
+        .keep_values = 1,
+        .interrupt = &interrupt,
+        .status = JQ_RUN_OK,
+        .results = jv_invalid(),
+        .error = jv_invalid(),
+    };
+
+    int state = jq_call_without_gvl(jq_run_nogvl, &run, run.interrupt,
+                                    &run.finished, run.opts->async);
+    if (state) {
+        jq_run_free(&run);
+        rb_jump_tag(state);
+    }
+
+    if (run.status != JQ_RUN_OK) {
+        rb_exc_raise(jq_run_exception(&run));
+    }
+
+    jv results = run.results;
+    run.results = jv_invalid();
+    jq_run_free(&run);
+
+    int count = jv_array_length(jv_copy(results));
+
+    if (!opts->multiple_outputs) {
+        if (count == 0) {
+            jv_free(results);
+            return Qnil;
+        }
+        return jq_jv_to_rb(jv_array_get(results, 0), object_opts);  // CONSUMES results
+    }
+
+    VALUE ary = rb_ary_new_capa(count);
+    for (int i = 0; i < count; i++) {
+        rb_ary_push(ary, jq_jv_to_rb(jv_array_get(jv_copy(results), i),
+                                     object_opts));
+    }
+    jv_free(results);
+
+    return ary;
+}
+
+// A jq_run whose results are handed to Ruby a few at a time
+typedef struct {
+    jq_run run;
+    int step_done;      // Run finished or paused with a full batch
+    jv batch;           // Results being yielded
+} jq_each;
+
+/**
+ * Produce the next batch of results of a jq_each without the GVL
+ *
+ * @param ptr The jq_each being executed
+ * @return NULL
+ */
+static void *jq_each_nogvl(void *ptr) {
+    jq_each *each = (jq_each *)ptr;
+
+    jq_run_nogvl(&each->run);
+    // Not finished and not interrupted: paused after a full batch
+    each->step_done = each->run.finished || !each->run.interrupt->requested;
+    return NULL;
+}
+
+static VALUE jq_each_body(VALUE arg) {
+    jq_each *each = (jq_each *)arg;
+    jq_run *run = &each->run;
+
+    for (;;) {
+        each->step_done = 0;
+        int state = jq_call_without_gvl(jq_each_nogvl, each, run->interrupt,
+                                        &each->step_done, run->opts->async);
+        if (state) rb_jump_tag(state);  // The ensure releases the run
+
+        // Take this batch; the run keeps appending to a fresh array
+        each->batch = run->results;
+        run->results = jv_array();
+
+        int count = jv_array_length(jv_copy(each->batch));
+        for (int i = 0; i < count; i++) {
+            rb_yield(jv_string_to_rb(jv_array_get(jv_copy(each->batch), i)));
+        }
+        jv_free(each->batch);
+        each->batch = jv_invalid();
+
+        // Results produced before an error have been yielded by now
+        if (run->status != JQ_RUN_OK) {
+            rb_exc_raise(jq_run_exception(run));
+        }
+
+        if (run->finished) break;
+    }
+
+    return Qnil;
+}
+
+static VALUE jq_each_ensure(VALUE arg) {
+    jq_each *each = (jq_each *)arg;
+    jq_run_free(&each->run);
+    jv_free(each->batch);
+    return Qnil;
+}
+
+/**
+ * Run a compiled filter against JSON input, yielding results to the block
+ * as they are produced
+ *
+ * Results are pulled from jq_next() in batches of JQ_EACH_BATCH_SIZE, so
+ * memory stays proportional to a batch rather than to all results. If the
+ * block breaks, the jq_state is left mid-run; the next jq_start() (or
+ * jq_teardown()) resets it.
+ *
+ * @param jq Compiled jq_state
+ * @param json_str Ruby string containing JSON input
+ * @param opts Output options (every result is yielded)
+ * @param kernel The filter's native kernel, or NULL
+ * @return nil
+ */
+static VALUE jq_execute_each(jq_state *jq, VALUE json_str,
+                             const jq_output_options *opts,
+                             const jq_kernel *kernel) {
+    VALUE input = jq_pin_input(json_str);
+    jq_interrupt interrupt = {0};
+
+    jq_output_options each_opts = *opts;
+    each_opts.multiple_outputs = 1;
+
+    jq_each each = {
+        .run = {
+            .jq = jq,
+            .json_str = RSTRING_PTR(input),
+            .json_len = (int)RSTRING_LEN(input),
+            .input = jv_invalid(),
+            .args = jq_args_new(opts),
+            .opts = &each_opts,
+            .kernel = kernel,
+            .max_results = JQ_EACH_BATCH_SIZE,
+            .interrupt = &interrupt,
+            .status = JQ_RUN_OK,
+            .results = jv_invalid(),
+            .error = jv_invalid(),
+        },
+        .step_done = 0,
+        .batch = jv_invalid(),
+    };
+    rb_ensure(jq_each_body, (VALUE)&each, jq_each_ensure, (VALUE)&each);
+
+    RB_GC_GUARD(input);
+    return Qnil;
+}
+
+// A jq_run writing its results to a String or IO (JQ.filter_into)
+typedef struct {
+    jq_run run;
+    jq_output_buffer output;
+    int step_done;      // Run finished or paused with a full output buffer
+    VALUE dest;
+} jq_into;
+
+/**
+ * Run (or resume) a jq_into without the GVL until it finishes or its output
+ * buffer needs draining
+ *
+ * @param ptr The jq_into being executed
+ * @return NULL
+ */
+static void *jq_into_nogvl(void *ptr) {
+    jq_into *into = (jq_into *)ptr;
+    jq_run *run = &into->run;
+
+    jq_run_nogvl(run);
+    if (run->finished && into->output.file &&
+        fflush(into->output.file) != 0 && run->status == JQ_RUN_OK) {
+        run->status = JQ_RUN_DUMP_ERROR;
+    }
+    // Not finished and not interrupted: paused with a full buffer
+    into->step_done = run->finished || !run->interrupt->requested;
+    return NULL;
+}
+
+/**
+ * Hand the bytes accumulated in an output buffer to the destination
+ */
+static void jq_output_drain(jq_output_buffer *out, VALUE dest) {
+    if (out->len == 0) return;
+
+    if (RB_TYPE_P(dest, T_STRING)) {
+        rb_str_cat(dest, out->ptr, (long)out->len);
+    } else {
+        rb_funcall(dest, id_write, 1, rb_utf8_str_new(out->ptr, (long)out->len));
+    }
+    out->len = 0;
+}
+
+static VALUE jq_into_body(VALUE arg) {
+    jq_into *into = (jq_into *)arg;
+    jq_run *run = &into->run;
+
+    for (;;) {
+        into->step_done = 0;
+        int state = jq_call_without_gvl(jq_into_nogvl, into, run->interrupt,
+                                        &into->step_done, run->opts->async);
+        if (state) rb_jump_tag(state);  // The ensure releases the run
+
+        // Output produced before an error is written by now
+        jq_output_drain(&into->output, into->dest);
+
+        if (run->status != JQ_RUN_OK) {
+            rb_exc_raise(jq_run_exception(run));
+        }
+
+        if (run->finished) break;
+    }
+
+    return into->dest;
+}
+
+static VALUE jq_into_ensure(VALUE arg) {
+    jq_into *into = (jq_into *)arg;
+    jq_run_free(&into->run);
+    jq_output_close(&into->output);
+    return Qnil;
+}
+
+/**
+ * Run a compiled filter against JSON input, writing every result to a
+ * String or IO, newline-terminated
+ *
+ * Results are serialized without the GVL into a C buffer, which is appended
+ * to the destination every JQ_OUTPUT_FLUSH_SIZE bytes and at the end. No
+ * Ruby object is created per result.
+ *
+ * @param jq Compiled jq_state
+ * @param json_str Ruby string containing JSON input
+ * @param dest Unfrozen String, or IO-like object responding to write
+ * @param opts Output options (every result is written)
+ * @param kernel The filter's native kernel, or NULL
+ * @return dest
+ */
+static VALUE jq_execute_into(jq_state *jq, VALUE json_str, VALUE dest,
+                             const jq_output_options *opts,
+                             const jq_kernel *kernel) {
+    VALUE input = jq_pin_input(json_str);
+    jq_interrupt interrupt = {0};
+
+    jq_output_options into_opts = *opts;
+    into_opts.multiple_outputs = 1;
+
+    jq_into into = {
+        .run = {
+            .jq = jq,
+            .json_str = RSTRING_PTR(input),
+            .json_len = (int)RSTRING_LEN(input),
+            .input = jv_invalid(),
+            .args = jq_args_new(opts),
+            .opts = &into_opts,
+            .output = &into.output,
+            .kernel = kernel,
+            .interrupt = &interrupt,
+            .status = JQ_RUN_OK,
+            .results = jv_invalid(),
+            .error = jv_invalid(),
+        },
+        .output = { NULL, 0, 0, NULL, 0 },
+        .step_done = 0,
+        .dest = dest,
+    };
+    jq_output_open(&into.output);
+    rb_ensure(jq_into_body, (VALUE)&into, jq_into_ensure, (VALUE)&into);
+
+    RB_GC_GUARD(input);
+    return dest;
+}
+
+/**
+ * Check that an output destination is an unfrozen String or IO-like object
+ */
+static void check_output_destination(VALUE dest) {
+    if (RB_TYPE_P(dest, T_STRING)) {
+        rb_check_frozen(dest);
+    } else if (!rb_respond_to(dest, id_write)) {
+        rb_raise(rb_eTypeError, "expected String or IO (got %"PRIsVALUE")",
+                 rb_obj_class(dest));
+    }
+}
+
+/**
+ * Add one jq --stream event to the value being rebuilt at stream_depth
+ *
+ * Like fromstream(depth | truncate_stream(inputs)): leaves below the depth
+ * are set into stream->partial at their path relative to it, and the
+ * closing event of a value at the depth completes it. Unlike
+ * truncate_stream, scalars and empty containers at the depth are values
+ * too. Events above the depth are dropped.
+ *
+ * @param event [path, leaf] or closing [path] event (CONSUMED)
+ * @return A complete value, or invalid without a message if there is none
+ */
+static jv jq_stream_rebuild(jq_stream *stream, jv event) {
+    int depth = stream->opts.stream_depth;
+    int is_leaf = jv_array_length(jv_copy(event)) == 2;
+    jv path = jv_array_get(jv_copy(event), 0);
+    int len = jv_array_length(jv_copy(path));
+
+    if (is_leaf && len == depth) {  // A scalar or empty container at the depth
+        jv_free(path);
+        return jv_array_get(event, 1);  // CONSUMES event
+    }
+    if (is_leaf && len > depth) {
+        stream->partial = jv_setpath(stream->partial,
+                                     jv_array_slice(path, depth, len),
+                                     jv_array_get(event, 1));
+        if (!jv_is_valid(stream->partial)) {
+            jv error = stream->partial;
+            stream->partial = jv_null();
+            return error;
+        }
+        return jv_invalid();
+    }
+
+    jv_free(path);
+    jv_free(event);
+    if (is_leaf || len != depth + 1) return jv_invalid();
+
+    jv value = stream->partial;  // Closed after its last child
+    stream->partial = jv_null();
+    return value;
+}
+
+/**
+ * Parse and filter every complete document in the parser's current buffer
+ * without the GVL
+ *
+ * Serialized results are appended to stream->results. Stops early when
+ * interrupted (and resumes where it left off) or on the first parse or
+ * runtime error.
+ *
+ * @param ptr The jq_stream being processed
+ * @return NULL
+ */
+static void *jq_stream_nogvl(void *ptr) {
+    jq_stream *stream = (jq_stream *)ptr;
+
+    for (;;) {
+        if (!stream->run_active) {
+            if (stream->interrupt.requested) return NULL;
+
+            jv value = jv_parser_next(stream->parser);
+            if (jv_is_valid(value) && stream->opts.stream_depth >= 0) {
+                value = jq_stream_rebuild(stream, value);  // CONSUMES value
+                if (!jv_is_valid(value) && !jv_invalid_has_msg(jv_copy(value))) {
+                    jv_free(value);
+                    continue;  // The value at that depth is not complete yet
+                }
+            }
+            if (!jv_is_valid(value)) {
+                if (jv_invalid_has_msg(jv_copy(value))) {
+                    stream->run.status = JQ_RUN_PARSE_ERROR;
+                    stream->run.error = jv_invalid_get_msg(value);  // CONSUMES value
+                    stream->failed = 1;
+                } else {
+                    jv_free(value);  // Buffer exhausted
+                }
+                break;
+            }
+
+            stream->run.input = value;
+            stream->run.started = 0;
+            stream->run.finished = 0;
+            stream->run_active = 1;
+        }
+
+        jq_run_nogvl(&stream->run);
+        if (!stream->run.finished) return NULL;  // Interrupted
+
+        stream->run_active = 0;
+        if (stream->run.status != JQ_RUN_OK) {
+            stream->failed = 1;
+            break;
+        }
+
+        stream->results = jv_array_concat(stream->results, stream->run.results);
+        stream->run.results = jv_invalid();
+    }
+
+    stream->finished = 1;
+    return NULL;
+}
+
+// Arguments for processing a stream under rb_ensure
+struct jq_stream_args {
+    jq_stream *stream;
+    VALUE input;        // String or IO
+    VALUE chunk;        // Last chunk read from an IO (referenced by the parser)
+    const jq_file *file;    // Mapped file read instead of input, or NULL
+};
+
+static VALUE jq_stream_body(VALUE arg) {
+    struct jq_stream_args *args = (struct jq_stream_args *)arg;
+    jq_stream *stream = args->stream;
+    int is_string = !args->file && RB_TYPE_P(args->input, T_STRING);
+    long offset = 0;
+    int last = 0;
+
+    while (!last) {
+        const char *buf;
+        long len;
+
+        if (args->file) {
+            buf = args->file->ptr + offset;
+            len = args->file->len - offset < JQ_STREAM_CHUNK_SIZE ?
+                args->file->len - offset : JQ_STREAM_CHUNK_SIZE;
+            offset += len;
+            last = offset >= args->file->len;
+        } else if (is_string) {
+            long total = RSTRING_LEN(args->input);
+            buf = RSTRING_PTR(args->input) + offset;
+            len = total - offset < JQ_STREAM_CHUNK_SIZE ?
+                total - offset : JQ_STREAM_CHUNK_SIZE;
+            offset += len;
+            last = offset >= total;
+        } else {
+            VALUE chunk = rb_funcall(args->input, id_read, 1,
+                                     INT2FIX(JQ_STREAM_CHUNK_SIZE));
+            if (NIL_P(chunk)) {
+                buf = "";
+                len = 0;
+                last = 1;
+            } else {
+                StringValue(chunk);
+                // The parser keeps pointing into the chunk until the next one
+                args->chunk = rb_str_new_frozen(chunk);
+                buf = RSTRING_PTR(args->chunk);
+                len = RSTRING_LEN(args->chunk);
+                if (len > JQ_STREAM_CHUNK_SIZE) {
+                    rb_raise(rb_eArgError, "read returned more than %d bytes",
+                             JQ_STREAM_CHUNK_SIZE);
+                }
+            }
+        }
+
+        jv_parser_set_buf(stream->parser, buf, (int)len, !last);
+
+        stream->finished = 0;
+        int state = jq_call_without_gvl(jq_stream_nogvl, stream,
+                                        &stream->interrupt, &stream->finished,
+                                        stream->opts.async);
+        if (state) rb_jump_tag(state);  // The ensure releases the stream
+
+        // Yield the results of this buffer, then report a failure, so every
+        // document before the failing one is seen
+        int count = jv_array_length(jv_copy(stream->results));
+        for (int i = 0; i < count; i++) {
+            rb_yield(jv_string_to_rb(jv_array_get(jv_copy(stream->results), i)));
+        }
+        jv_free(stream->results);
+        stream->results = jv_array();
+
+        if (stream->failed) {
+            rb_exc_raise(jq_run_exception(&stream->run));
+        }
+    }
+
+    return Qnil;
+}
+
+static VALUE jq_stream_ensure(VALUE arg) {
+    struct jq_stream_args *args = (struct jq_stream_args *)arg;
+    jq_stream *stream = args->stream;
+
+    jv_parser_free(stream->parser);
+    jq_run_free(&stream->run);
+    jv_free(stream->results);
+    jv_free(stream->partial);
+    return Qnil;
+}
+
+/**
+ * Run a compiled filter against every JSON document in a String or IO,
+ * yielding each serialized result to the block as it is produced
+ *
+ * Input is fed to libjq's incremental parser in chunks of
+ * JQ_STREAM_CHUNK_SIZE bytes, so memory use is bounded by the largest
+ * document rather than the whole input. Each chunk is parsed and filtered
+ * without the GVL.
+ *
+ * With opts->stream, the input is parsed with JV_PARSE_STREAMING and the
+ * filter runs once per [path, leaf] event instead, as with jq --stream, or
+ * once per value at opts->stream_depth (see jq_stream_rebuild). Memory use
+ * is then bounded by the nesting depth, or the largest such value, even for
+ * one huge document.
+ *
+ * @param jq Compiled jq_state
+ * @param input String, or IO-like object responding to read(length)
+ * @param opts Output options (every result is yielded)
+ * @param file Mapped file to read instead of input, or NULL
+ * @return nil
+ */
+static VALUE jq_execute_stream(jq_state *jq, VALUE input,
+                               const jq_output_options *opts,
+                               const jq_file *file) {
+    if (RB_TYPE_P(input, T_STRING)) {
+        // Keep the buffer stable while it is parsed without the GVL
+        input = rb_str_new_frozen(input);
+    }
+
+    jq_stream stream = {
+        .jq = jq,
+        .opts = *opts,
+        .run_active = 0,
+        .finished = 0,
+        .failed = 0,
+        .interrupt = {0},
+    };
+    stream.opts.multiple_outputs = 1;
+    stream.run = (jq_run){
+        .jq = jq,
+        .json_str = NULL,
+        .input = jv_invalid(),
+        .args = jq_args_new(opts),  // Bound to every document
+        .opts = &stream.opts,
+        .interrupt = &stream.interrupt,
+        .status = JQ_RUN_OK,
+        .results = jv_invalid(),
+        .error = jv_invalid(),
+    };
+    stream.results = jv_array();
+    stream.partial = jv_null();
+    stream.parser = jv_parser_new(opts->stream ? JV_PARSE_STREAMING : 0);
+
+    struct jq_stream_args args = { &stream, input, Qnil, file };
+    rb_ensure(jq_stream_body, (VALUE)&args, jq_stream_ensure, (VALUE)&args);
+
+    RB_GC_GUARD(input);
+    return Qnil;
+}
+
+/**
+ * Check that a stream input is a String or IO-like object
+ */
+static void check_stream_input(VALUE input) {
+    if (!RB_TYPE_P(input, T_STRING) && !rb_respond_to(input, id_read)) {
+        rb_raise(rb_eTypeError, "expected String or IO (got %"PRIsVALUE")",
+                 rb_obj_class(input));
+    }
+}
+
+/**
+ * Run every document of a batch without the GVL, one after another on the
+ * same jq_state
+ *
+ * @param ptr The jq_batch being executed
+ * @return NULL
+ */
+static void *jq_batch_nogvl(void *ptr) {
+    jq_batch *batch = (jq_batch *)ptr;
+
+    if (!batch->jq) {
+        batch->jq = batch->bytecode ?
+            jq_new_loaded_state(batch->bytecode, batch->bytecode_len,
+                                batch->sandbox) :
+            jq_new_state(batch->filter, batch->sandbox);
+        if (!batch->jq) {
+            batch->compile_failed = 1;
+            batch->finished = 1;
+            return NULL;
+        }
+    }
+
+    while (batch->next < batch->count) {
+        jq_run *run = &batch->runs[batch->next];
+
+        run->jq = batch->jq;
+        jq_run_nogvl(run);
+        if (!run->finished) return NULL;  // Interrupted
+
+        batch->next++;
+        if (run->status != JQ_RUN_OK && batch->stop_on_error) break;
+    }
+
+    batch->finished = 1;
+    return NULL;
+}
+
+/**
+ * Run every shard of a parallel batch without the GVL
+ *
+ * Shard 0 runs on the calling thread, the others on native threads that are
+ * joined before returning. A shard whose thread cannot be started runs on
+ * the calling thread instead.
+ *
+ * @param ptr The jq_parallel being executed
+ * @return NULL
+ */
+static void *jq_parallel_nogvl(void *ptr) {
+    jq_parallel *parallel = (jq_parallel *)ptr;
+    int i;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_t threads[JQ_PARALLEL_MAX];
+    int started[JQ_PARALLEL_MAX];
+
+    for (i = 1; i < parallel->count; i++) {
+        started[i] = !parallel->shards[i].finished &&
+            pthread_create(&threads[i], NULL, jq_batch_nogvl,
+                           &parallel->shards[i]) == 0;
+    }
+#endif
+
+    jq_batch_nogvl(&parallel->shards[0]);
+
+    for (i = 1; i < parallel->count; i++) {
+#ifdef HAVE_PTHREAD_H
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+            continue;
+        }
+#endif
+        if (!parallel->shards[i].finished) {
+            jq_batch_nogvl(&parallel->shards[i]);
+        }
+    }
+
+    parallel->finished = 1;
+    for (i = 0; i < parallel->count; i++) {
+        if (!parallel->shards[i].finished) parallel->finished = 0;
+    }
+    return NULL;
+}
+
+/**
+ * Release everything an array of runs still owns, including the array
+ */
+static void jq_runs_free(jq_run *runs, long count) {
+    for (long i = 0; i < count; i++) {
+        jq_run_free(&runs[i]);
+    }
+    xfree(runs);
+}
+
+/**
+ * Run a compiled filter against every JSON document in an array
+ *
+ * The documents are split into contiguous shards, one per jq_state, and the
+ * whole batch runs in a single GVL-free section. With more than one shard,
+ * each shard runs on its own native thread. Errors are reported according
+ * to +error_mode+: raised (the failing document with the lowest index wins),
+ * replaced by nil, or returned in place as exception objects.
+ *
+ * @param states jq_states to use, states[0] compiled; NULL entries are
+ *   compiled (or loaded) by the worker threads and stored back, so the
+ *   caller owns (and must release) every non-NULL entry afterwards
+ * @param nstates Number of entries in +states+ (upper bound on shards)
+ * @param filter Frozen filter source, used for NULL entries of +states+
+ * @param bytecode Frozen JSON bytecode loaded into NULL entries instead of
+ *   compiling +filter+ (JQ::Program.load), or Qnil
+ * @param sandbox Sandbox flag for NULL entries of +states+
+ * @param kernel The filter's native kernel, or NULL
+ * @param jsons Ruby array of JSON strings
+ * @param opts Output options
+ * @param error_mode How per-document errors are reported
+ * @return Ruby array with one result per input document
+ */
+static VALUE jq_execute_many(jq_state **states, int nstates, VALUE filter,
+                             VALUE bytecode, int sandbox,
+                             const jq_kernel *kernel, VALUE jsons,
+                             const jq_output_options *opts,
+                             jq_error_mode error_mode) {
+    Check_Type(jsons, T_ARRAY);
+    long count = RARRAY_LEN(jsons);
+    if (count <= 0) return rb_ary_new();
+
+    // Pinned copies keep every buffer stable while the GVL is released,
+    // even if the caller's array or strings are modified
+    VALUE inputs = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        VALUE json_str = RARRAY_AREF(jsons, i);
+        Check_Type(json_str, T_STRING);
+        rb_ary_push(inputs, jq_pin_input(json_str));
+    }
+
+    int nshards = count < nstates ? (int)count : nstates;
+    jq_batch *shards = ALLOCA_N(jq_batch, nshards);
+    jq_parallel parallel = {
+        .shards = shards,
+        .count = nshards,
+        .finished = 0,
+        .interrupt = {0},
+    };
+
+    // Every shard gets its own copy of the bindings: jv reference counts are
+    // not atomic, so shards running in parallel must not share values
+    jv *shard_args = ALLOCA_N(jv, nshards);
+    for (int i = 0; i < nshards; i++) {
+        shard_args[i] = jq_args_new(opts);
+    }
+
+    jq_run *runs = ALLOC_N(jq_run, count);
+    for (long i = 0; i < count; i++) {
+        VALUE input = RARRAY_AREF(inputs, i);
+        runs[i] = (jq_run){
+            .json_str = RSTRING_PTR(input),
+            .json_len = (int)RSTRING_LEN(input),
+            .input = jv_invalid(),
+            .args = jv_invalid(),
+            .opts = opts,
+            .kernel = kernel,
+            .interrupt = &parallel.interrupt,
+            .status = JQ_RUN_OK,
+            .results = jv_invalid(),
+            .error = jv_invalid(),
+        };
+    }
+
+    for (int i = 0; i < nshards; i++) {
+        long lo = count * i / nshards;
+        long hi = count * (i + 1) / nshards;
+
+        shards[i] = (jq_batch){
+            .jq = states[i],
+            .filter = NIL_P(filter) ? NULL : RSTRING_PTR(filter),
+            .bytecode = NIL_P(bytecode) ? NULL : RSTRING_PTR(bytecode),
+            .bytecode_len = NIL_P(bytecode) ? 0 : RSTRING_LEN(bytecode),
+            .sandbox = sandbox,
+            .runs = runs + lo,
+            .count = hi - lo,
+            .stop_on_error = error_mode == JQ_ERRORS_RAISE,
+        };
+        for (long j = lo; j < hi; j++) {
+            runs[j].args = jv_copy(shard_args[i]);
+        }
+        jv_free(shard_args[i]);
+    }
+
+    int state;
+    if (nshards == 1) {
+        state = jq_call_without_gvl(jq_batch_nogvl, &shards[0],
+                                    &parallel.interrupt, &shards[0].finished,
+                                    opts->async);
+    } else {
+        state = jq_call_without_gvl(jq_parallel_nogvl, &parallel,
+                                    &parallel.interrupt, &parallel.finished,
+                                    opts->async);
+    }
+
+    // Hand the states compiled by worker threads back to the caller
+    int compile_failed = 0;
+    for (int i = 0; i < nshards; i++) {
+        states[i] = shards[i].jq;
+        compile_failed |= shards[i].compile_failed;
+    }
+
+    if (state) {
+        jq_runs_free(runs, count);
+        rb_jump_tag(state);
+    }
+
+    if (compile_failed) {
+        jq_runs_free(runs, count);
+        rb_raise(rb_eJQError, "Failed to compile jq filter on worker thread");
+    }
+
+    if (error_mode == JQ_ERRORS_RAISE) {
+        for (int i = 0; i < nshards; i++) {
+            jq_batch *shard = &shards[i];
+            if (shard->next > 0 &&
+                shard->runs[shard->next - 1].status != JQ_RUN_OK) {
+                VALUE exception = jq_run_exception(&shard->runs[shard->next - 1]);
+                jq_runs_free(runs, count);
+                rb_exc_raise(exception);
+            }
+        }
+    }
+
+    VALUE results = rb_ary_new_capa(count);
+    for (long i = 0; i < count; i++) {
+        jq_run *run = &runs[i];
+
+        if (run->status == JQ_RUN_OK) {
+            rb_ary_push(results, jq_run_value(run));
+        } else if (error_mode == JQ_ERRORS_ERROR) {
+            rb_ary_push(results, jq_run_exception(run));
+        } else {
+            jq_run_free(run);
+            rb_ary_push(results, Qnil);
+        }
+    }
+    xfree(runs);
+
+    RB_GC_GUARD(inputs);
+    RB_GC_GUARD(filter);
+    RB_GC_GUARD(bytecode);
+    return results;
+}
+
+// Arguments for running jq_execute under rb_ensure
+struct jq_execute_args {
+    jq_state *jq;
+    VALUE input;
+    const jq_output_options *opts;
+    jq_input_kind kind;
+    const jq_object_options *object_opts;   // Only for JQ_INPUT_OBJECT
+    VALUE dest;                             // Only for JQ_INPUT_INTO
+    const jq_kernel *kernel;                // The filter's native kernel, or NULL
+    const jq_file *file;                    // Only for JQ_INPUT_FILE(_STREAM)
+};
+
+static VALUE jq_execute_body(VALUE arg) {
+    struct jq_execute_args *args = (struct jq_execute_args *)arg;
+
+    switch (args->kind) {
+    case JQ_INPUT_OBJECT:
+        return jq_execute_object(args->jq, args->input, args->opts,
+                                 args->object_opts, args->kernel);
+    case JQ_INPUT_STREAM:
+        return jq_execute_stream(args->jq, args->input, args->opts, NULL);
+    case JQ_INPUT_EACH:
+        return jq_execute_each(args->jq, args->input, args->opts, args->kernel);
+    case JQ_INPUT_INTO:
+        return jq_execute_into(args->jq, args->input, args->dest, args->opts,
+                               args->kernel);
+    case JQ_INPUT_FILE:
+        return jq_execute_file(args->jq, args->file, args->opts, args->kernel);
+    case JQ_INPUT_FILE_STREAM:
+        return jq_execute_stream(args->jq, Qnil, args->opts, args->file);
+    case JQ_INPUT_DOCUMENT:
+        return jq_execute_document(args->jq, args->input, args->opts,
+                                   args->kernel);
+    default:
+        return jq_execute(args->jq, args->input, args->opts, args->kernel);
+    }
+}
+
+static VALUE jq_teardown_ensure(VALUE arg) {
+    jq_state **jq = (jq_state **)arg;
+    jq_state_release(jq);
+    return Qnil;
+}
+
+/**
+ * Implementation of JQ.filter (and JQ.filter_file)
+ *
+ * @param json_str Ruby string containing JSON input or a JQ::Document (nil
+ *   for a file)
+ * @param filter_str jq filter expression
+ * @param opts Output options (raw, compact, sort keys, multiple outputs)
+ * @param sandbox If true, enable sandbox mode (blocks env/include/import)
+ * @param file File to read instead of json_str, or NULL
+ * @param kind JQ_INPUT_JSON, JQ_INPUT_DOCUMENT, JQ_INPUT_FILE or
+ *   JQ_INPUT_FILE_STREAM
+ * @return Ruby string or array of strings (nil when streaming), or
+ *   documents with +document:+
+ */
+static VALUE rb_jq_filter_impl(VALUE json_str, const char *filter_str,
+                                const jq_output_options *opts, int sandbox,
+                                const jq_file *file, jq_input_kind kind) {
+    unsigned long long start = jq_stats_start(opts);
+    jq_state *jq = jq_compile_filter(filter_str, sandbox);
+    if (opts->stats) jq_stats_add(&opts->stats->compile_ns, start);
+    jq_kernel kernel;
+    struct jq_execute_args args = {
+        jq, json_str, opts, kind, NULL, Qnil,
+        kind != JQ_INPUT_FILE_STREAM &&
+            jq_kernel_compile(filter_str, strlen(filter_str), &kernel) ? &kernel : NULL,
+        file
+    };
+
+    // The state is torn down even if execution raises
+    return rb_ensure(jq_execute_body, (VALUE)&args,
+                     jq_teardown_ensure, (VALUE)&jq);
+}
+
+// Arguments of a JQ.filter call
+struct jq_filter_args {
+    VALUE json_str;
+    VALUE filter_str;
+    const jq_output_options *opts;
+    int sandbox;
+    const jq_file *file;    // JQ.filter_file: the file read instead of json_str
+    jq_input_kind kind;
+};
+
+/**
+ * Run a JQ.filter call, through the cache when it is enabled
+ */
+static VALUE jq_filter_body(VALUE arg) {
+    struct jq_filter_args *args = (struct jq_filter_args *)arg;
+    const jq_output_options *opts = args->opts;
+
+    if (jq_cache_capacity > 0) {
+        long hits = jq_cache_current()->hits;
+        unsigned long long start = jq_stats_start(opts);
+        VALUE program = jq_cache_fetch(args->filter_str, args->sandbox);
+        if (opts->stats) {
+            jq_stats_add(&opts->stats->compile_ns, start);
+            opts->stats->cached = jq_cache_current()->hits != hits;
+        }
+        if (args->file) {
+            return jq_program_run_file(program, args->file, opts, args->kind);
+        }
+        return jq_program_run(program, args->json_str, opts);
+    }
+
+    return rb_jq_filter_impl(args->json_str, RSTRING_PTR(args->filter_str),
+                             opts, args->sandbox, args->file, args->kind);
+}
+
+/**
+ * Read the :stats option
+ *
+ * @param opts Ruby options hash (may be nil)
+ * @return Qtrue (keep the stats for JQ.last_stats), an object responding to
+ *   #call (called with the stats), or Qnil (not requested)
+ * @raise ArgumentError for anything else
+ */
+static VALUE parse_stats_option(VALUE opts) {
+    if (NIL_P(opts)) return Qnil;
+
+    VALUE opt = rb_hash_aref(opts, sym_stats);
+    if (NIL_P(opt) || opt == Qfalse) return Qnil;
+    if (opt == Qtrue || rb_respond_to(opt, id_call)) return opt;
+
+    rb_raise(rb_eArgError,
+             "stats must be true, false or respond to #call (got %+"PRIsVALUE")",
+             opt);
+}
+
+/**
+ * The name of a kernel as a Symbol, or nil for JQ_KERNEL_NONE
+ */
+static VALUE jq_kernel_symbol(int kind) {
+    const char *name = jq_kernel_name((jq_kernel_kind)kind);
+    return name ? ID2SYM(rb_intern(name)) : Qnil;
+}
+
+/**
+ * Convert the measurements of a call to a JQ::Stats
+ */
+static VALUE jq_stats_new(const jq_run_stats *stats,
+                          unsigned long long total_ns) {
+    return rb_struct_new(rb_cJQStats,
+                         ULL2NUM(stats->compile_ns),
+                         ULL2NUM(stats->parse_ns),
+                         ULL2NUM(stats->execute_ns),
+                         ULL2NUM(stats->serialize_ns),
+                         ULL2NUM(total_ns),
+                         LONG2NUM(stats->input_bytes),
+                         LONG2NUM(stats->outputs),
+                         LL2NUM(stats->output_bytes),
+                         LL2NUM(stats->allocations),
+                         LL2NUM(stats->memory),
+                         stats->path ? Qtrue : Qfalse,
+                         stats->cached ? Qtrue : Qfalse,
+                         jq_kernel_symbol(stats->kernel));
+}
+
+/**
+ * Hand the stats of a finished call to whoever asked for them
+ *
+ * @param stats JQ::Stats
+ * @param report Value of the :stats option (see parse_stats_option)
+ * @param filter Filter source, for the instrumenter's payload
+ * @param error Exception the call raised, or Qnil
+ */
+static void jq_stats_report(VALUE stats, VALUE report, VALUE filter,
+                            VALUE error) {
+    if (report == Qtrue) {
+        rb_thread_local_aset(rb_thread_current(), id_last_stats, stats);
+    } else if (!NIL_P(report)) {
+        rb_funcall(report, id_call, 1, stats);
+    }
+
+    VALUE instrumenter = jq_instrumenter_current();
+    if (!NIL_P(instrumenter)) {
+        VALUE payload = rb_funcall(stats, id_to_h, 0);
+        rb_hash_aset(payload, sym_filter, filter);
+        if (!NIL_P(error)) {
+            // Keys ActiveSupport::Notifications sets for a block that raised
+            rb_hash_aset(payload, sym_exception,
+                         rb_ary_new_from_args(2, rb_class_name(rb_obj_class(error)),
+                                              rb_funcall(error, rb_intern("message"), 0)));
+            rb_hash_aset(payload, sym_exception_object, error);
+        }
+        rb_funcall(instrumenter, id_instrument, 2,
+                   rb_str_new_cstr("filter.jq"), payload);
+    }
+}
+
+// A measured JQ.filter or Program#call, reported if it raises too
+struct jq_stats_report_args {
+    VALUE stats;
+    VALUE report;
+    VALUE filter;
+    VALUE error;
+};
+
+static VALUE jq_stats_report_body(VALUE arg) {
+    struct jq_stats_report_args *args = (struct jq_stats_report_args *)arg;
+    jq_stats_report(args->stats, args->report, args->filter, args->error);
+    return Qnil;
+}
+
+/**
+ * Run +func+ with +opts+ collecting stats, then report them
+ *
+ * A call that raises a Ruby exception is reported with the exception
+ * (errors raised while reporting it are dropped) and then re-raised.
+ *
+ * @param func Body of the call
+ * @param arg Argument for +func+
+ * @param opts Parsed options of the call, which +func+ runs with
+ * @param report Value of the :stats option (see parse_stats_option)
+ * @param filter Filter source
+ * @return Result of +func+
+ */
+static VALUE jq_instrumented(VALUE (*func)(VALUE), VALUE arg,
+                             jq_output_options *opts, VALUE report,
+                             VALUE filter) {
+    jq_run_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    opts->stats = &stats;
+
+    unsigned long long start = jq_monotonic_ns();
+    int state = 0;
+    VALUE result = rb_protect(func, arg, &state);
+    unsigned long long total_ns = jq_monotonic_ns() - start;
+    opts->stats = NULL;
+
+    if (!state) {
+        jq_stats_report(jq_stats_new(&stats, total_ns), report, filter, Qnil);
+        return result;
+    }
+
+    VALUE error = rb_errinfo();
+    if (!rb_obj_is_kind_of(error, rb_eException)) rb_jump_tag(state);
+    rb_set_errinfo(Qnil);
+
+    struct jq_stats_report_args args = {
+        jq_stats_new(&stats, total_ns), report, filter, error
+    };
+    int ignored = 0;
+    rb_protect(jq_stats_report_body, (VALUE)&args, &ignored);
+    rb_set_errinfo(Qnil);
+    rb_exc_raise(error);
+}
+
+/*
+ * call-seq:
+ *   JQ.filter(json, filter, **options) -> String or Array<String>
+ *   JQ.filter(document, filter, document: true, **options) -> JQ::Document or Array<JQ::Document>
+ *
+ * Apply a jq filter to JSON input and return the result.
+ *
+ * This is the primary method for using jq from Ruby. It parses the JSON input,
+ * compiles the filter expression, executes it, and returns the result as a
+ * JSON string (or array of strings with +multiple_outputs: true+).
+ *
+ * === Parameters
+ *
+ * [json (String, JQ::Document)] Valid JSON input string, or an already parsed JQ::Document
+ * [filter (String)] jq filter expression (e.g., ".name", ".[] | select(.age > 18)")
+ *
+ * === Options
+ *
+ * [:raw_output (Boolean)] Return raw strings without JSON encoding (equivalent to jq -r). Default: false
+ * [:compact_output (Boolean)] Output compact JSON on a single line. Default: true (set to false for pretty output)
+ * [:sort_keys (Boolean)] Sort object keys alphabetically (equivalent to jq -S). Default: false
+ * [:multiple_outputs (Boolean)] Return array of all results instead of just the first. Default: false
+ * [:sandbox (Boolean)] Enable sandbox mode to block access to environment variables and file imports. Default: true
+ * [:timeout (Numeric)] Seconds the filter may run per input document. Default: nil (no limit)
+ * [:max_steps (Integer)] jq instructions the filter may execute per input document. Default: nil (no limit)
+ * [:max_outputs (Integer)] Results the filter may produce per input document. Default: nil (no limit)
+ * [:max_memory (Integer)] Bytes the filter may hold in jq values per input document, including the parsed input. Default: nil (no limit)
+ * [:async (Boolean)] Under a Fiber.scheduler, run on a worker thread while the fiber waits. Default: JQ.async
+ * [:stats (Boolean, #call)] Measure the call: +true+ keeps a JQ::Stats for JQ.last_stats, a callable is called with it. Default: false
+ * [:document (Boolean)] Return results as JQ::Document instead of JSON text. Default: false
+ *
+ * === Returns
+ *
+ * [String] JSON-encoded result (default), or raw string if +raw_output: true+
+ * [Array<String>] Array of results if +multiple_outputs: true+
+ * [JQ::Document] The result, unserialized, if +document: true+ (an Array of them with +multiple_outputs: true+)
+ *
+ * === Raises
+ *
+ * [JQ::ParseError] If the JSON input is invalid
+ * [JQ::CompileError] If the jq filter expression is invalid
+ * [JQ::RuntimeError] If the filter execution fails
+ * [JQ::TimeoutError] If the filter exceeds +:timeout+, +:max_steps+ or +:max_outputs+
+ * [JQ::ResourceError] If the filter exceeds +:max_memory+
+ * [TypeError] If json is not a String or JQ::Document, or filter is not a String
+ *
+ * === Examples
+ *
+ *   # Basic filtering
+ *   JQ.filter('{"name":"Alice","age":30}', '.name')
+ *   # => "\"Alice\""
+ *
+ *   # Raw output (no JSON encoding)
+ *   JQ.filter('{"name":"Alice"}', '.name', raw_output: true)
+ *   # => "Alice"
+ *
+ *   # Pretty output
+ *   JQ.filter('{"a":1,"b":2}', '.', compact_output: false)
+ *   # => "{\n  \"a\": 1,\n  \"b\": 2\n}"
+ *
+ *   # Multiple outputs
+ *   JQ.filter('[1,2,3]', '.[]', multiple_outputs: true)
+ *   # => ["1", "2", "3"]
+ *
+ *   # Sort keys
+ *   JQ.filter('{"z":1,"a":2}', '.', sort_keys: true)
+ *   # => "{\"a\":2,\"z\":1}"
+ *
+ *   # Complex transformation
+ *   json = '[{"name":"Alice","age":30},{"name":"Bob","age":25}]'
+ *   JQ.filter(json, '[.[] | select(.age > 26) | .name]')
+ *   # => "[\"Alice\"]"
+ *
+ * === Thread Safety
+ *
+ * This method is thread-safe with jq 1.7+ (required by this gem). Each call
+ * creates an isolated jq_state, so concurrent calls do not interfere with
+ * each other.
+ *
+ * The GVL is released while the input is parsed, the filter runs and the
+ * results are serialized, so other Ruby threads keep running during a long
+ * call. Thread#raise and signals are handled between results.
+ *
+ * === Execution Budget
+ *
+ * +:timeout+ and +:max_steps+ are checked inside jq's interpreter loop
+ * (every JQ_BUDGET_CHECK_STEPS instructions for the timeout), so they also
+ * stop a filter that never produces a result, such as
+ * <tt>[range(1e9)]</tt>. The filter is halted and JQ::TimeoutError raised;
+ * the jq_state stays reusable. Time spent parsing the input counts toward
+ * +:timeout+, but a single long-running builtin (or parse) is not cut short.
+ * +:max_memory+ counts the bytes held by jq values allocated while the
+ * filter runs (on the thread running it), is checked at the same points
+ * and after every result, and raises JQ::ResourceError. One allocation
+ * larger than the limit is not refused, only stopped after.
+ * Every other filter method accepts the same options; the batch and stream
+ * methods apply them to each document.
+ *
+ * === Simple Paths
+ *
+ * A filter that is only field and index steps (<tt>.user.id</tt>,
+ * <tt>.items[0].sku</tt>, <tt>.["key"][2]</tt>) is answered by scanning the
+ * JSON text without allocating and parsing just the selected value; the
+ * rest of the document is validated but never built. Anything the scan
+ * cannot answer exactly like jq, including errors, runs through jq as
+ * usual. +:max_memory+ then only counts the selected value.
+ *
+ * === Native Kernels
+ *
+ * A few other common shapes, <tt>select(.status == "active")</tt>,
+ * <tt>map(.id)</tt> and <tt>{id, name}</tt>, are answered on the parsed
+ * input by native code instead of jq's interpreter (see
+ * JQ::Program#kernel), with the same fallback to jq.
+ *
+ * === Instrumentation
+ *
+ * With +:stats+ (or JQ.instrumenter set), the call records a JQ::Stats:
+ * nanoseconds spent compiling (or fetching from the cache), parsing,
+ * executing and serializing, plus the total; the input size; the number
+ * and size of the results; the jv allocations the run made and the bytes
+ * it still held at the end; whether the simple path scan or the cache
+ * answered; and which native kernel, if any, produced the results.
+ * Collecting them costs two clock reads per result.
+ *
+ *   JQ.filter(json, '.items[]', multiple_outputs: true, stats: true)
+ *   JQ.last_stats.execute_ns  # => 81234
+ *
+ * === Caching
+ *
+ * When JQ.cache_capacity is non-zero, compiled filters are kept in an LRU
+ * cache keyed by filter text and sandbox flag, so repeated calls with the
+ * same filter skip compilation. See JQ.cache_stats.
+ *
+ */
+VALUE rb_jq_filter(int argc, VALUE *argv, VALUE self) {
+    VALUE json_str, filter_str, opts;
+    rb_scan_args(argc, argv, "2:", &json_str, &filter_str, &opts);
+
+    jq_input_kind kind = jq_is_document(json_str) ? JQ_INPUT_DOCUMENT :
+        JQ_INPUT_JSON;
+    if (kind == JQ_INPUT_JSON) Check_Type(json_str, T_STRING);
+    Check_Type(filter_str, T_STRING);
+
+    StringValueCStr(filter_str);  // Rejects filters containing NUL
+
+    // Parse options (default to compact output, sandbox enabled)
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_document_option(opts, &output_opts);
+    struct jq_filter_args args = {
+        json_str, filter_str, &output_opts, parse_sandbox_option(opts), NULL,
+        kind
+    };
+
+    VALUE report = parse_stats_option(opts);
+    if (NIL_P(report) && NIL_P(jq_instrumenter_current())) {
+        return jq_filter_body((VALUE)&args);
+    }
+    return jq_instrumented(jq_filter_body, (VALUE)&args, &output_opts,
+                           report, filter_str);
+}
+
+// Arguments for running jq_execute_many under rb_ensure
+struct jq_execute_many_args {
+    jq_state **states;
+    int nstates;
+    VALUE filter;
+    VALUE bytecode;     // Loaded instead of compiling filter, or Qnil
+    int sandbox;
+    const jq_kernel *kernel;
+    VALUE jsons;
+    const jq_output_options *opts;
+    jq_error_mode error_mode;
+};
+
+static VALUE jq_execute_many_body(VALUE arg) {
+    struct jq_execute_many_args *args = (struct jq_execute_many_args *)arg;
+    return jq_execute_many(args->states, args->nstates, args->filter,
+                           args->bytecode, args->sandbox, args->kernel,
+                           args->jsons, args->opts, args->error_mode);
+}
+
+static VALUE jq_teardown_many_ensure(VALUE arg) {
+    struct jq_execute_many_args *args = (struct jq_execute_many_args *)arg;
+    for (int i = 0; i < args->nstates; i++) {
+        if (args->states[i]) jq_state_release(&args->states[i]);
+    }
+    return Qnil;
+}
+
+/**
+ * Number of jq_states a batch of +jsons+ is sharded over: the :parallel
+ * option, but never more than one per document
+ */
+static int jq_batch_width(VALUE jsons, int parallel) {
+    long count = RARRAY_LEN(jsons);
+    if (count < parallel) return count > 1 ? (int)count : 1;
+    return parallel;
+}
+
+/*
+ * call-seq:
+ *   JQ.filter_many(jsons, filter, **options) -> Array
+ *
+ * Apply one jq filter to many JSON documents in a single native call.
+ *
+ * The filter is compiled once and every document is processed in one
+ * GVL-free section, avoiding the per-call overhead of JQ.filter. This is the
+ * fastest way to run one filter over a large batch of small documents.
+ *
+ * === Parameters
+ *
+ * [jsons (Array<String>)] JSON input strings
+ * [filter (String)] jq filter expression
+ *
+ * === Options
+ *
+ * Accepts every JQ.filter option, plus:
+ *
+ * [:errors (Symbol)] How a failing document is reported. +:raise+ (default) raises the first error; +:nil+ puts nil in its place; +:error+ puts the JQ::Error instance in its place
+ * [:parallel (Integer)] Number of native threads to shard the documents over (default: 1, max: 256)
+ *
+ * === Parallel Execution
+ *
+ * With <tt>parallel: N</tt> the documents are split into N contiguous
+ * shards, each run on its own native thread with its own compiled jq_state,
+ * all without the GVL. Results are returned in input order. With
+ * +errors: :raise+ the error of the failing document with the lowest index
+ * is raised. Parallelism pays off for large batches; for a handful of small
+ * documents the cost of compiling extra jq_states dominates.
+ *
+ * === Returns
+ *
+ * [Array] One result per input document, in order. Each result is what
+ * JQ.filter would return for that document (a String, or an Array<String>
+ * with +multiple_outputs: true+).
+ *
+ * === Raises
+ *
+ * [JQ::CompileError] If the jq filter expression is invalid
+ * [JQ::ParseError] If a document is invalid JSON (with +errors: :raise+)
+ * [JQ::RuntimeError] If the filter fails on a document (with +errors: :raise+)
+ * [TypeError] If jsons is not an array of strings
+ * [ArgumentError] If +:errors+ or +:parallel+ is out of range
+ *
+ * === Examples
+ *
+ *   JQ.filter_many(['{"id":1}', '{"id":2}'], '.id')
+ *   # => ["1", "2"]
+ *
+ *   JQ.filter_many(['{"id":1}', 'oops'], '.id', errors: :nil)
+ *   # => ["1", nil]
+ *
+ *   JQ.filter_many(['{"id":1}', 'oops'], '.id', errors: :error)
+ *   # => ["1", #<JQ::ParseError: ...>]
+ *
+ *   JQ.filter_many(lines, '.user.id', parallel: 4)
+ *
+ */
+VALUE rb_jq_filter_many(int argc, VALUE *argv, VALUE self) {
+    VALUE jsons, filter_str, opts;
+    rb_scan_args(argc, argv, "2:", &jsons, &filter_str, &opts);
+
+    Check_Type(jsons, T_ARRAY);
+    Check_Type(filter_str, T_STRING);
+
+    const char *filter_cstr = StringValueCStr(filter_str);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    int sandbox = parse_sandbox_option(opts);
+    jq_error_mode error_mode = parse_error_mode_option(opts);
+    int parallel = parse_parallel_option(opts);
+
+    if (jq_cache_capacity > 0) {
+        VALUE program = jq_cache_fetch(filter_str, sandbox);
+        return jq_program_run_many(program, jsons, &output_opts, error_mode,
+                                   parallel);
+    }
+
+    // Worker threads compile their own states from a stable copy of the
+    // filter; only the first is compiled here, reporting compile errors
+    int nstates = jq_batch_width(jsons, parallel);
+    jq_state **states = ALLOCA_N(jq_state *, nstates);
+    MEMZERO(states, jq_state *, nstates);
+    states[0] = jq_compile_filter(filter_cstr, sandbox);
+
+    jq_kernel kernel;
+    struct jq_execute_many_args args = {
+        states, nstates, rb_str_new_frozen(filter_str), Qnil, sandbox,
+        jq_kernel_compile(filter_cstr, RSTRING_LEN(filter_str), &kernel) ? &kernel : NULL,
+        jsons, &output_opts, error_mode
+    };
+
+    // The states are torn down even if execution raises
+    return rb_ensure(jq_execute_many_body, (VALUE)&args,
+                     jq_teardown_many_ensure, (VALUE)&args);
+}
+
+/*
+ * call-seq:
+ *   JQ.filter_object(obj, filter, **options) -> Object or Array
+ *
+ * Apply a jq filter to a Ruby object and return Ruby objects.
+ *
+ * Equivalent to <tt>JSON.parse(JQ.filter(obj.to_json, filter))</tt>, but the
+ * input is converted straight to jq values and the results straight back, with
+ * no JSON text in between.
+ *
+ * === Parameters
+ *
+ * [obj (Object)] Hash (String or Symbol keys), Array, String, Symbol, Integer, Float, true, false or nil, nested
+ * [filter (String)] jq filter expression
+ *
+ * === Options
+ *
+ * [:symbolize_names (Boolean)] Return Hash keys as Symbols (default: false)
+ * [:freeze (Boolean)] Return deeply frozen objects; strings are deduplicated (default: false)
+ * [:multiple_outputs (Boolean)] Return an array of all results instead of the first (default: false)
+ * [:sandbox (Boolean)] Block env/$ENV and include/import (default: true)
+ *
+ * === Returns
+ *
+ * [Object] The first result (nil if there is none), or an Array of all
+ * results with +multiple_outputs: true+. Numbers without a fraction become
+ * Integers; NaN becomes nil.
+ *
+ * === Raises
+ *
+ * [JQ::CompileError] If the jq filter expression is invalid
+ * [JQ::RuntimeError] If the filter execution fails
+ * [TypeError] If obj contains an unsupported object or Hash key
+ * [ArgumentError] If obj is nested more than 10000 levels deep
+ *
+ * === Examples
+ *
+ *   JQ.filter_object({"name" => "Alice", "age" => 30}, '.name')
+ *   # => "Alice"
+ *
+ *   JQ.filter_object({users: [{id: 1}, {id: 2}]}, '.users | map(.id)')
+ *   # => [1, 2]
+ *
+ *   JQ.filter_object([{"a" => 1}], '.[0]', symbolize_names: true)
+ *   # => {a: 1}
+ *
+ */
+VALUE rb_jq_filter_object(int argc, VALUE *argv, VALUE self) {
+    VALUE obj, filter_str, opts;
+    rb_scan_args(argc, argv, "2:", &obj, &filter_str, &opts);
+
+    Check_Type(filter_str, T_STRING);
+
+    const char *filter_cstr = StringValueCStr(filter_str);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    jq_object_options object_opts;
+    parse_object_options(opts, &object_opts);
+    int sandbox = parse_sandbox_option(opts);
+
+    if (jq_cache_capacity > 0) {
+        VALUE program = jq_cache_fetch(filter_str, sandbox);
+        return jq_program_run_object(program, obj, &output_opts, &object_opts);
+    }
+
+    jq_state *jq = jq_compile_filter(filter_cstr, sandbox);
+    jq_kernel kernel;
+    struct jq_execute_args args = {
+        jq, obj, &output_opts, JQ_INPUT_OBJECT, &object_opts, Qnil,
+        jq_kernel_compile(filter_cstr, RSTRING_LEN(filter_str), &kernel) ? &kernel : NULL,
+        NULL
+    };
+
+    // The state is torn down even if conversion or execution raises
+    return rb_ensure(jq_execute_body, (VALUE)&args,
+                     jq_teardown_ensure, (VALUE)&jq);
+}
+
+/*
+ * call-seq:
+ *   JQ.filter_stream(input, filter, **options) { |result| ... } -> nil
+ *   JQ.filter_stream(input, filter, **options) -> Enumerator
+ *
+ * Apply a jq filter to every JSON document in a multi-document input,
+ * yielding each result as it is produced.
+ *
+ * The input may hold any number of JSON values, newline-delimited (NDJSON)
+ * or simply concatenated. It is parsed incrementally, 64 KiB at a time, so
+ * multi-gigabyte inputs can be processed without loading them into memory.
+ *
+ * === Parameters
+ *
+ * [input (String, IO)] JSON documents; an IO (or any object responding to <tt>read(length)</tt>) is read until EOF
+ * [filter (String)] jq filter expression
+ *
+ * === Options
+ *
+ * Accepts the formatting options of JQ.filter (+:raw_output+,
+ * +:compact_output+, +:sort_keys+) and +:sandbox+. Every result of every
+ * document is yielded, so +:multiple_outputs+ does not apply.
+ *
+ * [:stream (Boolean, Integer)] Parse the input as <tt>jq --stream</tt> does. +true+ runs the filter on each <tt>[path, leaf]</tt> event; a depth runs it on each value at that depth, rebuilt from the events like <tt>fromstream(depth | truncate_stream(inputs))</tt>. Default: false
+ *
+ * === Streaming Huge Documents
+ *
+ * Without +:stream+ each document is parsed whole, so one 8 GB array needs
+ * 8 GB of jq values. With <tt>stream: 1</tt> only one element of it is
+ * built at a time (the parser itself holds one path), and the filter sees
+ * each element as its input. Unlike +truncate_stream+, scalar and empty
+ * elements at the depth are passed on too. Values above the depth are
+ * never filtered, and their keys are not available; use <tt>stream:
+ * true</tt> for the raw events, which carry full paths.
+ *
+ * === Raises
+ *
+ * [JQ::CompileError] If the jq filter expression is invalid
+ * [JQ::ParseError] If the input contains invalid JSON (results of earlier documents have already been yielded)
+ * [ArgumentError] If +:stream+ is neither a Boolean nor a depth
+ * [JQ::RuntimeError] If the filter fails on a document
+ * [TypeError] If input is neither a String nor an IO
+ *
+ * === Examples
+ *
+ *   File.open('events.ndjson') do |io|
+ *     JQ.filter_stream(io, 'select(.level == "error") | .message', raw_output: true) do |message|
+ *       puts message
+ *     end
+ *   end
+ *
+ *   JQ.filter_stream("1 2 3", '. * 10').to_a
+ *   # => ["10", "20", "30"]
+ *
+ *   JQ.filter_stream('[{"id":1},{"id":2}]', '.id', stream: 1).to_a
+ *   # => ["1", "2"]
+ *
+ *   JQ.filter_stream('{"a":[1]}', '.', stream: true).to_a
+ *   # => ["[[\"a\",0],1]", "[[\"a\",0]]", "[[\"a\"]]"]
+ *
+ */
+VALUE rb_jq_filter_stream(int argc, VALUE *argv, VALUE self) {
+    RETURN_ENUMERATOR_KW(self, argc, argv, RB_PASS_CALLED_KEYWORDS);
+
+    VALUE input, filter_str, opts;
+    rb_scan_args(argc, argv, "2:", &input, &filter_str, &opts);
+
+    check_stream_input(input);
+    Check_Type(filter_str, T_STRING);
+
+    const char *filter_cstr = StringValueCStr(filter_str);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_stream_option(opts, &output_opts);
+    int sandbox = parse_sandbox_option(opts);
+
+    if (jq_cache_capacity > 0) {
+        VALUE program = jq_cache_fetch(filter_str, sandbox);
+        return jq_program_run_input(program, input, &output_opts,
+                                    JQ_INPUT_STREAM, NULL);
+    }
+
+    jq_state *jq = jq_compile_filter(filter_cstr, sandbox);
+    struct jq_execute_args args = {
+        jq, input, &output_opts, JQ_INPUT_STREAM, NULL, Qnil, NULL, NULL
+    };
+
+    // The state is torn down even if the block breaks or raises
+    return rb_ensure(jq_execute_body, (VALUE)&args,
+                     jq_teardown_ensure, (VALUE)&jq);
+}
+
+/*
+ * call-seq:
+ *   JQ.each(json, filter, **options) { |result| ... } -> nil
+ *   JQ.each(json, filter, **options) -> Enumerator
+ *
+ * Apply a jq filter to JSON input, yielding each result as it is produced.
+ *
+ * Unlike <tt>JQ.filter(json, filter, multiple_outputs: true)</tt>, results
+ * are not collected into an array first: they are pulled from jq a few at a
+ * time, so a filter like <tt>.[]</tt> over a huge array only keeps a small
+ * batch of result strings alive at once. Breaking out of the block stops the
+ * filter.
+ *
+ * === Options
+ *
+ * Accepts the formatting options of JQ.filter (+:raw_output+,
+ * +:compact_output+, +:sort_keys+) and +:sandbox+. Every result is yielded,
+ * so +:multiple_outputs+ does not apply.
+ *
+ * === Raises
+ *
+ * Same as JQ.filter. A RuntimeError is raised after the results produced
+ * before the error have been yielded.
+ *
+ * === Examples
+ *
+ *   JQ.each(huge_json, '.[] | .id') { |id| ids << id }
+ *
+ *   JQ.each('[1,2,3]', '.[]').first(2)
+ *   # => ["1", "2"]
+ *
+ */
+VALUE rb_jq_each(int argc, VALUE *argv, VALUE self) {
+    RETURN_ENUMERATOR_KW(self, argc, argv, RB_PASS_CALLED_KEYWORDS);
+
+    VALUE json_str, filter_str, opts;
+    rb_scan_args(argc, argv, "2:", &json_str, &filter_str, &opts);
+
+    Check_Type(json_str, T_STRING);
+    Check_Type(filter_str, T_STRING);
+
+    const char *filter_cstr = StringValueCStr(filter_str);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    int sandbox = parse_sandbox_option(opts);
+
+    if (jq_cache_capacity > 0) {
+        VALUE program = jq_cache_fetch(filter_str, sandbox);
+        return jq_program_run_input(program, json_str, &output_opts,
+                                    JQ_INPUT_EACH, NULL);
+    }
+
+    jq_state *jq = jq_compile_filter(filter_cstr, sandbox);
+    jq_kernel kernel;
+    struct jq_execute_args args = {
+        jq, json_str, &output_opts, JQ_INPUT_EACH, NULL, Qnil,
+        jq_kernel_compile(filter_cstr, RSTRING_LEN(filter_str), &kernel) ? &kernel : NULL,
+        NULL
+    };
+
+    // The state is torn down even if the block breaks or raises
+    return rb_ensure(jq_execute_body, (VALUE)&args,
+                     jq_teardown_ensure, (VALUE)&jq);
+}
+
+/*
+ * call-seq:
+ *   JQ.filter_into(json, filter, dest, **options) -> dest
+ *
+ * Apply a jq filter to JSON input and write every result to +dest+, each
+ * followed by a newline, like the output of <tt>jq -c</tt>.
+ *
+ * Results are serialized without the GVL straight into a native buffer that
+ * is appended to +dest+ 64 KiB at a time, so no Ruby String is allocated per
+ * result. Use it to stream a large number of results to a response body or
+ * file, or to fill one preallocated String.
+ *
+ * === Parameters
+ *
+ * [json (String)] Valid JSON input string
+ * [filter (String)] jq filter expression
+ * [dest (String, IO)] Unfrozen String to append to, or an IO (or any object responding to <tt>write(string)</tt>)
+ *
+ * === Options
+ *
+ * Accepts the formatting options of JQ.filter (+:raw_output+,
+ * +:compact_output+, +:sort_keys+) and +:sandbox+. Every result is written,
+ * so +:multiple_outputs+ does not apply.
+ *
+ * === Raises
+ *
+ * Same as JQ.filter. Output produced before a RuntimeError has already been
+ * written to +dest+ when it is raised.
+ *
+ * [TypeError] If dest is neither a String nor an IO
+ * [FrozenError] If dest is a frozen String
+ *
+ * === Examples
+ *
+ *   buffer = String.new(capacity: 1 << 20)
+ *   JQ.filter_into('[{"id":1},{"id":2}]', '.[]', buffer)
+ *   # => "{\"id\":1}\n{\"id\":2}\n"
+ *
+ *   File.open('ids.txt', 'w') do |file|
+ *     JQ.filter_into(json, '.users[].id', file, raw_output: true)
+ *   end
+ *
+ */
+VALUE rb_jq_filter_into(int argc, VALUE *argv, VALUE self) {
+    VALUE json_str, filter_str, dest, opts;
+    rb_scan_args(argc, argv, "3:", &json_str, &filter_str, &dest, &opts);
+
+    Check_Type(json_str, T_STRING);
+    Check_Type(filter_str, T_STRING);
+    check_output_destination(dest);
+
+    const char *filter_cstr = StringValueCStr(filter_str);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    int sandbox = parse_sandbox_option(opts);
+
+    if (jq_cache_capacity > 0) {
+        VALUE program = jq_cache_fetch(filter_str, sandbox);
+        return jq_program_run_into(program, json_str, dest, &output_opts);
+    }
+
+    jq_state *jq = jq_compile_filter(filter_cstr, sandbox);
+    jq_kernel kernel;
+    struct jq_execute_args args = {
+        jq, json_str, &output_opts, JQ_INPUT_INTO, NULL, dest,
+        jq_kernel_compile(filter_cstr, RSTRING_LEN(filter_str), &kernel) ? &kernel : NULL,
+        NULL
+    };
+
+    // The state is torn down even if execution or a write raises
+    return rb_ensure(jq_execute_body, (VALUE)&args,
+                     jq_teardown_ensure, (VALUE)&jq);
+}
+
+// Arguments for running a JQ.filter_file call with the file open
+struct jq_filter_file_args {
+    struct jq_filter_args filter;
+    jq_output_options opts;     // filter.opts
+    jq_file file;
+    VALUE report;               // :stats option
+};
+
+static VALUE jq_filter_file_body(VALUE arg) {
+    struct jq_filter_file_args *args = (struct jq_filter_file_args *)arg;
+
+    if (NIL_P(args->report) && NIL_P(jq_instrumenter_current())) {
+        return jq_filter_body((VALUE)&args->filter);
+    }
+    return jq_instrumented(jq_filter_body, (VALUE)&args->filter, &args->opts,
+                           args->report, args->filter.filter_str);
+}
+
+static VALUE jq_filter_file_ensure(VALUE arg) {
+    struct jq_filter_file_args *args = (struct jq_filter_file_args *)arg;
+    jq_file_close(&args->file);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   JQ.filter_file(path, filter, **options) -> String or Array<String>
+ *   JQ.filter_file(path, filter, stream: true | depth, **options) { |result| ... } -> nil
+ *   JQ.filter_file(path, filter, stream: true | depth, **options) -> Enumerator
+ *
+ * Apply a jq filter to the JSON document in a file.
+ *
+ * The file is mapped into memory and parsed in place, without reading it
+ * into a Ruby String first, so a document of several gigabytes costs only
+ * the parsed value (and, for a simple path such as <tt>.meta.count</tt>,
+ * not even that). Results are the same as
+ * <tt>JQ.filter(File.read(path), filter)</tt>.
+ *
+ * === Parameters
+ *
+ * [path (String, Pathname)] Path of a regular file
+ * [filter (String)] jq filter expression
+ *
+ * === Options
+ *
+ * Accepts every option of JQ.filter, plus:
+ *
+ * [:stream (Boolean, Integer)] Parse the file as <tt>jq --stream</tt> does and yield every result: +true+ runs the filter on each <tt>[path, leaf]</tt> event, a depth on each value at that depth (see JQ.filter_stream), so memory use stays bounded however large the document is. Default: false
+ *
+ * With +:stream+, +:multiple_outputs+ does not apply, and the limits apply
+ * to each event or value.
+ *
+ * === Raises
+ *
+ * Same as JQ.filter. Parse errors do not quote the input.
+ *
+ * [SystemCallError] If the file cannot be opened or read
+ * [ArgumentError] If path is not a regular file
+ *
+ * === Examples
+ *
+ *   JQ.filter_file('export.json', '.meta.count')
+ *   # => "1048576"
+ *
+ *   # Every id in a huge array, without building the array
+ *   JQ.filter_file('export.json', 'select(length == 2 and .[0][-1] == "id") | .[1]',
+ *                  stream: true) do |id|
+ *     puts id
+ *   end
+ *
+ *   # Each element of a huge top-level array, built one at a time
+ *   JQ.filter_file('export.json', '.id', stream: 1) { |id| puts id }
+ *
+ */
+VALUE rb_jq_filter_file(int argc, VALUE *argv, VALUE self) {
+    VALUE path, filter_str, opts;
+    rb_scan_args(argc, argv, "2:", &path, &filter_str, &opts);
+
+    int stream = !NIL_P(opts) && RTEST(rb_hash_aref(opts, sym_stream));
+    if (stream) RETURN_ENUMERATOR_KW(self, argc, argv, RB_PASS_CALLED_KEYWORDS);
+
+    Check_Type(filter_str, T_STRING);
+    StringValueCStr(filter_str);  // Rejects filters containing NUL
+
+    struct jq_filter_file_args args;
+    parse_output_options(opts, &args.opts);
+    parse_stream_option(opts, &args.opts);
+    args.filter = (struct jq_filter_args){
+        Qnil, filter_str, &args.opts, parse_sandbox_option(opts), &args.file,
+        stream ? JQ_INPUT_FILE_STREAM : JQ_INPUT_FILE
+    };
+    args.report = parse_stats_option(opts);
+
+    // Options are checked before the file is opened, so they cannot leak it
+    jq_file_open(path, &args.file);
+    return rb_ensure(jq_filter_file_body, (VALUE)&args,
+                     jq_filter_file_ensure, (VALUE)&args);
+}
+
+/*
+ * call-seq:
+ *   JQ.validate_filter!(filter) -> true
+ *
+ * Validate a jq filter expression without executing it.
  *
  * This method compiles the filter to check for syntax errors without requiring
  * any JSON input. Use this to validate user-provided filters before attempting
@@ -310,81 +3646,2234 @@ VALUE rb_jq_filter(int argc, VALUE *argv, VALUE self) {
  *
  * === Parameters
  *
- * [filter (String)] jq filter expression to validate
+ * [filter (String)] jq filter expression to validate
+ *
+ * === Returns
+ *
+ * [true] Always returns true if the filter is valid
+ *
+ * === Raises
+ *
+ * [JQ::CompileError] If the filter expression is invalid
+ * [TypeError] If filter is not a string
+ *
+ * === Examples
+ *
+ *   # Valid filters return true
+ *   JQ.validate_filter!('.name')
+ *   # => true
+ *
+ *   JQ.validate_filter!('.[] | select(.age > 18)')
+ *   # => true
+ *
+ *   # Invalid filters raise CompileError
+ *   JQ.validate_filter!('. @@@ .')
+ *   # raises JQ::CompileError: Syntax error in jq filter
+ *
+ *   # Validate user input before use
+ *   user_filter = params[:filter]
+ *   begin
+ *     JQ.validate_filter!(user_filter)
+ *     result = JQ.filter(json, user_filter)
+ *   rescue JQ::CompileError => e
+ *     puts "Invalid filter: #{e.message}"
+ *   end
+ *
+ * === Thread Safety
+ *
+ * This method is thread-safe with jq 1.7+ (required by this gem).
+ *
+ */
+VALUE rb_jq_validate_filter(VALUE self, VALUE filter) {
+    Check_Type(filter, T_STRING);
+    const char *filter_cstr = StringValueCStr(filter);
+
+    jq_state *jq = jq_compile_filter(filter_cstr, 1);
+
+    jq_state_release(&jq);
+    return Qtrue;
+}
+
+/*
+ * JQ::Program
+ *
+ * A compiled jq filter. The jq_state (bytecode plus all bound builtins) is
+ * created once and reused for every call, so only parsing and execution are
+ * paid per document.
+ */
+
+static void jq_program_free(void *ptr) {
+    jq_program *program = (jq_program *)ptr;
+
+    for (int i = 0; i < program->idle_count; i++) {
+        jq_teardown(&program->idle[i]);
+    }
+    rb_nativethread_lock_destroy(&program->lock);
+    xfree(program->idle);
+    xfree(program);
+}
+
+static void jq_program_mark(void *ptr) {
+    jq_program *program = (jq_program *)ptr;
+    rb_gc_mark(program->filter);
+    rb_gc_mark(program->source);
+    rb_gc_mark(program->arg_names);
+    rb_gc_mark(program->bytecode);
+    rb_gc_mark(program->permits);
+}
+
+static size_t jq_program_memsize(const void *ptr) {
+    const jq_program *program = (const jq_program *)ptr;
+    return sizeof(jq_program) + sizeof(jq_state *) * program->idle_capa;
+}
+
+static const rb_data_type_t jq_program_type = {
+    .wrap_struct_name = "JQ::Program",
+    .function = {
+        .dmark = jq_program_mark,
+        .dfree = jq_program_free,
+        .dsize = jq_program_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+};
+
+static VALUE rb_jq_program_alloc(VALUE klass) {
+    jq_program *program;
+    VALUE obj = TypedData_Make_Struct(klass, jq_program, &jq_program_type,
+                                      program);
+    program->idle = NULL;
+    program->idle_count = 0;
+    program->idle_capa = 0;
+    program->pool_size = 0;
+    program->checked_out = 0;
+    program->permits = Qnil;
+    program->pool_timeout = 0.0;
+    program->filter = Qnil;
+    program->source = Qnil;
+    program->arg_names = Qnil;
+    program->bytecode = Qnil;
+    program->sandbox = 1;
+    program->compile_time = 0.0;
+    program->kernel.kind = JQ_KERNEL_NONE;
+    program->frozen = 0;
+    rb_nativethread_lock_initialize(&program->lock);
+    return obj;
+}
+
+/**
+ * Fetch the compiled program from a JQ::Program, raising if uninitialized
+ */
+static jq_program *get_jq_program(VALUE self) {
+    jq_program *program;
+    TypedData_Get_Struct(self, jq_program, &jq_program_type, program);
+
+    if (NIL_P(program->filter)) {
+        rb_raise(rb_eJQError, "Uninitialized JQ::Program");
+    }
+    return program;
+}
+
+/**
+ * The program's native kernel, or NULL if its filter has none
+ */
+static const jq_kernel *jq_program_kernel(const jq_program *program) {
+    return program->kernel.kind != JQ_KERNEL_NONE ? &program->kernel : NULL;
+}
+
+/**
+ * Reserve one of a bounded program's pool_size slots
+ *
+ * Waits on the permits queue without the GVL, so other threads keep running
+ * (and can check states in) meanwhile; Thread#raise interrupts the wait.
+ *
+ * @param timeout Seconds to wait (0: do not wait)
+ * @return 1 if a slot was reserved, 0 on timeout
+ */
+static int jq_program_reserve(jq_program *program, double timeout) {
+    VALUE kwargs = rb_hash_new();
+    rb_hash_aset(kwargs, sym_timeout, DBL2NUM(timeout));
+    VALUE permit = rb_funcallv_kw(program->permits, id_pop, 1, &kwargs,
+                                  RB_PASS_KEYWORDS);
+    return !NIL_P(permit);
+}
+
+/**
+ * Give back a slot reserved with jq_program_reserve
+ */
+static void jq_program_unreserve(jq_program *program) {
+    rb_nativethread_lock_lock(&program->lock);
+    program->checked_out--;
+    rb_nativethread_lock_unlock(&program->lock);
+    if (!NIL_P(program->permits)) {
+        rb_funcall(program->permits, id_push, 1, Qtrue);
+    }
+}
+
+static VALUE jq_program_compile_body(VALUE arg) {
+    jq_program *program = (jq_program *)arg;
+    if (!NIL_P(program->bytecode)) {
+        return (VALUE)jq_load_bytecode(program->bytecode, program->sandbox);
+    }
+    return (VALUE)jq_compile_filter(RSTRING_PTR(program->source),
+                                    program->sandbox);
+}
+
+/**
+ * Take a jq_state for running this program
+ *
+ * Runs happen without the GVL, so two threads calling the same program must
+ * not share a jq_state. Idle states are reused; otherwise a new one is
+ * compiled. With pool_timeout set, at most pool_size states are in use at
+ * once and a call waits up to pool_timeout seconds for one to be checked
+ * in. Called with the GVL held; the lock only covers the idle list, as a
+ * frozen program is shared by Ractors that each hold their own GVL (and
+ * nothing that can start a GC runs under it).
+ *
+ * Programs made by JQ::Program.load load their bytecode instead of
+ * compiling.
+ *
+ * @raise JQ::PoolTimeoutError if no state became free in time
+ */
+static jq_state *jq_program_checkout(jq_program *program) {
+    if (!NIL_P(program->permits) &&
+        !jq_program_reserve(program, program->pool_timeout)) {
+        rb_raise(rb_eJQPoolTimeoutError,
+                 "Timed out after %g seconds waiting for a free jq_state "
+                 "(pool_size: %d)", program->pool_timeout, program->pool_size);
+    }
+    rb_nativethread_lock_lock(&program->lock);
+    program->checked_out++;
+    jq_state *idle = program->idle_count > 0 ?
+        program->idle[--program->idle_count] : NULL;
+    rb_nativethread_lock_unlock(&program->lock);
+    if (idle) return idle;
+
+    // Give the slot back if compiling fails
+    int state = 0;
+    VALUE jq = rb_protect(jq_program_compile_body, (VALUE)program, &state);
+    if (state) {
+        jq_program_unreserve(program);
+        rb_jump_tag(state);
+    }
+    return (jq_state *)jq;
+}
+
+/**
+ * Return a jq_state obtained from jq_program_checkout, keeping it for reuse
+ * unless the idle list is full (pool_size states, or JQ_PROGRAM_POOL_MAX
+ * once frozen)
+ *
+ * The state is reset here, with the GVL held, so the values its last run
+ * left on the stack (the input, which may be a JQ::Document's value used by
+ * other threads) are dropped now, rather than by the jq_start of the next
+ * run, which happens without the GVL on whichever thread checks it out.
+ *
+ * A frozen program also freezes the state before another Ractor can take
+ * it, so values that share its constants are never counted by two
+ * Ractors. A state it cannot keep is released like any other: recompiling
+ * or tearing it down thaws it, and its constants are freed.
+ */
+static void jq_program_checkin(jq_program *program, jq_state *jq) {
+    jq_start(jq, jv_null(), 0);  // Resets the previous run
+    if (program->frozen) jq_freeze(jq);
+
+    rb_nativethread_lock_lock(&program->lock);
+    if (program->idle_count < program->idle_capa) {
+        program->idle[program->idle_count++] = jq;
+        jq = NULL;
+    }
+    rb_nativethread_lock_unlock(&program->lock);
+
+    if (jq) jq_state_release(&jq);
+    jq_program_unreserve(program);
+}
+
+// Arguments for running a program call under rb_ensure
+struct jq_program_call_args {
+    jq_program *program;
+    struct jq_execute_args run;
+};
+
+static VALUE jq_program_call_body(VALUE arg) {
+    struct jq_program_call_args *args = (struct jq_program_call_args *)arg;
+    return jq_execute_body((VALUE)&args->run);
+}
+
+static VALUE jq_program_checkin_ensure(VALUE arg) {
+    struct jq_program_call_args *args = (struct jq_program_call_args *)arg;
+    jq_program_checkin(args->program, args->run.jq);
+    return Qnil;
+}
+
+/**
+ * Run a JQ::Program with a checked-out state filled into +run+
+ */
+static VALUE jq_program_run_args(VALUE self, struct jq_execute_args run) {
+    jq_program *program = get_jq_program(self);
+    run.kernel = jq_program_kernel(program);
+    run.jq = jq_program_checkout(program);
+    struct jq_program_call_args args = { program, run };
+
+    VALUE result = rb_ensure(jq_program_call_body, (VALUE)&args,
+                             jq_program_checkin_ensure, (VALUE)&args);
+    RB_GC_GUARD(self);
+    return result;
+}
+
+/**
+ * Run a JQ::Program against any kind of input
+ */
+static VALUE jq_program_run_input(VALUE self, VALUE input,
+                                  const jq_output_options *opts,
+                                  jq_input_kind kind,
+                                  const jq_object_options *object_opts) {
+    struct jq_execute_args run = {
+        NULL, input, opts, kind, object_opts, Qnil, NULL, NULL
+    };
+    return jq_program_run_args(self, run);
+}
+
+/**
+ * Run a JQ::Program against JSON input, writing the results to +dest+
+ * (shared by Program#call_into and the cached JQ.filter_into path)
+ */
+static VALUE jq_program_run_into(VALUE self, VALUE json_str, VALUE dest,
+                                 const jq_output_options *opts) {
+    struct jq_execute_args run = {
+        NULL, json_str, opts, JQ_INPUT_INTO, NULL, dest, NULL, NULL
+    };
+    return jq_program_run_args(self, run);
+}
+
+/**
+ * Run a JQ::Program against a file opened with jq_file_open (the cached
+ * JQ.filter_file path)
+ */
+static VALUE jq_program_run_file(VALUE self, const jq_file *file,
+                                 const jq_output_options *opts,
+                                 jq_input_kind kind) {
+    struct jq_execute_args run = {
+        NULL, Qnil, opts, kind, NULL, Qnil, NULL, file
+    };
+    return jq_program_run_args(self, run);
+}
+
+/**
+ * Run a JQ::Program against JSON input or a JQ::Document (shared by
+ * Program#call and the cached JQ.filter path)
+ */
+static VALUE jq_program_run(VALUE self, VALUE json_str,
+                            const jq_output_options *opts) {
+    return jq_program_run_input(self, json_str, opts,
+                                jq_is_document(json_str) ? JQ_INPUT_DOCUMENT :
+                                JQ_INPUT_JSON, NULL);
+}
+
+/**
+ * Run a JQ::Program against a Ruby object (the cached JQ.filter_object
+ * path)
+ */
+static VALUE jq_program_run_object(VALUE self, VALUE obj,
+                                   const jq_output_options *opts,
+                                   const jq_object_options *object_opts) {
+    return jq_program_run_input(self, obj, opts, JQ_INPUT_OBJECT, object_opts);
+}
+
+// Arguments for running a program batch under rb_ensure
+struct jq_program_call_many_args {
+    jq_program *program;
+    struct jq_execute_many_args batch;
+};
+
+static VALUE jq_program_call_many_body(VALUE arg) {
+    struct jq_program_call_many_args *args =
+        (struct jq_program_call_many_args *)arg;
+    return jq_execute_many_body((VALUE)&args->batch);
+}
+
+static VALUE jq_program_checkin_many_ensure(VALUE arg) {
+    struct jq_program_call_many_args *args =
+        (struct jq_program_call_many_args *)arg;
+
+    for (int i = 0; i < args->batch.nstates; i++) {
+        if (args->batch.states[i]) {
+            jq_program_checkin(args->program, args->batch.states[i]);
+        } else {
+            jq_program_unreserve(args->program);  // Never compiled
+        }
+    }
+    return Qnil;
+}
+
+/**
+ * Run a JQ::Program against an array of JSON documents (shared by
+ * Program#call_many and the cached JQ.filter_many path)
+ *
+ * The first state is checked out as usual; extra states for parallel runs
+ * come from the idle list or are compiled by the worker threads (loaded
+ * from the bytecode, for a JQ::Program.load program), and are all checked
+ * in afterwards. A bounded pool (pool_timeout set) only adds the
+ * shards it has free slots for, without waiting.
+ */
+static VALUE jq_program_run_many(VALUE self, VALUE jsons,
+                                 const jq_output_options *opts,
+                                 jq_error_mode error_mode, int parallel) {
+    jq_program *program = get_jq_program(self);
+
+    Check_Type(jsons, T_ARRAY);
+    int nstates = jq_batch_width(jsons, parallel);
+    jq_state **states = ALLOCA_N(jq_state *, nstates);
+
+    states[0] = jq_program_checkout(program);
+    for (int i = 1; i < nstates; i++) {
+        if (!NIL_P(program->permits) && !jq_program_reserve(program, 0.0)) {
+            nstates = i;
+            break;
+        }
+        rb_nativethread_lock_lock(&program->lock);
+        states[i] = program->idle_count > 0 ?
+            program->idle[--program->idle_count] : NULL;
+        program->checked_out++;
+        rb_nativethread_lock_unlock(&program->lock);
+    }
+
+    struct jq_program_call_many_args args = {
+        program,
+        { states, nstates, program->source, program->bytecode,
+          program->sandbox, jq_program_kernel(program), jsons, opts,
+          error_mode }
+    };
+
+    VALUE result = rb_ensure(jq_program_call_many_body, (VALUE)&args,
+                             jq_program_checkin_many_ensure, (VALUE)&args);
+    RB_GC_GUARD(self);
+    return result;
+}
+
+// Variable the args: prologue binds the program's real input to
+#define JQ_ARGS_INPUT_VAR "__jq_input__"
+
+/**
+ * Check that a String is usable as a jq $name variable
+ *
+ * Names starting with two underscores are reserved (for $__loc__ and the
+ * args: prologue).
+ */
+static int jq_arg_name_valid(VALUE name) {
+    const char *ptr = RSTRING_PTR(name);
+    long len = RSTRING_LEN(name);
+
+    if (len == 0 || ISDIGIT(ptr[0])) return 0;
+    if (len >= 2 && ptr[0] == '_' && ptr[1] == '_') return 0;
+    for (long i = 0; i < len; i++) {
+        if (!ISALNUM(ptr[i]) && ptr[i] != '_') return 0;
+    }
+    return 1;
+}
+
+/**
+ * Read the :args option of JQ::Program.new: the $name variables every call
+ * can bind
+ *
+ * @return Frozen Array of frozen names, or Qnil if none are declared
+ * @raise ArgumentError if a name is not a valid jq variable name or repeats
+ */
+static VALUE parse_arg_names_option(VALUE opts) {
+    if (NIL_P(opts)) return Qnil;
+
+    Check_Type(opts, T_HASH);
+    VALUE opt = rb_hash_aref(opts, sym_args);
+    if (NIL_P(opt)) return Qnil;
+
+    Check_Type(opt, T_ARRAY);
+    if (RARRAY_LEN(opt) == 0) return Qnil;
+
+    VALUE names = rb_ary_new_capa(RARRAY_LEN(opt));
+    for (long i = 0; i < RARRAY_LEN(opt); i++) {
+        VALUE name = RARRAY_AREF(opt, i);
+        if (SYMBOL_P(name)) name = rb_sym2str(name);
+        Check_Type(name, T_STRING);
+
+        if (!jq_arg_name_valid(name)) {
+            rb_raise(rb_eArgError, "invalid jq variable name: %+"PRIsVALUE,
+                     name);
+        }
+        if (RTEST(rb_ary_includes(names, name))) {
+            rb_raise(rb_eArgError, "duplicate jq variable name: %+"PRIsVALUE,
+                     name);
+        }
+        rb_ary_push(names, rb_str_new_frozen(name));
+    }
+    return rb_ary_freeze(names);
+}
+
+/**
+ * Length of the module directives (module, import and include) a filter
+ * starts with, up to the ';' ending the last one
+ *
+ * Comments, strings and metadata objects are skipped. Returns 0 if the
+ * filter starts with anything else; an unterminated directive is left
+ * out, for jq to report.
+ */
+static long jq_module_directives_length(const char *p, long len) {
+    static const char *const keywords[] = {"module", "import", "include"};
+    long pos = 0, end = 0;
+
+    for (;;) {
+        while (pos < len && (ISSPACE(p[pos]) || p[pos] == '#')) {
+            if (p[pos] == '#') {
+                while (pos < len && p[pos] != '\n') pos++;
+            } else {
+                pos++;
+            }
+        }
+
+        long word = 0;
+        while (pos + word < len &&
+               (ISALNUM(p[pos + word]) || p[pos + word] == '_')) {
+            word++;
+        }
+        int directive = 0;
+        for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+            directive |= (long)strlen(keywords[i]) == word &&
+                memcmp(p + pos, keywords[i], word) == 0;
+        }
+        if (!directive) return end;
+
+        int depth = 0, in_string = 0;
+        for (pos += word; pos < len; pos++) {
+            char c = p[pos];
+            if (in_string) {
+                if (c == '\\') pos++;
+                else if (c == '"') in_string = 0;
+            } else if (c == '"') {
+                in_string = 1;
+            } else if (c == '#') {
+                while (pos + 1 < len && p[pos + 1] != '\n') pos++;
+            } else if (c == '{' || c == '[' || c == '(') {
+                depth++;
+            } else if (c == '}' || c == ']' || c == ')') {
+                depth--;
+            } else if (c == ';' && depth == 0) {
+                break;
+            }
+        }
+        if (pos >= len) return end;
+        end = ++pos;
+    }
+}
+
+/**
+ * Build the text compiled for a program with args:
+ *
+ * Bindings are passed with each input as <tt>[input, {name: value}]</tt>; a
+ * prologue destructures them into $name variables and runs the filter on
+ * the real input. It goes right after the filter's leading module
+ * directives, which jq only accepts at the top, on the same line, so line
+ * numbers in compile errors still match the filter.
+ *
+ * @param filter Filter source
+ * @param names Declared variable names (from parse_arg_names_option)
+ * @return Frozen source String
+ */
+static VALUE jq_args_source(VALUE filter, VALUE names) {
+    long head = jq_module_directives_length(RSTRING_PTR(filter),
+                                            RSTRING_LEN(filter));
+    VALUE source = rb_str_new(RSTRING_PTR(filter), head);
+
+    rb_str_cat_cstr(source, " . as [$" JQ_ARGS_INPUT_VAR ", {");
+    for (long i = 0; i < RARRAY_LEN(names); i++) {
+        if (i > 0) rb_str_cat_cstr(source, ", ");
+        rb_str_cat_cstr(source, "$");
+        rb_str_concat(source, RARRAY_AREF(names, i));
+    }
+    rb_str_cat_cstr(source, "}] | $" JQ_ARGS_INPUT_VAR " | (");
+    rb_str_cat(source, RSTRING_PTR(filter) + head, RSTRING_LEN(filter) - head);
+    rb_str_cat_cstr(source, "\n)");  // A trailing comment cannot eat the ')'
+    return rb_str_freeze(source);
+}
+
+struct jq_args_bind_arg {
+    VALUE arg_names;
+    VALUE bindings;
+};
+
+static int jq_args_bind_i(VALUE key, VALUE value, VALUE arg) {
+    struct jq_args_bind_arg *bind = (struct jq_args_bind_arg *)arg;
+
+    VALUE name = SYMBOL_P(key) ? rb_sym2str(key) : key;
+    if (!RB_TYPE_P(name, T_STRING) ||
+        !RTEST(rb_ary_includes(bind->arg_names, name))) {
+        rb_raise(rb_eArgError, "unknown jq variable: %+"PRIsVALUE
+                 " (declared: %"PRIsVALUE")", key, bind->arg_names);
+    }
+    rb_hash_aset(bind->bindings, name, value);
+    return ST_CONTINUE;
+}
+
+/**
+ * Read the :args option of a JQ::Program call: the values of its declared
+ * $name variables
+ *
+ * Declared variables that are not given are bound to null.
+ *
+ * @param program Program being called
+ * @param opts Ruby options hash (may be nil)
+ * @param out Options struct to store the bindings in
+ * @raise ArgumentError if a name is not declared by the program
+ */
+static void parse_args_option(const jq_program *program, VALUE opts,
+                              jq_output_options *out) {
+    VALUE given = NIL_P(opts) ? Qnil : rb_hash_aref(opts, sym_args);
+    if (!NIL_P(given)) Check_Type(given, T_HASH);
+
+    if (NIL_P(program->arg_names)) {
+        if (!NIL_P(given) && RHASH_SIZE(given) > 0) {
+            rb_raise(rb_eArgError,
+                     "args: given, but the program declares no variables "
+                     "(compile it with args: [...])");
+        }
+        return;
+    }
+
+    struct jq_args_bind_arg bind = { program->arg_names, rb_hash_new() };
+    if (!NIL_P(given)) rb_hash_foreach(given, jq_args_bind_i, (VALUE)&bind);
+    out->args = bind.bindings;
+}
+
+/**
+ * Give a JQ::Program its state pool, holding its first jq_state
+ *
+ * States left from an earlier initialization are released.
+ */
+static void jq_program_setup(VALUE self, jq_program *program, jq_state *jq,
+                             int pool_size, double pool_timeout) {
+    for (int i = 0; i < program->idle_count; i++) {
+        jq_state_release(&program->idle[i]);
+    }
+    REALLOC_N(program->idle, jq_state *, pool_size);
+    program->idle_capa = pool_size;
+    program->idle[0] = jq;
+    program->idle_count = 1;
+    program->pool_size = pool_size;
+    program->pool_timeout = pool_timeout;
+    program->permits = Qnil;
+    if (pool_timeout >= 0) {
+        // One token per slot; the initial state's slot is free while idle
+        VALUE permits = rb_class_new_instance(0, NULL, rb_cQueue);
+        for (int i = 0; i < pool_size; i++) {
+            rb_funcall(permits, id_push, 1, Qtrue);
+        }
+        RB_OBJ_WRITE(self, &program->permits, permits);
+    }
+}
+
+/*
+ * call-seq:
+ *   JQ::Program.new(filter, sandbox: true, pool_size: 8, pool_timeout: nil, args: []) -> JQ::Program
+ *
+ * Compile a jq filter once for repeated use.
+ *
+ * === Parameters
+ *
+ * [filter (String)] jq filter expression
+ *
+ * === Options
+ *
+ * [:sandbox (Boolean)] Enable sandbox mode to block access to environment variables and file imports. Default: true
+ * [:pool_size (Integer)] Number of compiled jq_states kept for reuse by concurrent calls (1 to 256). Default: 8
+ * [:pool_timeout (Numeric)] Limit concurrent calls to +pool_size+; a call waits up to this many seconds for a free jq_state, then raises JQ::PoolTimeoutError. Default: nil (no limit; extra states are compiled on demand)
+ * [:args (Array<String, Symbol>)] Names of the $variables the filter uses, bound per call with <tt>args: {name => value}</tt>. Default: none
+ *
+ * === Arguments
+ *
+ * A program compiled with +:args+ is compiled once and called with
+ * different values for its variables, like <tt>jq --argjson</tt>, instead
+ * of compiling a new filter for every value interpolated into its text.
+ * Values are Ruby objects, converted like the input of JQ.filter_object;
+ * variables a call does not bind are null.
+ *
+ *   program = JQ.compile('.orders[] | select(.tenant == $tenant)', args: [:tenant])
+ *   program.call(json, args: { tenant: 'acme' }, multiple_outputs: true)
+ *
+ * === State Pool
+ *
+ * Each call runs on its own jq_state, checked out of the program's pool and
+ * checked back in afterwards, so concurrent threads never share one. By
+ * default a call that finds every state busy compiles another, and up to
+ * +pool_size+ idle states are kept. With +pool_timeout+ the pool is bounded:
+ * at most +pool_size+ states exist and callers queue for them, which caps
+ * the memory and CPU one program can use under load.
+ *
+ * === Raises
+ *
+ * [JQ::CompileError] If the jq filter expression is invalid
+ * [TypeError] If filter is not a string
+ * [ArgumentError] If +:pool_size+ or +:pool_timeout+ is out of range, or an +:args+ name is not a valid jq variable name
+ *
+ */
+VALUE rb_jq_program_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE filter_str, opts;
+    rb_scan_args(argc, argv, "1:", &filter_str, &opts);
+
+    Check_Type(filter_str, T_STRING);
+    StringValueCStr(filter_str);  // Rejects NUL bytes
+    int sandbox = parse_sandbox_option(opts);
+    int pool_size = parse_pool_size_option(opts);
+    double pool_timeout = parse_pool_timeout_option(opts);
+    VALUE arg_names = parse_arg_names_option(opts);
+
+    VALUE filter = rb_str_new_frozen(filter_str);
+    VALUE source = NIL_P(arg_names) ? filter : jq_args_source(filter, arg_names);
+
+    jq_program *program;
+    TypedData_Get_Struct(self, jq_program, &jq_program_type, program);
+
+    rb_check_frozen(self);
+    if (program->checked_out > 0) {
+        rb_raise(rb_eJQError, "Cannot reinitialize a JQ::Program while it is running");
+    }
+
+    double started = jq_monotonic_time();
+    jq_state *jq = jq_compile_filter(RSTRING_PTR(source), sandbox);
+    double compile_time = jq_monotonic_time() - started;
+
+    jq_program_setup(self, program, jq, pool_size, pool_timeout);
+    program->filter = filter;
+    program->source = source;
+    program->arg_names = arg_names;
+    program->bytecode = Qnil;
+    program->sandbox = sandbox;
+    program->compile_time = compile_time;
+    jq_kernel_compile(RSTRING_PTR(filter), RSTRING_LEN(filter),
+                      &program->kernel);
+
+    return self;
+}
+
+// Arguments of a measured Program#call
+struct jq_program_call_stats_args {
+    VALUE self;
+    VALUE json_str;
+    const jq_output_options *opts;
+};
+
+static VALUE jq_program_call_stats_body(VALUE arg) {
+    struct jq_program_call_stats_args *args =
+        (struct jq_program_call_stats_args *)arg;
+    return jq_program_run(args->self, args->json_str, args->opts);
+}
+
+/*
+ * call-seq:
+ *   program.call(json, **options) -> String or Array<String>
+ *   program.call(document, document: true, **options) -> JQ::Document or Array<JQ::Document>
+ *
+ * Apply the compiled filter to JSON input or a JQ::Document. Accepts the
+ * same output options as JQ.filter (+:raw_output+, +:compact_output+,
+ * +:sort_keys+, +:multiple_outputs+, +:document+) and its execution budget
+ * (+:timeout+, +:max_steps+, +:max_outputs+, +:max_memory+); the sandbox
+ * setting is fixed at compile time. +:stats+ measures the call like
+ * JQ.filter (+compile_ns+ is 0).
+ *
+ * Every call method also accepts <tt>args: {name => value}</tt> to bind the
+ * variables declared with the +:args+ option of JQ::Program.new.
+ *
+ * === Raises
+ *
+ * [JQ::ParseError] If the JSON input is invalid
+ * [JQ::RuntimeError] If the filter execution fails
+ * [JQ::TimeoutError] If the filter exceeds +:timeout+, +:max_steps+ or +:max_outputs+
+ * [JQ::ResourceError] If the filter exceeds +:max_memory+
+ * [TypeError] If json is not a String or JQ::Document, or an argument value cannot be converted
+ * [ArgumentError] If +:args+ binds a variable the program does not declare
+ *
+ * === Examples
+ *
+ *   program = JQ.compile('.name')
+ *   program.call('{"name":"Alice"}')
+ *   # => "\"Alice\""
+ *
+ *   program.call('{"name":"Bob"}', raw_output: true)
+ *   # => "Bob"
+ *
+ */
+VALUE rb_jq_program_call(int argc, VALUE *argv, VALUE self) {
+    VALUE json_str, opts;
+    rb_scan_args(argc, argv, "1:", &json_str, &opts);
+
+    if (!jq_is_document(json_str)) Check_Type(json_str, T_STRING);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_document_option(opts, &output_opts);
+    parse_args_option(get_jq_program(self), opts, &output_opts);
+
+    VALUE report = parse_stats_option(opts);
+    if (NIL_P(report) && NIL_P(jq_instrumenter_current())) {
+        return jq_program_run(self, json_str, &output_opts);
+    }
+
+    struct jq_program_call_stats_args args = { self, json_str, &output_opts };
+    return jq_instrumented(jq_program_call_stats_body, (VALUE)&args,
+                           &output_opts, report,
+                           get_jq_program(self)->filter);
+}
+
+/*
+ * call-seq:
+ *   program.call_many(jsons, **options) -> Array
+ *
+ * Apply the compiled filter to every JSON document in +jsons+ in a single
+ * native call. Accepts the same options as JQ.filter_many (except
+ * +:sandbox+), including +:parallel+, and returns one result per document,
+ * in order.
+ *
+ * === Examples
+ *
+ *   program = JQ.compile('.id')
+ *   program.call_many(['{"id":1}', '{"id":2}'])
+ *   # => ["1", "2"]
+ *
+ */
+VALUE rb_jq_program_call_many(int argc, VALUE *argv, VALUE self) {
+    VALUE jsons, opts;
+    rb_scan_args(argc, argv, "1:", &jsons, &opts);
+
+    Check_Type(jsons, T_ARRAY);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_args_option(get_jq_program(self), opts, &output_opts);
+    jq_error_mode error_mode = parse_error_mode_option(opts);
+    int parallel = parse_parallel_option(opts);
+
+    return jq_program_run_many(self, jsons, &output_opts, error_mode, parallel);
+}
+
+/*
+ * call-seq:
+ *   program.call_stream(input, **options) { |result| ... } -> nil
+ *   program.call_stream(input, **options) -> Enumerator
+ *
+ * Apply the compiled filter to every JSON document in a String or IO,
+ * yielding each result as it is produced. Accepts the same options as
+ * JQ.filter_stream (except +:sandbox+).
+ *
+ * === Examples
+ *
+ *   program = JQ.compile('.id')
+ *   program.call_stream(io) { |id| ids << id }
+ *
+ *   # One element of a huge top-level array at a time
+ *   program.call_stream(File.open('export.json'), stream: 1) { |id| ids << id }
+ *
+ */
+VALUE rb_jq_program_call_stream(int argc, VALUE *argv, VALUE self) {
+    RETURN_ENUMERATOR_KW(self, argc, argv, RB_PASS_CALLED_KEYWORDS);
+
+    VALUE input, opts;
+    rb_scan_args(argc, argv, "1:", &input, &opts);
+
+    check_stream_input(input);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_stream_option(opts, &output_opts);
+    parse_args_option(get_jq_program(self), opts, &output_opts);
+
+    return jq_program_run_input(self, input, &output_opts, JQ_INPUT_STREAM,
+                                NULL);
+}
+
+/*
+ * call-seq:
+ *   program.each(json, **options) { |result| ... } -> nil
+ *   program.each(json, **options) -> Enumerator
+ *
+ * Apply the compiled filter to JSON input, yielding each result as it is
+ * produced. Accepts the same options as JQ.each (except +:sandbox+).
+ *
+ * === Examples
+ *
+ *   program = JQ.compile('.[] | .name')
+ *   program.each(json) { |name| puts name }
+ *
+ */
+VALUE rb_jq_program_each(int argc, VALUE *argv, VALUE self) {
+    RETURN_ENUMERATOR_KW(self, argc, argv, RB_PASS_CALLED_KEYWORDS);
+
+    VALUE json_str, opts;
+    rb_scan_args(argc, argv, "1:", &json_str, &opts);
+
+    Check_Type(json_str, T_STRING);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_args_option(get_jq_program(self), opts, &output_opts);
+
+    return jq_program_run_input(self, json_str, &output_opts, JQ_INPUT_EACH,
+                                NULL);
+}
+
+/*
+ * call-seq:
+ *   program.call_into(json, dest, **options) -> dest
+ *
+ * Apply the compiled filter to JSON input, writing every result to +dest+
+ * newline-terminated. Accepts the same options as JQ.filter_into (except
+ * +:sandbox+).
+ *
+ * === Examples
+ *
+ *   program = JQ.compile('.items[]')
+ *   program.call_into(json, response.stream)
+ *
+ */
+VALUE rb_jq_program_call_into(int argc, VALUE *argv, VALUE self) {
+    VALUE json_str, dest, opts;
+    rb_scan_args(argc, argv, "2:", &json_str, &dest, &opts);
+
+    Check_Type(json_str, T_STRING);
+    check_output_destination(dest);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_args_option(get_jq_program(self), opts, &output_opts);
+
+    return jq_program_run_into(self, json_str, dest, &output_opts);
+}
+
+/*
+ * call-seq:
+ *   program.filter -> String
+ *
+ * The filter expression this program was compiled from (frozen).
+ */
+VALUE rb_jq_program_filter(VALUE self) {
+    return get_jq_program(self)->filter;
+}
+
+/*
+ * call-seq:
+ *   program.args -> Array<String>
+ *
+ * The $variable names declared with the +:args+ option (frozen).
+ */
+VALUE rb_jq_program_args(VALUE self) {
+    VALUE names = get_jq_program(self)->arg_names;
+    return NIL_P(names) ? rb_ary_freeze(rb_ary_new()) : names;
+}
+
+/*
+ * call-seq:
+ *   program.sandbox? -> true or false
+ *
+ * Whether this program was compiled in sandbox mode.
+ */
+VALUE rb_jq_program_sandbox_p(VALUE self) {
+    return get_jq_program(self)->sandbox ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   program.kernel -> Symbol or nil
+ *
+ * The native kernel chosen for this program's filter when it was compiled,
+ * or nil if every call runs jq's interpreter:
+ *
+ * [:path] A simple path (<tt>.user.id</tt>, <tt>.items[0].sku</tt>), also answered by scanning JSON text
+ * [:select] <tt>select(path == literal)</tt> or <tt>!=</tt>, with a null, boolean, non-negative number or plain string literal
+ * [:map] <tt>map(path)</tt>
+ * [:pluck] <tt>{a, b, ...}</tt>
+ *
+ * A kernel answers a call without starting jq, with the same results.
+ * Inputs it cannot answer exactly as jq would (such as those that make jq
+ * raise) still run through jq; JQ::Stats#kernel tells which happened.
+ *
+ * === Examples
+ *
+ *   JQ.compile('select(.status == "active")').kernel  # => :select
+ *   JQ.compile('map(.id) | add').kernel                # => nil
+ *
+ */
+VALUE rb_jq_program_kernel(VALUE self) {
+    return jq_kernel_symbol(get_jq_program(self)->kernel.kind);
+}
+
+/*
+ * call-seq:
+ *   program.freeze -> program
+ *
+ * Freeze the program and prepare its idle jq_states to be shared
+ * copy-on-write with forked processes. The bytecode of each state is moved
+ * into one allocation, and its constants (the strings, numbers, arrays and
+ * objects in the filter) are made immortal: running the program no longer
+ * writes their reference counts, so the pages holding them stay shared by
+ * every process forked afterwards instead of being copied into each.
+ *
+ * Compile and freeze the programs workers use in the parent process (a
+ * Puma or Unicorn master) before it forks. A frozen program cannot be
+ * reinitialized. States compiled later, when concurrent calls find every
+ * state busy, are frozen when their call finishes and kept, up to 256
+ * (JQ_PROGRAM_POOL_MAX) idle states; the rest are released and, like the
+ * states of a program that is garbage collected, give their constants
+ * back.
+ *
+ * A frozen program is shareable, so Ractor.make_shareable (which calls
+ * this method) or a frozen constant lets every Ractor call it; each
+ * concurrent call still gets its own jq_state. Programs compiled with
+ * +pool_timeout:+ wait on a Thread::Queue and cannot be shared.
+ *
+ * === Examples
+ *
+ *   # Loaded by the master before it forks (Puma's preload_app!)
+ *   ACTIVE_IDS = JQ.compile('.[] | select(.active) | .id').freeze
+ *
+ *   # In a worker
+ *   ACTIVE_IDS.call(json, multiple_outputs: true)
+ *
+ *   # One Ractor per core, sharing the program
+ *   ractors = Etc.nprocessors.times.map do |i|
+ *     Ractor.new(i) { |n| ACTIVE_IDS.call(File.read("part#{n}.json")) }
+ *   end
+ *
+ */
+VALUE rb_jq_program_freeze(VALUE self) {
+    jq_program *program;
+    TypedData_Get_Struct(self, jq_program, &jq_program_type, program);
+
+    if (!OBJ_FROZEN(self)) {
+        for (int i = 0; i < program->idle_count; i++) {
+            jq_freeze(program->idle[i]);  // Reset when checked in
+        }
+        if (program->idle_capa < JQ_PROGRAM_POOL_MAX) {
+            REALLOC_N(program->idle, jq_state *, JQ_PROGRAM_POOL_MAX);
+            program->idle_capa = JQ_PROGRAM_POOL_MAX;
+        }
+        program->frozen = 1;
+    }
+    return rb_call_super(0, NULL);
+}
+
+/*
+ * call-seq:
+ *   program.dump -> String
+ *
+ * Serialize the compiled program: its bytecode, constants and the names of
+ * the jq builtins it calls, with its filter, +:sandbox+ and +:args+
+ * settings. JQ::Program.load turns the dump back into a program without
+ * compiling the filter, so a filter compiled once (say, at deploy time or
+ * in a pre-fork master) can be stored and loaded by every process.
+ *
+ * The dump is JSON text. It can only be loaded by the same jq version
+ * (JQ::Program.load checks), and the builtin functions it calls are found
+ * by name when it is loaded.
+ *
+ * === Security
+ *
+ * A dump is code. JQ::Program.load checks that it is well formed and that
+ * every instruction refers to constants, variables, functions and jump
+ * targets that exist, but not how the instructions use jq's stack, so
+ * only load dumps from a trusted source. For a program that is not sandboxed, the dump also contains the
+ * environment of the process at compile time if the filter uses +$ENV+.
+ *
+ * === Examples
+ *
+ *   File.write('active_ids.jqc', JQ.compile('.[] | select(.active) | .id').dump)
+ *
+ *   program = JQ::Program.load(File.read('active_ids.jqc'))
+ *   program.call(json, multiple_outputs: true)
+ *
+ */
+VALUE rb_jq_program_dump(VALUE self) {
+    jq_program *program = get_jq_program(self);
+
+    jq_state *jq = jq_program_checkout(program);
+    jv bytecode = jq_get_bytecode(jq);
+    jq_program_checkin(program, jq);
+
+    jv args = jv_null();
+    if (!NIL_P(program->arg_names)) {
+        args = jv_array();
+        for (long i = 0; i < RARRAY_LEN(program->arg_names); i++) {
+            VALUE name = RARRAY_AREF(program->arg_names, i);
+            args = jv_array_append(args, jv_string_sized(RSTRING_PTR(name),
+                                                         (int)RSTRING_LEN(name)));
+        }
+    }
+
+    jv dump = jv_object();
+    dump = jv_object_set(dump, jv_string("format"),
+                         jv_number(JQ_PROGRAM_DUMP_FORMAT));
+    dump = jv_object_set(dump, jv_string("jq"), jv_string(JQ_LIBJQ_VERSION));
+    dump = jv_object_set(dump, jv_string("filter"),
+                         jv_string_sized(RSTRING_PTR(program->filter),
+                                         (int)RSTRING_LEN(program->filter)));
+    dump = jv_object_set(dump, jv_string("sandbox"), jv_bool(program->sandbox));
+    dump = jv_object_set(dump, jv_string("args"), args);
+    dump = jv_object_set(dump, jv_string("bytecode"), bytecode);
+
+    jv text = jv_dump_string(dump, 0);
+    VALUE result = rb_utf8_str_new(jv_string_value(text),
+                                   jv_string_length_bytes(jv_copy(text)));
+    jv_free(text);
+    return result;
+}
+
+/*
+ * call-seq:
+ *   JQ::Program.load(dump, pool_size: 8, pool_timeout: nil) -> JQ::Program
+ *
+ * Recreate a program from the output of JQ::Program#dump without compiling
+ * its filter. The loaded program behaves like the one that was dumped: it
+ * has the same filter, sandbox setting and declared +:args+, and further
+ * jq_states for its pool are loaded from the dump as well.
+ *
+ * Only load dumps from a trusted source (see JQ::Program#dump).
+ *
+ * === Options
+ *
+ * [:pool_size (Integer)] As for JQ::Program.new. Default: 8
+ * [:pool_timeout (Numeric)] As for JQ::Program.new. Default: nil
+ *
+ * === Raises
+ *
+ * [JQ::Error] If the dump is malformed, was made by another jq version, or calls a builtin this jq does not have
+ * [TypeError] If dump is not a string
+ * [ArgumentError] If +:pool_size+ or +:pool_timeout+ is out of range
+ *
+ * === Examples
+ *
+ *   dump = JQ.compile('.user.name').dump
+ *   JQ::Program.load(dump).call('{"user":{"name":"Alice"}}')
+ *   # => "\"Alice\""
+ *
+ */
+VALUE rb_jq_program_load(int argc, VALUE *argv, VALUE klass) {
+    VALUE dump, opts;
+    rb_scan_args(argc, argv, "1:", &dump, &opts);
+
+    Check_Type(dump, T_STRING);
+    int pool_size = parse_pool_size_option(opts);
+    double pool_timeout = parse_pool_timeout_option(opts);
+
+    jv fields = jv_parse_sized(RSTRING_PTR(dump), (int)RSTRING_LEN(dump));
+    if (jv_get_kind(fields) != JV_KIND_OBJECT) {
+        jv_free(fields);
+        rb_raise(rb_eJQError, "Invalid JQ::Program dump: not a JSON object");
+    }
+
+    // Copy the fields into Ruby values, so nothing raises while jv values
+    // are held
+    jv format = jv_object_get(jv_copy(fields), jv_string("format"));
+    jv version = jv_object_get(jv_copy(fields), jv_string("jq"));
+    jv filter = jv_object_get(jv_copy(fields), jv_string("filter"));
+    jv sandbox = jv_object_get(jv_copy(fields), jv_string("sandbox"));
+    jv args = jv_object_get(jv_copy(fields), jv_string("args"));
+    jv bytecode = jv_object_get(fields, jv_string("bytecode"));
+
+    int format_ok = jv_get_kind(format) == JV_KIND_NUMBER &&
+        jv_number_value(format) == JQ_PROGRAM_DUMP_FORMAT;
+    VALUE version_str = jv_get_kind(version) == JV_KIND_STRING ?
+        rb_utf8_str_new_cstr(jv_string_value(version)) : Qnil;
+    VALUE filter_str = jv_get_kind(filter) == JV_KIND_STRING ?
+        rb_utf8_str_new(jv_string_value(filter),
+                        jv_string_length_bytes(jv_copy(filter))) : Qnil;
+    int sandbox_kind = jv_get_kind(sandbox);
+
+    int args_ok = jv_get_kind(args) == JV_KIND_NULL;
+    VALUE arg_list = Qnil;
+    if (jv_get_kind(args) == JV_KIND_ARRAY) {
+        args_ok = 1;
+        arg_list = rb_ary_new();
+        int count = jv_array_length(jv_copy(args));
+        for (int i = 0; i < count; i++) {
+            jv name = jv_array_get(jv_copy(args), i);
+            if (jv_get_kind(name) == JV_KIND_STRING) {
+                rb_ary_push(arg_list, rb_utf8_str_new_cstr(jv_string_value(name)));
+            } else {
+                args_ok = 0;
+            }
+            jv_free(name);
+        }
+    }
+
+    VALUE bytecode_text = Qnil;
+    if (jv_get_kind(bytecode) == JV_KIND_OBJECT) {
+        jv text = jv_dump_string(jv_copy(bytecode), 0);
+        bytecode_text = rb_str_new(jv_string_value(text),
+                                   jv_string_length_bytes(jv_copy(text)));
+        jv_free(text);
+    }
+
+    jv_free(format);
+    jv_free(version);
+    jv_free(filter);
+    jv_free(sandbox);
+    jv_free(args);
+    jv_free(bytecode);
+
+    if (!format_ok) {
+        rb_raise(rb_eJQError, "Invalid JQ::Program dump: format is not %d",
+                 JQ_PROGRAM_DUMP_FORMAT);
+    }
+    if (NIL_P(version_str)) version_str = rb_str_new_cstr("(unknown)");
+    if (!RTEST(rb_str_equal(version_str, rb_str_new_cstr(JQ_LIBJQ_VERSION)))) {
+        rb_raise(rb_eJQError,
+                 "JQ::Program dump was made with jq %"PRIsVALUE", not jq "
+                 JQ_LIBJQ_VERSION, version_str);
+    }
+    if (NIL_P(filter_str) || !args_ok || NIL_P(bytecode_text) ||
+        (sandbox_kind != JV_KIND_TRUE && sandbox_kind != JV_KIND_FALSE) ||
+        memchr(RSTRING_PTR(filter_str), '\0', RSTRING_LEN(filter_str))) {
+        rb_raise(rb_eJQError, "Invalid JQ::Program dump: malformed fields");
+    }
+
+    VALUE arg_names = Qnil;
+    if (!NIL_P(arg_list)) {
+        VALUE arg_opts = rb_hash_new();
+        rb_hash_aset(arg_opts, sym_args, arg_list);
+        arg_names = parse_arg_names_option(arg_opts);
+    }
+    VALUE filter_value = rb_obj_freeze(filter_str);
+    VALUE source = NIL_P(arg_names) ? filter_value :
+        jq_args_source(filter_value, arg_names);
+    rb_obj_freeze(bytecode_text);
+
+    VALUE self = rb_obj_alloc(klass);
+    jq_program *program;
+    TypedData_Get_Struct(self, jq_program, &jq_program_type, program);
+
+    double started = jq_monotonic_time();
+    jq_state *jq = jq_load_bytecode(bytecode_text, sandbox_kind == JV_KIND_TRUE);
+    double load_time = jq_monotonic_time() - started;
+
+    jq_program_setup(self, program, jq, pool_size, pool_timeout);
+    program->filter = filter_value;
+    program->source = source;
+    program->arg_names = arg_names;
+    program->bytecode = bytecode_text;
+    program->sandbox = sandbox_kind == JV_KIND_TRUE;
+    program->compile_time = load_time;
+    jq_kernel_compile(RSTRING_PTR(filter_value), RSTRING_LEN(filter_value),
+                      &program->kernel);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *   JQ.compile(filter, sandbox: true) -> JQ::Program
+ *
+ * Compile a jq filter into a reusable JQ::Program. Equivalent to
+ * JQ::Program.new.
+ *
+ * === Examples
+ *
+ *   program = JQ.compile('.[] | select(.active) | .id')
+ *   documents.each { |json| program.call(json, multiple_outputs: true) }
+ *
+ * === Thread Safety
+ *
+ * A program can be shared between threads. Calls run without the GVL and
+ * each concurrent call gets its own jq_state: idle states are reused, and a
+ * new one is compiled only when all of them are busy.
+ *
+ */
+VALUE rb_jq_compile(int argc, VALUE *argv, VALUE self) {
+    return rb_class_new_instance_kw(argc, argv, rb_cJQProgram,
+                                    RB_PASS_CALLED_KEYWORDS);
+}
+
+/*
+ * JQ::ProgramSet
+ *
+ * Named programs run against one document. The input is parsed once and
+ * every program runs on a jv_copy of the value (a reference count
+ * increment), so extracting N fields costs one parse instead of N. Once
+ * frozen with its programs (Ractor.make_shareable), a set is shareable like
+ * a frozen JQ::Program.
+ */
+
+static void jq_program_set_mark(void *ptr) {
+    jq_program_set *set = (jq_program_set *)ptr;
+    rb_gc_mark(set->keys);
+    rb_gc_mark(set->programs);
+}
+
+static size_t jq_program_set_memsize(const void *ptr) {
+    return sizeof(jq_program_set);
+}
+
+static const rb_data_type_t jq_program_set_type = {
+    .wrap_struct_name = "JQ::ProgramSet",
+    .function = {
+        .dmark = jq_program_set_mark,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = jq_program_set_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE,
+};
+
+static VALUE rb_jq_program_set_alloc(VALUE klass) {
+    jq_program_set *set;
+    VALUE obj = TypedData_Make_Struct(klass, jq_program_set,
+                                      &jq_program_set_type, set);
+    set->keys = Qnil;
+    set->programs = Qnil;
+    return obj;
+}
+
+static jq_program_set *get_jq_program_set(VALUE self) {
+    jq_program_set *set;
+    TypedData_Get_Struct(self, jq_program_set, &jq_program_set_type, set);
+
+    if (NIL_P(set->keys)) {
+        rb_raise(rb_eJQError, "Uninitialized JQ::ProgramSet");
+    }
+    return set;
+}
+
+/**
+ * Bindings for the $name variables one program of a set declares, taken
+ * from the args: Hash shared by all of them (String or Symbol keys)
+ *
+ * Names other programs declare are ignored; a declared name that is not
+ * given is bound to null.
+ */
+static VALUE jq_program_set_bindings(const jq_program *program, VALUE given) {
+    if (NIL_P(program->arg_names)) return Qnil;
+
+    VALUE bindings = rb_hash_new();
+    for (long i = 0; i < RARRAY_LEN(program->arg_names); i++) {
+        VALUE name = RARRAY_AREF(program->arg_names, i);
+        VALUE value = Qnil;
+        if (!NIL_P(given)) {
+            value = rb_hash_lookup2(given, name, Qundef);
+            if (value == Qundef) {
+                value = rb_hash_lookup2(given, rb_str_intern(name), Qnil);
+            }
+        }
+        rb_hash_aset(bindings, name, value);
+    }
+    return bindings;
+}
+
+// One program of a ProgramSet call, run under rb_ensure
+struct jq_program_set_run_args {
+    jq_program *program;
+    jq_state *jq;
+    jv input;                       // The shared document (borrowed)
+    jq_output_options opts;         // The call's options with this program's args
+    jq_error_mode error_mode;
+    int hold_gvl;                   // The input is a JQ::Document's value
+    jq_interrupt interrupt;
+    jq_run run;
+};
+
+static VALUE jq_program_set_run_body(VALUE arg) {
+    struct jq_program_set_run_args *args = (struct jq_program_set_run_args *)arg;
+    jq_run *run = &args->run;
+
+    *run = (jq_run){
+        .jq = args->jq,
+        .json_str = NULL,
+        .input = jv_invalid(),
+        .args = jq_args_new(&args->opts),  // Raises before the copy below
+        .opts = &args->opts,
+        .kernel = jq_program_kernel(args->program),
+        .keep_values = args->opts.document,
+        .count_memory = args->opts.document,
+        .interrupt = &args->interrupt,
+        .status = JQ_RUN_OK,
+        .results = jv_invalid(),
+        .error = jv_invalid(),
+    };
+    run->input = jv_copy(args->input);
+
+    if (args->hold_gvl) {
+        jq_run_nogvl(run);  // As jq_execute_document does
+    } else {
+        int state = jq_call_without_gvl(jq_run_nogvl, run, run->interrupt,
+                                        &run->finished, args->opts.async);
+        if (state) {
+            jq_run_free(run);
+            rb_jump_tag(state);
+        }
+    }
+    if (run->status == JQ_RUN_OK) {
+        return args->opts.document ? jq_run_documents(run) : jq_run_value(run);
+    }
+
+    VALUE error = jq_run_exception(run);
+    if (args->error_mode == JQ_ERRORS_RAISE) rb_exc_raise(error);
+    return args->error_mode == JQ_ERRORS_ERROR ? error : Qnil;
+}
+
+static VALUE jq_program_set_run_ensure(VALUE arg) {
+    struct jq_program_set_run_args *args = (struct jq_program_set_run_args *)arg;
+    // Drops the state's reference to the shared input before the next
+    // program runs on it, or another call takes the state
+    jq_program_checkin(args->program, args->jq);
+    return Qnil;
+}
+
+// A ProgramSet call over the parsed document, run under rb_ensure
+struct jq_program_set_call_args {
+    VALUE keys;
+    VALUE programs;
+    jv input;                       // Parsed document, freed by the ensure
+    const jq_output_options *opts;
+    VALUE given;                    // args: Hash, or Qnil
+    jq_error_mode error_mode;
+    int hold_gvl;                   // The input is a JQ::Document's value
+};
+
+static VALUE jq_program_set_call_body(VALUE arg) {
+    struct jq_program_set_call_args *call = (struct jq_program_set_call_args *)arg;
+    VALUE result = rb_hash_new();
+
+    for (long i = 0; i < RARRAY_LEN(call->programs); i++) {
+        VALUE self = RARRAY_AREF(call->programs, i);
+        jq_program *program = get_jq_program(self);
+        struct jq_program_set_run_args args = {
+            .program = program,
+            .input = call->input,
+            .opts = *call->opts,
+            .error_mode = call->error_mode,
+            .hold_gvl = call->hold_gvl,
+            .interrupt = {0},
+        };
+        args.opts.args = jq_program_set_bindings(program, call->given);
+        args.jq = jq_program_checkout(program);
+
+        VALUE value = rb_ensure(jq_program_set_run_body, (VALUE)&args,
+                                jq_program_set_run_ensure, (VALUE)&args);
+        rb_hash_aset(result, RARRAY_AREF(call->keys, i), value);
+        RB_GC_GUARD(self);
+        RB_GC_GUARD(args.opts.args);
+    }
+
+    return result;
+}
+
+static VALUE jq_program_set_call_ensure(VALUE arg) {
+    struct jq_program_set_call_args *call = (struct jq_program_set_call_args *)arg;
+    jv_free(call->input);
+    return Qnil;
+}
+
+/**
+ * Parse JSON input once (or take a JQ::Document's value) and run every
+ * program against it
+ *
+ * @param keys Result keys, one per program
+ * @param programs JQ::Program objects
+ * @param json_str JSON input or JQ::Document
+ * @param opts Ruby options hash (may be nil)
+ * @return Hash of key => result
+ */
+static VALUE jq_program_set_run(VALUE keys, VALUE programs, VALUE json_str,
+                                VALUE opts) {
+    int document = jq_is_document(json_str);
+    if (!document) Check_Type(json_str, T_STRING);
+
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    parse_document_option(opts, &output_opts);
+    jq_error_mode error_mode = parse_error_mode_option(opts);
+    VALUE given = NIL_P(opts) ? Qnil : rb_hash_aref(opts, sym_args);
+    if (!NIL_P(given)) Check_Type(given, T_HASH);
+
+    struct jq_program_set_call_args call = {
+        keys, programs,
+        document ? jq_document_value(json_str) :
+            jq_parse_input(json_str, &output_opts, NULL),
+        &output_opts, given, error_mode, document
+    };
+    VALUE result = rb_ensure(jq_program_set_call_body, (VALUE)&call,
+                             jq_program_set_call_ensure, (VALUE)&call);
+    RB_GC_GUARD(json_str);
+    return result;
+}
+
+// Keys and programs collected by JQ::ProgramSet.new and JQ.filter_multi
+struct jq_program_set_build {
+    VALUE keys;
+    VALUE programs;
+    VALUE compile_opts;     // ProgramSet.new: options for JQ::Program.new
+    int sandbox;            // JQ.filter_multi: sandbox of the cached programs
+    int multi;              // Built by JQ.filter_multi
+};
+
+static int jq_program_set_build_i(VALUE key, VALUE value, VALUE arg) {
+    struct jq_program_set_build *build = (struct jq_program_set_build *)arg;
+
+    if (build->multi) {
+        Check_Type(value, T_STRING);
+        if (jq_cache_capacity > 0) {
+            value = jq_cache_fetch(value, build->sandbox);
+        } else {
+            VALUE args[2] = { value, rb_hash_new() };
+            rb_hash_aset(args[1], sym_sandbox, build->sandbox ? Qtrue : Qfalse);
+            rb_hash_aset(args[1], sym_pool_size, INT2FIX(1));
+            value = rb_class_new_instance_kw(2, args, rb_cJQProgram,
+                                             RB_PASS_KEYWORDS);
+        }
+    } else if (rb_obj_is_kind_of(value, rb_cJQProgram)) {
+        get_jq_program(value);  // Rejects an uninitialized program
+    } else if (RB_TYPE_P(value, T_STRING)) {
+        VALUE args[2] = { value, build->compile_opts };
+        value = rb_class_new_instance_kw(NIL_P(build->compile_opts) ? 1 : 2,
+                                         args, rb_cJQProgram,
+                                         NIL_P(build->compile_opts) ?
+                                         RB_NO_KEYWORDS : RB_PASS_KEYWORDS);
+    } else {
+        rb_raise(rb_eTypeError,
+                 "expected String or JQ::Program for %+"PRIsVALUE" (got %"PRIsVALUE")",
+                 key, rb_obj_class(value));
+    }
+
+    rb_ary_push(build->keys, key);
+    rb_ary_push(build->programs, value);
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *   JQ::ProgramSet.new(filters, **options) -> JQ::ProgramSet
+ *
+ * Compile named filters to run together against one document.
+ *
+ * === Parameters
+ *
+ * [filters (Hash)] Result key => filter String or JQ::Program (pass it in braces, as options follow)
+ *
+ * === Options
+ *
+ * Passed to JQ::Program.new for every String filter (+:sandbox+,
+ * +:pool_size+, +:pool_timeout+, +:args+); programs are used as they are.
+ *
+ * === Examples
+ *
+ *   fields = JQ::ProgramSet.new({ id: '.id', user: '.user.name', tags: '[.tags[]]' })
+ *   fields.call('{"id":1,"user":{"name":"Alice"},"tags":["a"]}')
+ *   # => {id: "1", user: "\"Alice\"", tags: "[\"a\"]"}
+ *
+ */
+VALUE rb_jq_program_set_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE filters, opts;
+    rb_scan_args(argc, argv, "1:", &filters, &opts);
+    Check_Type(filters, T_HASH);
+
+    jq_program_set *set;
+    TypedData_Get_Struct(self, jq_program_set, &jq_program_set_type, set);
+    rb_check_frozen(self);
+
+    struct jq_program_set_build build = {
+        rb_ary_new_capa(RHASH_SIZE(filters)),
+        rb_ary_new_capa(RHASH_SIZE(filters)),
+        opts, 1, 0
+    };
+    rb_hash_foreach(filters, jq_program_set_build_i, (VALUE)&build);
+
+    RB_OBJ_WRITE(self, &set->keys, rb_obj_freeze(build.keys));
+    RB_OBJ_WRITE(self, &set->programs, rb_obj_freeze(build.programs));
+    return self;
+}
+
+/*
+ * call-seq:
+ *   set.call(json, **options) -> Hash
+ *
+ * Parse JSON input once and apply every program to it, returning a Hash of
+ * each key to its program's result (a String, or an Array of Strings with
+ * +multiple_outputs: true+), in the order the filters were given. A
+ * JQ::Document is not parsed at all.
+ *
+ * Accepts the options of JQ::Program#call, including +:document+. <tt>args: {name => value}</tt>
+ * is shared: each program binds the variables it declares. The budget
+ * options apply to each program, and +:max_memory+ does not count the
+ * shared input. +:errors+ chooses what a failing program gives, as with
+ * JQ.filter_many: <tt>:raise</tt> (the default), <tt>:nil</tt> or
+ * <tt>:error</tt>. Invalid input always raises.
+ *
+ * === Raises
+ *
+ * [JQ::ParseError] If the JSON input is invalid
+ * [JQ::RuntimeError] If a program fails (with <tt>errors: :raise</tt>)
+ * [TypeError] If json is not a String or JQ::Document
+ *
+ * === Examples
+ *
+ *   fields = JQ::ProgramSet.new({ 'id' => '.id', 'names' => '.users[].name' })
+ *   fields.call(json, raw_output: true, multiple_outputs: true)
+ *   # => {"id" => ["7"], "names" => ["Alice", "Bob"]}
+ *
+ */
+VALUE rb_jq_program_set_call(int argc, VALUE *argv, VALUE self) {
+    VALUE json_str, opts;
+    rb_scan_args(argc, argv, "1:", &json_str, &opts);
+
+    jq_program_set *set = get_jq_program_set(self);
+    VALUE result = jq_program_set_run(set->keys, set->programs, json_str, opts);
+    RB_GC_GUARD(self);
+    return result;
+}
+
+/*
+ * call-seq:
+ *   set.programs -> Hash
+ *
+ * The compiled programs of the set, by key.
+ */
+VALUE rb_jq_program_set_programs(VALUE self) {
+    jq_program_set *set = get_jq_program_set(self);
+    VALUE programs = rb_hash_new();
+    for (long i = 0; i < RARRAY_LEN(set->keys); i++) {
+        rb_hash_aset(programs, RARRAY_AREF(set->keys, i),
+                     RARRAY_AREF(set->programs, i));
+    }
+    return programs;
+}
+
+/*
+ * call-seq:
+ *   JQ.filter_multi(json, filters, **options) -> Hash
+ *
+ * Apply several named jq filters to one JSON document, parsing it once.
+ *
+ * Equivalent to calling JQ.filter once per filter, but the input is parsed
+ * a single time and each filter runs on a reference-counted copy of the
+ * parsed value. Filters are compiled with the +:sandbox+ option, through
+ * the cache when JQ.cache_capacity is non-zero; a JQ::ProgramSet compiles
+ * them only once.
+ *
+ * === Parameters
+ *
+ * [json (String, JQ::Document)] Valid JSON input string, or an already parsed JQ::Document
+ * [filters (Hash)] Result key => jq filter expression
  *
- * === Returns
+ * === Options
  *
- * [true] Always returns true if the filter is valid
+ * The options of JQ::ProgramSet#call, plus +:sandbox+.
+ *
+ * === Examples
+ *
+ *   JQ.filter_multi('{"id":1,"user":{"name":"Alice"}}', { id: '.id', name: '.user.name' })
+ *   # => {id: "1", name: "\"Alice\""}
+ *
+ */
+VALUE rb_jq_filter_multi(int argc, VALUE *argv, VALUE self) {
+    VALUE json_str, filters, opts;
+    rb_scan_args(argc, argv, "2:", &json_str, &filters, &opts);
+
+    if (!jq_is_document(json_str)) Check_Type(json_str, T_STRING);
+    Check_Type(filters, T_HASH);
+
+    struct jq_program_set_build build = {
+        rb_ary_new_capa(RHASH_SIZE(filters)),
+        rb_ary_new_capa(RHASH_SIZE(filters)),
+        Qnil, parse_sandbox_option(opts), 1
+    };
+    rb_hash_foreach(filters, jq_program_set_build_i, (VALUE)&build);
+
+    return jq_program_set_run(build.keys, build.programs, json_str, opts);
+}
+
+/*
+ * JQ::Document
+ *
+ * A parsed JSON document kept as a jq value, so it can be filtered any
+ * number of times without being parsed again: a run starts from a
+ * reference to the value (see jq_execute_document). jq allocates with
+ * malloc, out of the GC's sight, so the bytes a document holds are
+ * reported to it with rb_gc_adjust_memory_usage and through dsize.
+ *
+ * Documents are not shareable: two Ractors would update the reference
+ * counts of the same jv values, which are not atomic.
+ */
+
+static void jq_document_free(void *ptr) {
+    jq_document *doc = (jq_document *)ptr;
+    jv_free(doc->value);
+    rb_gc_adjust_memory_usage(-(ssize_t)doc->memsize);
+    xfree(doc);
+}
+
+static size_t jq_document_memsize(const void *ptr) {
+    const jq_document *doc = (const jq_document *)ptr;
+    return sizeof(jq_document) + doc->memsize;
+}
+
+static const rb_data_type_t jq_document_type = {
+    .wrap_struct_name = "JQ::Document",
+    .function = {
+        .dmark = NULL,
+        .dfree = jq_document_free,
+        .dsize = jq_document_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE rb_jq_document_alloc(VALUE klass) {
+    jq_document *doc;
+    VALUE obj = TypedData_Make_Struct(klass, jq_document, &jq_document_type,
+                                      doc);
+    doc->value = jv_invalid();
+    doc->memsize = 0;
+    return obj;
+}
+
+/**
+ * Fetch the document of a JQ::Document, raising if uninitialized
+ */
+static jq_document *get_jq_document(VALUE self) {
+    jq_document *doc;
+    TypedData_Get_Struct(self, jq_document, &jq_document_type, doc);
+
+    if (!jv_is_valid(doc->value)) {
+        rb_raise(rb_eJQError, "Uninitialized JQ::Document");
+    }
+    return doc;
+}
+
+/**
+ * Set the value of a JQ::Document, releasing any previous one
+ *
+ * @param doc The document
+ * @param value The value (CONSUMED)
+ * @param memsize Bytes of jv values it holds
+ */
+static void jq_document_set(jq_document *doc, jv value, long long memsize) {
+    jv_free(doc->value);
+    rb_gc_adjust_memory_usage(-(ssize_t)doc->memsize);
+
+    doc->value = value;
+    doc->memsize = memsize > 0 ? (size_t)memsize : 0;
+    rb_gc_adjust_memory_usage((ssize_t)doc->memsize);
+}
+
+/**
+ * Whether +obj+ is a JQ::Document
+ */
+static int jq_is_document(VALUE obj) {
+    return rb_typeddata_is_kind_of(obj, &jq_document_type);
+}
+
+/**
+ * A new reference to the value of a JQ::Document
+ *
+ * @raise JQ::Error if the document is uninitialized
+ */
+static jv jq_document_value(VALUE self) {
+    return jv_copy(get_jq_document(self)->value);
+}
+
+/**
+ * Wrap a jq value in a new JQ::Document
+ *
+ * @param value The value (CONSUMED)
+ * @param memsize Bytes of jv values it holds
+ */
+static VALUE jq_document_wrap(jv value, long long memsize) {
+    VALUE obj = rb_jq_document_alloc(rb_cJQDocument);
+    jq_document *doc;
+    TypedData_Get_Struct(obj, jq_document, &jq_document_type, doc);
+    jq_document_set(doc, value, memsize);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *   JQ::Document.new(json) -> JQ::Document
+ *
+ * Parse JSON text once, to filter it any number of times.
+ *
+ * The text is parsed without the GVL, like the input of JQ.filter. Pass
+ * the document to JQ.filter, JQ::Program#call or JQ::ProgramSet#call in
+ * place of the JSON string; with +document: true+ they return their
+ * results as documents too, so a pipeline of filters never serializes or
+ * parses the values in between.
+ *
+ * The jq values a document holds count toward Ruby's GC heuristics and
+ * ObjectSpace.memsize_of. Calls on a document keep the GVL while the
+ * filter runs (jq's reference counts are not thread-safe), so other
+ * threads wait for them.
  *
  * === Raises
  *
- * [JQ::CompileError] If the filter expression is invalid
- * [TypeError] If filter is not a string
+ * [JQ::ParseError] If the JSON input is invalid
+ * [TypeError] If json is not a string
  *
  * === Examples
  *
- *   # Valid filters return true
- *   JQ.validate_filter!('.name')
- *   # => true
+ *   doc = JQ::Document.new('{"users":[{"name":"Alice","age":30}]}')
+ *   JQ.filter(doc, '.users[0].name')
+ *   # => "\"Alice\""
  *
- *   JQ.validate_filter!('.[] | select(.age > 18)')
- *   # => true
+ *   adults = JQ.filter(doc, '[.users[] | select(.age >= 18)]', document: true)
+ *   JQ.filter(adults, 'length')
+ *   # => "1"
  *
- *   # Invalid filters raise CompileError
- *   JQ.validate_filter!('. @@@ .')
- *   # raises JQ::CompileError: Syntax error in jq filter
+ */
+VALUE rb_jq_document_initialize(VALUE self, VALUE json_str) {
+    Check_Type(json_str, T_STRING);
+
+    jq_document *doc;
+    TypedData_Get_Struct(self, jq_document, &jq_document_type, doc);
+    rb_check_frozen(self);
+
+    jq_output_options opts;
+    parse_output_options(Qnil, &opts);
+    long long memory = 0;
+    jv value = jq_parse_input(json_str, &opts, &memory);
+    jq_document_set(doc, value, memory);  // CONSUMES value
+    return self;
+}
+
+/*
+ * call-seq:
+ *   document.to_json(*args, compact_output: true, sort_keys: false) -> String
  *
- *   # Validate user input before use
- *   user_filter = params[:filter]
- *   begin
- *     JQ.validate_filter!(user_filter)
- *     result = JQ.filter(json, user_filter)
- *   rescue JQ::CompileError => e
- *     puts "Invalid filter: #{e.message}"
- *   end
+ * The document as JSON text. Positional arguments (such as the
+ * JSON::State that JSON.generate passes) are ignored, so documents can be
+ * embedded in structures generated with the json library.
  *
- * === Thread Safety
+ * === Examples
  *
- * This method is thread-safe with jq 1.7+ (required by this gem).
+ *   JQ::Document.new('{"b":1,"a":[2]}').to_json(sort_keys: true)
+ *   # => "{\"a\":[2],\"b\":1}"
  *
  */
-VALUE rb_jq_validate_filter(VALUE self, VALUE filter) {
-    Check_Type(filter, T_STRING);
-    const char *filter_cstr = StringValueCStr(filter);
+VALUE rb_jq_document_to_json(int argc, VALUE *argv, VALUE self) {
+    VALUE opts;
+    rb_scan_args(argc, argv, "*:", NULL, &opts);
 
-    jq_state *jq = jq_init();
-    if (!jq) {
-        rb_raise(rb_eJQError, "Failed to initialize jq");
+    jq_output_options output_opts;
+    parse_output_options(opts, &output_opts);
+    output_opts.raw_output = 0;
+
+    jv json = jv_serialize(jq_document_value(self), &output_opts);  // CONSUMES value
+    if (!jv_is_valid(json)) {
+        jv_free(json);
+        rb_raise(rb_eJQRuntimeError, "Failed to convert result to JSON");
     }
+    return jv_string_to_rb(json);
+}
 
-    jq_set_sandbox(jq);
+/*
+ * call-seq:
+ *   document.to_ruby(symbolize_names: false, freeze: false) -> Object
+ *
+ * The document as Ruby objects, converted as JQ.filter_object converts
+ * its results.
+ *
+ * === Examples
+ *
+ *   JQ::Document.new('{"a":[1,null]}').to_ruby(symbolize_names: true)
+ *   # => {a: [1, nil]}
+ *
+ */
+VALUE rb_jq_document_to_ruby(int argc, VALUE *argv, VALUE self) {
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
 
-    if (!jq_compile(jq, filter_cstr)) {
-        jv error = jq_get_error_message(jq);
+    jq_object_options object_opts;
+    parse_object_options(opts, &object_opts);
+    return jq_jv_to_rb(jq_document_value(self), &object_opts);  // CONSUMES value
+}
 
-        if (jv_is_valid(error) && jv_get_kind(error) == JV_KIND_STRING) {
-            const char *error_msg = jv_string_value(error);
-            VALUE rb_error_msg = rb_str_new_cstr(error_msg);
-            jv_free(error);
-            // Store C string before cleanup (StringValueCStr can raise)
-            const char *error_cstr = StringValueCStr(rb_error_msg);
-            jq_teardown(&jq);
-            rb_raise(rb_eJQCompileError, "%s", error_cstr);
-        }
+/*
+ * Compiled-filter cache
+ *
+ * An opt-in LRU cache of JQ::Program objects used by JQ.filter, keyed by the
+ * filter text and sandbox flag. The Ruby Hash keeps insertion order, so the
+ * least recently used entry is always the first one: a hit is moved to the
+ * end by deleting and re-inserting it. Each Ractor has its own cache (Ruby
+ * objects cannot be shared), and all access happens with its GVL held.
+ */
 
-        jv_free(error);
-        jq_teardown(&jq);
-        rb_raise(rb_eJQCompileError, "Syntax error in jq filter");
+static void jq_filter_cache_mark(void *ptr) {
+    rb_gc_mark(((jq_filter_cache *)ptr)->programs);
+}
+
+static const struct rb_ractor_local_storage_type jq_filter_cache_storage = {
+    jq_filter_cache_mark,
+    ruby_xfree,
+};
+
+/**
+ * The cache of the current Ractor, created on first use
+ */
+static jq_filter_cache *jq_cache_current(void) {
+    jq_filter_cache *cache = rb_ractor_local_storage_ptr(jq_cache_key);
+    if (!cache) {
+        cache = ZALLOC(jq_filter_cache);
+        cache->programs = Qnil;
+        rb_ractor_local_storage_ptr_set(jq_cache_key, cache);
+        cache->programs = rb_hash_new();
     }
+    return cache;
+}
 
-    jq_teardown(&jq);
-    return Qtrue;
+static int jq_cache_first_key_i(VALUE key, VALUE value, VALUE arg) {
+    *(VALUE *)arg = key;
+    return ST_STOP;
+}
+
+/**
+ * Evict least recently used entries until the cache holds at most +limit+
+ */
+static void jq_cache_trim(jq_filter_cache *cache, long limit) {
+    while (RHASH_SIZE(cache->programs) > (size_t)limit) {
+        VALUE key = Qundef;
+        rb_hash_foreach(cache->programs, jq_cache_first_key_i, (VALUE)&key);
+        if (key == Qundef) break;
+
+        rb_hash_delete(cache->programs, key);
+        cache->evictions++;
+    }
+}
+
+/**
+ * Look up (or compile and insert) the cached program for a filter
+ *
+ * @param filter_str Filter source string
+ * @param sandbox Sandbox flag the program must be compiled with
+ * @return JQ::Program
+ */
+static VALUE jq_cache_fetch(VALUE filter_str, int sandbox) {
+    VALUE key = rb_str_buf_new(RSTRING_LEN(filter_str) + 1);
+    rb_str_buf_cat(key, sandbox ? "s" : "u", 1);
+    rb_str_buf_append(key, filter_str);
+    rb_obj_freeze(key);
+
+    jq_filter_cache *cache = jq_cache_current();
+    VALUE program = rb_hash_delete(cache->programs, key);
+
+    if (!NIL_P(program)) {
+        cache->hits++;
+        cache->time_saved += get_jq_program(program)->compile_time;
+    } else {
+        VALUE args[2] = { filter_str, rb_hash_new() };
+        rb_hash_aset(args[1], sym_sandbox,
+                     sandbox ? Qtrue : Qfalse);
+        program = rb_class_new_instance_kw(2, args, rb_cJQProgram,
+                                           RB_PASS_KEYWORDS);
+        cache->misses++;
+        jq_cache_trim(cache, jq_cache_capacity - 1);
+    }
+
+    rb_hash_aset(cache->programs, key, program);
+    return program;
+}
+
+/*
+ * call-seq:
+ *   JQ.cache_capacity -> Integer
+ *
+ * Maximum number of compiled filters kept by the JQ.filter cache. 0 (the
+ * default) disables the cache.
+ */
+VALUE rb_jq_cache_capacity(VALUE self) {
+    return LONG2NUM(jq_cache_capacity);
+}
+
+/*
+ * call-seq:
+ *   JQ.cache_capacity = capacity
+ *
+ * Enable the compiled filter cache for JQ.filter, keeping up to +capacity+
+ * compiled programs (keyed by filter text and sandbox flag). Set to 0 to
+ * disable it. Shrinking the cache evicts the least recently used entries.
+ *
+ * Each Ractor caches the programs it compiles, up to the same capacity; the
+ * capacity can only be set from the main Ractor.
+ *
+ * === Examples
+ *
+ *   JQ.cache_capacity = 256
+ *   JQ.filter(json, '.user.id')   # compiles and caches
+ *   JQ.filter(json, '.user.id')   # reuses the compiled program
+ *
+ */
+VALUE rb_jq_set_cache_capacity(VALUE self, VALUE capacity) {
+    long value = NUM2LONG(capacity);
+    if (value < 0) {
+        rb_raise(rb_eArgError, "cache capacity must not be negative");
+    }
+
+    jq_check_main_ractor("cache_capacity");
+    jq_cache_capacity = value;
+    jq_cache_trim(jq_cache_current(), value);
+    return capacity;
+}
+
+/*
+ * call-seq:
+ *   JQ.cache_stats -> Hash
+ *
+ * Statistics for the JQ.filter compiled filter cache of the current Ractor:
+ *
+ * [:size] Number of cached programs
+ * [:capacity] Configured capacity
+ * [:hits] Lookups served from the cache
+ * [:misses] Lookups that had to compile the filter
+ * [:evictions] Programs dropped to stay within capacity
+ * [:compile_time_saved] Seconds of compilation avoided by cache hits
+ *
+ */
+VALUE rb_jq_cache_stats(VALUE self) {
+    jq_filter_cache *cache = jq_cache_current();
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")),
+                 LONG2NUM((long)RHASH_SIZE(cache->programs)));
+    rb_hash_aset(stats, ID2SYM(rb_intern("capacity")),
+                 LONG2NUM(jq_cache_capacity));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), LONG2NUM(cache->hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), LONG2NUM(cache->misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("evictions")),
+                 LONG2NUM(cache->evictions));
+    rb_hash_aset(stats, ID2SYM(rb_intern("compile_time_saved")),
+                 DBL2NUM(cache->time_saved));
+    return stats;
+}
+
+/*
+ * call-seq:
+ *   JQ.clear_cache -> nil
+ *
+ * Drop every cached program and reset the cache statistics (of the current
+ * Ractor).
+ */
+VALUE rb_jq_clear_cache(VALUE self) {
+    jq_filter_cache *cache = jq_cache_current();
+    rb_hash_clear(cache->programs);
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+    cache->time_saved = 0.0;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *   JQ.state_pool_size -> Integer
+ *
+ * Number of initialized jq_states kept for reuse per sandbox flag (see
+ * JQ.state_pool_size=).
+ */
+VALUE rb_jq_state_pool_size(VALUE self) {
+    return INT2NUM(jq_state_pool_size);
+}
+
+/*
+ * call-seq:
+ *   JQ.state_pool_size = size
+ *
+ * Keep up to +size+ initialized jq_states per sandbox flag (0 to 64,
+ * default 4) for JQ.filter without the cache, JQ.validate_filter! and
+ * JQ::Program compiles.
+ *
+ * A released state is recompiled in place by the next call instead of being
+ * torn down and recreated, which removes the jq_init()/jq_teardown()
+ * allocations from every call. Compilation itself still runs each time; use
+ * JQ.compile or JQ.cache_capacity= to skip it. Set to 0 to disable pooling.
+ *
+ */
+VALUE rb_jq_set_state_pool_size(VALUE self, VALUE size) {
+    int value = NUM2INT(size);
+    if (value < 0 || value > JQ_STATE_POOL_MAX) {
+        rb_raise(rb_eArgError, "state pool size must be between 0 and %d (got %d)",
+                 JQ_STATE_POOL_MAX, value);
+    }
+
+    jq_check_main_ractor("state_pool_size");
+    jq_state_pool_size = value;
+    jq_state_pool_trim(value);
+    return size;
+}
+
+/*
+ * call-seq:
+ *   JQ.parser -> :fast or :jq
+ *
+ * The parser used for JSON text input (see JQ.parser=).
+ */
+VALUE rb_jq_parser(VALUE self) {
+    return jq_fast_parse ? sym_fast : sym_jq;
+}
+
+/*
+ * call-seq:
+ *   JQ.parser = :fast or :jq
+ *
+ * Choose how JSON text input is parsed by every filter method except the
+ * streaming ones (JQ.filter_stream and Program#call_stream), which always
+ * parse incrementally with jq's parser.
+ *
+ * +:fast+ (the default) builds jq values directly, finding the end of each
+ * string 16 bytes at a time with SSE2 or NEON. It produces the same values
+ * as jq, and any input it does not handle (including all invalid JSON) is
+ * parsed again by jq, so values and parse error messages are jq's exactly.
+ * +:jq+ always uses jq's byte-at-a-time parser.
+ *
+ * === Raises
+ *
+ * [ArgumentError] If +parser+ is not :fast or :jq
+ * [NotImplementedError] For :fast, if the extension was built with
+ *   <tt>--disable-fast-parser</tt>
+ *
+ */
+VALUE rb_jq_set_parser(VALUE self, VALUE parser) {
+    jq_check_main_ractor("parser");
+    if (parser == sym_jq) {
+        jq_fast_parse = 0;
+    } else if (parser == sym_fast) {
+#ifdef JQ_FAST_PARSER
+        jq_fast_parse = 1;
+#else
+        rb_raise(rb_eNotImpError,
+                 "jq extension was built with --disable-fast-parser");
+#endif
+    } else {
+        rb_raise(rb_eArgError, "parser must be :fast or :jq (got %+"PRIsVALUE")",
+                 parser);
+    }
+    return parser;
+}
+
+/*
+ * call-seq:
+ *   JQ.async -> true or false
+ *
+ * Whether filter methods called from a fiber under a Fiber.scheduler
+ * offload their work to a worker thread by default (see JQ.async=).
+ */
+VALUE rb_jq_async(VALUE self) {
+    return jq_async ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   JQ.async = true or false
+ *
+ * Set the default of the +async:+ option of every filter method.
+ *
+ * With +async+ enabled and a Fiber.scheduler active (Async, Falcon...),
+ * parsing, execution and serialization run on a worker thread while the
+ * calling fiber waits through the scheduler, so other fibers keep running
+ * instead of the whole reactor blocking on a long filter. Without a
+ * scheduler the option has no effect. Each offloaded call starts a thread,
+ * so it pays off for filters that take longer than a fraction of a
+ * millisecond.
+ *
+ * If the waiting fiber is interrupted (e.g. its task is stopped), the
+ * worker is killed, which stops the run within a few thousand jq
+ * instructions even in the middle of a long result, and the exception
+ * propagates once the worker has exited.
+ */
+VALUE rb_jq_set_async(VALUE self, VALUE async) {
+    jq_check_main_ractor("async");
+    jq_async = RTEST(async) ? 1 : 0;
+    return async;
+}
+
+/*
+ * call-seq:
+ *   JQ.last_stats -> JQ::Stats or nil
+ *
+ * The JQ::Stats of the last JQ.filter or Program#call made with
+ * <tt>stats: true</tt> on the current fiber.
+ */
+VALUE rb_jq_last_stats(VALUE self) {
+    return rb_thread_local_aref(rb_thread_current(), id_last_stats);
+}
+
+/*
+ * call-seq:
+ *   JQ.instrumenter -> object or nil
+ *
+ * The receiver of "filter.jq" events (see JQ.instrumenter=); nil in
+ * Ractors other than the main one, which do not publish events.
+ */
+VALUE rb_jq_instrumenter(VALUE self) {
+    return jq_instrumenter_current();
+}
+
+/*
+ * call-seq:
+ *   JQ.instrumenter = ActiveSupport::Notifications or nil
+ *
+ * Measure every JQ.filter and Program#call and report it with
+ * <tt>instrumenter.instrument("filter.jq", payload)</tt>, the interface of
+ * ActiveSupport::Notifications. The payload is JQ::Stats#to_h plus
+ * +:filter+, and +:exception+ / +:exception_object+ when the call raised.
+ * The event is published after the call, so its own duration is not the
+ * call's: use the +:total_ns+ of the payload.
+ *
+ * Only calls made in the main Ractor are reported, and only the main
+ * Ractor can set the instrumenter.
+ */
+VALUE rb_jq_set_instrumenter(VALUE self, VALUE instrumenter) {
+    if (!NIL_P(instrumenter) && !rb_respond_to(instrumenter, id_instrument)) {
+        rb_raise(rb_eArgError, "instrumenter must respond to #instrument");
+    }
+    jq_check_main_ractor("instrumenter");
+    jq_instrumenter = instrumenter;
+    return instrumenter;
 }
 
 /**
  * Initialize the jq extension
  */
 void Init_jq_ext(void) {
+    // Every method can run in any Ractor: the state they share is either
+    // per Ractor (caches, pools) or guarded (JQ::Program's states)
+    rb_ext_ractor_safe(true);
+
+    // Intern option keys
+    sym_raw_output = ID2SYM(rb_intern("raw_output"));
+    sym_compact_output = ID2SYM(rb_intern("compact_output"));
+    sym_sort_keys = ID2SYM(rb_intern("sort_keys"));
+    sym_multiple_outputs = ID2SYM(rb_intern("multiple_outputs"));
+    sym_sandbox = ID2SYM(rb_intern("sandbox"));
+    sym_errors = ID2SYM(rb_intern("errors"));
+    sym_parallel = ID2SYM(rb_intern("parallel"));
+    sym_symbolize_names = ID2SYM(rb_intern("symbolize_names"));
+    sym_freeze = ID2SYM(rb_intern("freeze"));
+    sym_pool_size = ID2SYM(rb_intern("pool_size"));
+    sym_pool_timeout = ID2SYM(rb_intern("pool_timeout"));
+    sym_timeout = ID2SYM(rb_intern("timeout"));
+    sym_args = ID2SYM(rb_intern("args"));
+    sym_max_steps = ID2SYM(rb_intern("max_steps"));
+    sym_max_outputs = ID2SYM(rb_intern("max_outputs"));
+    sym_max_memory = ID2SYM(rb_intern("max_memory"));
+    sym_fast = ID2SYM(rb_intern("fast"));
+    sym_jq = ID2SYM(rb_intern("jq"));
+    sym_async = ID2SYM(rb_intern("async"));
+    id_join = rb_intern("join");
+    sym_stats = ID2SYM(rb_intern("stats"));
+    sym_stream = ID2SYM(rb_intern("stream"));
+    sym_document = ID2SYM(rb_intern("document"));
+    sym_filter = ID2SYM(rb_intern("filter"));
+    sym_exception = ID2SYM(rb_intern("exception"));
+    sym_exception_object = ID2SYM(rb_intern("exception_object"));
+    id_call = rb_intern("call");
+    id_instrument = rb_intern("instrument");
+    id_to_h = rb_intern("to_h");
+    id_last_stats = rb_intern("__jq_last_stats");
+    id_pop = rb_intern("pop");
+    id_push = rb_intern("push");
+    rb_cQueue = rb_path2class("Thread::Queue");
+    id_read = rb_intern("read");
+    id_write = rb_intern("write");
+    sym_raise = ID2SYM(rb_intern("raise"));
+    sym_nil = ID2SYM(rb_intern("nil"));
+    sym_error = ID2SYM(rb_intern("error"));
+
     // Define module
     rb_mJQ = rb_define_module("JQ");
 
@@ -393,8 +5882,81 @@ void Init_jq_ext(void) {
     rb_eJQCompileError = rb_define_class_under(rb_mJQ, "CompileError", rb_eJQError);
     rb_eJQRuntimeError = rb_define_class_under(rb_mJQ, "RuntimeError", rb_eJQError);
     rb_eJQParseError = rb_define_class_under(rb_mJQ, "ParseError", rb_eJQError);
+    rb_eJQPoolTimeoutError = rb_define_class_under(rb_mJQ, "PoolTimeoutError", rb_eJQError);
+    rb_eJQTimeoutError = rb_define_class_under(rb_mJQ, "TimeoutError", rb_eJQError);
+    rb_eJQResourceError = rb_define_class_under(rb_mJQ, "ResourceError", rb_eJQError);
 
     // Define methods
     rb_define_singleton_method(rb_mJQ, "filter", rb_jq_filter, -1);
+    rb_define_singleton_method(rb_mJQ, "filter_many", rb_jq_filter_many, -1);
+    rb_define_singleton_method(rb_mJQ, "filter_object", rb_jq_filter_object, -1);
+    rb_define_singleton_method(rb_mJQ, "filter_stream", rb_jq_filter_stream, -1);
+    rb_define_singleton_method(rb_mJQ, "each", rb_jq_each, -1);
+    rb_define_singleton_method(rb_mJQ, "filter_into", rb_jq_filter_into, -1);
+    rb_define_singleton_method(rb_mJQ, "filter_file", rb_jq_filter_file, -1);
+    rb_define_singleton_method(rb_mJQ, "filter_multi", rb_jq_filter_multi, -1);
     rb_define_singleton_method(rb_mJQ, "validate_filter!", rb_jq_validate_filter, 1);
+    rb_define_singleton_method(rb_mJQ, "compile", rb_jq_compile, -1);
+    rb_define_singleton_method(rb_mJQ, "cache_capacity", rb_jq_cache_capacity, 0);
+    rb_define_singleton_method(rb_mJQ, "cache_capacity=", rb_jq_set_cache_capacity, 1);
+    rb_define_singleton_method(rb_mJQ, "cache_stats", rb_jq_cache_stats, 0);
+    rb_define_singleton_method(rb_mJQ, "clear_cache", rb_jq_clear_cache, 0);
+    rb_define_singleton_method(rb_mJQ, "state_pool_size", rb_jq_state_pool_size, 0);
+    rb_define_singleton_method(rb_mJQ, "state_pool_size=", rb_jq_set_state_pool_size, 1);
+    rb_define_singleton_method(rb_mJQ, "parser", rb_jq_parser, 0);
+    rb_define_singleton_method(rb_mJQ, "parser=", rb_jq_set_parser, 1);
+    rb_define_singleton_method(rb_mJQ, "async", rb_jq_async, 0);
+    rb_define_singleton_method(rb_mJQ, "async=", rb_jq_set_async, 1);
+    rb_define_singleton_method(rb_mJQ, "last_stats", rb_jq_last_stats, 0);
+    rb_define_singleton_method(rb_mJQ, "instrumenter", rb_jq_instrumenter, 0);
+    rb_define_singleton_method(rb_mJQ, "instrumenter=", rb_jq_set_instrumenter, 1);
+
+    // Per-Ractor state; the extension is loaded by the main Ractor
+    rb_eRactorIsolationError = rb_path2class("Ractor::IsolationError");
+    jq_main_ractor_key = rb_ractor_local_storage_value_newkey();
+    rb_ractor_local_storage_value_set(jq_main_ractor_key, Qtrue);
+    jq_cache_key = rb_ractor_local_storage_ptr_newkey(&jq_filter_cache_storage);
+    jq_state_pool_key = rb_ractor_local_storage_ptr_newkey(&jq_state_pool_storage);
+    rb_gc_register_address(&jq_instrumenter);
+
+    // Measurements of one call (stats:, JQ.instrumenter=)
+    rb_cJQStats = rb_struct_define_under(rb_mJQ, "Stats",
+                                         "compile_ns", "parse_ns",
+                                         "execute_ns", "serialize_ns",
+                                         "total_ns", "input_bytes",
+                                         "output_count", "output_bytes",
+                                         "allocations", "memory_bytes",
+                                         "fast_path", "cached", "kernel",
+                                         NULL);
+
+    // Define JQ::Program
+    rb_cJQProgram = rb_define_class_under(rb_mJQ, "Program", rb_cObject);
+    rb_define_alloc_func(rb_cJQProgram, rb_jq_program_alloc);
+    rb_define_method(rb_cJQProgram, "initialize", rb_jq_program_initialize, -1);
+    rb_define_method(rb_cJQProgram, "call", rb_jq_program_call, -1);
+    rb_define_method(rb_cJQProgram, "call_many", rb_jq_program_call_many, -1);
+    rb_define_method(rb_cJQProgram, "call_stream", rb_jq_program_call_stream, -1);
+    rb_define_method(rb_cJQProgram, "each", rb_jq_program_each, -1);
+    rb_define_method(rb_cJQProgram, "call_into", rb_jq_program_call_into, -1);
+    rb_define_method(rb_cJQProgram, "filter", rb_jq_program_filter, 0);
+    rb_define_method(rb_cJQProgram, "args", rb_jq_program_args, 0);
+    rb_define_method(rb_cJQProgram, "sandbox?", rb_jq_program_sandbox_p, 0);
+    rb_define_method(rb_cJQProgram, "kernel", rb_jq_program_kernel, 0);
+    rb_define_method(rb_cJQProgram, "freeze", rb_jq_program_freeze, 0);
+    rb_define_method(rb_cJQProgram, "dump", rb_jq_program_dump, 0);
+    rb_define_singleton_method(rb_cJQProgram, "load", rb_jq_program_load, -1);
+
+    // Define JQ::ProgramSet
+    rb_cJQProgramSet = rb_define_class_under(rb_mJQ, "ProgramSet", rb_cObject);
+    rb_define_alloc_func(rb_cJQProgramSet, rb_jq_program_set_alloc);
+    rb_define_method(rb_cJQProgramSet, "initialize", rb_jq_program_set_initialize, -1);
+    rb_define_method(rb_cJQProgramSet, "call", rb_jq_program_set_call, -1);
+    rb_define_method(rb_cJQProgramSet, "programs", rb_jq_program_set_programs, 0);
+
+    // Define JQ::Document
+    rb_cJQDocument = rb_define_class_under(rb_mJQ, "Document", rb_cObject);
+    rb_define_alloc_func(rb_cJQDocument, rb_jq_document_alloc);
+    rb_define_method(rb_cJQDocument, "initialize", rb_jq_document_initialize, 1);
+    rb_define_method(rb_cJQDocument, "to_json", rb_jq_document_to_json, -1);
+    rb_define_method(rb_cJQDocument, "to_ruby", rb_jq_document_to_ruby, -1);
 }
@@ -4,6 +4,8 @@
 #define JQ_EXT_H
 
 #include <ruby.h>
+#include <ruby/thread_native.h>
+#include <stdio.h>
 #include <jq.h>
 #include <jv.h>
 
@@ -13,10 +15,424 @@ extern VALUE rb_eJQError;
 extern VALUE rb_eJQCompileError;
 extern VALUE rb_eJQRuntimeError;
 extern VALUE rb_eJQParseError;
+extern VALUE rb_eJQPoolTimeoutError;
+extern VALUE rb_eJQTimeoutError;
+extern VALUE rb_eJQResourceError;
+extern VALUE rb_cJQProgram;
+extern VALUE rb_cJQProgramSet;
+extern VALUE rb_cJQDocument;
+
+// Measurements of one JQ.filter or Program#call (stats:, JQ.instrumenter)
+typedef struct {
+    unsigned long long compile_ns;
+    unsigned long long parse_ns;      // Including the simple path scan
+    unsigned long long execute_ns;    // jq_start and jq_next calls
+    unsigned long long serialize_ns;
+    long input_bytes;
+    long outputs;
+    long long output_bytes;
+    long long allocations;            // jv allocations made by the run
+    long long memory;                 // Bytes the run held in jv values at the end
+    int path;                         // Answered by the simple path scan
+    int cached;                       // Program taken from the JQ.filter cache
+    int kernel;                       // jq_kernel_kind that answered (0: jq did)
+} jq_run_stats;
+
+// Output options shared by JQ.filter and JQ::Program#call
+typedef struct {
+    int raw_output;
+    int compact_output;
+    int sort_keys;
+    int multiple_outputs;
+    VALUE args;         // Hash of $name bindings for a program with args:, or Qnil
+    double timeout;     // Seconds a run may take per input document (0: no limit)
+    long max_steps;     // jq instructions per input document (0: no limit)
+    long max_outputs;   // Results per input document (0: no limit)
+    long long max_memory;  // Bytes of jv allocations per input document (0: no limit)
+    int fast_parse;     // Parse JSON text with jq_parse_fast (JQ.parser)
+    int async;          // Offload to a worker thread under a fiber scheduler
+    int stream;         // Parse stream input as jq --stream events (stream:)
+    int stream_depth;   // With stream, rebuild the values at this depth (-1: none)
+    int document;       // Return results as JQ::Document (document:)
+    jq_run_stats *stats;  // Filled in while the call runs (NULL: not measured)
+} jq_output_options;
+
+// jq instructions between two budget (and interrupt) checks of a run
+#define JQ_BUDGET_CHECK_STEPS 4096
+
+// Longest filter, and most steps, recognized as a simple path
+#define JQ_PATH_MAX_LENGTH 256
+#define JQ_PATH_MAX_STEPS 16
+
+// Deepest nesting jq_path_find scans before leaving a document to jq
+#define JQ_PATH_MAX_DEPTH 256
+
+// A filter made only of field and index steps, like .items[0].sku, answered
+// by scanning the JSON text instead of running jq (jq_path.c)
+typedef struct {
+    int count;                  // Steps; 0 if the filter is not a simple path
+    struct {
+        int name_offset;        // Object key in text, or -1 for an index
+        int name_len;
+        long index;             // Array index when name_offset is -1
+    } steps[JQ_PATH_MAX_STEPS];
+    char text[JQ_PATH_MAX_LENGTH];  // Copy of the filter holding the keys
+} jq_path;
+
+// A filter shape answered by a native kernel on the parsed input instead
+// of jq's interpreter (jq_kernel.c)
+typedef enum {
+    JQ_KERNEL_NONE = 0,         // Run the filter with jq
+    JQ_KERNEL_PATH,             // .a.b[0]: the value at a simple path
+    JQ_KERNEL_SELECT,           // select(.a == "x"): the input if a path equals a literal
+    JQ_KERNEL_MAP,              // map(.a): the value at a path of each element
+    JQ_KERNEL_PLUCK             // {a, b}: an object of some of the input's keys
+} jq_kernel_kind;
+
+// A filter recognized by jq_kernel_compile. Plain data, shared read-only by
+// every run of a program: the literal of a select is rebuilt by each run.
+typedef struct {
+    jq_kernel_kind kind;
+    jq_path path;               // PATH, SELECT, MAP: the path; PLUCK: the keys
+    int negate;                 // SELECT: != rather than ==
+    jv_kind literal_kind;       // SELECT: kind of the literal compared with
+    int literal_len;
+    char literal[JQ_PATH_MAX_LENGTH];  // SELECT: string or number text
+} jq_kernel;
+
+// Outcome of jq_kernel_run
+typedef enum {
+    JQ_KERNEL_FALLBACK = 0,     // jq must run the filter (it would raise, or cannot tell)
+    JQ_KERNEL_RESULT,           // The filter produces one result
+    JQ_KERNEL_EMPTY             // The filter produces no results
+} jq_kernel_status;
+
+// Deepest nesting jq_parse_fast parses before leaving a document to jv_parse
+#define JQ_PARSE_MAX_DEPTH 256
+
+// Outcome of jq_path_find
+typedef enum {
+    JQ_PATH_FALLBACK = 0,       // Cannot tell without jq: run the filter
+    JQ_PATH_FOUND,              // The result is the JSON text found
+    JQ_PATH_NULL                // The result is null (missing key or index)
+} jq_path_status;
+
+// Default number of idle compiled states a JQ::Program keeps for reuse
+#define JQ_PROGRAM_MAX_IDLE 8
+
+// Upper bound for the pool_size: option of JQ::Program
+#define JQ_PROGRAM_POOL_MAX 256
+
+// Version of the JQ::Program#dump format (bump when it changes)
+#define JQ_PROGRAM_DUMP_FORMAT 1
+
+// Set by extconf.rb to the vendored jq release
+#ifndef JQ_LIBJQ_VERSION
+#define JQ_LIBJQ_VERSION "unknown"
+#endif
+
+// Default and upper bound for JQ.state_pool_size
+#define JQ_STATE_POOL_SIZE 4
+#define JQ_STATE_POOL_MAX 64
+
+// Initialized jq_states of one Ractor, per sandbox flag (see
+// JQ.state_pool_size)
+typedef struct {
+    jq_state *states[2][JQ_STATE_POOL_MAX];
+    int count[2];
+} jq_state_pool;
+
+// Compiled filter cache of one Ractor (see JQ.cache_capacity)
+typedef struct {
+    VALUE programs;     // Hash of filter key => JQ::Program, oldest first
+    long hits;
+    long misses;
+    long evictions;
+    double time_saved;  // Seconds of compilation avoided by hits
+} jq_filter_cache;
+
+// Data wrapped by JQ::Program
+typedef struct {
+    jq_state **idle;    // Compiled states ready for reuse
+    int idle_count;
+    int idle_capa;      // Slots in idle: pool_size, or JQ_PROGRAM_POOL_MAX once frozen
+    int pool_size;      // Idle states kept (with a timeout, also states in use)
+    int checked_out;    // States currently used by running calls
+    VALUE permits;      // Thread::Queue of free slots with pool_timeout, else nil
+    double pool_timeout;  // Seconds a call waits for a free slot
+    VALUE filter;       // Frozen copy of the filter source
+    VALUE source;       // Text compiled: filter, wrapped to bind arg_names
+    VALUE arg_names;    // Frozen Array of declared $name arguments, or Qnil
+    VALUE bytecode;     // JSON bytecode states are loaded from, or Qnil to compile
+    int sandbox;
+    double compile_time;  // Seconds spent compiling (or loading) the first state
+    jq_kernel kernel;   // The filter's native kernel (kind JQ_KERNEL_NONE: none)
+    int frozen;         // Frozen (and shareable): every state is frozen and kept
+    rb_nativethread_lock_t lock;  // Guards idle and checked_out across Ractors
+} jq_program;
+
+// Data wrapped by JQ::Document
+typedef struct {
+    jv value;           // Parsed document (invalid until initialized)
+    size_t memsize;     // Bytes of jv values it holds, as reported to the GC
+} jq_document;
+
+// Data wrapped by JQ::ProgramSet
+typedef struct {
+    VALUE keys;         // Frozen Array of result keys, in the order given
+    VALUE programs;     // Frozen Array of JQ::Program, one per key
+} jq_program_set;
+
+// Outcome of a filter run
+typedef enum {
+    JQ_RUN_OK = 0,
+    JQ_RUN_PARSE_ERROR,
+    JQ_RUN_RUNTIME_ERROR,
+    JQ_RUN_DUMP_ERROR,
+    JQ_RUN_TIMEOUT,             // Ran longer than opts->timeout
+    JQ_RUN_STEP_LIMIT,          // Ran more than opts->max_steps instructions
+    JQ_RUN_OUTPUT_LIMIT,        // Produced more than opts->max_outputs results
+    JQ_RUN_MEMORY_LIMIT,        // Held more than opts->max_memory bytes
+    JQ_RUN_INTERRUPTED          // Halted mid-filter by an interrupt (never reported)
+} jq_run_status;
+
+// An interrupt request for a GVL-free call (see jq_call_without_gvl)
+typedef struct {
+    volatile int requested;     // Set by the unblocking function
+    int state;                  // rb_protect state of an exception raised
+                                // while a run handled the request, or 0
+} jq_interrupt;
+
+// Bytes of output JQ.filter_into accumulates before handing them to Ruby
+#define JQ_OUTPUT_FLUSH_SIZE 65536
+
+// Serialized results accumulated without the GVL (JQ.filter_into)
+typedef struct {
+    char *ptr;                  // malloc'd bytes not yet written to Ruby
+    size_t len;
+    size_t capa;
+    FILE *file;                 // Dump stream appending to ptr (NULL: none)
+    int failed;                 // Out of memory
+} jq_output_buffer;
+
+// Deepest nesting jq_dump writes before leaving a value to jv_dump_string,
+// well within jq's own print depth limit
+#define JQ_DUMP_MAX_DEPTH 128
+
+// Scratch bytes first allocated to serialize one result with jq_dump
+#define JQ_DUMP_INITIAL_SIZE 1024
+
+// A single filter run, executed without the GVL
+typedef struct {
+    jq_state *jq;
+    const char *json_str;       // JSON input, or NULL to use input
+    long json_len;              // Length of json_str in bytes
+    int json_mapped;            // json_str is a mapped file (see jq_file_parse)
+    jv input;                   // Input value when json_str is NULL
+    jv args;                    // $name bindings passed with the input (invalid: none)
+    const jq_output_options *opts;
+    int keep_values;            // Collect result values instead of serializing them
+    int max_results;            // Pause once results holds this many (0: no limit)
+    jq_output_buffer *output;   // Write results here instead of collecting them
+    const jq_kernel *kernel;    // The filter's native kernel, or NULL
+    int started;                // Input parsed and jq_start() called
+    int finished;
+    jq_interrupt *interrupt;    // Set by the unblocking function
+    jq_run_status status;
+    jv results;                 // Array of serialized results (or values)
+    jv error;                   // Error message when status != JQ_RUN_OK
+    long outputs;               // Results produced for the current input
+    unsigned long steps;        // Instructions run up to the last budget check
+    unsigned long step_interval;  // Instructions from there to the next check
+    double elapsed;             // Seconds spent in earlier jq_run_nogvl calls
+    double resumed_at;          // When the current jq_run_nogvl call began
+    long long memory;           // Bytes allocated (less freed) by the run so far
+    int count_memory;           // Count memory without max_memory or stats
+} jq_run;
+
+// What kind of input a filter runs against
+typedef enum {
+    JQ_INPUT_JSON = 0,      // One JSON document in a String
+    JQ_INPUT_OBJECT,        // A Ruby object (JQ.filter_object)
+    JQ_INPUT_STREAM,        // Many JSON documents in an IO or String
+    JQ_INPUT_EACH,          // One JSON document, results yielded lazily
+    JQ_INPUT_INTO,          // One JSON document, results written to a String or IO
+    JQ_INPUT_FILE,          // One JSON document in a file (JQ.filter_file)
+    JQ_INPUT_FILE_STREAM,   // A file parsed as jq --stream events, results yielded
+    JQ_INPUT_DOCUMENT       // A parsed JQ::Document
+} jq_input_kind;
+
+// How the batch APIs report a failing document
+typedef enum {
+    JQ_ERRORS_RAISE = 0,    // Raise the first error
+    JQ_ERRORS_NIL,          // Return nil in its place
+    JQ_ERRORS_ERROR         // Return the exception object in its place
+} jq_error_mode;
+
+// Options for converting jq results to Ruby objects (JQ.filter_object)
+typedef struct {
+    int symbolize_names;
+    int freeze;
+} jq_object_options;
+
+// Results produced per GVL-free section by JQ.each
+#define JQ_EACH_BATCH_SIZE 64
+
+// Bytes read from an IO per parser refill by JQ.filter_stream
+#define JQ_STREAM_CHUNK_SIZE 65536
+
+// Deepest stream: depth accepted (jq's parser nests no deeper)
+#define JQ_STREAM_MAX_DEPTH 10000
+
+// Bytes of a mapped file handed to jq's parser at a time
+#define JQ_FILE_CHUNK_SIZE (1 << 20)
+
+// A file read by JQ.filter_file (jq_file.c)
+typedef struct {
+    const char *ptr;            // The file's bytes (not NUL-terminated)
+    long len;
+    void *map;                  // Mapping (or buffer) to release, NULL if empty
+    size_t map_len;
+} jq_file;
+
+// A GVL-free function completed on a worker thread while a fiber waits
+typedef struct {
+    void *(*func)(void *);
+    void *data;
+    jq_interrupt *interrupt;
+    const int *finished;
+} jq_offload;
+
+// A multi-document input being parsed incrementally and filtered
+typedef struct {
+    jq_state *jq;
+    struct jv_parser *parser;
+    jq_output_options opts;     // Copy of the caller's options, all outputs
+    jq_run run;                 // Run for the current (or failed) document
+    int run_active;             // run holds a started, unfinished document
+    int finished;               // Current buffer fully processed
+    int failed;                 // run holds a parse or runtime error
+    jq_interrupt interrupt;     // Set by the unblocking function
+    jv results;                 // Serialized results for the current buffer
+    jv partial;                 // Value being rebuilt from events (stream_depth)
+} jq_stream;
+
+// Upper bound for the parallel: option of the batch APIs
+#define JQ_PARALLEL_MAX 256
+
+// A batch of runs sharing one jq_state, executed without the GVL
+typedef struct {
+    jq_state *jq;               // NULL: compiled from filter before the first run
+    const char *filter;
+    const char *bytecode;       // JSON bytecode to load instead of filter, or NULL
+    long bytecode_len;
+    int sandbox;
+    jq_run *runs;
+    long count;
+    long next;                  // Index of the run in progress
+    int stop_on_error;
+    int finished;
+    int compile_failed;
+} jq_batch;
+
+// A batch split into contiguous shards, each run on its own native thread
+typedef struct {
+    jq_batch *shards;
+    int count;
+    int finished;
+    jq_interrupt interrupt;     // Shared by every run of every shard
+} jq_parallel;
+
+// jv <-> Ruby object conversion (jq_convert.c)
+jv jq_rb_to_jv(VALUE obj);
+VALUE jq_jv_to_rb(jv value, const jq_object_options *opts);
+
+// JSON text to jv without jv_parse (jq_parse.c); jq_parse_fast only when
+// built with the fast parser (see extconf.rb)
+const char *jq_scan_string(const char *p, const char *end);
+#ifdef JQ_FAST_PARSER
+jv jq_parse_fast(const char *json, long len);
+#endif
+
+// Output buffers (jq_ext.c) and compact JSON output (jq_dump.c)
+int jq_output_reserve(jq_output_buffer *out, size_t extra);
+int jq_output_append(jq_output_buffer *out, const char *buf, size_t len);
+int jq_dump(jq_output_buffer *out, jv value, int flags);
+
+// File input (jq_file.c)
+void jq_file_open(VALUE path, jq_file *file);
+void jq_file_close(jq_file *file);
+jv jq_file_parse(const char *json, long len);
+
+// Simple path fast path (jq_path.c)
+int jq_path_compile(const char *filter, long len, jq_path *path);
+jq_path_status jq_path_find(const jq_path *path, const char *json, long len,
+                            const char **start, const char **end);
+
+// Native kernels for common filter shapes (jq_kernel.c)
+int jq_kernel_compile(const char *filter, long len, jq_kernel *kernel);
+jq_kernel_status jq_kernel_run(const jq_kernel *kernel, jv input, jv *result);
+const char *jq_kernel_name(jq_kernel_kind kind);
 
 // Main methods
 VALUE rb_jq_filter(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_filter_many(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_filter_object(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_filter_stream(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_each(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_filter_into(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_filter_file(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_filter_multi(int argc, VALUE *argv, VALUE self);
 VALUE rb_jq_validate_filter(VALUE self, VALUE filter);
+VALUE rb_jq_compile(int argc, VALUE *argv, VALUE self);
+
+// Compiled filter cache
+VALUE rb_jq_cache_capacity(VALUE self);
+VALUE rb_jq_set_cache_capacity(VALUE self, VALUE capacity);
+VALUE rb_jq_cache_stats(VALUE self);
+VALUE rb_jq_clear_cache(VALUE self);
+
+// Pool of initialized jq_states reused across compiles
+VALUE rb_jq_state_pool_size(VALUE self);
+VALUE rb_jq_set_state_pool_size(VALUE self, VALUE size);
+
+// JSON parser used for JSON text
+VALUE rb_jq_parser(VALUE self);
+VALUE rb_jq_set_parser(VALUE self, VALUE parser);
+
+// Offloading runs under a fiber scheduler
+VALUE rb_jq_async(VALUE self);
+VALUE rb_jq_set_async(VALUE self, VALUE async);
+
+// Instrumentation (stats:)
+VALUE rb_jq_last_stats(VALUE self);
+VALUE rb_jq_instrumenter(VALUE self);
+VALUE rb_jq_set_instrumenter(VALUE self, VALUE instrumenter);
+
+// JQ::Program methods
+VALUE rb_jq_program_initialize(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_call(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_call_many(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_call_stream(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_each(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_call_into(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_filter(VALUE self);
+VALUE rb_jq_program_args(VALUE self);
+VALUE rb_jq_program_sandbox_p(VALUE self);
+VALUE rb_jq_program_freeze(VALUE self);
+VALUE rb_jq_program_dump(VALUE self);
+VALUE rb_jq_program_kernel(VALUE self);
+VALUE rb_jq_program_load(int argc, VALUE *argv, VALUE klass);
+
+// JQ::Document methods
+VALUE rb_jq_document_initialize(VALUE self, VALUE json_str);
+VALUE rb_jq_document_to_json(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_document_to_ruby(int argc, VALUE *argv, VALUE self);
+
+// JQ::ProgramSet methods
+VALUE rb_jq_program_set_initialize(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_set_call(int argc, VALUE *argv, VALUE self);
+VALUE rb_jq_program_set_programs(VALUE self);
 
 // Initialization
 void Init_jq_ext(void);
@@ -0,0 +1,161 @@
+/* frozen_string_literal: true */
+
+#include "jq_ext.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+/*
+ * File input for JQ.filter_file
+ *
+ * The file is mapped read-only and jq reads the mapping directly, so a
+ * multi-gigabyte document never becomes a Ruby String (or any other copy)
+ * on its way to the parser; pages are faulted in as the parser reaches
+ * them, without the GVL. Without mmap() the file is read into one malloc'd
+ * buffer instead.
+ *
+ * A mapping is not NUL-terminated and may be larger than jv_parse_sized()
+ * accepts, so whatever jq parses from it goes through its incremental
+ * parser (jq_file_parse), fed JQ_FILE_CHUNK_SIZE bytes at a time.
+ */
+
+/**
+ * Map a file for reading
+ *
+ * Called with the GVL held; the caller must jq_file_close the file.
+ *
+ * @param path File path (String or Pathname)
+ * @param file Filled in with the file's bytes
+ * @raise SystemCallError if the file cannot be opened, read or mapped
+ * @raise ArgumentError if it is not a regular file
+ */
+void jq_file_open(VALUE path, jq_file *file) {
+    FilePathValue(path);
+
+    int fd = rb_cloexec_open(RSTRING_PTR(path), O_RDONLY, 0);
+    if (fd < 0) rb_sys_fail_str(path);
+    rb_update_max_fd(fd);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int e = errno;
+        close(fd);
+        rb_syserr_fail_str(e, path);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        rb_raise(rb_eArgError, "not a regular file: %"PRIsVALUE, path);
+    }
+
+    file->ptr = "";
+    file->len = 0;
+    file->map = NULL;
+    file->map_len = 0;
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+#ifdef HAVE_MMAP
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int e = errno;
+    close(fd);
+    if (map == MAP_FAILED) rb_syserr_fail_str(e, path);
+#ifdef MADV_SEQUENTIAL
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);  // Read ahead, drop behind
+#endif
+#else
+    char *map = malloc((size_t)st.st_size);
+    if (!map) {
+        close(fd);
+        rb_raise(rb_eNoMemError, "failed to allocate %ld bytes for %"PRIsVALUE,
+                 (long)st.st_size, path);
+    }
+    size_t done = 0;
+    while (done < (size_t)st.st_size) {
+        ssize_t n = read(fd, map + done, (size_t)st.st_size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            int e = n < 0 ? errno : EIO;  // EIO: truncated while being read
+            free(map);
+            close(fd);
+            rb_syserr_fail_str(e, path);
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+#endif
+
+    file->ptr = map;
+    file->len = (long)st.st_size;
+    file->map = map;
+    file->map_len = (size_t)st.st_size;
+}
+
+/**
+ * Release a file opened with jq_file_open
+ */
+void jq_file_close(jq_file *file) {
+    if (!file->map) return;
+#ifdef HAVE_MMAP
+    munmap(file->map, file->map_len);
+#else
+    free(file->map);
+#endif
+    file->map = NULL;
+}
+
+/**
+ * Parse one JSON document with jq's incremental parser
+ *
+ * Gives the same values and error messages as jv_parse_sized(), except
+ * that errors do not quote the input. Pure C (no Ruby API), so it is safe
+ * to call without the GVL.
+ *
+ * @param json JSON text, not necessarily NUL-terminated
+ * @param len Length in bytes (any size)
+ * @return Parsed value, or invalid with an error message
+ */
+jv jq_file_parse(const char *json, long len) {
+    struct jv_parser *parser = jv_parser_new(0);
+    jv value = jv_invalid();
+    long offset = 0;
+
+    do {
+        long n = len - offset < JQ_FILE_CHUNK_SIZE ? len - offset :
+            JQ_FILE_CHUNK_SIZE;
+        offset += n;
+        jv_parser_set_buf(parser, json + offset - n, (int)n, offset < len);
+
+        for (;;) {
+            jv next = jv_parser_next(parser);
+            if (!jv_is_valid(next)) {
+                if (jv_invalid_has_msg(jv_copy(next))) {
+                    jv_free(value);
+                    jv_parser_free(parser);
+                    return next;
+                }
+                jv_free(next);  // Buffer exhausted
+                break;
+            }
+            if (jv_is_valid(value)) {
+                jv_free(next);
+                jv_free(value);
+                jv_parser_free(parser);
+                return jv_invalid_with_msg(jv_string("Unexpected extra JSON values"));
+            }
+            value = next;
+        }
+    } while (offset < len);
+
+    jv_parser_free(parser);
+    if (!jv_is_valid(value)) {
+        return jv_invalid_with_msg(jv_string("Expected JSON value"));
+    }
+    return value;
+}
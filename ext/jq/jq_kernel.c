@@ -0,0 +1,406 @@
+/* frozen_string_literal: true */
+
+#include "jq_ext.h"
+#include <string.h>
+
+/*
+ * Native kernels for common filter shapes
+ *
+ * Most filters in practice are one of a handful of shapes: a path
+ * (.user.id), a select on a path compared with a literal
+ * (select(.status == "active")), a map of a path (map(.id)) or an object
+ * of some of the input's keys ({id, name}). jq_kernel_compile recognizes
+ * these in the filter text when a program is compiled, and jq_kernel_run
+ * then answers a run on the parsed input with a few jv calls instead of
+ * starting jq's interpreter.
+ *
+ * A kernel only answers what it is sure jq would answer the same way:
+ * whenever jq would raise (indexing a number, iterating null, ...) it
+ * falls back and the filter runs with jq, which produces the error. Like
+ * jq_path_compile, the recognizer only accepts text that jq compiles to
+ * these builtins, and relies on the filter having compiled.
+ */
+
+static int jq_kernel_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static int jq_kernel_ident_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static int jq_kernel_ident_char(char c) {
+    return jq_kernel_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+/**
+ * Trim whitespace from both ends of [*p, *end)
+ */
+static void jq_kernel_trim(const char **p, const char **end) {
+    while (*p < *end && jq_kernel_ws(**p)) (*p)++;
+    while (*end > *p && jq_kernel_ws((*end)[-1])) (*end)--;
+}
+
+/**
+ * Match name(...) spanning the whole of [p, end)
+ *
+ * The parentheses are not balanced here: the argument is handed to a
+ * recognizer that rejects any stray parenthesis.
+ *
+ * @return 1 with the argument span in *arg and *arg_end, else 0
+ */
+static int jq_kernel_call(const char *p, const char *end, const char *name,
+                          const char **arg, const char **arg_end) {
+    size_t n = strlen(name);
+    if ((size_t)(end - p) < n + 2 || memcmp(p, name, n) != 0) return 0;
+    p += n;
+    while (p < end && jq_kernel_ws(*p)) p++;
+    if (p >= end || *p != '(' || end[-1] != ')') return 0;
+
+    *arg = p + 1;
+    *arg_end = end - 1;
+    jq_kernel_trim(arg, arg_end);
+    return 1;
+}
+
+/**
+ * Recognize a path, or "." for the input itself (only if allowed)
+ */
+static int jq_kernel_compile_path(const char *p, const char *end,
+                                  jq_path *path, int identity) {
+    if (identity && end - p == 1 && *p == '.') {
+        path->count = 0;
+        return 1;
+    }
+    return jq_path_compile(p, end - p, path);
+}
+
+/**
+ * Recognize the literal of a select: null, true, false, a non-negative
+ * number without exponent, or a string of printable ASCII without escapes
+ *
+ * Negative numbers are left to jq: they are a negation, not a literal.
+ */
+static int jq_kernel_compile_literal(const char *p, const char *end,
+                                     jq_kernel *kernel) {
+    long len = end - p;
+    if (len <= 0 || len >= JQ_PATH_MAX_LENGTH) return 0;
+
+    if (len == 4 && memcmp(p, "null", 4) == 0) {
+        kernel->literal_kind = JV_KIND_NULL;
+    } else if (len == 4 && memcmp(p, "true", 4) == 0) {
+        kernel->literal_kind = JV_KIND_TRUE;
+    } else if (len == 5 && memcmp(p, "false", 5) == 0) {
+        kernel->literal_kind = JV_KIND_FALSE;
+    } else if (*p == '"') {
+        if (len < 2 || end[-1] != '"') return 0;
+        for (const char *q = p + 1; q < end - 1; q++) {
+            if (*q == '"' || *q == '\\' || *q < 0x20 || *q > 0x7e) return 0;
+        }
+        kernel->literal_kind = JV_KIND_STRING;
+        p++;
+        len -= 2;
+    } else {
+        const char *q = p;
+        while (q < end && *q >= '0' && *q <= '9') q++;
+        if (q == p) return 0;
+        if (q < end && *q == '.') {
+            const char *digits = ++q;
+            while (q < end && *q >= '0' && *q <= '9') q++;
+            if (q == digits) return 0;
+        }
+        if (q != end) return 0;
+        kernel->literal_kind = JV_KIND_NUMBER;
+    }
+
+    memcpy(kernel->literal, p, len);
+    kernel->literal[len] = '\0';
+    kernel->literal_len = (int)len;
+    return 1;
+}
+
+/**
+ * Recognize the argument of select(PATH == LITERAL) or select(PATH != LITERAL)
+ */
+static int jq_kernel_compile_select(const char *p, const char *end,
+                                    jq_kernel *kernel) {
+    // The operator is the first == or != outside a quoted key
+    const char *op = NULL;
+    int quoted = 0;
+    for (const char *q = p; q + 1 < end; q++) {
+        if (*q == '"') quoted = !quoted;
+        if (!quoted && (q[0] == '=' || q[0] == '!') && q[1] == '=') {
+            op = q;
+            break;
+        }
+    }
+    if (!op) return 0;
+
+    const char *path_end = op;
+    const char *literal = op + 2;
+    const char *literal_end = end;
+    jq_kernel_trim(&p, &path_end);
+    jq_kernel_trim(&literal, &literal_end);
+
+    if (!jq_kernel_compile_path(p, path_end, &kernel->path, 1) ||
+        !jq_kernel_compile_literal(literal, literal_end, kernel)) {
+        return 0;
+    }
+    kernel->negate = *op == '!';
+    kernel->kind = JQ_KERNEL_SELECT;
+    return 1;
+}
+
+/**
+ * Recognize {a, b, ...}: keys as plain identifiers, stored as name steps
+ */
+static int jq_kernel_compile_pluck(const char *p, const char *end,
+                                   jq_kernel *kernel) {
+    if (end - p >= JQ_PATH_MAX_LENGTH || end - p < 3 || *p != '{' ||
+        end[-1] != '}') {
+        return 0;
+    }
+
+    jq_path *path = &kernel->path;
+    memcpy(path->text, p, end - p);
+    const char *q = path->text + 1;
+    const char *close = path->text + (end - p) - 1;
+    int count = 0;
+
+    for (;;) {
+        while (q < close && jq_kernel_ws(*q)) q++;
+        if (q >= close || !jq_kernel_ident_start(*q)) return 0;
+        if (count == JQ_PATH_MAX_STEPS) return 0;
+
+        const char *name = q;
+        while (q < close && jq_kernel_ident_char(*q)) q++;
+        path->steps[count].name_offset = (int)(name - path->text);
+        path->steps[count].name_len = (int)(q - name);
+        path->steps[count].index = 0;
+        count++;
+
+        while (q < close && jq_kernel_ws(*q)) q++;
+        if (q == close) break;
+        if (*q != ',') return 0;
+        q++;
+    }
+
+    path->count = count;
+    kernel->kind = JQ_KERNEL_PLUCK;
+    return 1;
+}
+
+/**
+ * Recognize a filter that a native kernel can answer
+ *
+ * @param filter Filter source (already compiled by jq)
+ * @param len Length of filter in bytes
+ * @param kernel Filled in; kernel->kind is JQ_KERNEL_NONE unless this
+ *   returns 1
+ * @return 1 if the filter has a kernel, else 0
+ */
+int jq_kernel_compile(const char *filter, long len, jq_kernel *kernel) {
+    const char *p = filter;
+    const char *end = filter + len;
+    const char *arg, *arg_end;
+
+    kernel->kind = JQ_KERNEL_NONE;
+    kernel->path.count = 0;
+    kernel->negate = 0;
+    kernel->literal_kind = JV_KIND_INVALID;
+    kernel->literal_len = 0;
+    jq_kernel_trim(&p, &end);
+
+    if (jq_path_compile(p, end - p, &kernel->path)) {
+        kernel->kind = JQ_KERNEL_PATH;
+    } else if (jq_kernel_call(p, end, "select", &arg, &arg_end)) {
+        jq_kernel_compile_select(arg, arg_end, kernel);
+    } else if (jq_kernel_call(p, end, "map", &arg, &arg_end)) {
+        if (jq_path_compile(arg, arg_end - arg, &kernel->path)) {
+            kernel->kind = JQ_KERNEL_MAP;
+        }
+    } else if (p < end && *p == '{') {
+        jq_kernel_compile_pluck(p, end, kernel);
+    }
+
+    if (kernel->kind == JQ_KERNEL_NONE) kernel->path.count = 0;
+    return kernel->kind != JQ_KERNEL_NONE;
+}
+
+/**
+ * The value of a key of an object, or null if it is missing
+ *
+ * @param object Object or null (CONSUMED)
+ */
+static jv jq_kernel_key(const jq_path *path, int step, jv object) {
+    if (jv_get_kind(object) == JV_KIND_NULL) return object;
+
+    jv key = jv_string_sized(path->text + path->steps[step].name_offset,
+                             path->steps[step].name_len);
+    jv value = jv_object_get(object, key);  // CONSUMES object, key
+    return jv_is_valid(value) ? value : jv_null();
+}
+
+/**
+ * The value at a path, as jq's path steps produce it
+ *
+ * Keys of null, and keys or indexes that are missing, are null.
+ *
+ * @param path Path (0 steps: the value itself)
+ * @param value Value (CONSUMED)
+ * @param result Set to the value at the path
+ * @return 1, or 0 if jq would raise (indexing the wrong type)
+ */
+static int jq_kernel_get(const jq_path *path, jv value, jv *result) {
+    for (int i = 0; i < path->count; i++) {
+        jv_kind kind = jv_get_kind(value);
+        if (kind == JV_KIND_NULL) continue;
+
+        if (path->steps[i].name_offset >= 0) {
+            if (kind != JV_KIND_OBJECT) {
+                jv_free(value);
+                return 0;
+            }
+            value = jq_kernel_key(path, i, value);  // CONSUMES value
+        } else {
+            if (kind != JV_KIND_ARRAY) {
+                jv_free(value);
+                return 0;
+            }
+            jv element = jv_array_get(value, (int)path->steps[i].index);  // CONSUMES value
+            value = jv_is_valid(element) ? element : jv_null();
+        }
+    }
+
+    *result = value;
+    return 1;
+}
+
+/**
+ * A new jv of the literal of a select kernel, built the way jq's lexer
+ * builds it, so == compares exactly as jq does (literal numbers included)
+ */
+static jv jq_kernel_literal(const jq_kernel *kernel) {
+    switch (kernel->literal_kind) {
+    case JV_KIND_NULL:
+        return jv_null();
+    case JV_KIND_TRUE:
+        return jv_true();
+    case JV_KIND_FALSE:
+        return jv_false();
+    case JV_KIND_STRING:
+        return jv_string_sized(kernel->literal, kernel->literal_len);
+    default:
+        return jv_parse_sized(kernel->literal, kernel->literal_len);
+    }
+}
+
+/**
+ * map(PATH): the value at the path of each element of an array or each
+ * value of an object, in jq's iteration order
+ */
+static int jq_kernel_map(const jq_path *path, jv input, jv *result) {
+    jv_kind kind = jv_get_kind(input);
+    if (kind != JV_KIND_ARRAY && kind != JV_KIND_OBJECT) return 0;
+
+    jv out = jv_array();
+    if (kind == JV_KIND_ARRAY) {
+        int count = jv_array_length(jv_copy(input));
+        for (int i = 0; i < count; i++) {
+            jv value;
+            if (!jq_kernel_get(path, jv_array_get(jv_copy(input), i), &value)) {
+                jv_free(out);
+                return 0;
+            }
+            out = jv_array_append(out, value);
+        }
+    } else {
+        for (int i = jv_object_iter(input); jv_object_iter_valid(input, i);
+             i = jv_object_iter_next(input, i)) {
+            jv value;
+            if (!jq_kernel_get(path, jv_object_iter_value(input, i), &value)) {
+                jv_free(out);
+                return 0;
+            }
+            out = jv_array_append(out, value);
+        }
+    }
+
+    *result = out;
+    return 1;
+}
+
+/**
+ * {a, b}: an object of the named keys of an object (or of null)
+ */
+static int jq_kernel_pluck(const jq_path *path, jv input, jv *result) {
+    jv_kind kind = jv_get_kind(input);
+    if (kind != JV_KIND_OBJECT && kind != JV_KIND_NULL) return 0;
+
+    jv out = jv_object();
+    for (int i = 0; i < path->count; i++) {
+        jv key = jv_string_sized(path->text + path->steps[i].name_offset,
+                                 path->steps[i].name_len);
+        out = jv_object_set(out, key, jq_kernel_key(path, i, jv_copy(input)));
+    }
+
+    *result = out;
+    return 1;
+}
+
+/**
+ * Answer a run with the kernel of its filter
+ *
+ * Pure C (no Ruby API), so it is safe to call without the GVL.
+ *
+ * @param kernel Kernel from jq_kernel_compile
+ * @param input Parsed input (borrowed: on fallback it goes to jq)
+ * @param result Set to the result when this returns JQ_KERNEL_RESULT
+ * @return Whether the filter produces a result, none, or needs jq
+ */
+jq_kernel_status jq_kernel_run(const jq_kernel *kernel, jv input,
+                               jv *result) {
+    switch (kernel->kind) {
+    case JQ_KERNEL_PATH:
+        return jq_kernel_get(&kernel->path, jv_copy(input), result) ?
+            JQ_KERNEL_RESULT : JQ_KERNEL_FALLBACK;
+    case JQ_KERNEL_SELECT: {
+        jv value;
+        if (!jq_kernel_get(&kernel->path, jv_copy(input), &value)) {
+            return JQ_KERNEL_FALLBACK;
+        }
+        int equal = jv_equal(value, jq_kernel_literal(kernel));  // CONSUMES both
+        if (equal == kernel->negate) return JQ_KERNEL_EMPTY;
+        *result = jv_copy(input);
+        return JQ_KERNEL_RESULT;
+    }
+    case JQ_KERNEL_MAP:
+        return jq_kernel_map(&kernel->path, input, result) ?
+            JQ_KERNEL_RESULT : JQ_KERNEL_FALLBACK;
+    case JQ_KERNEL_PLUCK:
+        return jq_kernel_pluck(&kernel->path, input, result) ?
+            JQ_KERNEL_RESULT : JQ_KERNEL_FALLBACK;
+    default:
+        return JQ_KERNEL_FALLBACK;
+    }
+}
+
+/**
+ * Name of a kernel, as Program#kernel and JQ::Stats#kernel report it
+ *
+ * @return Name, or NULL for JQ_KERNEL_NONE
+ */
+const char *jq_kernel_name(jq_kernel_kind kind) {
+    switch (kind) {
+    case JQ_KERNEL_PATH:
+        return "path";
+    case JQ_KERNEL_SELECT:
+        return "select";
+    case JQ_KERNEL_MAP:
+        return "map";
+    case JQ_KERNEL_PLUCK:
+        return "pluck";
+    default:
+        return NULL;
+    }
+}
@@ -0,0 +1,381 @@
+/* frozen_string_literal: true */
+
+#include "jq_ext.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * JSON text to jv values without jv_parse (see JQ.parser)
+ *
+ * jv_parse() feeds every byte through its tokenizer state machine and
+ * copies strings into a token buffer one byte at a time. jq_parse_fast
+ * finds the end of each string 16 bytes at a time instead, and builds the
+ * values with the same constructors jv_parse uses (jv_string_sized,
+ * jv_number_with_literal, jv_object_set...), so the result is identical.
+ * Like jq_path_find, it only accepts strict JSON it is sure about: on
+ * anything else, every syntax error included, it gives up and the caller
+ * parses the text with jv_parse_sized() for jq's exact value or error.
+ */
+
+/**
+ * Find the first '"', '\\' or control character of a string body
+ *
+ * Checks 16 bytes per step with SSE2 or NEON, which every x86-64 and arm64
+ * CPU has, so no runtime dispatch is needed; other targets scan bytewise.
+ *
+ * @return Pointer to that byte, or end if there is none
+ */
+const char *jq_scan_string(const char *p, const char *end) {
+#if defined(__SSE2__) && defined(__GNUC__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                         _mm_cmpeq_epi8(chunk, backslash)),
+            // Unsigned chunk <= 0x1f
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t control = vdupq_n_u8(0x1f);
+
+    while (end - p >= 16) {
+        uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+        uint8x16_t hits = vorrq_u8(
+            vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash)),
+            vcleq_u8(chunk, control));
+        if (vmaxvq_u8(hits)) break;  // Found in this chunk: finish bytewise
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef JQ_FAST_PARSER
+
+// State of one jq_parse_fast call
+typedef struct {
+    const char *p;              // Next byte to parse
+    const char *end;
+    int depth;
+    char *buf;                  // malloc'd scratch for escaped strings and numbers
+    size_t capa;
+} jq_fast_parser;
+
+static jv jq_parse_fast_value(jq_fast_parser *s);
+
+static int jq_parse_fast_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void jq_parse_fast_skip_ws(jq_fast_parser *s) {
+    while (s->p < s->end && jq_parse_fast_ws(*s->p)) s->p++;
+}
+
+/**
+ * Make room for +len+ bytes in the scratch buffer
+ *
+ * Uses malloc rather than xmalloc: it runs without the GVL.
+ *
+ * @return 1, or 0 if out of memory
+ */
+static int jq_parse_fast_reserve(jq_fast_parser *s, size_t len) {
+    if (len <= s->capa) return 1;
+
+    size_t capa = s->capa ? s->capa : 256;
+    while (capa < len) capa *= 2;
+
+    char *buf = realloc(s->buf, capa);
+    if (!buf) return 0;
+    s->buf = buf;
+    s->capa = capa;
+    return 1;
+}
+
+static int jq_parse_fast_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Decode one escape sequence (after its backslash) into the scratch buffer
+ *
+ * @return Bytes written at s->buf + len, or 0 for escapes left to jq
+ *   (invalid, \u0000 and UTF-16 surrogates)
+ */
+static int jq_parse_fast_escape(jq_fast_parser *s, size_t len) {
+    char *out = s->buf + len;
+    char c = *s->p++;
+
+    switch (c) {
+    case '"': case '\\': case '/': *out = c; return 1;
+    case 'b': *out = '\b'; return 1;
+    case 'f': *out = '\f'; return 1;
+    case 'n': *out = '\n'; return 1;
+    case 'r': *out = '\r'; return 1;
+    case 't': *out = '\t'; return 1;
+    case 'u': break;
+    default: return 0;
+    }
+
+    if (s->end - s->p < 4) return 0;
+    unsigned codepoint = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = jq_parse_fast_hex(s->p[i]);
+        if (digit < 0) return 0;
+        codepoint = codepoint * 16 + digit;
+    }
+    if (codepoint == 0 || (codepoint >= 0xd800 && codepoint <= 0xdfff)) {
+        return 0;
+    }
+    s->p += 4;
+
+    if (codepoint < 0x80) {
+        out[0] = (char)codepoint;
+        return 1;
+    }
+    if (codepoint < 0x800) {
+        out[0] = (char)(0xc0 | (codepoint >> 6));
+        out[1] = (char)(0x80 | (codepoint & 0x3f));
+        return 2;
+    }
+    out[0] = (char)(0xe0 | (codepoint >> 12));
+    out[1] = (char)(0x80 | ((codepoint >> 6) & 0x3f));
+    out[2] = (char)(0x80 | (codepoint & 0x3f));
+    return 3;
+}
+
+/**
+ * Parse a string starting at its opening quote
+ *
+ * Strings without escapes go straight from the input to jv_string_sized();
+ * escaped ones are decoded into the scratch buffer first.
+ */
+static jv jq_parse_fast_string(jq_fast_parser *s) {
+    const char *start = ++s->p;
+    const char *stop = jq_scan_string(start, s->end);
+
+    if (stop < s->end && *stop == '"') {
+        s->p = stop + 1;
+        return jv_string_sized(start, (int)(stop - start));
+    }
+
+    size_t len = 0;
+    for (;;) {
+        size_t run = stop - start;
+        // Room for the run plus the longest decoded escape
+        if (!jq_parse_fast_reserve(s, len + run + 4)) return jv_invalid();
+        memcpy(s->buf + len, start, run);
+        len += run;
+
+        if (stop < s->end && *stop == '"') break;
+        if (stop >= s->end || *stop != '\\') {
+            return jv_invalid();  // Unterminated, or a raw control character
+        }
+
+        s->p = stop + 1;
+        if (s->p >= s->end) return jv_invalid();
+        int n = jq_parse_fast_escape(s, len);
+        if (!n) return jv_invalid();
+        len += n;
+
+        start = s->p;
+        stop = jq_scan_string(start, s->end);
+    }
+
+    s->p = stop + 1;
+    return jv_string_sized(s->buf, (int)len);
+}
+
+/**
+ * Parse a number in strict JSON syntax, keeping its literal text as
+ * jv_parse does
+ */
+static jv jq_parse_fast_number(jq_fast_parser *s) {
+    const char *start = s->p;
+    const char *p = s->p;
+    const char *end = s->end;
+
+    if (p < end && *p == '-') p++;
+    if (p >= end) return jv_invalid();
+    if (*p == '0') {
+        p++;
+    } else if (*p >= '1' && *p <= '9') {
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    } else {
+        return jv_invalid();
+    }
+    if (p < end && *p == '.') {
+        const char *digits = ++p;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+        if (p == digits) return jv_invalid();
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        const char *digits = p;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+        if (p == digits) return jv_invalid();
+    }
+
+    size_t len = p - start;
+    if (!jq_parse_fast_reserve(s, len + 1)) return jv_invalid();
+    memcpy(s->buf, start, len);
+    s->buf[len] = '\0';
+    s->p = p;
+
+    return jv_number_with_literal(s->buf);
+}
+
+static jv jq_parse_fast_literal(jq_fast_parser *s, const char *literal,
+                                long len, jv value) {
+    if (s->end - s->p < len || memcmp(s->p, literal, len) != 0) {
+        return jv_invalid();
+    }
+    s->p += len;
+    return value;
+}
+
+static jv jq_parse_fast_object(jq_fast_parser *s) {
+    jv object = jv_object();
+
+    s->p++;
+    jq_parse_fast_skip_ws(s);
+    if (s->p < s->end && *s->p == '}') {
+        s->p++;
+        return object;
+    }
+
+    for (;;) {
+        if (s->p >= s->end || *s->p != '"') break;
+        jv key = jq_parse_fast_string(s);
+        if (!jv_is_valid(key)) break;
+
+        jq_parse_fast_skip_ws(s);
+        if (s->p >= s->end || *s->p != ':') {
+            jv_free(key);
+            break;
+        }
+        s->p++;
+
+        jv value = jq_parse_fast_value(s);
+        if (!jv_is_valid(value)) {
+            jv_free(key);
+            break;
+        }
+        // Duplicate keys keep the last value, as with jv_parse
+        object = jv_object_set(object, key, value);
+
+        jq_parse_fast_skip_ws(s);
+        if (s->p >= s->end) break;
+        if (*s->p == '}') {
+            s->p++;
+            return object;
+        }
+        if (*s->p != ',') break;
+        s->p++;
+        jq_parse_fast_skip_ws(s);
+    }
+
+    jv_free(object);
+    return jv_invalid();
+}
+
+static jv jq_parse_fast_array(jq_fast_parser *s) {
+    jv array = jv_array();
+
+    s->p++;
+    jq_parse_fast_skip_ws(s);
+    if (s->p < s->end && *s->p == ']') {
+        s->p++;
+        return array;
+    }
+
+    for (;;) {
+        jv value = jq_parse_fast_value(s);
+        if (!jv_is_valid(value)) break;
+        array = jv_array_append(array, value);
+
+        jq_parse_fast_skip_ws(s);
+        if (s->p >= s->end) break;
+        if (*s->p == ']') {
+            s->p++;
+            return array;
+        }
+        if (*s->p != ',') break;
+        s->p++;
+    }
+
+    jv_free(array);
+    return jv_invalid();
+}
+
+static jv jq_parse_fast_value(jq_fast_parser *s) {
+    jq_parse_fast_skip_ws(s);
+    if (s->p >= s->end) return jv_invalid();
+
+    switch (*s->p) {
+    case '{':
+    case '[': {
+        if (++s->depth > JQ_PARSE_MAX_DEPTH) return jv_invalid();
+        jv value = *s->p == '{' ? jq_parse_fast_object(s) :
+            jq_parse_fast_array(s);
+        s->depth--;
+        return value;
+    }
+    case '"':
+        return jq_parse_fast_string(s);
+    case 't':
+        return jq_parse_fast_literal(s, "true", 4, jv_true());
+    case 'f':
+        return jq_parse_fast_literal(s, "false", 5, jv_false());
+    case 'n':
+        return jq_parse_fast_literal(s, "null", 4, jv_null());
+    default:
+        return jq_parse_fast_number(s);
+    }
+}
+
+/**
+ * Parse one JSON document into the jv jv_parse_sized() would build
+ *
+ * Pure C (no Ruby API), so it is safe to call without the GVL.
+ *
+ * @param json JSON text
+ * @param len Length of json in bytes
+ * @return The value, or jv_invalid() without a message if the text must be
+ *   parsed with jv_parse_sized() instead (invalid, or not handled here)
+ */
+jv jq_parse_fast(const char *json, long len) {
+    jq_fast_parser s = { json, json + len, 0, NULL, 0 };
+
+    jv value = jq_parse_fast_value(&s);
+    jq_parse_fast_skip_ws(&s);
+    free(s.buf);
+
+    if (jv_is_valid(value) && s.p != s.end) {  // Extra values, or garbage
+        jv_free(value);
+        return jv_invalid();
+    }
+    return value;
+}
+
+#endif /* JQ_FAST_PARSER */
@@ -0,0 +1,425 @@
+/* frozen_string_literal: true */
+
+#include "jq_ext.h"
+#include <string.h>
+
+/*
+ * Fast path for filters that are a plain path, such as .user.id or
+ * .items[0].sku
+ *
+ * Rather than parsing the whole document into jv values, jq_path_find scans
+ * it once without allocating: every byte is validated, but only the span of
+ * the value at the path is returned, for jv_parse_sized() to parse alone.
+ * Whenever the scan cannot be sure jq would see the same thing (escaped
+ * keys on the path, \u surrogate escapes, raw control characters, a BOM,
+ * non-standard literals, deep nesting, or indexing a value of the wrong
+ * type), it gives up and the caller runs the filter with jq, which then
+ * produces the result or error jq always would.
+ */
+
+// A value matched against the remaining steps of a path
+typedef struct {
+    jq_path_status status;
+    const char *start;          // Span of the value when status is FOUND
+    const char *end;
+} jq_path_match;
+
+typedef struct {
+    const jq_path *path;
+    const char *p;              // Next byte to scan
+    const char *end;
+    int depth;
+} jq_path_scanner;
+
+static int jq_path_scan_value(jq_path_scanner *s, int step,
+                              jq_path_match *match);
+
+static int jq_path_ident_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static int jq_path_ident_char(char c) {
+    return jq_path_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+static int jq_path_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Parse a "key" step of a filter: printable ASCII only, so there are no
+ * escapes or interpolations and the bytes compare as-is with JSON keys
+ *
+ * @return Length of the step including quotes, or 0 if it is not one
+ */
+static long jq_path_compile_key(const char *p, const char *end) {
+    if (p >= end || *p != '"') return 0;
+    for (const char *q = p + 1; q < end; q++) {
+        if (*q == '"') return q > p + 1 ? q - p + 1 : 0;
+        if (*q == '\\' || *q < 0x20 || *q > 0x7e) return 0;
+    }
+    return 0;
+}
+
+/**
+ * Recognize a filter made only of .name, ."name", .[N] and ["name"] steps
+ *
+ * Only accepts text jq compiles to the same plain path: the caller must
+ * still have compiled the filter with jq, which rejects any syntax the
+ * installed jq version does not support.
+ *
+ * @param filter Filter source
+ * @param len Length of filter in bytes
+ * @param path Filled in; path->count is 0 unless this returns 1
+ * @return 1 if the filter is a simple path of at least one step, else 0
+ */
+int jq_path_compile(const char *filter, long len, jq_path *path) {
+    const char *p = filter;
+    const char *end = filter + len;
+
+    path->count = 0;
+    while (p < end && jq_path_ws(*p)) p++;
+    while (end > p && jq_path_ws(end[-1])) end--;
+    if (end - p >= JQ_PATH_MAX_LENGTH || p >= end || *p != '.') return 0;
+
+    memcpy(path->text, p, end - p);
+    end = path->text + (end - p);
+    p = path->text;
+
+    int count = 0;
+    int dotted = 0;     // Just read the '.' of a step
+    while (p < end) {
+        if (count == JQ_PATH_MAX_STEPS) return 0;
+
+        if (*p == '.' && !dotted) {
+            dotted = 1;
+            p++;
+            continue;
+        }
+
+        const char *name = NULL;
+        long name_len = 0;
+        long index = 0;
+
+        if (dotted && jq_path_ident_start(*p)) {
+            name = p;
+            while (p < end && jq_path_ident_char(*p)) p++;
+            name_len = p - name;
+        } else if (dotted && *p == '"') {
+            long n = jq_path_compile_key(p, end);
+            if (!n) return 0;
+            name = p + 1;
+            name_len = n - 2;
+            p += n;
+        } else if (*p == '[') {
+            p++;
+            if (p < end && *p == '"') {
+                long n = jq_path_compile_key(p, end);
+                if (!n) return 0;
+                name = p + 1;
+                name_len = n - 2;
+                p += n;
+            } else {
+                const char *digits = p;
+                while (p < end && *p >= '0' && *p <= '9' && p - digits < 9) {
+                    index = index * 10 + (*p - '0');
+                    p++;
+                }
+                if (p == digits) return 0;
+            }
+            if (p >= end || *p != ']') return 0;
+            p++;
+        } else {
+            return 0;
+        }
+
+        path->steps[count].name_offset = name ? (int)(name - path->text) : -1;
+        path->steps[count].name_len = (int)name_len;
+        path->steps[count].index = index;
+        count++;
+        dotted = 0;
+    }
+
+    if (dotted || count == 0) return 0;  // Trailing '.', or just '.'
+    path->count = count;
+    return 1;
+}
+
+static void jq_path_skip_ws(jq_path_scanner *s) {
+    while (s->p < s->end && jq_path_ws(*s->p)) s->p++;
+}
+
+static int jq_path_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Scan a string starting at its opening quote
+ *
+ * @param escaped Set if the string contains any escape
+ * @return 1, or 0 if it is invalid or left to jq
+ */
+static int jq_path_scan_string(jq_path_scanner *s, int *escaped) {
+    *escaped = 0;
+    s->p++;
+
+    while (s->p < s->end) {
+        s->p = jq_scan_string(s->p, s->end);
+        if (s->p >= s->end) return 0;
+
+        unsigned char c = (unsigned char)*s->p++;
+        if (c == '"') return 1;
+        if (c < 0x20) return 0;
+
+        *escaped = 1;
+        if (s->p >= s->end) return 0;
+        c = (unsigned char)*s->p++;
+        if (c == 'u') {
+            if (s->end - s->p < 4) return 0;
+            int codepoint = 0;
+            for (int i = 0; i < 4; i++) {
+                int digit = jq_path_hex(s->p[i]);
+                if (digit < 0) return 0;
+                codepoint = codepoint * 16 + digit;
+            }
+            // Surrogate pairs (and lone surrogates) are left to jq
+            if (codepoint >= 0xd800 && codepoint <= 0xdfff) return 0;
+            s->p += 4;
+        } else if (!strchr("\"\\/bfnrt", c) || c == '\0') {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Scan a number in strict JSON syntax
+ *
+ * @return 1, or 0 if it is invalid or left to jq
+ */
+static int jq_path_scan_number(jq_path_scanner *s) {
+    const char *p = s->p;
+    const char *end = s->end;
+
+    if (p < end && *p == '-') p++;
+    if (p >= end) return 0;
+    if (*p == '0') {
+        p++;
+    } else if (*p >= '1' && *p <= '9') {
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    } else {
+        return 0;
+    }
+    if (p < end && *p == '.') {
+        const char *digits = ++p;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+        if (p == digits) return 0;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        const char *digits = p;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+        if (p == digits) return 0;
+    }
+
+    s->p = p;
+    return 1;
+}
+
+static int jq_path_scan_literal(jq_path_scanner *s, const char *literal,
+                                long len) {
+    if (s->end - s->p < len || memcmp(s->p, literal, len) != 0) return 0;
+    s->p += len;
+    return 1;
+}
+
+/**
+ * Scan an object starting at its '{'
+ *
+ * @param step Index of the path step to match members against, or -1
+ */
+static int jq_path_scan_object(jq_path_scanner *s, int step,
+                               jq_path_match *match) {
+    const char *name = NULL;
+    long name_len = 0;
+
+    if (step >= 0) {
+        int offset = s->path->steps[step].name_offset;
+        if (offset < 0) {
+            match->status = JQ_PATH_FALLBACK;  // Object indexed with a number
+            step = -1;
+        } else {
+            match->status = JQ_PATH_NULL;      // Until the key is found
+            name = s->path->text + offset;
+            name_len = s->path->steps[step].name_len;
+        }
+    }
+
+    s->p++;
+    jq_path_skip_ws(s);
+    if (s->p < s->end && *s->p == '}') {
+        s->p++;
+        return 1;
+    }
+
+    for (;;) {
+        if (s->p >= s->end || *s->p != '"') return 0;
+        const char *key = s->p + 1;
+        int escaped;
+        if (!jq_path_scan_string(s, &escaped)) return 0;
+        long key_len = s->p - 1 - key;
+
+        // An escaped key might spell the name: only jq can tell
+        if (step >= 0 && escaped) return 0;
+
+        jq_path_skip_ws(s);
+        if (s->p >= s->end || *s->p != ':') return 0;
+        s->p++;
+
+        // jq keeps the last of duplicate keys, so a later match wins
+        int matched = step >= 0 && key_len == name_len &&
+            memcmp(key, name, name_len) == 0;
+        if (!jq_path_scan_value(s, matched ? step + 1 : -1, match)) return 0;
+
+        jq_path_skip_ws(s);
+        if (s->p >= s->end) return 0;
+        if (*s->p == '}') {
+            s->p++;
+            return 1;
+        }
+        if (*s->p != ',') return 0;
+        s->p++;
+        jq_path_skip_ws(s);
+    }
+}
+
+/**
+ * Scan an array starting at its '['
+ *
+ * @param step Index of the path step to match elements against, or -1
+ */
+static int jq_path_scan_array(jq_path_scanner *s, int step,
+                              jq_path_match *match) {
+    long index = -1;
+
+    if (step >= 0) {
+        if (s->path->steps[step].name_offset >= 0) {
+            match->status = JQ_PATH_FALLBACK;  // Array indexed with a key
+            step = -1;
+        } else {
+            match->status = JQ_PATH_NULL;      // Until the index is reached
+            index = s->path->steps[step].index;
+        }
+    }
+
+    s->p++;
+    jq_path_skip_ws(s);
+    if (s->p < s->end && *s->p == ']') {
+        s->p++;
+        return 1;
+    }
+
+    for (long i = 0;; i++) {
+        int matched = step >= 0 && i == index;
+        if (!jq_path_scan_value(s, matched ? step + 1 : -1, match)) return 0;
+
+        jq_path_skip_ws(s);
+        if (s->p >= s->end) return 0;
+        if (*s->p == ']') {
+            s->p++;
+            return 1;
+        }
+        if (*s->p != ',') return 0;
+        s->p++;
+    }
+}
+
+/**
+ * Scan one value, matching it against the path from +step+ on
+ *
+ * @param step Index of the next path step, path->count if this value is
+ *   the result, or -1 if it is off the path
+ * @param match Updated when the value is on the path
+ * @return 1, or 0 if the document is invalid or left to jq
+ */
+static int jq_path_scan_value(jq_path_scanner *s, int step,
+                              jq_path_match *match) {
+    jq_path_skip_ws(s);
+    if (s->p >= s->end) return 0;
+
+    const char *start = s->p;
+    int target = step == s->path->count;
+    int next = target ? -1 : step;
+    int ok;
+    int escaped;
+
+    switch (*s->p) {
+    case '{':
+    case '[':
+        if (++s->depth > JQ_PATH_MAX_DEPTH) return 0;
+        ok = *s->p == '{' ? jq_path_scan_object(s, next, match) :
+            jq_path_scan_array(s, next, match);
+        s->depth--;
+        break;
+    case '"':
+        ok = jq_path_scan_string(s, &escaped);
+        if (next >= 0) match->status = JQ_PATH_FALLBACK;  // Cannot index
+        break;
+    case 'n':
+        ok = jq_path_scan_literal(s, "null", 4);
+        if (next >= 0) match->status = JQ_PATH_NULL;      // null.a is null
+        break;
+    case 't':
+    case 'f':
+        ok = *s->p == 't' ? jq_path_scan_literal(s, "true", 4) :
+            jq_path_scan_literal(s, "false", 5);
+        if (next >= 0) match->status = JQ_PATH_FALLBACK;
+        break;
+    default:
+        ok = jq_path_scan_number(s);
+        if (next >= 0) match->status = JQ_PATH_FALLBACK;
+        break;
+    }
+
+    if (ok && target) {
+        match->status = JQ_PATH_FOUND;
+        match->start = start;
+        match->end = s->p;
+    }
+    return ok;
+}
+
+/**
+ * Find the value a simple path selects in a JSON document
+ *
+ * Pure C (no Ruby API, no allocation), so it is safe to call without the
+ * GVL.
+ *
+ * @param path Path recognized by jq_path_compile
+ * @param json JSON text of exactly one document
+ * @param len Length of json in bytes
+ * @param start Set to the start of the value when JQ_PATH_FOUND is returned
+ * @param end Set to the end of the value when JQ_PATH_FOUND is returned
+ * @return JQ_PATH_FOUND, JQ_PATH_NULL, or JQ_PATH_FALLBACK if jq must run
+ *   the filter (invalid input, a type error, or anything the scan leaves
+ *   to jq)
+ */
+jq_path_status jq_path_find(const jq_path *path, const char *json, long len,
+                            const char **start, const char **end) {
+    jq_path_scanner s = { path, json, json + len, 0 };
+    jq_path_match match = { JQ_PATH_FALLBACK, NULL, NULL };
+
+    if (!jq_path_scan_value(&s, 0, &match)) return JQ_PATH_FALLBACK;
+    jq_path_skip_ws(&s);
+    if (s.p != s.end) return JQ_PATH_FALLBACK;  // Extra values, or garbage
+
+    if (match.status == JQ_PATH_FOUND) {
+        *start = match.start;
+        *end = match.end;
+    }
+    return match.status;
+}
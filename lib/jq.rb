@@ -13,6 +13,10 @@
 # call creates an isolated jq_state, and jq 1.7+ includes critical thread
 # safety fixes (PR #2546). Safe to use from multiple threads in MRI Ruby.
 #
+# The extension is also Ractor-safe. Frozen programs (JQ::Program#freeze,
+# Ractor.make_shareable) can be shared by Ractors. The JQ.* settings can
+# only be changed from the main Ractor.
+#
 # === Basic Usage
 #
 #   require 'jq'
@@ -29,6 +33,28 @@
 #   JQ.filter('[1,2,3]', '.[]', multiple_outputs: true)
 #   # => ["1", "2", "3"]
 #
+# === Compiled Programs
+#
+# Compile a filter once and apply it to many documents:
+#
+#   program = JQ.compile('.name')
+#   program.call('{"name":"Alice"}')
+#   # => "\"Alice\""
+#
+#   # Ruby objects in, Ruby objects out
+#   JQ.filter_object({"name" => "Alice"}, '.name')
+#   # => "Alice"
+#
+#   # Results one at a time instead of one big array
+#   JQ.each('[1,2,3]', '.[]') { |result| puts result }
+#
+#   # NDJSON from an IO, one result at a time
+#   JQ.filter_stream(io, '.id') { |id| puts id }
+#
+#   # Many documents in one native call
+#   JQ.filter_many(['{"id":1}', '{"id":2}'], '.id')
+#   # => ["1", "2"]
+#
 # === Error Handling
 #
 # All jq-related errors inherit from JQ::Error:
@@ -90,6 +116,77 @@ module JQ
   #   # raises JQ::ParseError: Invalid JSON input
   #
   class ParseError < Error; end
+
+  ##
+  # Raised when a JQ::Program created with +pool_timeout:+ has no free
+  # jq_state within the timeout.
+  #
+  #   program = JQ.compile('.id', pool_size: 4, pool_timeout: 0.5)
+  #   program.call(json)
+  #   # raises JQ::PoolTimeoutError when 4 calls are already running
+  #
+  class PoolTimeoutError < Error; end
+
+  ##
+  # Raised when a filter exceeds its execution budget: the +timeout:+,
+  # +max_steps:+ or +max_outputs:+ option of the call.
+  #
+  #   JQ.filter('null', '[range(1e9)]', timeout: 0.1)
+  #   # raises JQ::TimeoutError: jq filter timed out after 0.1 seconds
+  #
+  class TimeoutError < Error; end
+
+  ##
+  # Raised when a filter holds more memory in jq values than the
+  # +max_memory:+ option of the call allows.
+  #
+  #   JQ.filter('null', '[range(1e8)]', max_memory: 64 << 20)
+  #   # raises JQ::ResourceError: jq filter exceeded max_memory (67108864 bytes)
+  #
+  class ResourceError < Error; end
+
+  ##
+  # A compiled jq filter that can be applied to many JSON documents.
+  #
+  # Compiling a filter (including binding all of jq's builtins) is usually
+  # far more expensive than running it, so reuse a program whenever the same
+  # filter is applied repeatedly:
+  #
+  #   program = JQ.compile('.[] | select(.active) | .id')
+  #   program.call(json, multiple_outputs: true)
+  #
+  # Instances are created by JQ.compile or JQ::Program.new; the methods are
+  # implemented in the C extension.
+  #
+  class Program; end
+
+  ##
+  # Named JQ::Programs applied together to one JSON document, which is
+  # parsed once for all of them:
+  #
+  #   fields = JQ::ProgramSet.new({ id: '.id', name: '.user.name' })
+  #   fields.call(json, raw_output: true)
+  #   # => {id: "1", name: "Alice"}
+  #
+  # JQ.filter_multi does the same for a one-off Hash of filters. The
+  # methods are implemented in the C extension.
+  #
+  class ProgramSet; end
+
+  ##
+  # A JSON document parsed once and kept as a jq value. Pass it to
+  # JQ.filter, JQ::Program#call or JQ::ProgramSet#call in place of a JSON
+  # string to skip parsing; <tt>document: true</tt> returns results as
+  # documents, to chain filters without serializing in between:
+  #
+  #   doc = JQ::Document.new(json)
+  #   active = JQ.filter(doc, '[.users[] | select(.active)]', document: true)
+  #   JQ.filter(active, 'length')  # => "2"
+  #   active.to_ruby               # => [{"name" => "Alice", ...}, ...]
+  #
+  # The methods are implemented in the C extension.
+  #
+  class Document; end
 end
 
 begin
@@ -0,0 +1,127 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'JQ::Program args' do
+  let(:json) { '{"orders":[{"tenant":"acme","id":1},{"tenant":"initech","id":2},{"tenant":"acme","id":3}]}' }
+  let(:program) { JQ.compile('[.orders[] | select(.tenant == $tenant) | .id][:$limit]', args: %i[tenant limit]) }
+
+  describe '.compile' do
+    it 'declares the variables' do
+      expect(program.args).to eq(%w[tenant limit])
+      expect(program.args).to be_frozen
+    end
+
+    it 'keeps the original filter text' do
+      expect(program.filter).to eq('[.orders[] | select(.tenant == $tenant) | .id][:$limit]')
+    end
+
+    it 'has no args by default' do
+      expect(JQ.compile('.').args).to eq([])
+    end
+
+    it 'accepts String names' do
+      expect(JQ.compile('$a', args: ['a']).call('null', args: { 'a' => 1 })).to eq('1')
+    end
+
+    it 'rejects invalid names' do
+      expect { JQ.compile('.', args: ['not-a-name']) }.to raise_error(ArgumentError, /invalid jq variable name/)
+      expect { JQ.compile('.', args: ['1st']) }.to raise_error(ArgumentError)
+      expect { JQ.compile('.', args: ['__jq_input__']) }.to raise_error(ArgumentError)
+      expect { JQ.compile('.', args: [:a, :a]) }.to raise_error(ArgumentError, /duplicate/)
+      expect { JQ.compile('.', args: [1]) }.to raise_error(TypeError)
+    end
+
+    it 'still rejects invalid filters' do
+      expect { JQ.compile('. @@@ .', args: [:a]) }.to raise_error(JQ::CompileError)
+      expect { JQ.compile('$undeclared', args: [:a]) }.to raise_error(JQ::CompileError)
+    end
+
+    it 'handles a trailing comment' do
+      expect(JQ.compile("$a # comment", args: [:a]).call('null', args: { a: 2 })).to eq('2')
+    end
+
+    it 'keeps module directives at the top' do
+      program = JQ.compile(%(# header\nmodule {name: "m", v: [";"]};\n.a + $x), args: [:x])
+      expect(program.call('{"a":1}', args: { x: 2 })).to eq('3')
+
+      ['include "foo"; .', %(import "foo" as f;\nimport "bar" as $b; $x)].each do |filter|
+        expect { JQ.compile(filter, args: [:x]) }.to raise_error(JQ::CompileError, /not allowed in sandbox mode/)
+      end
+    end
+  end
+
+  describe '#call' do
+    it 'binds different values per call without recompiling' do
+      expect(program.call(json, args: { tenant: 'acme', limit: 5 })).to eq('[1,3]')
+      expect(program.call(json, args: { tenant: 'initech', limit: 5 })).to eq('[2]')
+      expect(program.call(json, args: { tenant: 'acme', limit: 1 })).to eq('[1]')
+    end
+
+    it 'accepts nested Ruby objects' do
+      program = JQ.compile('.a + $extra.list', args: [:extra])
+      expect(program.call('{"a":[1]}', args: { extra: { list: [2, 3.5, nil, true] } })).to eq('[1,2,3.5,null,true]')
+    end
+
+    it 'binds undeclared values to null' do
+      expect(program.call(json, args: { tenant: 'acme' })).to eq('[1,3]')
+      expect(JQ.compile('$a', args: [:a]).call('1')).to eq('null')
+    end
+
+    it 'passes the real input to the filter' do
+      expect(JQ.compile('.', args: [:a]).call('[1,2]', args: { a: 3 })).to eq('[1,2]')
+    end
+
+    it 'rejects unknown variables' do
+      expect { program.call(json, args: { other: 1 }) }.to raise_error(ArgumentError, /unknown jq variable/)
+    end
+
+    it 'rejects args for a program without declared variables' do
+      expect { JQ.compile('.').call('1', args: { a: 1 }) }.to raise_error(ArgumentError)
+      expect(JQ.compile('.').call('1', args: {})).to eq('1')
+    end
+
+    it 'rejects values that cannot be converted' do
+      expect { program.call(json, args: { tenant: Object.new }) }.to raise_error(TypeError)
+    end
+
+    it 'reports runtime errors from the filter' do
+      expect { JQ.compile('error($msg)', args: [:msg]).call('null', args: { msg: 'boom' }) }
+        .to raise_error(JQ::RuntimeError, /boom/)
+    end
+  end
+
+  describe 'other call methods' do
+    let(:program) { JQ.compile('.[] | . * $factor', args: [:factor]) }
+
+    it 'binds args in #each' do
+      expect(program.each('[1,2]', args: { factor: 3 }).to_a).to eq(%w[3 6])
+    end
+
+    it 'binds args in #call_stream for every document' do
+      expect(program.call_stream('[1] [2]', args: { factor: 10 }).to_a).to eq(%w[10 20])
+    end
+
+    it 'binds args in #call_into' do
+      expect(program.call_into('[1,2]', +'', args: { factor: 2 })).to eq("2\n4\n")
+    end
+
+    it 'binds args in #call_many' do
+      program = JQ.compile('.n * $factor', args: [:factor])
+      jsons = 20.times.map { |i| %({"n":#{i}}) }
+      expected = 20.times.map { |i| (i * 4).to_s }
+
+      expect(program.call_many(jsons, args: { factor: 4 })).to eq(expected)
+      expect(program.call_many(jsons, args: { factor: 4 }, parallel: 4)).to eq(expected)
+    end
+  end
+
+  it 'is safe to call concurrently with different bindings' do
+    program = JQ.compile('$n + .', args: [:n])
+    results = 4.times.map do |t|
+      Thread.new { 50.times.map { |i| program.call('1', args: { n: t * 100 + i }) } }
+    end.map(&:value)
+
+    expect(results).to eq(4.times.map { |t| 50.times.map { |i| (t * 100 + i + 1).to_s } })
+  end
+end
@@ -0,0 +1,170 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'async:' do
+  # The smallest Fiber.scheduler Thread#join and sleep work with: blocked
+  # fibers are resumed from a queue once something unblocks them
+  class TestScheduler
+    def initialize
+      @ready = Thread::Queue.new
+      @fibers = []
+    end
+
+    def fiber(&block)
+      fiber = Fiber.new(blocking: false, &block)
+      @fibers << fiber
+      fiber.resume
+      fiber
+    end
+
+    def block(_blocker, _timeout = nil)
+      Fiber.yield
+    end
+
+    def unblock(_blocker, fiber)
+      @ready.push(fiber)
+    end
+
+    def kernel_sleep(_duration = nil)
+      @ready.push(Fiber.current)
+      Fiber.yield
+    end
+
+    def io_wait(_io, _events, _timeout)
+      raise NotImplementedError
+    end
+
+    def close
+      while @fibers.any?(&:alive?)
+        fiber = @ready.pop
+        fiber.resume if fiber.alive?
+      end
+    end
+  end
+
+  # Ticks another fiber made while the filter ran, and the filter's result
+  def run_with_ticker(**opts)
+    ticks = 0
+    result = nil
+
+    Thread.new do
+      Fiber.set_scheduler(TestScheduler.new)
+      done = false
+      Fiber.schedule do
+        result = JQ.filter('null', '[range(3000000)] | length', **opts)
+      ensure
+        done = true
+      end
+      Fiber.schedule do
+        until done
+          ticks += 1
+          sleep(0)
+        end
+      end
+    end.join
+
+    [ticks, result]
+  end
+
+  after { JQ.async = false }
+
+  it 'is off by default' do
+    expect(JQ.async).to be(false)
+  end
+
+  it 'blocks the other fibers without it' do
+    ticks, result = run_with_ticker
+    expect(result).to eq('3000000')
+    expect(ticks).to eq(0)  # The ticker only starts once the filter is done
+  end
+
+  it 'lets other fibers run while the filter executes' do
+    ticks, result = run_with_ticker(async: true)
+    expect(result).to eq('3000000')
+    expect(ticks).to be > 1
+  end
+
+  it 'can be enabled for every call' do
+    JQ.async = true
+    ticks, = run_with_ticker
+    expect(ticks).to be > 1
+  end
+
+  it 'can be disabled per call' do
+    JQ.async = true
+    ticks, = run_with_ticker(async: false)
+    expect(ticks).to eq(0)
+  end
+
+  it 'runs inline without a scheduler' do
+    expect(JQ.filter('{"a":1}', '.a', async: true)).to eq('1')
+  end
+
+  it 'raises filter errors in the calling fiber' do
+    error = nil
+    Thread.new do
+      Fiber.set_scheduler(TestScheduler.new)
+      Fiber.schedule do
+        JQ.filter('{"a":1}', '.a.b', async: true)
+      rescue JQ::Error => e
+        error = e
+      end
+    end.join
+
+    expect(error).to be_a(JQ::RuntimeError)
+  end
+
+  it 'abandons the run when the waiting fiber is interrupted' do
+    error = nil
+    Thread.new do
+      Fiber.set_scheduler(TestScheduler.new)
+      worker = Fiber.schedule do
+        JQ.filter('null', 'range(1e9)', multiple_outputs: true, async: true)
+      rescue Interrupt => e
+        error = e
+      end
+      Fiber.schedule { worker.raise(Interrupt) }
+    end.join
+
+    expect(error).to be_a(Interrupt)
+    expect(JQ.filter('null', '1 + 1', async: true)).to eq('2')
+  end
+
+  it 'stops a single long result promptly when the waiting fiber is interrupted' do
+    error = nil
+    threads = Thread.list.size
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    Thread.new do
+      Fiber.set_scheduler(TestScheduler.new)
+      worker = Fiber.schedule do
+        JQ.filter('null', 'last(range(1e10))', async: true)
+      rescue Interrupt => e
+        error = e
+      end
+      Fiber.schedule do
+        sleep(0.05)
+        worker.raise(Interrupt)
+      end
+    end.join
+
+    expect(error).to be_a(Interrupt)
+    expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 1
+    expect(Thread.list.size).to eq(threads)  # The worker was joined
+  end
+
+  it 'applies to compiled programs and batches' do
+    results = nil
+    Thread.new do
+      Fiber.set_scheduler(TestScheduler.new)
+      Fiber.schedule do
+        program = JQ.compile('.a')
+        results = [program.call('{"a":1}', async: true),
+                   JQ.filter_many(%w[{"a":2} {"a":3}], '.a', async: true),
+                   JQ.each('[4,5]', '.[]', async: true).to_a]
+      end
+    end.join
+
+    expect(results).to eq(['1', %w[2 3], %w[4 5]])
+  end
+end
@@ -0,0 +1,199 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'Batch API' do
+  let(:jsons) { ['{"id":1,"name":"a"}', '{"id":2,"name":"b"}', '{"id":3,"name":"c"}'] }
+
+  describe 'JQ.filter_many' do
+    it 'returns one result per document, in order' do
+      expect(JQ.filter_many(jsons, '.id')).to eq(['1', '2', '3'])
+    end
+
+    it 'matches JQ.filter for every document' do
+      expected = jsons.map { |json| JQ.filter(json, '.name', raw_output: true) }
+      expect(JQ.filter_many(jsons, '.name', raw_output: true)).to eq(expected)
+    end
+
+    it 'returns an empty array for no documents' do
+      expect(JQ.filter_many([], '.')).to eq([])
+    end
+
+    it 'returns null for documents without results' do
+      expect(JQ.filter_many(['[]', '[1]'], '.[]')).to eq(['null', '1'])
+    end
+
+    it 'supports multiple_outputs' do
+      results = JQ.filter_many(['[1,2]', '[]', '[3]'], '.[]', multiple_outputs: true)
+      expect(results).to eq([['1', '2'], [], ['3']])
+    end
+
+    it 'supports formatting options' do
+      results = JQ.filter_many(['{"b":1,"a":2}'], '.', sort_keys: true)
+      expect(results).to eq(['{"a":2,"b":1}'])
+    end
+
+    it 'handles large batches' do
+      docs = 1000.times.map { |i| %({"n":#{i}}) }
+      expect(JQ.filter_many(docs, '.n')).to eq(1000.times.map(&:to_s))
+    end
+
+    it 'does not modify the input array' do
+      input = jsons.dup
+      JQ.filter_many(input, '.id')
+      expect(input).to eq(jsons)
+    end
+
+    it 'uses the compiled filter cache when enabled' do
+      JQ.clear_cache
+      JQ.cache_capacity = 4
+      JQ.filter_many(jsons, '.id')
+      JQ.filter_many(jsons, '.id')
+      expect(JQ.cache_stats[:hits]).to eq(1)
+    ensure
+      JQ.cache_capacity = 0
+      JQ.clear_cache
+    end
+
+    context 'with errors: :raise (default)' do
+      it 'raises ParseError for invalid documents' do
+        expect {
+          JQ.filter_many(['{"id":1}', 'invalid'], '.id')
+        }.to raise_error(JQ::ParseError)
+      end
+
+      it 'raises RuntimeError for failing filters' do
+        expect {
+          JQ.filter_many(['{"id":1}', '"x"'], '.id')
+        }.to raise_error(JQ::RuntimeError)
+      end
+    end
+
+    context 'with errors: :nil' do
+      it 'puts nil in place of failing documents' do
+        results = JQ.filter_many(['{"id":1}', 'invalid', '"x"', '{"id":4}'], '.id', errors: :nil)
+        expect(results).to eq(['1', nil, nil, '4'])
+      end
+    end
+
+    context 'with errors: :error' do
+      it 'puts the exception in place of failing documents' do
+        results = JQ.filter_many(['{"id":1}', 'invalid', '"x"'], '.id', errors: :error)
+
+        expect(results[0]).to eq('1')
+        expect(results[1]).to be_a(JQ::ParseError)
+        expect(results[2]).to be_a(JQ::RuntimeError)
+        expect(results[2].message).to include('Cannot index')
+      end
+    end
+
+    it 'raises CompileError for invalid filters' do
+      expect {
+        JQ.filter_many(jsons, '. @@@ .')
+      }.to raise_error(JQ::CompileError)
+    end
+
+    it 'raises ArgumentError for unknown error modes' do
+      expect {
+        JQ.filter_many(jsons, '.', errors: :ignore)
+      }.to raise_error(ArgumentError)
+    end
+
+    it 'raises TypeError for non-array input' do
+      expect {
+        JQ.filter_many('{}', '.')
+      }.to raise_error(TypeError)
+    end
+
+    it 'raises TypeError for non-string documents' do
+      expect {
+        JQ.filter_many(['{}', 1], '.')
+      }.to raise_error(TypeError)
+    end
+
+    it 'applies sandbox mode by default' do
+      expect(JQ.filter_many(['null'], 'env')).to eq(['{}'])
+    end
+  end
+
+  describe 'parallel execution' do
+    let(:docs) { 500.times.map { |i| %({"n":#{i},"tags":["t#{i}"]}) } }
+
+    it 'returns the same results as sequential execution' do
+      expected = JQ.filter_many(docs, '.n * 2')
+      expect(JQ.filter_many(docs, '.n * 2', parallel: 4)).to eq(expected)
+    end
+
+    it 'preserves input order' do
+      results = JQ.filter_many(docs, '.tags[0]', raw_output: true, parallel: 3)
+      expect(results).to eq(500.times.map { |i| "t#{i}" })
+    end
+
+    it 'handles more threads than documents' do
+      expect(JQ.filter_many(['1', '2'], '. + 1', parallel: 8)).to eq(['2', '3'])
+    end
+
+    it 'supports multiple_outputs' do
+      results = JQ.filter_many(docs.first(10), '.n, .n', multiple_outputs: true, parallel: 2)
+      expect(results).to eq(10.times.map { |i| [i.to_s, i.to_s] })
+    end
+
+    it 'raises the error of the first failing document' do
+      input = docs.dup
+      input[100] = 'invalid'
+      input[400] = '"x"'
+
+      expect {
+        JQ.filter_many(input, '.n', parallel: 4)
+      }.to raise_error(JQ::ParseError)
+    end
+
+    it 'reports per-document errors in place' do
+      input = ['{"n":1}', 'invalid', '{"n":3}', '"x"']
+      results = JQ.filter_many(input, '.n', errors: :error, parallel: 2)
+
+      expect(results[0]).to eq('1')
+      expect(results[1]).to be_a(JQ::ParseError)
+      expect(results[2]).to eq('3')
+      expect(results[3]).to be_a(JQ::RuntimeError)
+    end
+
+    it 'applies the sandbox flag to every worker' do
+      results = JQ.filter_many(['null'] * 4, 'env', parallel: 4)
+      expect(results).to eq(['{}'] * 4)
+    end
+
+    it 'works with a compiled program' do
+      program = JQ.compile('.n')
+      2.times do
+        expect(program.call_many(docs, parallel: 4)).to eq(500.times.map(&:to_s))
+      end
+    end
+
+    it 'raises ArgumentError for out of range values' do
+      expect { JQ.filter_many(docs, '.', parallel: 0) }.to raise_error(ArgumentError)
+      expect { JQ.filter_many(docs, '.', parallel: 257) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'JQ::Program#call_many' do
+    let(:program) { JQ.compile('.id') }
+
+    it 'returns one result per document' do
+      expect(program.call_many(jsons)).to eq(['1', '2', '3'])
+    end
+
+    it 'can be reused across batches' do
+      3.times { expect(program.call_many(jsons)).to eq(['1', '2', '3']) }
+    end
+
+    it 'keeps working after a failing batch' do
+      expect { program.call_many(['invalid']) }.to raise_error(JQ::ParseError)
+      expect(program.call_many(jsons)).to eq(['1', '2', '3'])
+    end
+
+    it 'supports the errors option' do
+      expect(program.call_many(['invalid', '{"id":5}'], errors: :nil)).to eq([nil, '5'])
+    end
+  end
+end
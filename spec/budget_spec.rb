@@ -0,0 +1,101 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'Execution budget' do
+  # Runs for seconds without producing a result
+  let(:slow_filter) { '[range(1e7)] | length' }
+
+  describe 'timeout:' do
+    it 'stops a filter that produces no result in time' do
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      expect { JQ.filter('null', slow_filter, timeout: 0.05) }
+        .to raise_error(JQ::TimeoutError, /timed out after 0.05 seconds/)
+      expect(Process.clock_gettime(Process::CLOCK_MONOTONIC) - started).to be < 1
+    end
+
+    it 'stops a filter producing results forever' do
+      expect { JQ.filter('0', 'repeat(.)', multiple_outputs: true, timeout: 0.05) }
+        .to raise_error(JQ::TimeoutError)
+    end
+
+    it 'does not affect filters that finish in time' do
+      expect(JQ.filter('[1,2,3]', 'map(. * 2)', timeout: 5)).to eq('[2,4,6]')
+    end
+
+    it 'applies to every document of a batch' do
+      results = JQ.filter_many(['1', '[1]'], 'if type == "number" then . else [range(1e7)] | length end',
+                               timeout: 0.05, errors: :error)
+      expect(results[0]).to eq('1')
+      expect(results[1]).to be_a(JQ::TimeoutError)
+    end
+
+    it 'works with compiled programs' do
+      program = JQ.compile(slow_filter)
+      expect { program.call('null', timeout: 0.05) }.to raise_error(JQ::TimeoutError)
+      expect(JQ.compile('.a').call('{"a":1}', timeout: 0.05)).to eq('1')
+    end
+
+    it 'leaves the jq_state reusable' do
+      program = JQ.compile('if . then [range(1e7)] | length else "done" end', pool_size: 1)
+      expect { program.call('true', timeout: 0.05) }.to raise_error(JQ::TimeoutError)
+      expect(program.call('false')).to eq('"done"')
+    end
+
+    it 'rejects non-positive values' do
+      expect { JQ.filter('1', '.', timeout: 0) }.to raise_error(ArgumentError)
+      expect { JQ.filter('1', '.', timeout: -1) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'max_steps:' do
+    it 'stops a filter after the given number of instructions' do
+      expect { JQ.filter('null', slow_filter, max_steps: 10_000) }
+        .to raise_error(JQ::TimeoutError, /max_steps \(10000\)/)
+    end
+
+    it 'does not affect small filters' do
+      expect(JQ.filter('{"a":1}', '.a', max_steps: 10_000)).to eq('1')
+    end
+
+    it 'is counted per document of a stream' do
+      expect(JQ.filter_stream("1\n2\n3\n", '. + 1', max_steps: 1000).to_a).to eq(%w[2 3 4])
+    end
+
+    it 'rejects non-positive values' do
+      expect { JQ.filter('1', '.', max_steps: 0) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'max_outputs:' do
+    it 'raises once a filter produces more results' do
+      expect { JQ.filter('0', 'repeat(.)', multiple_outputs: true, max_outputs: 100) }
+        .to raise_error(JQ::TimeoutError, /max_outputs \(100\)/)
+    end
+
+    it 'allows exactly max_outputs results' do
+      expect(JQ.filter('[1,2,3]', '.[]', multiple_outputs: true, max_outputs: 3)).to eq(%w[1 2 3])
+    end
+
+    it 'yields the results before the limit from each' do
+      results = []
+      expect { JQ.each('0', 'range(10)', max_outputs: 4) { |r| results << r } }
+        .to raise_error(JQ::TimeoutError)
+      expect(results).to eq(%w[0 1 2 3])
+    end
+
+    it 'writes the results before the limit with filter_into' do
+      buffer = +''
+      expect { JQ.filter_into('0', 'range(10)', buffer, max_outputs: 2) }.to raise_error(JQ::TimeoutError)
+      expect(buffer).to eq("0\n1\n")
+    end
+
+    it 'rejects non-positive values' do
+      expect { JQ.filter('1', '.', max_outputs: 0) }.to raise_error(ArgumentError)
+    end
+  end
+
+  it 'is a JQ::Error' do
+    expect(JQ::TimeoutError.ancestors).to include(JQ::Error)
+  end
+end
@@ -0,0 +1,93 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'Compiled filter cache' do
+  before do
+    JQ.clear_cache
+    JQ.cache_capacity = 4
+  end
+
+  after do
+    JQ.cache_capacity = 0
+    JQ.clear_cache
+  end
+
+  it 'is disabled by default' do
+    JQ.cache_capacity = 0
+    JQ.filter('{"a":1}', '.a')
+    expect(JQ.cache_stats).to include(size: 0, hits: 0, misses: 0)
+  end
+
+  it 'returns the same results as the uncached path' do
+    json = '[{"id":1,"tags":["a","b"]},{"id":2,"tags":[]}]'
+    2.times do
+      expect(JQ.filter(json, '.[] | .id', multiple_outputs: true)).to eq(['1', '2'])
+      expect(JQ.filter(json, '.[0].tags[]', multiple_outputs: true, raw_output: true)).to eq(['a', 'b'])
+    end
+  end
+
+  it 'counts hits and misses' do
+    3.times { JQ.filter('{"a":1}', '.a') }
+    stats = JQ.cache_stats
+    expect(stats[:misses]).to eq(1)
+    expect(stats[:hits]).to eq(2)
+    expect(stats[:size]).to eq(1)
+    expect(stats[:compile_time_saved]).to be > 0
+  end
+
+  it 'keys entries by sandbox flag' do
+    JQ.filter('null', '.')
+    JQ.filter('null', '.', sandbox: false)
+    expect(JQ.cache_stats).to include(misses: 2, size: 2)
+  end
+
+  it 'evicts the least recently used filter' do
+    JQ.filter('1', '. + 1')
+    JQ.filter('1', '. + 2')
+    JQ.filter('1', '. + 3')
+    JQ.filter('1', '. + 4')
+    JQ.filter('1', '. + 1') # refresh ". + 1"
+    JQ.filter('1', '. + 5') # evicts ". + 2"
+
+    expect(JQ.cache_stats).to include(size: 4, evictions: 1)
+    JQ.filter('1', '. + 1')
+    expect(JQ.cache_stats[:misses]).to eq(5)
+    JQ.filter('1', '. + 2')
+    expect(JQ.cache_stats[:misses]).to eq(6)
+  end
+
+  it 'evicts entries when the capacity shrinks' do
+    4.times { |i| JQ.filter('1', ". + #{i}") }
+    JQ.cache_capacity = 1
+    expect(JQ.cache_stats).to include(size: 1, capacity: 1, evictions: 3)
+  end
+
+  it 'does not cache filters that fail to compile' do
+    expect { JQ.filter('{}', '. @@@ .') }.to raise_error(JQ::CompileError)
+    expect(JQ.cache_stats[:size]).to eq(0)
+  end
+
+  it 'rejects a negative capacity' do
+    expect { JQ.cache_capacity = -1 }.to raise_error(ArgumentError)
+  end
+
+  it 'clear_cache drops entries and resets statistics' do
+    JQ.filter('1', '.')
+    JQ.filter('1', '.')
+    JQ.clear_cache
+    expect(JQ.cache_stats).to include(size: 0, hits: 0, misses: 0, evictions: 0)
+  end
+
+  it 'serves concurrent callers of one cached filter' do
+    threads = 8.times.map do |i|
+      Thread.new do
+        50.times.map { JQ.filter("[#{i}]", '.[0] * 10') }.uniq
+      end
+    end
+
+    threads.each_with_index do |thread, i|
+      expect(thread.value).to eq([(i * 10).to_s])
+    end
+  end
+end
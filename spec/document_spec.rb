@@ -0,0 +1,149 @@
+# frozen_string_literal: true
+
+require 'json'
+require 'objspace'
+require 'spec_helper'
+
+RSpec.describe JQ::Document do
+  let(:json) { '{"users":[{"name":"Alice","age":30},{"name":"Bob","age":17}],"total":2}' }
+  let(:doc) { described_class.new(json) }
+
+  it 'gives the same results as the JSON text' do
+    ['.', '.total', '[.users[] | .name]', '.users[] | .age', '.missing'].each do |filter|
+      expect(JQ.filter(doc, filter)).to eq(JQ.filter(json, filter))
+      expect(JQ.filter(doc, filter, multiple_outputs: true)).to eq(JQ.filter(json, filter, multiple_outputs: true))
+    end
+  end
+
+  it 'can be filtered any number of times' do
+    program = JQ.compile('.users | map(.age) | add')
+    expect(Array.new(3) { program.call(doc) }).to eq(%w[47 47 47])
+  end
+
+  it 'is not changed by filters that update it' do
+    expect(JQ.filter(doc, '.total = 5 | .total')).to eq('5')
+    expect(JQ.filter(doc, '.total')).to eq('2')
+  end
+
+  it 'supports the output options and budget' do
+    expect(JQ.filter(doc, '.users[].name', raw_output: true, multiple_outputs: true)).to eq(%w[Alice Bob])
+    expect(JQ.filter(doc, '.users[0]', compact_output: false)).to eq(JQ.filter(json, '.users[0]', compact_output: false))
+    expect { JQ.filter(doc, '[range(1e9)]', max_steps: 1000) }.to raise_error(JQ::TimeoutError)
+    expect { JQ.filter(doc, '.total.x') }.to raise_error(JQ::RuntimeError)
+  end
+
+  it 'can be shared by threads calling programs' do
+    # Each state is checked in holding the document; the next call on it must not drop that
+    program = JQ.compile('.users[0].name', pool_size: 4)
+    other = JQ.compile('[.users[] | .age] | add, length', pool_size: 4)
+    doc = self.doc
+
+    threads = Array.new(8) do |i|
+      Thread.new do
+        Array.new(200) do
+          i.even? ? program.call(doc) : [program.call(json), other.call(doc, multiple_outputs: true)]
+        end.uniq
+      end
+    end
+
+    expect(threads.map(&:value)).to eq(Array.new(8) { |i| i.even? ? ['"Alice"'] : [['"Alice"', %w[47 2]]] })
+    GC.start
+    expect(doc.to_json).to eq(json)
+  end
+
+  it 'binds program args' do
+    program = JQ.compile('[.users[] | select(.age >= $min) | .name]', args: [:min])
+    expect(program.call(doc, args: { min: 18 })).to eq('["Alice"]')
+  end
+
+  it 'works through the filter cache' do
+    JQ.cache_capacity = 4
+    2.times { expect(JQ.filter(doc, '.users[1].name')).to eq('"Bob"') }
+  ensure
+    JQ.cache_capacity = 0
+    JQ.clear_cache
+  end
+
+  it 'works with program sets' do
+    fields = JQ::ProgramSet.new({ total: '.total', names: '[.users[].name]' })
+    expect(fields.call(doc)).to eq(total: '2', names: '["Alice","Bob"]')
+    expect(JQ.filter_multi(doc, { first: '.users[0].name' })).to eq(first: '"Alice"')
+  end
+
+  context 'with document: true' do
+    it 'returns results as documents' do
+      adults = JQ.filter(json, '[.users[] | select(.age >= 18)]', document: true)
+      expect(adults).to be_a(described_class)
+      expect(adults.to_json).to eq('[{"name":"Alice","age":30}]')
+      expect(JQ.filter(adults, '.[0].name')).to eq('"Alice"')
+    end
+
+    it 'returns an array of documents with multiple_outputs' do
+      users = JQ.compile('.users[]').call(doc, document: true, multiple_outputs: true)
+      expect(users).to all(be_a(described_class))
+      expect(users.map { |user| user.to_ruby['name'] }).to eq(%w[Alice Bob])
+    end
+
+    it 'returns a null document without results' do
+      expect(JQ.filter(doc, 'empty', document: true).to_ruby).to be_nil
+    end
+
+    it 'returns documents from program sets' do
+      result = JQ::ProgramSet.new({ first: '.users[0]' }).call(json, document: true)
+      expect(result[:first].to_ruby).to eq('name' => 'Alice', 'age' => 30)
+    end
+
+    it 'keeps documents valid while other threads run the same program' do
+      # The literals are the state's constants; the documents must not share them
+      program = JQ.compile('{k: "literal", list: [1, "two", 100000000000000000000001]} + {n: (.users | length)}',
+                           pool_size: 2)
+      expected = program.call(json)
+
+      docs = Array.new(2) { Thread.new { Array.new(200) { program.call(json, document: true) } } }
+      calls = Array.new(4) { Thread.new { Array.new(200) { program.call(json) }.uniq } }
+
+      expect(calls.map(&:value)).to all(eq([expected]))
+      docs = docs.flat_map(&:value)
+      GC.start
+      expect(docs.map(&:to_json).uniq).to eq([expected])
+      expect(docs.map { |d| JQ.filter(d, '.list[1]') }.uniq).to eq(['"two"'])
+    end
+  end
+
+  describe '#to_json' do
+    it 'serializes with the formatting options' do
+      doc = described_class.new('{"b":1,"a":[2]}')
+      expect(doc.to_json).to eq('{"b":1,"a":[2]}')
+      expect(doc.to_json(sort_keys: true)).to eq('{"a":[2],"b":1}')
+      expect(doc.to_json(compact_output: false)).to eq(JQ.filter('{"b":1,"a":[2]}', '.', compact_output: false))
+    end
+
+    it 'can be embedded with the json library' do
+      expect(JSON.generate({ 'doc' => described_class.new('[1,{"a":null}]') })).to eq('{"doc":[1,{"a":null}]}')
+    end
+  end
+
+  describe '#to_ruby' do
+    it 'converts like JQ.filter_object' do
+      expect(doc.to_ruby(symbolize_names: true)).to eq(JQ.filter_object(JSON.parse(json), '.', symbolize_names: true))
+      expect(doc.to_ruby(freeze: true)).to be_frozen
+    end
+  end
+
+  it 'reports the memory it holds' do
+    small = described_class.new('1')
+    large = described_class.new(JSON.generate(Array.new(10_000) { |i| { 'id' => i, 'name' => "user#{i}" } }))
+
+    expect(ObjectSpace.memsize_of(large)).to be > ObjectSpace.memsize_of(small) + 100_000
+  end
+
+  it 'raises ParseError for invalid JSON' do
+    expect { described_class.new('{"a":') }.to raise_error(JQ::ParseError)
+  end
+
+  it 'rejects other inputs' do
+    expect { described_class.new(nil) }.to raise_error(TypeError)
+    expect { JQ.filter(Object.new, '.') }.to raise_error(TypeError)
+    expect { described_class.allocate.to_json }.to raise_error(JQ::Error, /Uninitialized/)
+  end
+end
@@ -0,0 +1,106 @@
+# frozen_string_literal: true
+
+require 'json'
+require 'spec_helper'
+
+RSpec.describe 'JQ::Program#dump' do
+  let(:json) { '{"users":[{"name":"Alice","age":30},{"name":"Bob","age":17}]}' }
+
+  it 'loads into a program that gives the same results' do
+    filter = '[.users[] | select(.age >= 18) | {name, label: "adult" + (.age | tostring)}]'
+    program = JQ::Program.load(JQ.compile(filter).dump)
+
+    expect(program).to be_a(JQ::Program)
+    expect(program.call(json)).to eq(JQ.filter(json, filter))
+  end
+
+  it 'keeps builtins, user functions and closures' do
+    filter = 'def twice(f): f | f; [.users[].age | twice(. * 2)] | add, (.users | map(.name) | join(","))'
+    program = JQ::Program.load(JQ.compile(filter).dump)
+
+    expect(program.call(json, multiple_outputs: true)).to eq(%w[188 "Alice,Bob"])
+  end
+
+  it 'keeps the filter, sandbox and args settings' do
+    original = JQ.compile('[.users[] | select(.age > $min) | .name]', sandbox: false, args: [:min])
+    program = JQ::Program.load(original.dump)
+
+    expect(program.filter).to eq(original.filter)
+    expect(program.sandbox?).to be(false)
+    expect(program.args).to eq(['min'])
+    expect(program.call(json, args: { min: 20 })).to eq('["Alice"]')
+  end
+
+  it 'writes JSON recording the format and jq version' do
+    dump = JSON.parse(JQ.compile('.a').dump)
+
+    expect(dump).to include('format' => 1, 'filter' => '.a', 'sandbox' => true, 'args' => nil)
+    expect(dump['jq']).to match(/\A\d+\.\d+/)
+    expect(dump['bytecode']).to include('cfunctions', 'program')
+  end
+
+  it 'loads extra states for concurrent calls' do
+    program = JQ::Program.load(JQ.compile('.users | length').dump, pool_size: 2)
+    results = Array.new(4) { Thread.new { Array.new(20) { program.call(json) } } }.flat_map(&:value)
+
+    expect(results.uniq).to eq(['2'])
+  end
+
+  it 'loads the states of a parallel batch instead of compiling them' do
+    # A filter text that disagrees with the bytecode shows which one ran
+    dump = JSON.parse(JQ.compile('.n * 2').dump).merge('filter' => '.n * 3')
+    program = JQ::Program.load(JSON.generate(dump))
+    jsons = Array.new(16) { |i| %({"n":#{i}}) }
+
+    expect(program.call_many(jsons, parallel: 4)).to eq(Array.new(16) { |i| (i * 2).to_s })
+  end
+
+  it 'can be dumped again' do
+    program = JQ::Program.load(JQ::Program.load(JQ.compile('.users[0].name').dump).dump)
+    expect(program.call(json)).to eq('"Alice"')
+  end
+
+  it 'refuses a dump from another jq version' do
+    dump = JSON.parse(JQ.compile('.a').dump).merge('jq' => '0.1')
+    expect { JQ::Program.load(JSON.generate(dump)) }
+      .to raise_error(JQ::Error, /made with jq 0\.1/)
+  end
+
+  it 'refuses malformed dumps' do
+    good = JSON.parse(JQ.compile('.a | length').dump)
+    program = good['bytecode']['program']
+
+    [
+      'not json',
+      '[1]',
+      JSON.generate(good.merge('format' => 2)),
+      JSON.generate(good.merge('filter' => nil)),
+      JSON.generate(good.merge('bytecode' => { 'cfunctions' => [], 'program' => program.merge('code' => [65_535]) })),
+      JSON.generate(good.merge('bytecode' => good['bytecode'].merge('cfunctions' => [['no_such_builtin', 1]]))),
+      JSON.generate(good.merge('bytecode' => good['bytecode'].merge('program' => program.merge('code' => program['code'] + ['x']))))
+    ].each do |dump|
+      expect { JQ::Program.load(dump) }.to raise_error(JQ::Error)
+    end
+  end
+
+  it 'refuses dumps whose instructions refer to what does not exist' do
+    good = JSON.parse(JQ.compile('def f: .a; . as $x | f | length + 1').dump)
+    program = good['bytecode']['program']
+
+    [
+      program.merge('constants' => []),
+      program.merge('nlocals' => 0),
+      program.merge('subfunctions' => []),
+      program.merge('nclosures' => 1),
+      program.merge('code' => program['code'][0...-1])
+    ].each do |broken|
+      dump = JSON.generate(good.merge('bytecode' => good['bytecode'].merge('program' => broken)))
+      expect { JQ::Program.load(dump) }.to raise_error(JQ::Error)
+    end
+    expect(JQ::Program.load(JSON.generate(good)).call('{"a":"xyz"}')).to eq('4')
+  end
+
+  it 'rejects non-string dumps' do
+    expect { JQ::Program.load(nil) }.to raise_error(TypeError)
+  end
+end
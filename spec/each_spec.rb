@@ -0,0 +1,100 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'JQ.each' do
+  let(:json) { '[{"id":1},{"id":2},{"id":3}]' }
+
+  it 'yields every result' do
+    results = []
+    JQ.each(json, '.[] | .id') { |result| results << result }
+    expect(results).to eq(['1', '2', '3'])
+  end
+
+  it 'returns nil with a block' do
+    expect(JQ.each(json, '.[]') { }).to be_nil
+  end
+
+  it 'matches JQ.filter with multiple_outputs' do
+    expected = JQ.filter(json, '.[] | .id', multiple_outputs: true)
+    expect(JQ.each(json, '.[] | .id').to_a).to eq(expected)
+  end
+
+  it 'returns an Enumerator without a block' do
+    enum = JQ.each(json, '.[] | .id')
+    expect(enum).to be_a(Enumerator)
+    expect(enum.next).to eq('1')
+    expect(enum.next).to eq('2')
+  end
+
+  it 'yields nothing when the filter produces no results' do
+    expect(JQ.each(json, 'empty').to_a).to eq([])
+  end
+
+  it 'supports formatting options' do
+    results = JQ.each('["a","b"]', '.[]', raw_output: true).to_a
+    expect(results).to eq(['a', 'b'])
+  end
+
+  it 'handles more results than a single batch' do
+    expect(JQ.each('null', 'range(1000)').to_a).to eq((0...1000).map(&:to_s))
+  end
+
+  it 'stops the filter when the block breaks' do
+    seen = 0
+    JQ.each('null', 'range(1000000)') do
+      seen += 1
+      break if seen == 10
+    end
+    expect(seen).to eq(10)
+  end
+
+  it 'supports lazy enumerators' do
+    expect(JQ.each('null', 'range(1000000)').lazy.map(&:to_i).select(&:even?).first(3)).to eq([0, 2, 4])
+  end
+
+  it 'yields results produced before a runtime error' do
+    seen = []
+    expect {
+      JQ.each('[1,"a",3]', '.[] | . + 1') { |result| seen << result }
+    }.to raise_error(JQ::RuntimeError)
+    expect(seen).to eq(['2'])
+  end
+
+  it 'raises ParseError for invalid JSON' do
+    expect {
+      JQ.each('[1,', '.[]') { }
+    }.to raise_error(JQ::ParseError)
+  end
+
+  it 'raises CompileError for invalid filters' do
+    expect {
+      JQ.each(json, '. @@@ .') { }
+    }.to raise_error(JQ::CompileError)
+  end
+
+  it 'propagates exceptions raised by the block' do
+    expect {
+      JQ.each(json, '.[]') { raise ArgumentError, 'stop' }
+    }.to raise_error(ArgumentError, 'stop')
+  end
+
+  describe 'JQ::Program#each' do
+    let(:program) { JQ.compile('.[] | .id') }
+
+    it 'yields every result' do
+      expect(program.each(json).to_a).to eq(['1', '2', '3'])
+    end
+
+    it 'can be reused after breaking out' do
+      program.each(json) { break }
+      expect(program.each(json).to_a).to eq(['1', '2', '3'])
+    end
+
+    it 'can be called again from inside its own block' do
+      nested = []
+      program.each(json) { |id| nested << program.each(json).first }
+      expect(nested).to eq(['1', '1', '1'])
+    end
+  end
+end
@@ -0,0 +1,101 @@
+# frozen_string_literal: true
+
+require 'pathname'
+require 'spec_helper'
+require 'tempfile'
+
+RSpec.describe 'JQ.filter_file' do
+  let(:json) { '{"meta":{"count":2},"items":[{"id":1,"name":"a"},{"id":2,"name":"b"}]}' }
+  let(:file) do
+    Tempfile.new(['filter_file', '.json']).tap do |f|
+      f.write(json)
+      f.flush
+    end
+  end
+
+  after { file.close! }
+
+  it 'gives the same results as JQ.filter on the file contents' do
+    ['.', '.meta.count', '[.items[] | .name]', '.items | map(.id) | add'].each do |filter|
+      expect(JQ.filter_file(file.path, filter)).to eq(JQ.filter(json, filter))
+    end
+  end
+
+  it 'accepts a Pathname' do
+    expect(JQ.filter_file(Pathname(file.path), '.meta.count')).to eq('2')
+  end
+
+  it 'supports the options of JQ.filter' do
+    expect(JQ.filter_file(file.path, '.items[].name', multiple_outputs: true, raw_output: true))
+      .to eq(%w[a b])
+    expect(JQ.filter_file(file.path, '.items[0]', compact_output: false))
+      .to eq(JQ.filter(json, '.items[0]', compact_output: false))
+    expect { JQ.filter_file(file.path, '[range(1e9)]', max_steps: 1000) }
+      .to raise_error(JQ::TimeoutError)
+  end
+
+  it 'records stats' do
+    JQ.filter_file(file.path, '.items[0].id', stats: true)
+    expect(JQ.last_stats.input_bytes).to eq(json.bytesize)
+  end
+
+  it 'parses documents larger than one parser chunk' do
+    big = Tempfile.new(['filter_file_big', '.json'])
+    big.write("[#{Array.new(200_000) { |i| %({"id":#{i},"pad":"#{'x' * 8}"}) }.join(',')}]")
+    big.flush
+
+    expect(JQ.filter_file(big.path, 'length')).to eq('200000')
+    expect(JQ.filter_file(big.path, '.[-1].id')).to eq('199999')
+  ensure
+    big.close!
+  end
+
+  it 'raises ParseError for invalid, empty or multi-document files' do
+    ['{"a":', '', '1 2'].each do |text|
+      File.write(file.path, text)
+      expect { JQ.filter_file(file.path, '.') }.to raise_error(JQ::ParseError)
+    end
+  end
+
+  it 'raises for missing files and directories' do
+    expect { JQ.filter_file('/nonexistent/file.json', '.') }.to raise_error(Errno::ENOENT)
+    expect { JQ.filter_file(Dir.tmpdir, '.') }.to raise_error(ArgumentError, /not a regular file/)
+  end
+
+  it 'raises CompileError for an invalid filter' do
+    expect { JQ.filter_file(file.path, '.[') }.to raise_error(JQ::CompileError)
+  end
+
+  it 'works through the filter cache' do
+    JQ.cache_capacity = 4
+    2.times { expect(JQ.filter_file(file.path, '.meta.count + 1')).to eq('3') }
+  ensure
+    JQ.cache_capacity = 0
+    JQ.clear_cache
+  end
+
+  context 'with stream: true' do
+    it 'runs the filter on each jq --stream event' do
+      events = JQ.filter_file(file.path, '.', stream: true).to_a
+      expect(events.first).to eq('[["meta","count"],2]')
+      expect(events.last).to eq('[["items"]]')
+      expect(events.size).to eq(10)
+    end
+
+    it 'yields results to a block and returns nil' do
+      ids = []
+      result = JQ.filter_file(file.path, 'select(length == 2 and .[0][-1] == "id") | .[1]',
+                              stream: true) { |id| ids << id }
+      expect(result).to be_nil
+      expect(ids).to eq(%w[1 2])
+    end
+
+    it 'raises ParseError after yielding the events before the error' do
+      File.write(file.path, '[1,2,')
+      events = []
+      expect { JQ.filter_file(file.path, '.', stream: true) { |e| events << e } }
+        .to raise_error(JQ::ParseError)
+      expect(events).to eq(['[[0],1]', '[[1],2]'])
+    end
+  end
+end
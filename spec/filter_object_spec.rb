@@ -0,0 +1,141 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'JQ.filter_object' do
+  let(:data) do
+    {
+      'name' => 'Alice',
+      'age' => 30,
+      'score' => 9.5,
+      'active' => true,
+      'manager' => nil,
+      'tags' => ['admin', 'dev']
+    }
+  end
+
+  it 'applies a filter to a Hash' do
+    expect(JQ.filter_object(data, '.name')).to eq('Alice')
+  end
+
+  it 'returns Ruby objects' do
+    expect(JQ.filter_object(data, '{n: .name, t: .tags}')).to eq({ 'n' => 'Alice', 't' => ['admin', 'dev'] })
+  end
+
+  it 'round-trips every supported type' do
+    expect(JQ.filter_object(data, '.')).to eq(data)
+  end
+
+  it 'matches parsing the output of JQ.filter' do
+    filter = '{name, older: (.age + 1), tags: (.tags | map(ascii_upcase))}'
+    expected = JSON.parse(JQ.filter(data.to_json, filter))
+    expect(JQ.filter_object(data, filter)).to eq(expected)
+  end
+
+  it 'accepts Arrays and scalars as input' do
+    expect(JQ.filter_object([1, 2, 3], 'add')).to eq(6)
+    expect(JQ.filter_object('hello', 'ascii_upcase')).to eq('HELLO')
+    expect(JQ.filter_object(nil, '.')).to be_nil
+  end
+
+  it 'converts Symbol keys and values to strings' do
+    expect(JQ.filter_object({ status: :ok }, '.status')).to eq('ok')
+  end
+
+  it 'returns Integers for integral results and Floats otherwise' do
+    expect(JQ.filter_object({ 'a' => 3 }, '.a * 2')).to eql(6)
+    expect(JQ.filter_object({ 'a' => 3 }, '.a / 2')).to eql(1.5)
+  end
+
+  it 'keeps integral Floats as Floats' do
+    expect(JQ.filter_object({ 'a' => 1.0 }, '.a')).to eql(1.0)
+  end
+
+  it 'preserves large Integers passed through unchanged' do
+    big = 2**70
+    expect(JQ.filter_object({ 'n' => big }, '.n')).to eq(big)
+  end
+
+  it 'returns nil when the filter produces no results' do
+    expect(JQ.filter_object(data, 'empty')).to be_nil
+  end
+
+  it 'returns UTF-8 strings' do
+    result = JQ.filter_object({ 'city' => 'Zürich' }, '.city')
+    expect(result).to eq('Zürich')
+    expect(result.encoding).to eq(Encoding::UTF_8)
+  end
+
+  it 'transcodes strings in other encodings' do
+    input = 'café'.encode('ISO-8859-1')
+    expect(JQ.filter_object(input, '.')).to eq('café')
+  end
+
+  describe 'options' do
+    it 'supports symbolize_names' do
+      result = JQ.filter_object({ 'user' => { 'id' => 1 } }, '.', symbolize_names: true)
+      expect(result).to eq({ user: { id: 1 } })
+    end
+
+    it 'supports freeze' do
+      result = JQ.filter_object({ 'list' => ['a'] }, '.', freeze: true)
+      expect(result).to be_frozen
+      expect(result['list']).to be_frozen
+      expect(result['list'][0]).to be_frozen
+    end
+
+    it 'supports multiple_outputs' do
+      expect(JQ.filter_object([1, 2, 3], '.[]', multiple_outputs: true)).to eq([1, 2, 3])
+      expect(JQ.filter_object([], '.[]', multiple_outputs: true)).to eq([])
+    end
+
+    it 'applies sandbox mode by default' do
+      expect(JQ.filter_object(nil, 'env')).to eq({})
+    end
+  end
+
+  describe 'errors' do
+    it 'raises CompileError for invalid filters' do
+      expect {
+        JQ.filter_object(data, '. @@@ .')
+      }.to raise_error(JQ::CompileError)
+    end
+
+    it 'raises RuntimeError for failing filters' do
+      expect {
+        JQ.filter_object(data, '.name | .first')
+      }.to raise_error(JQ::RuntimeError)
+    end
+
+    it 'raises TypeError for unsupported objects' do
+      expect {
+        JQ.filter_object({ 'at' => Time.now }, '.')
+      }.to raise_error(TypeError)
+    end
+
+    it 'raises TypeError for unsupported Hash keys' do
+      expect {
+        JQ.filter_object({ 1 => 'one' }, '.')
+      }.to raise_error(TypeError)
+    end
+
+    it 'raises ArgumentError for recursive structures' do
+      recursive = []
+      recursive << recursive
+
+      expect {
+        JQ.filter_object(recursive, '.')
+      }.to raise_error(ArgumentError, /too deep/)
+    end
+  end
+
+  it 'uses the compiled filter cache when enabled' do
+    JQ.clear_cache
+    JQ.cache_capacity = 4
+    2.times { expect(JQ.filter_object(data, '.age')).to eq(30) }
+    expect(JQ.cache_stats[:hits]).to eq(1)
+  ensure
+    JQ.cache_capacity = 0
+    JQ.clear_cache
+  end
+end
@@ -0,0 +1,80 @@
+# frozen_string_literal: true
+
+require 'objspace'
+require 'spec_helper'
+
+RSpec.describe 'JQ::Program#freeze' do
+  let(:json) { '{"users":[{"name":"Alice","tags":["a","b"]},{"name":"Bob","tags":[]}]}' }
+  let(:filter) { '[.users[] | {name, tagged: (.tags | length > 0), kind: "user", limits: [1, 2.5, {"max": 10}]}]' }
+
+  it 'returns the frozen program' do
+    program = JQ.compile(filter)
+
+    expect(program.freeze).to be(program)
+    expect(program).to be_frozen
+  end
+
+  it 'gives the same results as before freezing' do
+    program = JQ.compile(filter)
+    before = program.call(json)
+
+    program.freeze
+    expect(Array.new(3) { program.call(json) }.uniq).to eq([before])
+    expect(program.call(json)).to eq(JQ.filter(json, filter))
+  end
+
+  it 'keeps working for concurrent calls' do
+    program = JQ.compile('.users | map(.name) | join(",")').freeze
+    results = Array.new(4) { Thread.new { Array.new(20) { program.call(json) } } }.flat_map(&:value)
+
+    expect(results.uniq).to eq(['"Alice,Bob"'])
+  end
+
+  it 'gives its states back to be compiled again once collected or released' do
+    # Frozen states go back to the state pool, where compiling thaws them
+    programs = Array.new(20) { JQ.compile(filter).freeze }
+    busy = Array.new(8) { Thread.new { programs.map { |p| p.call_many(Array.new(8, json), parallel: 4) }.flatten.uniq } }
+    expect(busy.map(&:value).uniq).to eq([[JQ.filter(json, filter)]])
+
+    programs = nil
+    GC.start
+    expect(Array.new(20) { |i| JQ.filter(json, ".users[#{i % 2}].name") }.uniq).to eq(%w["Alice" "Bob"])
+    expect(ObjectSpace.memsize_of(JQ.compile('.').freeze)).to be < 4096
+  end
+
+  it 'does not let constants be modified through results' do
+    program = JQ.compile('{"a": [1, 2]} | .a += [3]').freeze
+
+    expect(program.call('null')).to eq('{"a":[1,2,3]}')
+    expect(program.call('null')).to eq('{"a":[1,2,3]}')
+  end
+
+  it 'can be dumped and loaded' do
+    program = JQ.compile(filter).freeze
+    expect(JQ::Program.load(program.dump).call(json)).to eq(program.call(json))
+  end
+
+  it 'cannot be reinitialized' do
+    program = JQ.compile('.a').freeze
+    expect { program.send(:initialize, '.b') }.to raise_error(FrozenError)
+  end
+
+  it 'runs in forked children', skip: !Process.respond_to?(:fork) && 'fork is not available' do
+    program = JQ.compile(filter).freeze
+    expected = program.call(json)
+
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      writer.write(program.call(json))
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    output = reader.read
+    _, status = Process.wait2(pid)
+
+    expect(status).to be_success
+    expect(output).to eq(expected)
+  end
+end
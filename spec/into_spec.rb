@@ -0,0 +1,131 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+require 'stringio'
+require 'tempfile'
+
+RSpec.describe 'JQ.filter_into' do
+  let(:json) { '[{"id":1,"name":"a"},{"id":2,"name":"b"}]' }
+
+  it 'appends every result to a String, newline-terminated' do
+    buffer = +''
+    JQ.filter_into(json, '.[]', buffer)
+    expect(buffer).to eq(%({"id":1,"name":"a"}\n{"id":2,"name":"b"}\n))
+  end
+
+  it 'returns the destination' do
+    buffer = +''
+    expect(JQ.filter_into(json, '.[0].id', buffer)).to equal(buffer)
+  end
+
+  it 'appends to existing content' do
+    buffer = +"header\n"
+    JQ.filter_into(json, '.[].id', buffer)
+    expect(buffer).to eq("header\n1\n2\n")
+  end
+
+  it 'matches JQ.filter with multiple_outputs' do
+    expected = JQ.filter(json, '.[] | .name', multiple_outputs: true)
+    expect(JQ.filter_into(json, '.[] | .name', +'')).to eq(expected.map { |r| "#{r}\n" }.join)
+  end
+
+  it 'writes nothing when the filter produces no results' do
+    expect(JQ.filter_into(json, 'empty', +'')).to eq('')
+  end
+
+  it 'supports formatting options' do
+    expect(JQ.filter_into(json, '.[].name', +'', raw_output: true)).to eq("a\nb\n")
+    expect(JQ.filter_into('{"b":1,"a":2}', '.', +'', sort_keys: true)).to eq(%({"a":2,"b":1}\n))
+    pretty = JQ.filter('{"a":1}', '.', compact_output: false)
+    expect(JQ.filter_into('{"a":1}', '.', +'', compact_output: false)).to eq("#{pretty}\n")
+  end
+
+  it 'writes raw strings containing NUL bytes' do
+    expect(JQ.filter_into('"a\\u0000b"', '.', +'', raw_output: true)).to eq("a\0b\n")
+  end
+
+  it 'writes to an IO' do
+    io = StringIO.new
+    JQ.filter_into(json, '.[].id', io)
+    expect(io.string).to eq("1\n2\n")
+  end
+
+  it 'writes to a File' do
+    Tempfile.create('into') do |file|
+      JQ.filter_into(json, '.[].name', file, raw_output: true)
+      file.flush
+      expect(File.read(file.path)).to eq("a\nb\n")
+    end
+  end
+
+  it 'handles output larger than the flush size' do
+    io = StringIO.new
+    writes = 0
+    io.define_singleton_method(:write) { |chunk| writes += 1; super(chunk) }
+
+    JQ.filter_into('null', 'range(100000)', io)
+    expect(io.string).to eq((0...100_000).map { |i| "#{i}\n" }.join)
+    expect(writes).to be > 1
+  end
+
+  it 'handles a single result larger than the flush size' do
+    big = { 'items' => (1..50_000).to_a }.to_json
+    expect(JQ.filter_into(big, '.', +'')).to eq("#{big}\n")
+  end
+
+  it 'writes output produced before a runtime error' do
+    buffer = +''
+    expect {
+      JQ.filter_into('[1,"a",3]', '.[] | . + 1', buffer)
+    }.to raise_error(JQ::RuntimeError)
+    expect(buffer).to eq("2\n")
+  end
+
+  it 'raises ParseError for invalid JSON' do
+    expect { JQ.filter_into('[1,', '.[]', +'') }.to raise_error(JQ::ParseError)
+  end
+
+  it 'raises CompileError for invalid filters' do
+    expect { JQ.filter_into(json, '. @@@ .', +'') }.to raise_error(JQ::CompileError)
+  end
+
+  it 'raises FrozenError for a frozen String' do
+    expect { JQ.filter_into(json, '.', '') }.to raise_error(FrozenError)
+  end
+
+  it 'raises TypeError for an unsupported destination' do
+    expect { JQ.filter_into(json, '.', 123) }.to raise_error(TypeError)
+  end
+
+  it 'propagates exceptions raised by the IO' do
+    io = Object.new
+    def io.write(_chunk)
+      raise IOError, 'closed stream'
+    end
+
+    expect { JQ.filter_into(json, '.[]', io) }.to raise_error(IOError, 'closed stream')
+  end
+
+  it 'uses the compiled filter cache when enabled' do
+    JQ.clear_cache
+    JQ.cache_capacity = 4
+    2.times { expect(JQ.filter_into(json, '.[0].id', +'')).to eq("1\n") }
+    expect(JQ.cache_stats[:hits]).to eq(1)
+  ensure
+    JQ.cache_capacity = 0
+    JQ.clear_cache
+  end
+
+  describe 'JQ::Program#call_into' do
+    let(:program) { JQ.compile('.[].id') }
+
+    it 'writes every result' do
+      expect(program.call_into(json, +'')).to eq("1\n2\n")
+    end
+
+    it 'can be reused after an error' do
+      expect { program.call_into('oops', +'') }.to raise_error(JQ::ParseError)
+      expect(program.call_into(json, +'')).to eq("1\n2\n")
+    end
+  end
+end
@@ -0,0 +1,97 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'native kernels' do
+  # Parentheses keep the same filter from matching a kernel, so jq runs it
+  def jq(json, filter, **options)
+    JQ.filter(json, "(#{filter})", **options)
+  end
+
+  let(:inputs) do
+    [
+      '{"status":"active","id":1,"user":{"name":"Alice"},"tags":["a","b"]}',
+      '{"status":"inactive","id":2.0,"user":null}',
+      '{"id":100000000000000000001}',
+      '[{"id":1,"name":"a"},{"id":2},{"name":"c"},null]',
+      '{"x":{"id":3},"y":{"id":4}}',
+      'null', '3', '"s"', '[]', '{}'
+    ]
+  end
+
+  {
+    'select(.status == "active")' => :select,
+    'select(.status != "active")' => :select,
+    'select(.user.name == "Alice")' => :select,
+    'select(. == null)' => :select,
+    'select(.id == 1)' => :select,
+    'select(.id==2)' => :select,
+    'select(.id == 100000000000000000000)' => :select,
+    'select(.tags[0] == "a")' => :select,
+    'select(.user != null)' => :select,
+    'select(.missing == false)' => :select,
+    'map(.id)' => :map,
+    'map(.user.name)' => :map,
+    '{id, name}' => :pluck,
+    '{status,id , user}' => :pluck,
+    '.user.name' => :path
+  }.each do |filter, kernel|
+    it "answers #{filter} as jq does" do
+      expect(JQ.compile(filter).kernel).to eq(kernel)
+
+      inputs.each do |json|
+        expected = begin
+          jq(json, filter, multiple_outputs: true)
+        rescue JQ::RuntimeError => e
+          e
+        end
+
+        if expected.is_a?(Exception)
+          expect { JQ.filter(json, filter, multiple_outputs: true) }
+            .to raise_error(JQ::RuntimeError, expected.message)
+        else
+          expect(JQ.filter(json, filter, multiple_outputs: true)).to eq(expected), "#{filter} on #{json}"
+        end
+      end
+    end
+  end
+
+  it 'leaves other filters to jq' do
+    ['.[] | select(.active)', 'select(.a == -1)', 'select(.a == "\\n")', 'select(.a == 1) | .b',
+     'map(.a) | add', 'map(. * 2)', '{a: .b}', '{$x}', '{a: 1}', 'select(.a < 1)', '.', '(.a)'].each do |filter|
+      expect(JQ.compile(filter, args: [:x]).kernel).to be_nil, filter
+    end
+  end
+
+  it 'reports which kernel answered' do
+    JQ.filter('{"status":"active"}', 'select(.status == "active")', stats: true)
+    expect(JQ.last_stats.kernel).to eq(:select)
+    expect(JQ.last_stats.fast_path).to be(false)
+
+    JQ.filter('{"a":{"b":1}}', '.a.b', stats: true)
+    expect(JQ.last_stats.kernel).to eq(:path)
+
+    expect { JQ.filter('3', 'map(.id)', stats: true) }.to raise_error(JQ::RuntimeError)
+    JQ.filter('[1,2]', '(map(.))', stats: true)
+    expect(JQ.last_stats.kernel).to be_nil
+  end
+
+  it 'applies to documents, Ruby objects, batches and program sets' do
+    doc = JQ::Document.new('[{"id":1},{"id":2}]')
+    expect(JQ.filter(doc, 'map(.id)')).to eq('[1,2]')
+    expect(JQ.filter_object([{ 'id' => 1 }], 'map(.id)')).to eq([1])
+    expect(JQ.filter_many(['{"a":1}', '{"a":2}'], 'select(.a == 2)')).to eq(%w[null {"a":2}])
+    expect(JQ::ProgramSet.new({ ids: 'map(.id)' }).call('[{"id":7}]')).to eq(ids: '[7]')
+  end
+
+  it 'keeps the output options and limits' do
+    expect(JQ.filter('{"a":"x","b":1}', '{a}', raw_output: true, compact_output: false))
+      .to eq(JQ.filter('{"a":"x","b":1}', '({a})', compact_output: false))
+    expect { JQ.filter(%([#{Array.new(1000) { '{"id":"xxxxxxxx"}' }.join(',')}]), 'map(.id)', max_memory: 10_000) }
+      .to raise_error(JQ::ResourceError)
+  end
+
+  it 'survives dump and load' do
+    expect(JQ::Program.load(JQ.compile('{id}').dump).kernel).to eq(:pluck)
+  end
+end
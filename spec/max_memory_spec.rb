@@ -0,0 +1,59 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'max_memory:' do
+  let(:limit) { 1 << 20 }
+
+  it 'stops a filter building a large value' do
+    expect { JQ.filter('null', '[range(1e7)] | length', max_memory: limit) }
+      .to raise_error(JQ::ResourceError, /max_memory \(1048576 bytes\)/)
+  end
+
+  it 'stops a filter whose results add up past the limit' do
+    expect { JQ.filter('null', 'range(1e6) | tostring * 10', multiple_outputs: true, max_memory: limit) }
+      .to raise_error(JQ::ResourceError)
+  end
+
+  it 'counts the parsed input' do
+    json = '[' + (['"' + 'x' * 100 + '"'] * 20_000).join(',') + ']'
+    expect { JQ.filter(json, 'length', max_memory: limit) }.to raise_error(JQ::ResourceError)
+  end
+
+  it 'does not count memory freed during the run' do
+    expect(JQ.filter('null', 'reduce range(100000) as $i (0; . + ([$i] | length))', max_memory: limit))
+      .to eq('100000')
+  end
+
+  it 'does not affect small filters' do
+    expect(JQ.filter('{"a":[1,2,3]}', '.a | add', max_memory: limit)).to eq('6')
+  end
+
+  it 'applies to every document of a batch' do
+    results = JQ.filter_many(['1', '0'], 'if . == 1 then . else [range(1e7)] | length end',
+                             max_memory: limit, errors: :error)
+    expect(results[0]).to eq('1')
+    expect(results[1]).to be_a(JQ::ResourceError)
+  end
+
+  it 'applies to parallel batches' do
+    results = JQ.filter_many(%w[1 2 3 4], '[range(1e6)] | length', max_memory: limit, parallel: 4, errors: :error)
+    expect(results).to all(be_a(JQ::ResourceError))
+  end
+
+  it 'works with compiled programs and leaves them reusable' do
+    program = JQ.compile('if . then [range(1e7)] | length else "done" end', pool_size: 1)
+    expect { program.call('true', max_memory: limit) }.to raise_error(JQ::ResourceError)
+    expect(program.call('false', max_memory: limit)).to eq('"done"')
+  end
+
+  it 'rejects non-positive values' do
+    expect { JQ.filter('1', '.', max_memory: 0) }.to raise_error(ArgumentError)
+    expect { JQ.filter('1', '.', max_memory: -1) }.to raise_error(ArgumentError)
+  end
+
+  it 'is a JQ::Error distinct from TimeoutError' do
+    expect(JQ::ResourceError.ancestors).to include(JQ::Error)
+    expect(JQ::ResourceError.ancestors).not_to include(JQ::TimeoutError)
+  end
+end
@@ -0,0 +1,71 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'JQ.parser' do
+  after { JQ.parser = :fast }
+
+  # Result (or error class and message) of the filter with each parser
+  def with_parsers(json, filter = '.')
+    %i[fast jq].map do |parser|
+      JQ.parser = parser
+      JQ.filter(json, filter, multiple_outputs: true)
+    rescue JQ::Error => e
+      [e.class, e.message]
+    end
+  end
+
+  it 'defaults to :fast' do
+    expect(JQ.parser).to eq(:fast)
+  end
+
+  it 'can be switched to jq' do
+    JQ.parser = :jq
+    expect(JQ.parser).to eq(:jq)
+    expect(JQ.filter('{"a":1}', '.a')).to eq('1')
+  end
+
+  it 'rejects unknown parsers' do
+    expect { JQ.parser = :simd }.to raise_error(ArgumentError, /:fast or :jq/)
+  end
+
+  {
+    'objects and arrays' => '{"a":[1,{"b":null}],"c":{},"d":[],"e":true,"f":false}',
+    'duplicate keys' => '{"a":1,"b":2,"a":3}',
+    'numbers' => '[0,-0,1,-1,2.50,1e5,1E-3,-1.5e+10,123456789012345678901234567890]',
+    'escapes' => '"\\" \\\\ \\/ \\b \\f \\n \\r \\t \\u00e9 \\u2603 \\u0041"',
+    'surrogate pairs' => '"\\ud83d\\ude00"',
+    'NUL escapes' => '"a\\u0000b"',
+    'raw UTF-8' => '"café ☃ 😀"',
+    'invalid UTF-8' => "\"a\xFFb\"".b,
+    'long strings' => %("#{'x' * 1000}\\n#{'y' * 100}"),
+    'whitespace' => " \t\r\n{ \"a\" : [ 1 , 2 ] }\n"
+  }.each do |name, json|
+    it "builds the same values as jq for #{name}" do
+      fast, jq = with_parsers(json)
+      expect(fast).to eq(jq)
+      expect(with_parsers(json, 'tojson').uniq.size).to eq(1)
+    end
+  end
+
+  ['[1,]', '{"a":1 "b":2}', '{"a"}', '01', 'nan', '[1] [2]', '', '"unterminated', "\"a\tb\"", '"\\x"', 'tru'].each do |json|
+    it "reports jq's error (or value) for #{json.inspect}" do
+      fast, jq = with_parsers(json)
+      expect(fast).to eq(jq)
+    end
+  end
+
+  it "keeps jq's nesting limit" do
+    [200, 10_001].each do |depth|
+      fast, jq = with_parsers('[' * depth + ']' * depth, 'length')
+      expect(fast).to eq(jq)
+    end
+  end
+
+  it 'is used by every JSON text method' do
+    json = '{"items":[{"id":1},{"id":2}],"n":"\\u00e9"}'
+    expect(JQ.each(json, '.items[].id').to_a).to eq(%w[1 2])
+    expect(JQ.filter_into(json, '.n', +'')).to eq("\"é\"\n")
+    expect(JQ.filter_many([json, '[1'], '.n', errors: :nil)).to eq(['"é"', nil])
+  end
+end
@@ -0,0 +1,93 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'Simple path fast path' do
+  let(:json) do
+    <<~JSON
+      {
+        "user": {"id": 42, "name": "Ada \\"A\\" Lovelace", "tags": ["a", {"x": [true, null, 2.5e3]}]},
+        "items": [{"sku": "x-1"}, {"sku": 2500}, {}],
+        "dup": 1, "dup": {"b": 3},
+        "key with spaces": -0,
+        "esc\\u0061ped": "e",
+        "unicode": "caf\\u00e9 \\u2603 ✓"
+      }
+    JSON
+  end
+
+  # Parentheses make the same filter miss the fast path, so jq runs it
+  def via_jq(input, filter, **opts)
+    JQ.filter(input, "(#{filter})", **opts)
+  end
+
+  paths = [
+    '.user', '.user.id', '.user.name', '.user.tags', '.user.tags[1].x', '.user.tags[1].x[2]',
+    '.items[0].sku', '.items[1].sku', '.items[2].sku', '.items[3]', '.items[3].sku',
+    '.missing', '.missing.deeper[0]', '.user.tags[1].x[1].y',
+    '.dup', '.dup.b', '."key with spaces"', '.["user"]["id"]', '.unicode', ' .user.id '
+  ]
+
+  paths.each do |filter|
+    it "returns what jq returns for #{filter.strip}" do
+      expect(JQ.filter(json, filter)).to eq(via_jq(json, filter))
+    end
+  end
+
+  it 'applies the output options' do
+    %i[compact_output sort_keys raw_output multiple_outputs].each do |option|
+      value = option != :compact_output
+      expect(JQ.filter(json, '.user', option => value)).to eq(via_jq(json, '.user', option => value))
+      expect(JQ.filter(json, '.user.name', option => value)).to eq(via_jq(json, '.user.name', option => value))
+    end
+  end
+
+  it 'raises the errors jq raises for indexing the wrong type' do
+    expect { JQ.filter(json, '.user.id.x') }.to raise_error(JQ::RuntimeError, /Cannot index number/)
+    expect { JQ.filter(json, '.items.sku') }.to raise_error(JQ::RuntimeError, /Cannot index array/)
+    expect { JQ.filter(json, '.user[0]') }.to raise_error(JQ::RuntimeError, /Cannot index object/)
+    expect { JQ.filter(json, '.user.name.first') }.to raise_error(JQ::RuntimeError, /Cannot index string/)
+  end
+
+  it 'still rejects invalid JSON outside the selected value' do
+    expect { JQ.filter('{"a":1,"b":[1,2}', '.a') }.to raise_error(JQ::ParseError)
+    expect { JQ.filter('{"a":1} {"a":2}', '.a') }.to raise_error(JQ::ParseError)
+    expect { JQ.filter('{"a":1,"b":tru}', '.a') }.to raise_error(JQ::ParseError)
+    expect { JQ.filter('{"a":1,"b":"\\q"}', '.a') }.to raise_error(JQ::ParseError)
+    expect { JQ.filter('', '.a') }.to raise_error(JQ::ParseError)
+  end
+
+  it 'leaves keys written with escapes to jq' do
+    expect(JQ.filter(json, '.escaped')).to eq('"e"')
+  end
+
+  it 'handles inputs that are not objects' do
+    expect(JQ.filter('null', '.a.b')).to eq('null')
+    expect(JQ.filter('[[1,2],[3,4]]', '.[1][0]')).to eq('3')
+    expect(JQ.filter(' [] ', '.[0]')).to eq('null')
+  end
+
+  it 'is used by compiled programs and every JSON call method' do
+    program = JQ.compile('.items[1].sku')
+    expect(program.call(json)).to eq('2500')
+    expect(program.each(json).to_a).to eq(['2500'])
+    expect(program.call_into(json, +'')).to eq("2500\n")
+    expect(program.call_many([json, '{"items":[]}'], parallel: 2)).to eq(%w[2500 null])
+    expect(JQ.filter_many([json, '[]'], '.user.id', errors: :nil)).to eq(['42', nil])
+  end
+
+  it 'is used with the filter cache' do
+    JQ.cache_capacity = 4
+    expect(JQ.filter(json, '.user.id')).to eq('42')
+    expect(JQ.filter(json, '.user.id')).to eq('42')
+  ensure
+    JQ.cache_capacity = 0
+  end
+
+  it 'leaves other filters to jq' do
+    expect(JQ.filter(json, '.user.tags[]', multiple_outputs: true)).to eq(['"a"', via_jq(json, '.user.tags[1]')])
+    expect(JQ.filter(json, '.user | .id')).to eq('42')
+    expect(JQ.filter(json, '.items[-1]')).to eq('{}')
+    expect(JQ.filter(json, '.user.id?')).to eq('42')
+  end
+end
@@ -0,0 +1,138 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'jq_state pools' do
+  describe 'JQ.state_pool_size' do
+    after { JQ.state_pool_size = 4 }
+
+    it 'defaults to 4' do
+      expect(JQ.state_pool_size).to eq(4)
+    end
+
+    it 'can be changed' do
+      JQ.state_pool_size = 16
+      expect(JQ.state_pool_size).to eq(16)
+    end
+
+    it 'rejects out of range sizes' do
+      expect { JQ.state_pool_size = -1 }.to raise_error(ArgumentError)
+      expect { JQ.state_pool_size = 65 }.to raise_error(ArgumentError)
+    end
+
+    it 'keeps results correct across reused states' do
+      results = 50.times.map { |i| JQ.filter(%({"n":#{i}}), i.even? ? '.n' : '.n * 10') }
+      expect(results).to eq(50.times.map { |i| (i.even? ? i : i * 10).to_s })
+    end
+
+    it 'works with pooling disabled' do
+      JQ.state_pool_size = 0
+      expect(JQ.filter('{"a":1}', '.a')).to eq('1')
+      expect(JQ.validate_filter!('.a')).to be true
+    end
+
+    it 'does not carry compile errors over to later compiles' do
+      JQ.filter('null', '.')
+      expect { JQ.filter('null', '. @@@ .') }.to raise_error(JQ::CompileError)
+      expect(JQ.filter('{"a":2}', '.a')).to eq('2')
+      expect(JQ.validate_filter!('.a')).to be true
+    end
+
+    it 'does not reuse unsandboxed states for sandboxed calls' do
+      JQ.filter('null', '.', sandbox: false)
+      expect(JQ.filter('null', 'env')).to eq('{}')
+    end
+
+    it 'reuses states released by Programs' do
+      program = JQ.compile('.a', pool_size: 1)
+      threads = 3.times.map { Thread.new { 20.times { program.call('{"a":1}') } } }
+      threads.each(&:join)
+      expect(JQ.filter('{"b":2}', '.b')).to eq('2')
+    end
+  end
+
+  describe 'JQ::Program pool options' do
+    let(:json) { '[1,2,3]' }
+
+    # Keep one state of +program+ checked out until the returned queue is
+    # pushed to
+    def hold_state(program)
+      started = Queue.new
+      release = Queue.new
+      thread = Thread.new do
+        program.each(json) do
+          started << true
+          release.pop
+          break
+        end
+      end
+      started.pop
+      [thread, release]
+    end
+
+    it 'rejects out of range options' do
+      expect { JQ.compile('.', pool_size: 0) }.to raise_error(ArgumentError)
+      expect { JQ.compile('.', pool_size: 257) }.to raise_error(ArgumentError)
+      expect { JQ.compile('.', pool_timeout: -1) }.to raise_error(ArgumentError)
+    end
+
+    it 'compiles extra states on demand without a timeout' do
+      program = JQ.compile('.[]', pool_size: 1)
+      thread, release = hold_state(program)
+
+      expect(program.call(json)).to eq('1')
+    ensure
+      release&.push(true)
+      thread&.join
+    end
+
+    it 'raises PoolTimeoutError when every state stays busy' do
+      program = JQ.compile('.[]', pool_size: 1, pool_timeout: 0.05)
+      thread, release = hold_state(program)
+
+      expect { program.call(json) }.to raise_error(JQ::PoolTimeoutError, /pool_size: 1/)
+    ensure
+      release&.push(true)
+      thread&.join
+    end
+
+    it 'is a JQ::Error' do
+      expect(JQ::PoolTimeoutError.ancestors).to include(JQ::Error)
+    end
+
+    it 'waits for a state to be checked in' do
+      program = JQ.compile('.[]', pool_size: 1, pool_timeout: 5)
+      thread, release = hold_state(program)
+
+      Thread.new { sleep 0.05; release << true }
+      expect(program.call(json)).to eq('1')
+    ensure
+      thread&.join
+    end
+
+    it 'frees the slot after an error' do
+      program = JQ.compile('.[]', pool_size: 1, pool_timeout: 0.05)
+      expect { program.call('42') }.to raise_error(JQ::RuntimeError)
+      expect(program.call(json)).to eq('1')
+    end
+
+    it 'limits parallel batches to the free slots' do
+      program = JQ.compile('.[]? // . * 2', pool_size: 2, pool_timeout: 0.05)
+      thread, release = hold_state(program)
+
+      expect(program.call_many(%w[1 2 3 4], parallel: 4)).to eq(%w[2 4 6 8])
+    ensure
+      release&.push(true)
+      thread&.join
+    end
+
+    it 'serves concurrent callers from a bounded pool' do
+      program = JQ.compile('.n', pool_size: 2, pool_timeout: 5)
+      results = 4.times.map do |t|
+        Thread.new { 25.times.map { |i| program.call(%({"n":#{t * 100 + i}})) } }
+      end.map(&:value)
+
+      expect(results.flatten.map(&:to_i).sort).to eq(4.times.flat_map { |t| 25.times.map { |i| t * 100 + i } }.sort)
+    end
+  end
+end
@@ -0,0 +1,118 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe JQ::ProgramSet do
+  let(:json) { '{"id":7,"user":{"name":"Alice","age":30},"tags":["a","b"]}' }
+  let(:filters) { { id: '.id', name: '.user.name', tags: '.tags[]' } }
+
+  it 'returns a Hash of every result, like separate JQ.filter calls' do
+    set = described_class.new(filters)
+    expected = filters.transform_values { |filter| JQ.filter(json, filter) }
+
+    expect(set.call(json)).to eq(expected)
+    expect(set.call(json).keys).to eq(%i[id name tags])
+  end
+
+  it 'applies the output options to every program' do
+    result = described_class.new(filters).call(json, raw_output: true, multiple_outputs: true)
+    expect(result).to eq(id: ['7'], name: ['Alice'], tags: %w[a b])
+  end
+
+  it 'accepts compiled programs and keeps them' do
+    program = JQ.compile('.user.age + 1')
+    set = described_class.new({ 'age' => program, 'id' => '.id' })
+
+    expect(set.call(json)).to eq('age' => '31', 'id' => '7')
+    expect(set.programs['age']).to equal(program)
+    expect(set.programs['id']).to be_a(JQ::Program)
+  end
+
+  it 'compiles String filters with the given options' do
+    set = described_class.new({ home: '$ENV.HOME' }, sandbox: false)
+    expect(set.programs[:home].sandbox?).to be(false)
+  end
+
+  it 'binds shared args to the variables each program declares' do
+    set = described_class.new({
+      over: JQ.compile('.user.age > $min', args: [:min]),
+      label: JQ.compile('$prefix + .user.name', args: [:prefix]),
+      id: '.id'
+    })
+
+    expect(set.call(json, args: { min: 18, 'prefix' => 'user:' }))
+      .to eq(over: 'true', label: '"user:Alice"', id: '7')
+  end
+
+  it 'raises a failing program by default' do
+    set = described_class.new({ id: '.id', bad: '.user.name + 1' })
+    expect { set.call(json) }.to raise_error(JQ::RuntimeError)
+  end
+
+  it 'returns nil or the error for failing programs with errors:' do
+    set = described_class.new({ id: '.id', bad: '.id[0]' })
+
+    expect(set.call(json, errors: :nil)).to eq(id: '7', bad: nil)
+    result = set.call(json, errors: :error)
+    expect(result[:id]).to eq('7')
+    expect(result[:bad]).to be_a(JQ::RuntimeError)
+  end
+
+  it 'raises ParseError for invalid input whatever errors: says' do
+    set = described_class.new(filters)
+    expect { set.call('{"id":', errors: :nil) }.to raise_error(JQ::ParseError)
+  end
+
+  it 'applies budgets to each program' do
+    set = described_class.new({ id: '.id', slow: '[range(1e9)]' })
+    expect(set.call(json, max_steps: 10_000, errors: :error)[:slow]).to be_a(JQ::TimeoutError)
+  end
+
+  it 'can be called from many threads' do
+    set = described_class.new(filters)
+    expected = set.call(json)
+    results = Array.new(4) { Thread.new { Array.new(20) { set.call(json) } } }.flat_map(&:value)
+    expect(results.uniq).to eq([expected])
+  end
+
+  it 'can share its programs with concurrent calls on other inputs' do
+    # Every program of a call runs on one parsed input; no state may keep it once checked in
+    programs = { id: JQ.compile('.id', pool_size: 2), tags: JQ.compile('.tags | join(",")', pool_size: 2) }
+    set = described_class.new(programs)
+    inputs = Array.new(8) { |i| %({"id":#{i},"tags":["t#{i}","u#{i}"]}) }
+
+    threads = inputs.each_with_index.map do |input, i|
+      Thread.new do
+        Array.new(100) { i.even? ? set.call(input) : programs.transform_values { |p| p.call(input) } }.uniq
+      end
+    end
+
+    expect(threads.map(&:value)).to eq(Array.new(8) { |i| [{ id: i.to_s, tags: %("t#{i},u#{i}") }] })
+  end
+
+  it 'rejects values that are not filters' do
+    expect { described_class.new({ id: 1 }) }.to raise_error(TypeError, /:id/)
+    expect { described_class.new({ id: '.[' }) }.to raise_error(JQ::CompileError)
+  end
+
+  describe 'JQ.filter_multi' do
+    it 'parses once and returns every result' do
+      expect(JQ.filter_multi(json, filters, raw_output: true, multiple_outputs: true))
+        .to eq(id: ['7'], name: ['Alice'], tags: %w[a b])
+    end
+
+    it 'uses the filter cache when it is enabled' do
+      JQ.clear_cache
+      JQ.cache_capacity = 8
+      2.times { JQ.filter_multi(json, filters) }
+      expect(JQ.cache_stats[:hits]).to eq(3)
+    ensure
+      JQ.cache_capacity = 0
+      JQ.clear_cache
+    end
+
+    it 'only accepts String filters' do
+      expect { JQ.filter_multi(json, { id: JQ.compile('.id') }) }.to raise_error(TypeError)
+    end
+  end
+end
@@ -0,0 +1,98 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe JQ::Program do
+  describe '.compile' do
+    it 'returns a JQ::Program' do
+      expect(JQ.compile('.name')).to be_a(JQ::Program)
+    end
+
+    it 'raises CompileError for invalid filters' do
+      expect {
+        JQ.compile('. @@@ .')
+      }.to raise_error(JQ::CompileError)
+    end
+
+    it 'raises TypeError for non-string filters' do
+      expect {
+        JQ.compile(123)
+      }.to raise_error(TypeError)
+    end
+  end
+
+  describe '.new' do
+    it 'is equivalent to JQ.compile' do
+      program = JQ::Program.new('.a')
+      expect(program.call('{"a":1}')).to eq('1')
+    end
+  end
+
+  describe '#call' do
+    let(:program) { JQ.compile('.name') }
+
+    it 'applies the filter' do
+      expect(program.call('{"name":"Alice"}')).to eq('"Alice"')
+    end
+
+    it 'can be reused for many documents' do
+      results = 100.times.map { |i| program.call(%({"name":"user#{i}"}), raw_output: true) }
+      expect(results).to eq(100.times.map { |i| "user#{i}" })
+    end
+
+    it 'supports output options' do
+      program = JQ.compile('.[]')
+      expect(program.call('["a","b"]', multiple_outputs: true, raw_output: true)).to eq(['a', 'b'])
+      expect(JQ.compile('.').call('{"b":1,"a":2}', sort_keys: true)).to eq('{"a":2,"b":1}')
+    end
+
+    it 'returns null when there are no results' do
+      expect(JQ.compile('empty').call('{}')).to eq('null')
+    end
+
+    it 'raises ParseError for invalid JSON and remains usable' do
+      expect { program.call('not json') }.to raise_error(JQ::ParseError)
+      expect(program.call('{"name":"Bob"}')).to eq('"Bob"')
+    end
+
+    it 'raises RuntimeError for execution errors and remains usable' do
+      program = JQ.compile('.[]')
+      expect { program.call('42') }.to raise_error(JQ::RuntimeError)
+      expect(program.call('[1,2]', multiple_outputs: true)).to eq(['1', '2'])
+    end
+
+    it 'recovers after an aborted multiple_outputs run' do
+      program = JQ.compile('.[] | if . == 2 then error("boom") else . end')
+      expect { program.call('[1,2,3]', multiple_outputs: true) }.to raise_error(JQ::RuntimeError, /boom/)
+      expect(program.call('[1,3]', multiple_outputs: true)).to eq(['1', '3'])
+    end
+  end
+
+  describe 'sandbox' do
+    it 'is enabled by default' do
+      program = JQ.compile('env')
+      expect(program.sandbox?).to be true
+      expect(program.call('null')).to eq('{}')
+    end
+
+    it 'can be disabled at compile time' do
+      expect(JQ.compile('.', sandbox: false).sandbox?).to be false
+    end
+  end
+
+  describe '#filter' do
+    it 'returns a frozen copy of the source' do
+      source = +'.a'
+      program = JQ.compile(source)
+      source << '.b'
+      expect(program.filter).to eq('.a')
+      expect(program.filter).to be_frozen
+    end
+  end
+
+  it 'raises for an uninitialized program' do
+    expect {
+      JQ::Program.allocate.call('{}')
+    }.to raise_error(JQ::Error)
+  end
+end
@@ -0,0 +1,128 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'Ractor support' do
+  let(:json) { '{"items":[{"id":1,"name":"a"},{"id":2,"name":"b"}]}' }
+
+  before(:context) { Warning[:experimental] = false }
+
+  def ractor_value(ractor)
+    ractor.respond_to?(:value) ? ractor.value : ractor.take
+  end
+
+  it 'runs JQ.filter in other Ractors' do
+    ractors = Array.new(4) do |i|
+      Ractor.new(json, i) { |input, n| JQ.filter(input, ".items[#{n % 2}].name", raw_output: true) }
+    end
+    expect(ractors.map { |r| ractor_value(r) }).to eq(%w[a b a b])
+  end
+
+  it 'runs the other module methods in other Ractors' do
+    result = ractor_value(Ractor.new(json) do |input|
+      [
+        JQ.filter_many([input, input], '.items | length'),
+        JQ.filter_object({ 'a' => [1, 2] }, '.a | add'),
+        JQ.filter_multi(input, { first: '.items[0].id' }),
+        JQ.filter_stream(input, '.id', stream: 2).to_a,
+        JQ.filter(JQ::Document.new(input), '.items[1].id')
+      ]
+    end)
+    expect(result).to eq([%w[2 2], 3, { first: '1' }, %w[1 2], '2'])
+  end
+
+  it 'raises jq errors in the Ractor' do
+    ractor = Ractor.new { JQ.filter('1', '.a') }
+    expect { ractor_value(ractor) }.to raise_error(Ractor::RemoteError) { |e| expect(e.cause).to be_a(JQ::RuntimeError) }
+  end
+
+  describe 'shareable programs' do
+    it 'makes frozen programs shareable' do
+      program = JQ.compile('.items[].id')
+      expect(Ractor.shareable?(program)).to be(false)
+
+      program.freeze
+      expect(Ractor.shareable?(program)).to be(true)
+      expect(Ractor.shareable?(Ractor.make_shareable(JQ.compile('.', args: [:x])))).to be(true)
+    end
+
+    it 'lets Ractors call the same program concurrently' do
+      program = Ractor.make_shareable(JQ.compile('[.items[] | .id * $k] | add', args: [:k]))
+      expected = Array.new(8) { |i| program.call(json, args: { k: i }) }
+
+      ractors = Array.new(8) do |i|
+        Ractor.new(program, json, i) { |p, input, k| Array.new(50) { p.call(input, args: { k: k }) }.uniq }
+      end
+      expect(ractors.map { |r| ractor_value(r) }).to eq(expected.map { |result| [result] })
+    end
+
+    it 'keeps documents made by a shared program valid' do
+      program = Ractor.make_shareable(JQ.compile('{"const": [1, 2]} + {items}'))
+      ractors = Array.new(4) do
+        Ractor.new(program, json) do |p, input|
+          docs = Array.new(20) { p.call(input, document: true) }
+          docs.map(&:to_json).uniq
+        end
+      end
+      expect(ractors.map { |r| ractor_value(r) }.uniq).to eq([[program.call(json)]])
+    end
+
+    it 'makes frozen program sets shareable' do
+      set = Ractor.make_shareable(JQ::ProgramSet.new({ count: '.items | length', names: '[.items[].name]' }))
+      expect(ractor_value(Ractor.new(set, json) { |s, input| s.call(input) }))
+        .to eq(count: '2', names: '["a","b"]')
+    end
+
+    it 'does not share documents or programs with a wait queue' do
+      expect { Ractor.make_shareable(JQ::Document.new(json)) }.to raise_error(Ractor::Error)
+      expect { Ractor.make_shareable(JQ.compile('.', pool_size: 2, pool_timeout: 1)) }.to raise_error(StandardError)
+    end
+  end
+
+  describe 'settings' do
+    after do
+      JQ.cache_capacity = 0
+      JQ.clear_cache
+    end
+
+    it 'can only be changed by the main Ractor' do
+      errors = ractor_value(Ractor.new do
+        [-> { JQ.cache_capacity = 1 }, -> { JQ.state_pool_size = 1 }, -> { JQ.parser = :jq },
+         -> { JQ.async = true }, -> { JQ.instrumenter = nil }].map do |set|
+          set.call
+          nil
+        rescue Ractor::IsolationError => e
+          e.message
+        end
+      end)
+      expect(errors).to all(match(/non-main Ractors/))
+      expect(JQ.cache_capacity).to eq(0)
+    end
+
+    it 'keeps a filter cache per Ractor' do
+      JQ.clear_cache
+      JQ.cache_capacity = 4
+      JQ.filter(json, '.items')
+
+      stats = ractor_value(Ractor.new(json) do |input|
+        3.times { JQ.filter(input, '.items') }
+        JQ.cache_stats.slice(:size, :capacity, :hits, :misses)
+      end)
+      expect(stats).to eq(size: 1, capacity: 4, hits: 2, misses: 1)
+      expect(JQ.cache_stats.slice(:hits, :misses)).to eq(hits: 0, misses: 1)
+    end
+
+    it 'reports stats but not instrumenter events in other Ractors' do
+      events = []
+      JQ.instrumenter = Class.new { define_method(:instrument) { |name, _payload| events << name } }.new
+
+      stats = ractor_value(Ractor.new(json) do |input|
+        [JQ.instrumenter, JQ.filter(input, '.items[0].id', stats: true) && JQ.last_stats.output_count]
+      end)
+      expect(stats).to eq([nil, 1])
+      expect(events).to be_empty
+    ensure
+      JQ.instrumenter = nil
+    end
+  end
+end
@@ -122,6 +122,25 @@ RSpec.describe 'Security' do
         JQ.filter(json, '.data')
       }.not_to raise_error
     end
+
+    it 'rejects raw null bytes in the input as invalid JSON' do
+      expect {
+        JQ.filter("{\"a\":1}\0{}", '.a')
+      }.to raise_error(JQ::ParseError)
+    end
+
+    it 'accepts binary-encoded input' do
+      json = '{"name":"caf\u00e9"}'.b
+      expect(JQ.filter(json, '.name', raw_output: true)).to eq('café')
+    end
+
+    it 'accepts frozen input and substrings without terminators' do
+      first = %({"a":1,"pad":"#{'x' * 100}"})
+      big = (first + '{"a":2').freeze
+      expect(JQ.filter(big[0, first.bytesize].freeze, '.a')).to eq('1')
+      expect(JQ.filter(big[0, first.bytesize], '.a')).to eq('1')
+      expect { JQ.filter(big[first.bytesize..], '.a') }.to raise_error(JQ::ParseError)
+    end
   end
 
   describe 'edge case filters' do
@@ -0,0 +1,66 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'JSON output' do
+  # jq's own jv_dump_string output, through tojson
+  def jq_dump(json, sorted: false)
+    filter = 'tojson'
+    if sorted
+      filter = 'walk(if type == "object" then to_entries | sort_by(.key) | from_entries else . end) | tojson'
+    end
+    JQ.filter(json, filter, raw_output: true)
+  end
+
+  {
+    'scalars' => '[null,true,false,0,-0,1,-1,"",[],{}]',
+    'literal numbers' => '[1.50,1e5,1E-3,-1.5e+10,123456789012345678901234567890,100000000000000000000]',
+    'escapes' => '"\\" \\\\ / \\b \\f \\n \\r \\t \\u0001 \\u001f \\u007f \\u00e9 \\u2603"',
+    'UTF-8' => '"café ☃ 😀 \\ud83d\\ude00"',
+    'long strings' => %("#{'x' * 100}\\n#{'y' * 37}\\"#{'z' * 16}"),
+    'nested values' => '{"b":[1,{"z":{},"a":[[]]}],"a":{"y":2,"x":"1"},"":null}'
+  }.each do |name, json|
+    it "writes the same bytes as jq for #{name}" do
+      expect(JQ.filter(json, '.')).to eq(jq_dump(json))
+      expect(JQ.filter(json, '.', sort_keys: true)).to eq(jq_dump(json, sorted: true))
+    end
+  end
+
+  it 'writes computed numbers like jq' do
+    %w[1+1 -(1) 0.1+0.2 1/3 pow(2;53) pow(2;70) -pow(10;16) 1e1000 -1e1000 nan].each do |expr|
+      expect(JQ.filter('null', "[#{expr}]")).to eq(JQ.filter('null', "[#{expr}] | tojson", raw_output: true))
+    end
+  end
+
+  it 'sorts keys in byte order, shorter keys first' do
+    json = '{"b":1,"ab":2,"a":3,"B":4,"é":5,"a\\u0000":6}'
+    expect(JQ.filter(json, 'keys | length')).to eq('6')
+    expect(JQ.filter(json, '.', sort_keys: true)).to eq(jq_dump(json, sorted: true))
+  end
+
+  it 'sorts objects with many keys' do
+    json = JSON.generate((1..100).to_h { |i| ["k#{(i * 37) % 101}", i] })
+    expect(JQ.filter(json, '.', sort_keys: true)).to eq(jq_dump(json, sorted: true))
+  end
+
+  it 'writes deeply nested values like jq' do
+    json = '[' * 300 + '{"b":1,"a":2}' + ']' * 300
+    expect(JQ.filter(json, '.')).to eq(jq_dump(json))
+    expect(JQ.filter(json, '.', sort_keys: true)).to eq(jq_dump(json, sorted: true))
+  end
+
+  it 'writes raw strings as is' do
+    expect(JQ.filter('"a\\nb"', '.', raw_output: true)).to eq("a\nb")
+  end
+
+  it 'keeps pretty printing to jq' do
+    expect(JQ.filter('{"b":1,"a":[2]}', '.', compact_output: false, sort_keys: true))
+      .to eq("{\n  \"a\": [\n    2\n  ],\n  \"b\": 1\n}")
+  end
+
+  it 'is used by JQ.filter_into' do
+    json = '{"b":"\\u00e9","a":[1,2.50]}'
+    out = JQ.filter_into(json, '., .a[]', +'', sort_keys: true)
+    expect(out).to eq(%({"a":[1,2.50],"b":"é"}\n1\n2.50\n))
+  end
+end
@@ -0,0 +1,116 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+
+RSpec.describe 'stats:' do
+  let(:json) { '{"items":[{"id":1},{"id":2},{"id":3}]}' }
+
+  after do
+    JQ.instrumenter = nil
+    JQ.cache_capacity = 0
+  end
+
+  it 'keeps the stats of the call for JQ.last_stats' do
+    result = JQ.filter(json, '.items[].id', multiple_outputs: true, stats: true)
+    stats = JQ.last_stats
+
+    expect(result).to eq(%w[1 2 3])
+    expect(stats).to be_a(JQ::Stats)
+    expect(stats.compile_ns).to be > 0
+    expect(stats.parse_ns).to be > 0
+    expect(stats.execute_ns).to be > 0
+    expect(stats.serialize_ns).to be > 0
+    expect(stats.total_ns).to be >= stats.parse_ns + stats.execute_ns
+    expect(stats.input_bytes).to eq(json.bytesize)
+    expect(stats.output_count).to eq(3)
+    expect(stats.output_bytes).to eq(3)
+    expect(stats.allocations).to be > 0
+    expect(stats.fast_path).to be(false)
+    expect(stats.cached).to be(false)
+  end
+
+  it 'calls a callable with the stats' do
+    received = nil
+    JQ.filter(json, '.items | length', stats: ->(stats) { received = stats })
+    expect(received.output_count).to eq(1)
+  end
+
+  it 'leaves JQ.last_stats alone without it' do
+    JQ.filter(json, '.items', stats: true)
+    stats = JQ.last_stats
+    JQ.filter(json, '.items')
+    expect(JQ.last_stats).to equal(stats)
+  end
+
+  it 'keeps JQ.last_stats per fiber' do
+    JQ.filter(json, '.items', stats: true)
+    expect(Fiber.new { JQ.last_stats }.resume).to be_nil
+  end
+
+  it 'rejects other values' do
+    expect { JQ.filter(json, '.', stats: 1) }.to raise_error(ArgumentError, /stats/)
+  end
+
+  it 'reports simple paths answered without jq' do
+    JQ.filter(json, '.items[0].id', stats: true)
+    expect(JQ.last_stats.fast_path).to be(true)
+    expect(JQ.last_stats.execute_ns).to eq(0)
+  end
+
+  it 'reports cached filters' do
+    JQ.cache_capacity = 4
+    JQ.filter(json, '.items', stats: true)
+    expect(JQ.last_stats.cached).to be(false)
+    JQ.filter(json, '.items', stats: true)
+    expect(JQ.last_stats.cached).to be(true)
+  end
+
+  it 'measures compiled programs' do
+    program = JQ.compile('[.items[].id] | add')
+    expect(program.call(json, stats: true)).to eq('6')
+    expect(JQ.last_stats.compile_ns).to eq(0)
+    expect(JQ.last_stats.execute_ns).to be > 0
+  end
+
+  describe 'JQ.instrumenter' do
+    # The part of ActiveSupport::Notifications the instrumenter uses
+    let(:instrumenter) do
+      Class.new do
+        attr_reader :events
+
+        def initialize
+          @events = []
+        end
+
+        def instrument(name, payload)
+          @events << [name, payload]
+        end
+      end.new
+    end
+
+    it 'publishes a filter.jq event for every call' do
+      JQ.instrumenter = instrumenter
+      JQ.filter(json, '.items[0]')
+      JQ.compile('.items').call(json)
+
+      expect(instrumenter.events.map(&:first)).to eq(%w[filter.jq filter.jq])
+      payload = instrumenter.events.first.last
+      expect(payload[:filter]).to eq('.items[0]')
+      expect(payload[:input_bytes]).to eq(json.bytesize)
+      expect(payload[:total_ns]).to be > 0
+    end
+
+    it 'publishes failed calls with their exception' do
+      JQ.instrumenter = instrumenter
+      expect { JQ.filter(json, '.items.x') }.to raise_error(JQ::RuntimeError)
+
+      payload = instrumenter.events.last.last
+      expect(payload[:exception].first).to eq('JQ::RuntimeError')
+      expect(payload[:exception_object]).to be_a(JQ::RuntimeError)
+    end
+
+    it 'must respond to #instrument' do
+      expect { JQ.instrumenter = Object.new }.to raise_error(ArgumentError)
+    end
+  end
+end
@@ -0,0 +1,86 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+require 'stringio'
+require 'tempfile'
+
+RSpec.describe 'stream: option' do
+  let(:json) { '{"meta":{"count":2},"items":[{"id":1,"tags":["a"]},{"id":2,"tags":[]}]}' }
+
+  context 'with stream: true' do
+    it 'runs the filter on each [path, leaf] event like jq --stream' do
+      events = JQ.filter_stream('{"a":[1,{"b":null}]}', '.', stream: true).to_a
+      expect(events).to eq([
+        '[["a",0],1]', '[["a",1,"b"],null]', '[["a",1,"b"]]', '[["a",1]]', '[["a"]]'
+      ])
+    end
+
+    it 'gives scalar documents an empty path' do
+      expect(JQ.filter_stream('3 "x"', '.', stream: true).to_a).to eq(['[[],3]', '[[],"x"]'])
+    end
+
+    it 'reads an IO' do
+      leaves = JQ.filter_stream(StringIO.new(json), 'select(length == 2) | .[1]', stream: true).to_a
+      expect(leaves).to eq(%w[2 1 "a" 2 []])
+    end
+  end
+
+  context 'with a depth' do
+    it 'runs the filter on each value at that depth' do
+      expect(JQ.filter_stream('[{"id":1},{"id":2},{"id":3}]', '.id', stream: 1).to_a).to eq(%w[1 2 3])
+      expect(JQ.filter_stream(json, '.', stream: 2).to_a)
+        .to eq(['2', '{"id":1,"tags":["a"]}', '{"id":2,"tags":[]}'])
+    end
+
+    it 'rebuilds each value as fromstream(depth | truncate_stream(inputs)) would' do
+      doc = '[{"a":[1,{"b":2}],"c":{}},[[3]],{"d":{"e":[4,5]}}]'
+      expected = JQ.filter(doc, '.[]', multiple_outputs: true)
+      expect(JQ.filter_stream(doc, '.', stream: 1).to_a).to eq(expected)
+    end
+
+    it 'passes on scalar and empty values at the depth' do
+      expect(JQ.filter_stream('[1,"x",null,[],{},[2]]', '.', stream: 1).to_a)
+        .to eq(%w[1 "x" null [] {} [2]])
+    end
+
+    it 'rebuilds whole documents at depth 0' do
+      expect(JQ.filter_stream('{"a":[1,2]} 3 [[]]', '.', stream: 0).to_a).to eq(['{"a":[1,2]}', '3', '[[]]'])
+    end
+
+    it 'skips values above the depth' do
+      expect(JQ.filter_stream('[1,[2,3],4]', '.', stream: 2).to_a).to eq(%w[2 3])
+    end
+
+    it 'applies per-document options to each value' do
+      expect(JQ.filter_stream('[{"b":1,"a":2}]', '.', stream: 1, sort_keys: true).to_a).to eq(['{"a":2,"b":1}'])
+      expect { JQ.filter_stream('[1,2]', '[range(1e9)]', stream: 1, max_steps: 1000).to_a }
+        .to raise_error(JQ::TimeoutError)
+    end
+
+    it 'yields the values before a parse error' do
+      seen = []
+      expect { JQ.filter_stream('[{"id":1},{"id":2},{"id":', '.id', stream: 1) { |id| seen << id } }
+        .to raise_error(JQ::ParseError)
+      expect(seen).to eq(%w[1 2])
+    end
+
+    it 'works with JQ::Program#call_stream' do
+      program = JQ.compile('.id * 10')
+      expect(program.call_stream(StringIO.new('[{"id":1},{"id":2}]'), stream: 1).to_a).to eq(%w[10 20])
+    end
+
+    it 'works with JQ.filter_file' do
+      Tempfile.create(['stream_events', '.json']) do |file|
+        file.write(json)
+        file.flush
+        expect(JQ.filter_file(file.path, 'objects | .id', stream: 2).to_a).to eq(%w[1 2])
+      end
+    end
+  end
+
+  it 'rejects invalid values' do
+    [-1, 1.5, 'x', 10_001].each do |value|
+      expect { JQ.filter_stream('[]', '.', stream: value).to_a }.to raise_error(ArgumentError, /stream must be/)
+    end
+  end
+end
@@ -0,0 +1,118 @@
+# frozen_string_literal: true
+
+require 'spec_helper'
+require 'stringio'
+require 'tempfile'
+
+RSpec.describe 'JQ.filter_stream' do
+  let(:ndjson) { %({"id":1,"level":"info"}\n{"id":2,"level":"error"}\n{"id":3,"level":"error"}\n) }
+
+  it 'yields the results of every document in a String' do
+    results = []
+    JQ.filter_stream(ndjson, '.id') { |result| results << result }
+    expect(results).to eq(['1', '2', '3'])
+  end
+
+  it 'returns an Enumerator without a block' do
+    enum = JQ.filter_stream(ndjson, '.id')
+    expect(enum).to be_a(Enumerator)
+    expect(enum.to_a).to eq(['1', '2', '3'])
+  end
+
+  it 'accepts concatenated documents' do
+    expect(JQ.filter_stream('1 2{"a":3}[4]"five"', '.').to_a).to eq(['1', '2', '{"a":3}', '[4]', '"five"'])
+  end
+
+  it 'yields every result of every document' do
+    expect(JQ.filter_stream("[1,2]\n[]\n[3]", '.[]').to_a).to eq(['1', '2', '3'])
+  end
+
+  it 'yields nothing for empty input' do
+    expect(JQ.filter_stream('', '.').to_a).to eq([])
+    expect(JQ.filter_stream("\n\n", '.').to_a).to eq([])
+  end
+
+  it 'supports formatting options' do
+    results = JQ.filter_stream(ndjson, 'select(.level == "error") | .level', raw_output: true).to_a
+    expect(results).to eq(['error', 'error'])
+  end
+
+  it 'reads from an IO' do
+    io = StringIO.new(ndjson)
+    expect(JQ.filter_stream(io, '.id').to_a).to eq(['1', '2', '3'])
+  end
+
+  it 'reads from a File' do
+    Tempfile.create('stream') do |file|
+      file.write(ndjson)
+      file.flush
+      file.rewind
+      expect(JQ.filter_stream(file, '.level', raw_output: true).to_a).to eq(['info', 'error', 'error'])
+    end
+  end
+
+  it 'handles documents spanning several reads' do
+    big = { 'items' => (1..50_000).to_a }.to_json
+    io = StringIO.new("#{big}\n#{big}\n")
+    expect(JQ.filter_stream(io, '.items | length').to_a).to eq(['50000', '50000'])
+  end
+
+  it 'handles many small documents' do
+    input = (1..20_000).map { |i| %({"n":#{i}}) }.join("\n")
+    expect(JQ.filter_stream(input, '.n').count).to eq(20_000)
+  end
+
+  it 'stops early on break' do
+    seen = []
+    JQ.filter_stream(StringIO.new(ndjson), '.id') do |result|
+      seen << result
+      break
+    end
+    expect(seen).to eq(['1'])
+  end
+
+  it 'raises ParseError after yielding the documents before invalid input' do
+    seen = []
+    expect {
+      JQ.filter_stream("1\n2\n{oops\n", '.') { |result| seen << result }
+    }.to raise_error(JQ::ParseError)
+    expect(seen).to eq(['1', '2'])
+  end
+
+  it 'raises ParseError for a truncated document' do
+    expect {
+      JQ.filter_stream('{"a":', '.').to_a
+    }.to raise_error(JQ::ParseError)
+  end
+
+  it 'raises RuntimeError when the filter fails on a document' do
+    expect {
+      JQ.filter_stream('{"a":1} "x"', '.a').to_a
+    }.to raise_error(JQ::RuntimeError)
+  end
+
+  it 'raises CompileError for invalid filters' do
+    expect {
+      JQ.filter_stream(ndjson, '. @@@ .') { }
+    }.to raise_error(JQ::CompileError)
+  end
+
+  it 'raises TypeError for unsupported input' do
+    expect {
+      JQ.filter_stream(123, '.') { }
+    }.to raise_error(TypeError)
+  end
+
+  describe 'JQ::Program#call_stream' do
+    let(:program) { JQ.compile('.id') }
+
+    it 'yields the results of every document' do
+      expect(program.call_stream(ndjson).to_a).to eq(['1', '2', '3'])
+    end
+
+    it 'can be reused after an error' do
+      expect { program.call_stream('{"id":1} oops').to_a }.to raise_error(JQ::ParseError)
+      expect(program.call_stream(StringIO.new(ndjson)).to_a).to eq(['1', '2', '3'])
+    end
+  end
+end
@@ -152,6 +152,110 @@ RSpec.describe 'Thread safety', :slow do
     end
   end
 
+  describe 'GVL release' do
+    let(:big_json) do
+      '[' + (1..200_000).map { |i| %({"id":#{i},"name":"user#{i}"}) }.join(',') + ']'
+    end
+
+    # A single long result: jq never returns between instructions
+    let(:long_filter) { 'reduce range(3000000) as $i (0; . + $i)' }
+
+    # Ticks of a busy thread while the block runs
+    def ticks_during
+      ticks = 0
+      ticker = Thread.new do
+        loop do
+          ticks += 1
+          Thread.pass
+        end
+      end
+      Thread.pass until ticks.positive?
+
+      before = ticks
+      yield
+      ticks - before
+    ensure
+      ticker&.kill&.join
+    end
+
+    def elapsed
+      started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      yield
+      Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+    end
+
+    it 'lets other threads run while a filter executes' do
+      # A run on a JQ::Document keeps the GVL, which makes the baseline
+      held = ticks_during { JQ.filter(JQ::Document.new('null'), long_filter) }
+      released = ticks_during { JQ.filter('null', long_filter) }
+
+      expect(released).to be > [held * 10, 1000].max
+    end
+
+    it 'delivers Thread#raise to a thread running a filter' do
+      json = big_json
+      thread = Thread.new do
+        Thread.current.report_on_exception = false
+        JQ.filter(json, '.[] | .name', multiple_outputs: true)
+      end
+      sleep 0.01
+      thread.raise(Interrupt)
+
+      expect { thread.join }.to raise_error(Interrupt)
+    end
+
+    it 'delivers Thread#raise and Thread#kill inside a single long result' do
+      [-> { JQ.filter('null', 'last(range(1e10))') },
+       -> { JQ.filter_many(Array.new(4, 'null'), 'last(range(1e10))', parallel: 4) }].each do |call|
+        thread = Thread.new do
+          Thread.current.report_on_exception = false
+          call.call
+        end
+        sleep 0.05
+        time = elapsed do
+          thread.raise(Interrupt)
+          expect { thread.join(5) }.to raise_error(Interrupt)
+        end
+        expect(time).to be < 1
+
+        thread = Thread.new(&call)
+        sleep 0.05
+        expect(elapsed { expect(thread.kill.join(5)).to eq(thread) }).to be < 1
+      ensure
+        thread&.kill
+      end
+    end
+
+    it 'goes on with the filter when a signal handler raises nothing' do
+      handled = false
+      previous = Signal.trap('USR2') { handled = true }
+      signaller = Thread.new do
+        sleep 0.01
+        Process.kill('USR2', Process.pid)
+      end
+
+      expect(JQ.filter('null', long_filter)).to eq((0...3_000_000).sum.to_s)
+      signaller.join
+      sleep 0.01 until handled
+    ensure
+      Signal.trap('USR2', previous || 'DEFAULT')
+    end
+
+    it 'keeps results isolated when threads share one JQ::Program' do
+      program = JQ.compile('.[] | . * 2')
+
+      threads = 10.times.map do |i|
+        Thread.new do
+          50.times.map { program.call("[#{i},#{i + 1}]", multiple_outputs: true) }.uniq
+        end
+      end
+
+      threads.each_with_index do |thread, i|
+        expect(thread.value).to eq([[(i * 2).to_s, ((i + 1) * 2).to_s]])
+      end
+    end
+  end
+
   describe 'stress test' do
     it 'survives sustained concurrent load', :stress do
       json = '{"data":{"nested":{"value":42}}}'